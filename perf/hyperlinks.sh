@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+
+# Emits lines with distinct OSC 8 hyperlinks, like ls --hyperlink does
+# for each file name. Run it with "time" to measure the hyperlink pool.
+
+cnt=$1
+[ -n "$cnt" ] || cnt=100000
+
+awk -v cnt="$cnt" 'BEGIN {
+	for (x = 0; x < cnt; x++)
+		printf "\033]8;;file:///tmp/hyperlinks/%d\033\\file%d\033]8;;\033\\\n", x, x
+}'
@@ -20,7 +20,10 @@
 #include "chunk.hh"
 
 #include <cstddef> // offsetof
+#include <list>
+#include <mutex>
 #include <new>
+#include <stack>
 
 namespace vte {
 
@@ -29,23 +32,54 @@ namespace base {
 static_assert(sizeof(Chunk) <= Chunk::k_chunk_size - 2 *sizeof(void*), "Chunk too large");
 static_assert(offsetof(Chunk, data) == offsetof(Chunk, dataminusone) + 1, "Chunk layout wrong");
 
+/* Chunks are recycled on the main thread but may be allocated on the
+ * PTY reader thread, so the free list needs a lock.
+ *
+ * The reader thread is never joined and may still use the free list at
+ * exit, so it is never destroyed.
+ */
+struct FreeChunks {
+        std::mutex mutex;
+        /* Note that this is using the standard deleter, not Recycler */
+        std::stack<std::unique_ptr<Chunk>, std::list<std::unique_ptr<Chunk>>> chunks;
+};
+
+static FreeChunks&
+free_chunks() noexcept
+{
+        static auto s_free_chunks = new FreeChunks{};
+        return *s_free_chunks;
+}
+
 void
 Chunk::recycle() noexcept
 {
-        g_free_chunks.push(std::unique_ptr<Chunk>(this));
+        if (m_release_func)
+                m_release_func(m_release_data);
+        m_borrowed = nullptr;
+        m_release_func = nullptr;
+        m_release_data = nullptr;
+
+        auto& free_list = free_chunks();
+        auto lock = std::lock_guard<std::mutex>{free_list.mutex};
+        free_list.chunks.push(std::unique_ptr<Chunk>(this));
         /* FIXME: bzero out the chunk for security? */
 }
 
-std::stack<std::unique_ptr<Chunk>, std::list<std::unique_ptr<Chunk>>> Chunk::g_free_chunks;
-
 Chunk::unique_type
 Chunk::get(void) noexcept
 {
-        Chunk* chunk;
-        if (!g_free_chunks.empty()) {
-                chunk = g_free_chunks.top().release();
-                g_free_chunks.pop();
+        Chunk* chunk{nullptr};
+        {
+                auto& free_list = free_chunks();
+                auto lock = std::lock_guard<std::mutex>{free_list.mutex};
+                if (!free_list.chunks.empty()) {
+                        chunk = free_list.chunks.top().release();
+                        free_list.chunks.pop();
+                }
+        }
 
+        if (chunk) {
                 chunk->reset();
         } else {
                 chunk = new Chunk();
@@ -53,11 +87,29 @@ Chunk::get(void) noexcept
 
         return Chunk::unique_type(chunk);
 }
+
+Chunk::unique_type
+Chunk::get_borrowed(uint8_t const* ptr,
+                    size_t size,
+                    release_func func,
+                    void* func_data) noexcept
+{
+        auto chunk = get();
+        chunk->m_borrowed = ptr;
+        chunk->m_release_func = func;
+        chunk->m_release_data = func_data;
+        chunk->len = size;
+        chunk->set_sealed();
+        return chunk;
+}
+
 void
 Chunk::prune(unsigned int max_size) noexcept
 {
-        while (g_free_chunks.size() > max_size)
-                g_free_chunks.pop();
+        auto& free_list = free_chunks();
+        auto lock = std::lock_guard<std::mutex>{free_list.mutex};
+        while (free_list.chunks.size() > max_size)
+                free_list.chunks.pop();
 }
 
 } // namespace base
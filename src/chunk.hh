@@ -17,10 +17,10 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <list>
 #include <memory>
-#include <stack>
 
 namespace vte {
 
@@ -48,13 +48,18 @@ private:
 
 public:
         using unique_type = std::unique_ptr<Chunk, Recycler>;
+        using release_func = void (*)(void* data);
 
         static unsigned int const k_chunk_size = 0x2000;
 
+        /* For borrowed chunks, the externally owned data, and how to release it */
+        uint8_t const* m_borrowed{nullptr};
+        release_func m_release_func{nullptr};
+        void* m_release_data{nullptr};
         unsigned int len{0};
         uint8_t m_flags{0};
         uint8_t dataminusone;    /* Hack: Keep it right before data, so that data[-1] is valid and usable */
-        uint8_t data[k_chunk_size - 2 * sizeof(void*) - 2 - sizeof(unsigned int)];
+        uint8_t data[k_chunk_size - 5 * sizeof(void*) - 2 - sizeof(unsigned int)];
 
         Chunk() = default;
         Chunk(Chunk const&) = delete;
@@ -73,7 +78,23 @@ public:
         inline constexpr size_t capacity() const noexcept { return sizeof(data); }
         inline constexpr size_t remaining_capacity() const noexcept { return capacity() - len; }
 
+        /* The bytes to process; for borrowed chunks, these are not in @data */
+        inline constexpr uint8_t const* begin() const noexcept { return m_borrowed ? m_borrowed : data; }
+        inline constexpr uint8_t const* end() const noexcept { return begin() + len; }
+
+        inline constexpr bool borrowed() const noexcept { return m_borrowed != nullptr; }
+
         static unique_type get() noexcept;
+
+        /* Returns a sealed chunk referring to @size bytes at @ptr without
+         * copying them; @func is called with @func_data when the chunk is
+         * recycled, i.e. once the data has been processed.
+         */
+        static unique_type get_borrowed(uint8_t const* ptr,
+                                        size_t size,
+                                        release_func func,
+                                        void* func_data) noexcept;
+
         static void prune(unsigned int max_size = k_max_free_chunks) noexcept;
 
         inline constexpr bool sealed() const noexcept { return m_flags & (uint8_t)Flags::eSEALED; }
@@ -81,11 +102,73 @@ public:
 
         inline constexpr bool eos() const noexcept { return m_flags & (uint8_t)Flags::eEOS; }
         inline void set_eos() noexcept { m_flags |= (uint8_t)Flags::eEOS; }
+};
 
-private:
+/*
+ * ChunkQueue:
+ *
+ * A bounded, lock-free queue of chunks with exactly one producer thread
+ * and one consumer thread. push() may only be called from the producer,
+ * pop() only from the consumer; size() and full() may be called from either,
+ * but are only exact on the producer (for full()) or consumer (for empty()) side.
+ */
+class ChunkQueue {
+public:
+        static constexpr size_t const k_capacity = 32;
+
+        ChunkQueue() = default;
+        ChunkQueue(ChunkQueue const&) = delete;
+        ChunkQueue(ChunkQueue&&) = delete;
+        ~ChunkQueue()
+        {
+                while (pop())
+                        ;
+        }
+
+        ChunkQueue& operator= (ChunkQueue const&) = delete;
+        ChunkQueue& operator= (ChunkQueue&&) = delete;
 
-        /* Note that this is using the standard deleter, not Recycler */
-        static std::stack<std::unique_ptr<Chunk>, std::list<std::unique_ptr<Chunk>>> g_free_chunks;
+        /* Producer only. Returns false if the queue is full, in which
+         * case @chunk is left untouched.
+         */
+        bool push(Chunk::unique_type& chunk) noexcept
+        {
+                auto const tail = m_tail.load(std::memory_order_relaxed);
+                if (tail - m_head.load(std::memory_order_acquire) == k_capacity)
+                        return false;
+
+                m_slots[tail % k_capacity] = chunk.release();
+                m_tail.store(tail + 1, std::memory_order_release);
+                return true;
+        }
+
+        /* Consumer only. Returns an empty pointer if the queue is empty. */
+        Chunk::unique_type pop() noexcept
+        {
+                auto const head = m_head.load(std::memory_order_relaxed);
+                if (head == m_tail.load(std::memory_order_acquire))
+                        return {};
+
+                auto chunk = Chunk::unique_type{m_slots[head % k_capacity]};
+                m_head.store(head + 1, std::memory_order_release);
+                return chunk;
+        }
+
+        inline size_t size() const noexcept
+        {
+                return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+        }
+
+        inline bool empty() const noexcept { return size() == 0; }
+        inline bool full() const noexcept { return size() == k_capacity; }
+
+private:
+        /* Keep the indices on separate cache lines so that the producer and
+         * consumer don't contend on them.
+         */
+        alignas(64) std::atomic<size_t> m_head{0}; /* consumer */
+        alignas(64) std::atomic<size_t> m_tail{0}; /* producer */
+        alignas(64) Chunk* m_slots[k_capacity]{};
 };
 
 } // namespace base
@@ -46,6 +46,7 @@ using namespace std::literals;
 class Options {
 private:
         bool m_benchmark{false};
+        bool m_bulk{false};
         bool m_codepoints{false};
         bool m_list{false};
         bool m_quiet{false};
@@ -87,6 +88,7 @@ public:
         Options& operator=(Options&&) = delete;
 
         inline constexpr bool benchmark()  const noexcept { return m_benchmark;  }
+        inline constexpr bool bulk()       const noexcept { return m_bulk;       }
         inline constexpr bool codepoints() const noexcept { return m_codepoints; }
         inline constexpr bool list()       const noexcept { return m_list;       }
         inline constexpr bool statistics() const noexcept { return m_statistics; }
@@ -102,6 +104,7 @@ public:
         {
                 {
                         auto benchmark = BoolArg{&m_benchmark, false};
+                        auto bulk = BoolArg{&m_bulk, false};
                         auto codepoints = BoolArg{&m_codepoints, false};
                         auto list = BoolArg{&m_list, false};
                         auto quiet = BoolArg{&m_quiet, false};
@@ -113,6 +116,8 @@ public:
                         GOptionEntry const entries[] = {
                                 { "benchmark", 'b', 0, G_OPTION_ARG_NONE, benchmark.ptr(),
                                   "Measure time spent parsing each file", nullptr },
+                                { "bulk", 'k', 0, G_OPTION_ARG_NONE, bulk.ptr(),
+                                  "Use the bulk UTF-8 decoder", nullptr },
                                 { "codepoints", 'u', 0, G_OPTION_ARG_NONE, codepoints.ptr(),
                                   "Output unicode code points by number", nullptr },
                                 { "charset", 'f', 0, G_OPTION_ARG_STRING, charset.ptr(),
@@ -279,12 +284,14 @@ private:
         template<class Functor>
         void
         process_file_utf8(int fd,
+                          bool bulk,
                           Functor& func)
         {
                 auto decoder = vte::base::UTF8Decoder{};
 
                 auto const buf_size = size_t{16384};
                 auto buf = g_new0(uint8_t, buf_size);
+                auto u32buf = bulk ? g_new0(uint32_t, buf_size + 1) : nullptr;
 
                 auto start_time = g_get_monotonic_time();
 
@@ -302,6 +309,15 @@ private:
                         m_input_bytes += len;
 
                         auto const bufend = buf + len;
+
+                        if (bulk) {
+                                auto const u32end = decoder.decode_bulk(buf, bufend, u32buf);
+                                for (auto uptr = u32buf; uptr < u32end; ++uptr)
+                                        func(*uptr);
+                                m_output_chars += u32end - u32buf;
+                                continue;
+                        }
+
                         for (auto sptr = buf; sptr < bufend; ++sptr) {
                                 switch (decoder.decode(*sptr)) {
                                 case vte::base::UTF8Decoder::REJECT_REWIND:
@@ -334,6 +350,7 @@ private:
                 auto const time_spent = int64_t{g_get_monotonic_time() - start_time};
                 g_array_append_val(m_bench_times, time_spent);
 
+                g_free(u32buf);
                 g_free(buf);
         }
 
@@ -434,7 +451,7 @@ private:
                         } else
 #endif
                         {
-                                process_file_utf8(fd, func);
+                                process_file_utf8(fd, options.bulk(), func);
                         }
                 }
 
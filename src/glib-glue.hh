@@ -66,6 +66,14 @@ dup_strv(char const* const* strv)
         return take_strv(g_strdupv(const_cast<char**>(strv)));
 }
 
+using BytesPtr = vte::FreeablePtr<GBytes, decltype(&g_bytes_unref), &g_bytes_unref>;
+
+inline BytesPtr
+take_bytes(GBytes* bytes)
+{
+        return BytesPtr{bytes};
+}
+
 class Error {
 public:
         Error() noexcept = default;
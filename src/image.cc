@@ -36,6 +36,10 @@ Image::paint(cairo_t* cr,
              int cell_width,
              int cell_height) const noexcept
 {
+        /* Still being decoded; the cell extent has been cleared already */
+        if (!m_surface)
+                return;
+
         auto scale_x = 1.0;
         auto scale_y = 1.0;
 
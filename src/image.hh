@@ -27,7 +27,7 @@ namespace image {
 
 class Image {
 private:
-        // Device-friendly Cairo surface
+        // Device-friendly Cairo surface; null while the image is being decoded
         vte::cairo::Surface m_surface{};
 
         // Draw/prune priority, must be unique
@@ -80,12 +80,15 @@ public:
         inline constexpr auto get_height() const noexcept { return (m_height_pixels + m_cell_height - 1) / m_cell_height; }
         inline auto get_bottom() const noexcept { return m_top_cells + get_height() - 1; }
 
+        inline bool has_surface() const noexcept { return bool(m_surface); }
+        inline void set_surface(vte::cairo::Surface&& surface) noexcept { m_surface = std::move(surface); }
+
         inline auto resource_size() const noexcept
         {
-                if (cairo_image_surface_get_stride(m_surface.get()) != 0)
+                if (m_surface && cairo_image_surface_get_stride(m_surface.get()) != 0)
                         return cairo_image_surface_get_stride(m_surface.get()) * m_height_pixels;
 
-                /* Not an image surface: Only the device knows for sure, so we guess */
+                /* Not an image surface, or not decoded yet: Only the device knows for sure, so we guess */
                 return m_width_pixels * m_height_pixels * 4;
         }
 
@@ -636,13 +636,15 @@ private:
                 gsize const buf_size = 16384;
                 guchar* buf = g_new0(guchar, buf_size);
 
+                /* The bulk decoder produces at most one codepoint per byte, plus one */
+                auto u32buf = g_new0(uint32_t, buf_size + 1);
+
                 auto start_time = g_get_monotonic_time();
 
                 vte::base::UTF8Decoder decoder;
 
-                gsize buf_start = 0;
                 for (;;) {
-                        auto len = read(fd, buf + buf_start, buf_size - buf_start);
+                        auto len = read(fd, buf, buf_size);
                         if (!len)
                                 break;
                         if (len == -1) {
@@ -651,37 +653,21 @@ private:
                                 break;
                         }
 
-                        auto const bufend = buf + len;
-                        for (auto sptr = buf; sptr < bufend; ++sptr) {
-                                switch (decoder.decode(*sptr)) {
-                                case vte::base::UTF8Decoder::REJECT_REWIND:
-                                        /* Rewind the stream.
-                                         * Note that this will never lead to a loop, since in the
-                                         * next round this byte *will* be consumed.
-                                         */
-                                        --sptr;
-                                        [[fallthrough]];
-                                case vte::base::UTF8Decoder::REJECT:
-                                        decoder.reset();
-                                        /* Fall through to insert the U+FFFD replacement character. */
-                                        [[fallthrough]];
-                                case vte::base::UTF8Decoder::ACCEPT: {
-                                        auto ret = parser.feed(decoder.codepoint());
-                                        if (G_UNLIKELY(ret < 0)) {
-                                                g_printerr("Parser error!\n");
-                                                goto out;
-                                        }
-
-                                        m_seq_stats[ret]++;
-                                        if (ret != VTE_SEQ_NONE) {
-                                                m_cmd_stats[seq.command()]++;
-                                                func(seq);
-                                        }
-                                        break;
+                        auto const u32end = decoder.decode_bulk(buf, buf + len, u32buf);
+                        for (auto uptr = (uint32_t const*)u32buf; uptr < u32end; ) {
+                                auto const uptr_start = uptr;
+                                auto ret = parser.feed(&uptr, u32end);
+                                if (G_UNLIKELY(ret < 0)) {
+                                        g_printerr("Parser error!\n");
+                                        goto out;
                                 }
 
-                                default:
-                                        break;
+                                /* All but the last consumed character returned VTE_SEQ_NONE */
+                                m_seq_stats[VTE_SEQ_NONE] += (uptr - uptr_start) - 1;
+                                m_seq_stats[ret]++;
+                                if (ret != VTE_SEQ_NONE) {
+                                        m_cmd_stats[seq.command()]++;
+                                        func(seq);
                                 }
                         }
                 }
@@ -691,6 +677,7 @@ private:
                 int64_t time_spent = g_get_monotonic_time() - start_time;
                 g_array_append_val(m_bench_times, time_spent);
 
+                g_free(u32buf);
                 g_free(buf);
         }
 
@@ -53,11 +53,25 @@ public:
                 return vte_parser_feed(&m_parser, raw);
         }
 
+        /* Feeds from *@ptr until a sequence completes or @end is reached,
+         * and advances *@ptr past the consumed characters.
+         */
+        inline int feed(uint32_t const** ptr,
+                        uint32_t const* end) noexcept
+        {
+                return vte_parser_feed_buffer(&m_parser, ptr, end);
+        }
+
         inline void reset() noexcept
         {
                 vte_parser_reset(&m_parser);
         }
 
+        inline bool in_ground_state() const noexcept
+        {
+                return vte_parser_in_ground_state(&m_parser);
+        }
+
 protected:
         vte_parser_t m_parser;
 }; // class Parser
@@ -173,6 +187,19 @@ public:
                 return m_seq->intermediates;
         }
 
+        /* string_segment:
+         *
+         * This tells which part of the string argument of a DCS or OSC
+         * sequence the sequence carries. Only streamed DCS are dispatched
+         * in more than one segment.
+         *
+         * Returns: a combination of the VTE_SEQ_STRING_SEGMENT_* flags
+         */
+        inline constexpr unsigned int string_segment() const noexcept
+        {
+                return m_seq->string_segment;
+        }
+
         // FIXMEchpe: upgrade to C++17 and use the u32string_view version below, instead
         /*
          * string:
@@ -35,16 +35,15 @@ typedef struct vte_seq_string_t {
 
 #define VTE_SEQ_STRING_DEFAULT_CAPACITY (1 << 7) /* must be power of two */
 
-#ifdef WITH_SIXEL
-/* This needs to be somewhat large for the time being; it accommodates inline
- * graphics formats (e.g. sixels), and there is no provision for parsing
- * those incrementally yet. 8M characters is typically enough for an
- * RLE-incompressible 256-color 1920x1080 image. Since VTE seqs store 32 bits
- * per character, this corresponds to a 32MiB buffer. */
-#define VTE_SEQ_STRING_MAX_CAPACITY     (1 << 23)
-#else
 #define VTE_SEQ_STRING_MAX_CAPACITY     (1 << 12)
-#endif
+
+/* Strings of sequences that carry potentially large payloads (e.g. sixel
+ * images) are not collected in full, but passed on in segments of this
+ * many characters as they arrive.
+ */
+#define VTE_SEQ_STRING_SEGMENT_SIZE     (1 << 12)
+
+static_assert(VTE_SEQ_STRING_SEGMENT_SIZE <= VTE_SEQ_STRING_MAX_CAPACITY, "Segment size exceeds capacity");
 
 /*
  * vte_seq_string_init:
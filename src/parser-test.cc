@@ -304,6 +304,38 @@ test_seq_control(void)
         }
 }
 
+static void
+test_seq_feed_buffer(void)
+{
+        /* Feeding a buffer stops after each complete sequence, and
+         * consumes non-dispatching characters in between.
+         */
+        std::u32string const s{U"a\x1b[1;2mb\x1b]0;x\x07\x1b["};
+        auto ptr = reinterpret_cast<uint32_t const*>(s.data());
+        auto const end = ptr + s.size();
+
+        static struct {
+                int type;
+                size_t pos;
+        } const expected[] = {
+                { VTE_SEQ_GRAPHIC, 1 },
+                { VTE_SEQ_CSI, 7 },
+                { VTE_SEQ_GRAPHIC, 8 },
+                { VTE_SEQ_OSC, 14 },
+                { VTE_SEQ_NONE, 16 },
+        };
+
+        parser.reset();
+        for (unsigned int i = 0; i < G_N_ELEMENTS(expected); i++) {
+                auto rv = parser.feed(&ptr, end);
+                g_assert_cmpint(rv, ==, expected[i].type);
+                g_assert_cmpuint(ptr - reinterpret_cast<uint32_t const*>(s.data()), ==, expected[i].pos);
+        }
+
+        g_assert_true(ptr == end);
+        g_assert_false(parser.in_ground_state());
+}
+
 static void
 test_seq_esc_invalid(void)
 {
@@ -957,6 +989,64 @@ test_seq_dcs_known(void)
 #undef _VTE_SEQ
 }
 
+#ifdef WITH_SIXEL
+
+static void
+test_seq_dcs_stream(size_t len)
+{
+        /* Tests that the string of a streamed DCS (DECSIXEL) is dispatched
+         * in segments as it arrives, instead of being collected in full.
+         */
+        vte_seq_builder b{VTE_SEQ_DCS, 'q'};
+        b.set_string(std::u32string(len, U'?'));
+
+        std::u32string s;
+        b.to_string(s, true);
+
+        parser.reset();
+
+        size_t total = 0;
+        unsigned int n_segments = 0;
+        for (auto c : s) {
+                auto rv = parser.feed((uint32_t)c);
+                if (rv == VTE_SEQ_NONE)
+                        continue;
+
+                g_assert_cmpint(rv, ==, VTE_SEQ_DCS);
+                g_assert_cmpint(seq.command(), ==, VTE_CMD_DECSIXEL);
+
+                auto const segment = seq.string_segment();
+                g_assert_cmpuint(!!(segment & VTE_SEQ_STRING_SEGMENT_FIRST), ==, n_segments == 0);
+
+                auto const str = seq.string();
+                g_assert_cmpuint(str.size(), <=, VTE_SEQ_STRING_SEGMENT_SIZE);
+                total += str.size();
+                ++n_segments;
+
+                if (segment & VTE_SEQ_STRING_SEGMENT_LAST)
+                        break;
+
+                g_assert_cmpuint(str.size(), ==, VTE_SEQ_STRING_SEGMENT_SIZE);
+        }
+
+        g_assert_cmpuint(total, ==, len);
+        g_assert_cmpuint(n_segments, ==, len / VTE_SEQ_STRING_SEGMENT_SIZE + 1);
+        g_assert_true(parser.in_ground_state());
+}
+
+static void
+test_seq_dcs_stream(void)
+{
+        test_seq_dcs_stream(0);
+        test_seq_dcs_stream(1);
+        test_seq_dcs_stream(VTE_SEQ_STRING_SEGMENT_SIZE - 1);
+        test_seq_dcs_stream(VTE_SEQ_STRING_SEGMENT_SIZE);
+        test_seq_dcs_stream(VTE_SEQ_STRING_SEGMENT_SIZE + 1);
+        test_seq_dcs_stream(VTE_SEQ_STRING_MAX_CAPACITY * 4 + 3);
+}
+
+#endif /* WITH_SIXEL */
+
 static void
 test_seq_parse(char const* str)
 {
@@ -1489,6 +1579,7 @@ main(int argc,
         g_test_add_func("/vte/parser/sequences/glue/sequence-builder", test_seq_glue_sequence_builder);
         g_test_add_func("/vte/parser/sequences/glue/reply-builder", test_seq_glue_reply_builder);
         g_test_add_func("/vte/parser/sequences/control", test_seq_control);
+        g_test_add_func("/vte/parser/sequences/feed-buffer", test_seq_feed_buffer);
         g_test_add_func("/vte/parser/sequences/escape/invalid", test_seq_esc_invalid);
         g_test_add_func("/vte/parser/sequences/escape/charset/94", test_seq_esc_charset_94);
         g_test_add_func("/vte/parser/sequences/escape/charset/96", test_seq_esc_charset_96);
@@ -1508,6 +1599,9 @@ main(int argc,
         g_test_add_func("/vte/parser/sequences/sci/known", test_seq_sci_known);
         g_test_add_func("/vte/parser/sequences/dcs", test_seq_dcs);
         g_test_add_func("/vte/parser/sequences/dcs/known", test_seq_dcs_known);
+#ifdef WITH_SIXEL
+        g_test_add_func("/vte/parser/sequences/dcs/stream", test_seq_dcs_stream);
+#endif
         g_test_add_func("/vte/parser/sequences/osc", test_seq_osc);
 
         return g_test_run();
@@ -496,7 +496,7 @@ vte_parse_host_sci(vte_seq_t const* seq)
  */
 
 enum parser_state_t {
-        STATE_GROUND,           /* initial state and ground */
+        STATE_GROUND = VTE_PARSER_STATE_GROUND, /* initial state and ground */
         STATE_DCS_PASS_ESC,     /* ESC after DCS which may be ESC \ aka C0 ST */
         STATE_OSC_STRING_ESC,   /* ESC after OSC which may be ESC \ aka C0 ST */
         STATE_ESC,              /* ESC sequence was started */
@@ -517,87 +517,37 @@ enum parser_state_t {
         STATE_N,
 };
 
-/* Parser state transitioning */
-
-typedef int (* parser_action_func)(vte_parser_t* parser, uint32_t raw);
-
-// FIXMEchpe: I get weird performance results here from
-// either not inlining, inlining these function or the
-// macros below. Sometimes (after a recompile) one is
-// (as much as 50%!) slower, sometimes the other one etc. ‽
-
-#if 1 // (inline) functions
-
-// #define PTINLINE inline
-#define PTINLINE
-
-/* nop */
-static PTINLINE int
-parser_nop(vte_parser_t* parser,
-           uint32_t raw)
-{
-        return VTE_SEQ_NONE;
-}
-/* dispatch related actions */
-static PTINLINE int
-parser_action(vte_parser_t* parser,
-              uint32_t raw,
-              parser_action_func action)
-{
-        return action(parser, raw);
-}
-
-/* perform state transition */
-static PTINLINE int
-parser_transition_no_action(vte_parser_t* parser,
-                            uint32_t raw,
-                            unsigned int state)
-{
-        parser->state = state;
-        return VTE_SEQ_NONE;
-}
-
-/* perform state transition and dispatch related actions */
-static PTINLINE int
-parser_transition(vte_parser_t* parser,
-                  uint32_t raw,
-                  unsigned int state,
-                  parser_action_func action)
-{
-        parser->state = state;
-
-        return action(parser, raw);
-}
-
-#undef PTINLINE
-
-#else // macros
-
-/* nop */
-#define parser_nop(parser,raw) \
-        ({ VTE_SEQ_NONE; })
-
-/* dispatch related actions */
-#define parser_action(p,r,a) \
-        ({ \
-                a((p), (r)); \
-        })
-
-/* perform state transition */
-#define parser_transition_no_action(p,r,s) \
-        ({ \
-                parser->state = s; \
-                VTE_SEQ_NONE; \
-        })
-
-/* perform state transition and dispatch related actions */
-#define parser_transition(p,r,s,a) \
-        ({ \
-                (p)->state = s; \
-                a((p), (r)); \
-        })
-
-#endif // (inline) functions or macros
+/* Parser actions */
+
+enum parser_action_t {
+        ACTION_NONE,
+        ACTION_CLEAR,
+        ACTION_CLEAR_INT,
+        ACTION_CLEAR_INT_AND_PARAMS,
+        ACTION_CLEAR_PARAMS_ONLY,
+        ACTION_IGNORE,
+        ACTION_PRINT,
+        ACTION_EXECUTE,
+        ACTION_COLLECT_ESC,
+        ACTION_COLLECT_CSI,
+        ACTION_COLLECT_DCS = ACTION_COLLECT_CSI,
+        ACTION_COLLECT_PARAMETER,
+        ACTION_PARAM,
+        ACTION_FINISH_PARAM,
+        ACTION_FINISH_SUBPARAM,
+        ACTION_ESC_DISPATCH,
+        ACTION_CSI_DISPATCH,
+        ACTION_DCS_START,
+        ACTION_DCS_CONSUME,
+        ACTION_DCS_COLLECT,
+        ACTION_DCS_DISPATCH,
+        ACTION_OSC_START,
+        ACTION_OSC_COLLECT,
+        ACTION_OSC_DISPATCH,
+        ACTION_SCI_DISPATCH,
+
+        ACTION_N,
+};
 
 /**
  * vte_parser_init() - Initialise parser object
@@ -772,10 +722,8 @@ parser_params_overflow(vte_parser_t* parser,
          * Transition to STATE_{CSI,DCS}_IGNORE to ignore the
          * whole sequence.
          */
-        parser_transition_no_action(parser,
-                                    raw,
-                                    parser->state == STATE_CSI_PARAM ?
-                                    STATE_CSI_IGNORE : STATE_DCS_IGNORE);
+        parser->state = parser->state == STATE_CSI_PARAM ?
+                STATE_CSI_IGNORE : STATE_DCS_IGNORE;
 }
 
 /* The next two functions are only called when encountering a ';' or ':',
@@ -851,6 +799,19 @@ parser_osc_collect(vte_parser_t* parser,
         return VTE_SEQ_NONE;
 }
 
+/* Whether the string of a DCS with @command is passed on in segments as
+ * it arrives, instead of being collected and dispatched in full.
+ */
+static inline bool
+parser_dcs_is_streamed(unsigned int command)
+{
+#ifdef WITH_SIXEL
+        return command == VTE_CMD_DECSIXEL;
+#else
+        return false;
+#endif
+}
+
 static int
 parser_dcs_start(vte_parser_t* parser,
                  uint32_t raw)
@@ -858,6 +819,9 @@ parser_dcs_start(vte_parser_t* parser,
         parser_clear_int_and_params(parser, raw);
 
         vte_seq_string_reset(&parser->seq.arg_str);
+        parser->seq.string_segment = VTE_SEQ_STRING_SEGMENT_FIRST;
+        parser->string_streamed = false;
+        parser->string_flushed = false;
 
         parser->seq.introducer = raw;
         return VTE_SEQ_NONE;
@@ -882,14 +846,42 @@ parser_dcs_consume(vte_parser_t* parser,
         parser->seq.type = VTE_SEQ_DCS;
         parser->seq.terminator = raw;
         parser->seq.command = vte_parse_host_dcs(&parser->seq);
+        parser->string_streamed = parser_dcs_is_streamed(parser->seq.command);
 
         return VTE_SEQ_NONE;
 }
 
+/* Starts the next segment of a streamed string, once the
+ * previous one has been dispatched.
+ */
+static inline void
+parser_dcs_next_segment(vte_parser_t* parser)
+{
+        if (!parser->string_flushed)
+                return;
+
+        vte_seq_string_reset(&parser->seq.arg_str);
+        parser->seq.string_segment &= ~VTE_SEQ_STRING_SEGMENT_FIRST;
+        parser->string_flushed = false;
+}
+
 static int
 parser_dcs_collect(vte_parser_t* parser,
                    uint32_t raw)
 {
+        if (parser->string_streamed) {
+                parser_dcs_next_segment(parser);
+
+                /* Cannot fail, since the segment size doesn't exceed the capacity */
+                vte_seq_string_push(&parser->seq.arg_str, raw);
+                if (parser->seq.arg_str.len < VTE_SEQ_STRING_SEGMENT_SIZE)
+                        return VTE_SEQ_NONE;
+
+                /* Dispatch the segment, but stay in STATE_DCS_PASS */
+                parser->string_flushed = true;
+                return parser->seq.type;
+        }
+
         if (G_UNLIKELY(!vte_seq_string_push(&parser->seq.arg_str, raw)))
                 parser->state = STATE_DCS_IGNORE;
 
@@ -951,6 +943,7 @@ parser_osc(vte_parser_t* parser,
         parser->seq.type = VTE_SEQ_OSC;
         parser->seq.command = VTE_CMD_OSC;
         parser->seq.terminator = raw;
+        parser->seq.string_segment = VTE_SEQ_STRING_SEGMENT_COMPLETE;
 
         return parser->seq.type;
 }
@@ -961,7 +954,11 @@ parser_dcs(vte_parser_t* parser,
 {
         /* parser->seq was already filled in parser_dcs_consume() */
 
+        if (parser->string_streamed)
+                parser_dcs_next_segment(parser);
+
         vte_seq_string_finish(&parser->seq.arg_str);
+        parser->seq.string_segment |= VTE_SEQ_STRING_SEGMENT_LAST;
 
         /* We only dispatch a DCS if the introducer and string
          * terminator are from the same control set, i.e. both
@@ -984,463 +981,356 @@ parser_sci(vte_parser_t* parser,
         return parser->seq.type;
 }
 
-#define ACTION_CLEAR parser_clear
-#define ACTION_CLEAR_INT parser_clear_int
-#define ACTION_CLEAR_INT_AND_PARAMS parser_clear_int_and_params
-#define ACTION_CLEAR_PARAMS_ONLY parser_clear_params
-#define ACTION_IGNORE parser_ignore
-#define ACTION_PRINT parser_print
-#define ACTION_EXECUTE parser_execute
-#define ACTION_COLLECT_ESC parser_collect_esc
-#define ACTION_COLLECT_CSI parser_collect_csi
-#define ACTION_COLLECT_DCS ACTION_COLLECT_CSI
-#define ACTION_COLLECT_PARAMETER parser_collect_parameter
-#define ACTION_PARAM parser_param
-#define ACTION_FINISH_PARAM parser_finish_param
-#define ACTION_FINISH_SUBPARAM parser_finish_subparam
-#define ACTION_ESC_DISPATCH parser_esc
-#define ACTION_CSI_DISPATCH parser_csi
-#define ACTION_DCS_START parser_dcs_start
-#define ACTION_DCS_CONSUME parser_dcs_consume
-#define ACTION_DCS_COLLECT parser_dcs_collect
-#define ACTION_DCS_DISPATCH parser_dcs
-#define ACTION_OSC_START parser_osc_start
-#define ACTION_OSC_COLLECT parser_osc_collect
-#define ACTION_OSC_DISPATCH parser_osc
-#define ACTION_SCI_DISPATCH parser_sci
-
-static int
-parser_feed_to_state(vte_parser_t* parser,
-                     uint32_t raw)
-{
-        switch (parser->state) {
-        case STATE_GROUND:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                case 0x80 ... 0x9f:        /* C1 */
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                }
+/*
+ * Transition Table
+ * The state machine is a dense [state][class] table, generated at compile
+ * time from the description below. Each entry holds the state to transition
+ * to (which is the current state for entries that don't transition), and
+ * the action to perform after the transition.
+ *
+ * Characters 0x00..0x9f each have their own class; all characters from
+ * 0xa0 on behave the same and share the last class.
+ */
 
-                return parser_action(parser, raw,
-                                     ACTION_PRINT);
-
-        case STATE_DCS_PASS_ESC:
-        case STATE_OSC_STRING_ESC:
-                if (raw == 0x5c /* '\' */) {
-                        switch (parser->state) {
-                        case STATE_DCS_PASS_ESC:
-                                return parser_transition(parser, raw, STATE_GROUND,
-                                                         ACTION_DCS_DISPATCH);
-                        case STATE_OSC_STRING_ESC:
-                                return parser_transition(parser, raw, STATE_GROUND,
-                                                         ACTION_OSC_DISPATCH);
-                        }
-                }
+#define PARSER_N_CLASSES (0xa1)
 
-                /* Do the deferred clear and fallthrough to STATE_ESC */
-                parser_transition(parser, 0x1b /* ESC */, STATE_ESC,
-                                  ACTION_CLEAR_INT);
-
-                [[fallthrough]];
-        case STATE_ESC:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                                 ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_transition(parser, raw, STATE_ESC_INT,
-                                                 ACTION_COLLECT_ESC);
-                case 0x30 ... 0x4f:        /* ['0' - '~'] \ */
-                case 0x51 ... 0x57:        /* { 'P', 'X', 'Z' '[', ']', '^', '_' } */
-                case 0x59:
-                case 0x5c:
-                case 0x60 ... 0x7e:
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_ESC_DISPATCH);
-                case 0x50:                /* 'P' */
-                        return parser_transition(parser, raw, STATE_DCS_ENTRY,
-                                                 ACTION_DCS_START);
-                case 0x5a:                /* 'Z' */
-                        return parser_transition(parser, raw, STATE_SCI,
-                                                 ACTION_CLEAR);
-                case 0x5b:                /* '[' */
-                        return parser_transition(parser, raw, STATE_CSI_ENTRY,
-                                                 ACTION_CLEAR_PARAMS_ONLY
-                                                 /* rest already cleaned on ESC state entry */);
-                case 0x5d:                /* ']' */
-                        return parser_transition(parser, raw, STATE_OSC_STRING,
-                                                 ACTION_OSC_START);
-                case 0x58:                /* 'X' */
-                case 0x5e:                /* '^' */
-                case 0x5f:                /* '_' */
-                        return parser_transition_no_action(parser, raw, STATE_ST_IGNORE);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+/* Entries in STATE_{DCS_PASS,OSC_STRING}_ESC that are not the final '\' of
+ * a C0 ST first perform the deferred ESC state entry action (CLEAR_INT),
+ * and then act as in STATE_ESC.
+ */
+#define PARSER_ENTRY_ESC_CLEAR (1u << 15)
 
-                return parser_transition(parser, raw, STATE_GROUND,
-                                         ACTION_IGNORE);
-        case STATE_ESC_INT:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_action(parser, raw,
-                                             ACTION_COLLECT_ESC);
-                case 0x30 ... 0x7e:        /* ['0' - '~'] */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_ESC_DISPATCH);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+typedef uint16_t parser_entry_t;
+typedef parser_entry_t parser_table_t[STATE_N][PARSER_N_CLASSES];
 
-                return parser_transition(parser, raw, STATE_GROUND,
-                                         ACTION_IGNORE);
-        case STATE_CSI_ENTRY:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_transition(parser, raw, STATE_CSI_INT,
-                                                 ACTION_COLLECT_CSI);
-                case 0x30 ... 0x39:        /* ['0' - '9'] */
-                        return parser_transition(parser, raw, STATE_CSI_PARAM,
-                                                 ACTION_PARAM);
-                case 0x3a:                 /* ':' */
-                        return parser_transition(parser, raw, STATE_CSI_PARAM,
-                                                 ACTION_FINISH_SUBPARAM);
-                case 0x3b:                 /* ';' */
-                        return parser_transition(parser, raw, STATE_CSI_PARAM,
-                                                 ACTION_FINISH_PARAM);
-                case 0x3c ... 0x3f:        /* ['<' - '?'] */
-                        return parser_transition(parser, raw, STATE_CSI_PARAM,
-                                                 ACTION_COLLECT_PARAMETER);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_CSI_DISPATCH);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+static_assert(ACTION_N <= 0x100, "Too many actions");
+static_assert(STATE_N <= 0x40, "Too many states");
 
-                return parser_transition_no_action(parser, raw, STATE_CSI_IGNORE);
-        case STATE_CSI_PARAM:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_transition(parser, raw, STATE_CSI_INT,
-                                                 ACTION_COLLECT_CSI);
-                case 0x30 ... 0x39:        /* ['0' - '9'] */
-                        return parser_action(parser, raw,
-                                             ACTION_PARAM);
-                case 0x3a:                 /* ':' */
-                        return parser_action(parser, raw,
-                                             ACTION_FINISH_SUBPARAM);
-                case 0x3b:                 /* ';' */
-                        return parser_action(parser, raw,
-                                             ACTION_FINISH_PARAM);
-                case 0x3c ... 0x3f:        /* ['<' - '?'] */
-                        return parser_transition_no_action(parser, raw, STATE_CSI_IGNORE);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_CSI_DISPATCH);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+static inline constexpr unsigned int
+parser_class(uint32_t raw) noexcept
+{
+        return raw < 0xa0 ? raw : 0xa0;
+}
 
-                return parser_transition_no_action(parser, raw, STATE_CSI_IGNORE);
-        case STATE_CSI_INT:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_action(parser, raw,
-                                             ACTION_COLLECT_CSI);
-                case 0x30 ... 0x3f:        /* ['0' - '?'] */
-                        return parser_transition_no_action(parser, raw, STATE_CSI_IGNORE);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_CSI_DISPATCH);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+static inline constexpr parser_entry_t
+parser_entry(unsigned int state,
+             unsigned int action) noexcept
+{
+        return parser_entry_t(state << 8 | action);
+}
 
-                return parser_transition_no_action(parser, raw, STATE_CSI_IGNORE);
-        case STATE_CSI_IGNORE:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_EXECUTE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x3f:        /* [' ' - '?'] */
-                        return parser_nop(parser, raw);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition_no_action(parser, raw, STATE_GROUND);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+static inline constexpr unsigned int
+parser_entry_state(parser_entry_t entry) noexcept
+{
+        return (entry >> 8) & 0x3f;
+}
 
-                return parser_nop(parser, raw);
-        case STATE_DCS_ENTRY:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ ESC */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_IGNORE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_transition(parser, raw, STATE_DCS_INT,
-                                                 ACTION_COLLECT_DCS);
-                case 0x30 ... 0x39:        /* ['0' - '9'] */
-                        return parser_transition(parser, raw, STATE_DCS_PARAM,
-                                                 ACTION_PARAM);
-                case 0x3a:                 /* ':' */
-                        return parser_transition(parser, raw, STATE_DCS_PARAM,
-                                                 ACTION_FINISH_SUBPARAM);
-                case 0x3b:                 /* ';' */
-                        return parser_transition(parser, raw, STATE_DCS_PARAM,
-                                                 ACTION_FINISH_PARAM);
-                case 0x3c ... 0x3f:        /* ['<' - '?'] */
-                        return parser_transition(parser, raw, STATE_DCS_PARAM,
-                                                 ACTION_COLLECT_PARAMETER);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_DCS_PASS,
-                                                 ACTION_DCS_CONSUME);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
-                }
+static inline constexpr unsigned int
+parser_entry_action(parser_entry_t entry) noexcept
+{
+        return entry & 0xff;
+}
 
-                return parser_transition(parser, raw,
-                                         STATE_DCS_PASS, ACTION_DCS_CONSUME);
-        case STATE_DCS_PARAM:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_IGNORE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_transition(parser, raw, STATE_DCS_INT,
-                                                 ACTION_COLLECT_DCS);
-                case 0x30 ... 0x39:        /* ['0' - '9'] */
-                        return parser_action(parser, raw,
-                                                 ACTION_PARAM);
-                case 0x3a:                 /* ':' */
-                        return parser_action(parser, raw,
-                                             ACTION_FINISH_SUBPARAM);
-                case 0x3b:                 /* ';' */
-                        return parser_action(parser, raw,
-                                             ACTION_FINISH_PARAM);
-                case 0x3c ... 0x3f:        /* ['<' - '?'] */
-                        return parser_transition_no_action(parser, raw, STATE_DCS_IGNORE);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_DCS_PASS,
-                                                 ACTION_DCS_CONSUME);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
+class ParserTable {
+public:
+        constexpr ParserTable() noexcept
+        {
+                /* Note that the order matters here; later rules override earlier ones. */
+
+                /* STATE_GROUND */
+                set(STATE_GROUND, 0x00, 0xa0, STATE_GROUND, ACTION_PRINT);
+                set(STATE_GROUND, 0x00, 0x1a, STATE_GROUND, ACTION_EXECUTE); /* C0 \ { ESC } */
+                set(STATE_GROUND, 0x1c, 0x1f, STATE_GROUND, ACTION_EXECUTE);
+                set(STATE_GROUND, 0x80, 0x9f, STATE_GROUND, ACTION_EXECUTE); /* C1 */
+                set(STATE_GROUND, 0x1b, STATE_ESC, ACTION_CLEAR_INT);        /* ESC */
+
+                /* STATE_ESC */
+                set(STATE_ESC, 0x00, 0xa0, STATE_GROUND, ACTION_IGNORE);
+                set_c0(STATE_ESC, STATE_ESC, ACTION_EXECUTE);
+                set(STATE_ESC, 0x20, 0x2f, STATE_ESC_INT, ACTION_COLLECT_ESC); /* [' ' - '\'] */
+                set(STATE_ESC, 0x30, 0x7e, STATE_GROUND, ACTION_ESC_DISPATCH); /* ['0' - '~'] \ { 'P', 'X', 'Z' '[', ']', '^', '_' } */
+                set(STATE_ESC, 0x50, STATE_DCS_ENTRY, ACTION_DCS_START);       /* 'P' */
+                set(STATE_ESC, 0x5a, STATE_SCI, ACTION_CLEAR);                 /* 'Z' */
+                set(STATE_ESC, 0x5b, STATE_CSI_ENTRY, ACTION_CLEAR_PARAMS_ONLY /* rest already cleaned on ESC state entry */); /* '[' */
+                set(STATE_ESC, 0x5d, STATE_OSC_STRING, ACTION_OSC_START);      /* ']' */
+                set(STATE_ESC, 0x58, STATE_ST_IGNORE, ACTION_NONE);            /* 'X' */
+                set(STATE_ESC, 0x5e, STATE_ST_IGNORE, ACTION_NONE);            /* '^' */
+                set(STATE_ESC, 0x5f, STATE_ST_IGNORE, ACTION_NONE);            /* '_' */
+                set(STATE_ESC, 0x9c, STATE_GROUND, ACTION_IGNORE);             /* ST */
+
+                /* STATE_DCS_PASS_ESC, STATE_OSC_STRING_ESC */
+                for (auto c = 0u; c < PARSER_N_CLASSES; ++c) {
+                        m_table[STATE_DCS_PASS_ESC][c] = parser_entry_t(m_table[STATE_ESC][c] | PARSER_ENTRY_ESC_CLEAR);
+                        m_table[STATE_OSC_STRING_ESC][c] = parser_entry_t(m_table[STATE_ESC][c] | PARSER_ENTRY_ESC_CLEAR);
                 }
-
-                return parser_transition(parser, raw,
-                                         STATE_DCS_PASS, ACTION_DCS_CONSUME);
-        case STATE_DCS_INT:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* C0 \ { ESC } */
-                case 0x1c ... 0x1f:
-                        return parser_action(parser, raw,
-                                             ACTION_IGNORE);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x20 ... 0x2f:        /* [' ' - '\'] */
-                        return parser_action(parser, raw,
-                                             ACTION_COLLECT_DCS);
-                case 0x30 ... 0x3f:        /* ['0' - '?'] */
-                        return parser_transition_no_action(parser, raw, STATE_DCS_IGNORE);
-                case 0x40 ... 0x7e:        /* ['@' - '~'] */
-                        return parser_transition(parser, raw, STATE_DCS_PASS,
-                                                 ACTION_DCS_CONSUME);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_IGNORE);
+                set(STATE_DCS_PASS_ESC, 0x5c, STATE_GROUND, ACTION_DCS_DISPATCH);   /* '\' */
+                set(STATE_OSC_STRING_ESC, 0x5c, STATE_GROUND, ACTION_OSC_DISPATCH); /* '\' */
+
+                /* STATE_ESC_INT */
+                set(STATE_ESC_INT, 0x00, 0xa0, STATE_GROUND, ACTION_IGNORE);
+                set_c0(STATE_ESC_INT, STATE_ESC_INT, ACTION_EXECUTE);
+                set(STATE_ESC_INT, 0x20, 0x2f, STATE_ESC_INT, ACTION_COLLECT_ESC); /* [' ' - '\'] */
+                set(STATE_ESC_INT, 0x30, 0x7e, STATE_GROUND, ACTION_ESC_DISPATCH); /* ['0' - '~'] */
+                set(STATE_ESC_INT, 0x9c, STATE_GROUND, ACTION_IGNORE);             /* ST */
+
+                /* STATE_CSI_ENTRY */
+                set(STATE_CSI_ENTRY, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+                set_c0(STATE_CSI_ENTRY, STATE_CSI_ENTRY, ACTION_EXECUTE);
+                set(STATE_CSI_ENTRY, 0x20, 0x2f, STATE_CSI_INT, ACTION_COLLECT_CSI);         /* [' ' - '\'] */
+                set(STATE_CSI_ENTRY, 0x30, 0x39, STATE_CSI_PARAM, ACTION_PARAM);             /* ['0' - '9'] */
+                set(STATE_CSI_ENTRY, 0x3a, STATE_CSI_PARAM, ACTION_FINISH_SUBPARAM);         /* ':' */
+                set(STATE_CSI_ENTRY, 0x3b, STATE_CSI_PARAM, ACTION_FINISH_PARAM);            /* ';' */
+                set(STATE_CSI_ENTRY, 0x3c, 0x3f, STATE_CSI_PARAM, ACTION_COLLECT_PARAMETER); /* ['<' - '?'] */
+                set(STATE_CSI_ENTRY, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);         /* ['@' - '~'] */
+                set(STATE_CSI_ENTRY, 0x9c, STATE_GROUND, ACTION_IGNORE);                     /* ST */
+
+                /* STATE_CSI_PARAM */
+                set(STATE_CSI_PARAM, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+                set_c0(STATE_CSI_PARAM, STATE_CSI_PARAM, ACTION_EXECUTE);
+                set(STATE_CSI_PARAM, 0x20, 0x2f, STATE_CSI_INT, ACTION_COLLECT_CSI);   /* [' ' - '\'] */
+                set(STATE_CSI_PARAM, 0x30, 0x39, STATE_CSI_PARAM, ACTION_PARAM);       /* ['0' - '9'] */
+                set(STATE_CSI_PARAM, 0x3a, STATE_CSI_PARAM, ACTION_FINISH_SUBPARAM);   /* ':' */
+                set(STATE_CSI_PARAM, 0x3b, STATE_CSI_PARAM, ACTION_FINISH_PARAM);      /* ';' */
+                set(STATE_CSI_PARAM, 0x3c, 0x3f, STATE_CSI_IGNORE, ACTION_NONE);       /* ['<' - '?'] */
+                set(STATE_CSI_PARAM, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);   /* ['@' - '~'] */
+                set(STATE_CSI_PARAM, 0x9c, STATE_GROUND, ACTION_IGNORE);               /* ST */
+
+                /* STATE_CSI_INT */
+                set(STATE_CSI_INT, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+                set_c0(STATE_CSI_INT, STATE_CSI_INT, ACTION_EXECUTE);
+                set(STATE_CSI_INT, 0x20, 0x2f, STATE_CSI_INT, ACTION_COLLECT_CSI);   /* [' ' - '\'] */
+                set(STATE_CSI_INT, 0x30, 0x3f, STATE_CSI_IGNORE, ACTION_NONE);       /* ['0' - '?'] */
+                set(STATE_CSI_INT, 0x40, 0x7e, STATE_GROUND, ACTION_CSI_DISPATCH);   /* ['@' - '~'] */
+                set(STATE_CSI_INT, 0x9c, STATE_GROUND, ACTION_IGNORE);               /* ST */
+
+                /* STATE_CSI_IGNORE */
+                set(STATE_CSI_IGNORE, 0x00, 0xa0, STATE_CSI_IGNORE, ACTION_NONE);
+                set_c0(STATE_CSI_IGNORE, STATE_CSI_IGNORE, ACTION_EXECUTE);
+                set(STATE_CSI_IGNORE, 0x40, 0x7e, STATE_GROUND, ACTION_NONE);   /* ['@' - '~'] */
+                set(STATE_CSI_IGNORE, 0x9c, STATE_GROUND, ACTION_IGNORE);       /* ST */
+
+                /* STATE_DCS_ENTRY */
+                set(STATE_DCS_ENTRY, 0x00, 0xa0, STATE_DCS_PASS, ACTION_DCS_CONSUME);
+                set_c0(STATE_DCS_ENTRY, STATE_DCS_ENTRY, ACTION_IGNORE);
+                set(STATE_DCS_ENTRY, 0x20, 0x2f, STATE_DCS_INT, ACTION_COLLECT_DCS);         /* [' ' - '\'] */
+                set(STATE_DCS_ENTRY, 0x30, 0x39, STATE_DCS_PARAM, ACTION_PARAM);             /* ['0' - '9'] */
+                set(STATE_DCS_ENTRY, 0x3a, STATE_DCS_PARAM, ACTION_FINISH_SUBPARAM);         /* ':' */
+                set(STATE_DCS_ENTRY, 0x3b, STATE_DCS_PARAM, ACTION_FINISH_PARAM);            /* ';' */
+                set(STATE_DCS_ENTRY, 0x3c, 0x3f, STATE_DCS_PARAM, ACTION_COLLECT_PARAMETER); /* ['<' - '?'] */
+                set(STATE_DCS_ENTRY, 0x40, 0x7e, STATE_DCS_PASS, ACTION_DCS_CONSUME);        /* ['@' - '~'] */
+                set(STATE_DCS_ENTRY, 0x9c, STATE_GROUND, ACTION_IGNORE);                     /* ST */
+
+                /* STATE_DCS_PARAM */
+                set(STATE_DCS_PARAM, 0x00, 0xa0, STATE_DCS_PASS, ACTION_DCS_CONSUME);
+                set_c0(STATE_DCS_PARAM, STATE_DCS_PARAM, ACTION_IGNORE);
+                set(STATE_DCS_PARAM, 0x20, 0x2f, STATE_DCS_INT, ACTION_COLLECT_DCS);     /* [' ' - '\'] */
+                set(STATE_DCS_PARAM, 0x30, 0x39, STATE_DCS_PARAM, ACTION_PARAM);         /* ['0' - '9'] */
+                set(STATE_DCS_PARAM, 0x3a, STATE_DCS_PARAM, ACTION_FINISH_SUBPARAM);     /* ':' */
+                set(STATE_DCS_PARAM, 0x3b, STATE_DCS_PARAM, ACTION_FINISH_PARAM);        /* ';' */
+                set(STATE_DCS_PARAM, 0x3c, 0x3f, STATE_DCS_IGNORE, ACTION_NONE);         /* ['<' - '?'] */
+                set(STATE_DCS_PARAM, 0x40, 0x7e, STATE_DCS_PASS, ACTION_DCS_CONSUME);    /* ['@' - '~'] */
+                set(STATE_DCS_PARAM, 0x9c, STATE_GROUND, ACTION_IGNORE);                 /* ST */
+
+                /* STATE_DCS_INT */
+                set(STATE_DCS_INT, 0x00, 0xa0, STATE_DCS_PASS, ACTION_DCS_CONSUME);
+                set_c0(STATE_DCS_INT, STATE_DCS_INT, ACTION_IGNORE);
+                set(STATE_DCS_INT, 0x20, 0x2f, STATE_DCS_INT, ACTION_COLLECT_DCS);     /* [' ' - '\'] */
+                set(STATE_DCS_INT, 0x30, 0x3f, STATE_DCS_IGNORE, ACTION_NONE);         /* ['0' - '?'] */
+                set(STATE_DCS_INT, 0x40, 0x7e, STATE_DCS_PASS, ACTION_DCS_CONSUME);    /* ['@' - '~'] */
+                set(STATE_DCS_INT, 0x9c, STATE_GROUND, ACTION_IGNORE);                 /* ST */
+
+                /* STATE_DCS_PASS */
+                set(STATE_DCS_PASS, 0x00, 0xa0, STATE_DCS_PASS, ACTION_DCS_COLLECT);
+                set(STATE_DCS_PASS, 0x1b, STATE_DCS_PASS_ESC, ACTION_NONE);     /* ESC */
+                set(STATE_DCS_PASS, 0x9c, STATE_GROUND, ACTION_DCS_DISPATCH);   /* ST */
+
+                /* STATE_DCS_IGNORE */
+                set(STATE_DCS_IGNORE, 0x00, 0xa0, STATE_DCS_IGNORE, ACTION_NONE);
+                set(STATE_DCS_IGNORE, 0x1b, STATE_ESC, ACTION_CLEAR_INT);   /* ESC */
+                set(STATE_DCS_IGNORE, 0x9c, STATE_GROUND, ACTION_NONE);     /* ST */
+
+                /* STATE_OSC_STRING */
+                set(STATE_OSC_STRING, 0x00, 0xa0, STATE_OSC_STRING, ACTION_OSC_COLLECT);
+                set(STATE_OSC_STRING, 0x00, 0x1f, STATE_OSC_STRING, ACTION_NONE);         /* C0 \ { BEL, ESC } */
+                set(STATE_OSC_STRING, 0x1b, STATE_OSC_STRING_ESC, ACTION_NONE);           /* ESC */
+                set(STATE_OSC_STRING, 0x07, STATE_GROUND, ACTION_OSC_DISPATCH);           /* BEL */
+                set(STATE_OSC_STRING, 0x9c, STATE_GROUND, ACTION_OSC_DISPATCH);           /* ST */
+
+                /* STATE_ST_IGNORE */
+                set(STATE_ST_IGNORE, 0x00, 0xa0, STATE_ST_IGNORE, ACTION_NONE);
+                set(STATE_ST_IGNORE, 0x1b, STATE_ESC, ACTION_CLEAR_INT);   /* ESC */
+                set(STATE_ST_IGNORE, 0x9c, STATE_GROUND, ACTION_IGNORE);   /* ST */
+
+                /* STATE_SCI */
+                set(STATE_SCI, 0x00, 0xa0, STATE_GROUND, ACTION_IGNORE);
+                set(STATE_SCI, 0x1b, STATE_ESC, ACTION_CLEAR_INT);          /* ESC */
+                set(STATE_SCI, 0x08, 0x0d, STATE_GROUND, ACTION_SCI_DISPATCH); /* BS, HT, LF, VT, FF, CR */
+                set(STATE_SCI, 0x20, 0x7e, STATE_GROUND, ACTION_SCI_DISPATCH); /* [' ' - '~'] */
+
+                /*
+                 * Notes:
+                 *  * DEC treats GR codes as GL. We don't do that as we require UTF-8
+                 *    as charset and, thus, it doesn't make sense to treat GR special.
+                 *  * During control sequences, unexpected C1 codes cancel the sequence
+                 *    and immediately start a new one. C0 codes, however, may or may not
+                 *    be ignored/executed depending on the sequence.
+                 *
+                 * These apply in all states and override the above.
+                 */
+                for (auto state = 0u; state < STATE_N; ++state) {
+                        set(state, 0x18, STATE_GROUND, ACTION_IGNORE);                     /* CAN */
+                        set(state, 0x1a, STATE_GROUND, ACTION_EXECUTE);                    /* SUB */
+                        set(state, 0x7f, state, ACTION_NONE);                              /* DEL */
+                        set(state, 0x80, 0x8f, STATE_GROUND, ACTION_EXECUTE);              /* C1 \ {DCS, SOS, SCI, CSI, ST, OSC, PM, APC} */
+                        set(state, 0x91, 0x97, STATE_GROUND, ACTION_EXECUTE);
+                        set(state, 0x99, STATE_GROUND, ACTION_EXECUTE);
+                        set(state, 0x98, STATE_ST_IGNORE, ACTION_NONE);                    /* SOS */
+                        set(state, 0x9e, STATE_ST_IGNORE, ACTION_NONE);                    /* PM */
+                        set(state, 0x9f, STATE_ST_IGNORE, ACTION_NONE);                    /* APC */
+                        // FIXMEchpe shouldn't SOS, PM, APC use ACTION_CLEAR?
+                        set(state, 0x90, STATE_DCS_ENTRY, ACTION_DCS_START);               /* DCS */
+                        set(state, 0x9a, STATE_SCI, ACTION_CLEAR);                         /* SCI */
+                        set(state, 0x9d, STATE_OSC_STRING, ACTION_OSC_START);              /* OSC */
+                        set(state, 0x9b, STATE_CSI_ENTRY, ACTION_CLEAR_INT_AND_PARAMS);    /* CSI */
                 }
+        }
 
-                return parser_transition(parser, raw,
-                                         STATE_DCS_PASS, ACTION_DCS_CONSUME);
-        case STATE_DCS_PASS:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* ASCII \ { ESC } */
-                case 0x1c ... 0x7f:
-                        return parser_action(parser, raw,
-                                             ACTION_DCS_COLLECT);
-                case 0x1b:                /* ESC */
-                        return parser_transition_no_action(parser, raw, STATE_DCS_PASS_ESC);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_DCS_DISPATCH);
-                }
+        inline constexpr parser_entry_t
+        entry(unsigned int state,
+              uint32_t raw) const noexcept
+        {
+                return m_table[state][parser_class(raw)];
+        }
 
-                return parser_action(parser, raw,
-                                     ACTION_DCS_COLLECT);
-        case STATE_DCS_IGNORE:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* ASCII \ { ESC } */
-                case 0x1c ... 0x7f:
-                        return parser_nop(parser, raw);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x9c:                /* ST */
-                        return parser_transition_no_action(parser, raw, STATE_GROUND);
-                }
+private:
+        parser_table_t m_table{};
+
+        constexpr void
+        set(unsigned int state,
+            unsigned int first,
+            unsigned int last,
+            unsigned int next_state,
+            unsigned int action) noexcept
+        {
+                for (auto c = first; c <= last; ++c)
+                        m_table[state][c] = parser_entry(next_state, action);
+        }
 
-                return parser_nop(parser, raw);
-        case STATE_OSC_STRING:
-                switch (raw) {
-                case 0x00 ... 0x06:        /* C0 \ { BEL, ESC } */
-                case 0x08 ... 0x1a:
-                case 0x1c ... 0x1f:
-                        return parser_nop(parser, raw);
-                case 0x1b:                /* ESC */
-                        return parser_transition_no_action(parser, raw, STATE_OSC_STRING_ESC);
-                case 0x20 ... 0x7f:        /* [' ' - DEL] */
-                        return parser_action(parser, raw,
-                                             ACTION_OSC_COLLECT);
-                case 0x07:                /* BEL */
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_OSC_DISPATCH);
-                }
+        constexpr void
+        set(unsigned int state,
+            unsigned int c,
+            unsigned int next_state,
+            unsigned int action) noexcept
+        {
+                set(state, c, c, next_state, action);
+        }
 
-                return parser_action(parser, raw,
-                                     ACTION_OSC_COLLECT);
-        case STATE_ST_IGNORE:
-                switch (raw) {
-                case 0x00 ... 0x1a:        /* ASCII \ { ESC } */
-                case 0x1c ... 0x7f:
-                        return parser_nop(parser, raw);
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw, STATE_ESC,
-                                                 ACTION_CLEAR_INT);
-                case 0x9c:                /* ST */
-                        return parser_transition(parser, raw,
-                                                 STATE_GROUND, ACTION_IGNORE);
-                }
+        /* C0 \ { ESC } executes (or ignores) without leaving the state, and ESC starts a new escape sequence */
+        constexpr void
+        set_c0(unsigned int state,
+               unsigned int next_state,
+               unsigned int action) noexcept
+        {
+                set(state, 0x00, 0x1f, next_state, action);
+                set(state, 0x1b, STATE_ESC, ACTION_CLEAR_INT);
+        }
+}; // class ParserTable
 
-                return parser_nop(parser, raw);
-        case STATE_SCI:
-                switch (raw) {
-                case 0x1b:                /* ESC */
-                        return parser_transition(parser, raw,
-                                                 STATE_ESC, ACTION_CLEAR_INT);
-                case 0x08 ... 0x0d:        /* BS, HT, LF, VT, FF, CR */
-                case 0x20 ... 0x7e:        /* [' ' - '~'] */
-                        return parser_transition(parser, raw, STATE_GROUND,
-                                                 ACTION_SCI_DISPATCH);
-                }
+static constexpr auto const parser_table = ParserTable{};
 
-                return parser_transition(parser, raw, STATE_GROUND,
-                                         ACTION_IGNORE);
+static inline int
+parser_perform_action(vte_parser_t* parser,
+                      uint32_t raw,
+                      unsigned int action)
+{
+        switch (action) {
+        case ACTION_NONE:                 return VTE_SEQ_NONE;
+        case ACTION_CLEAR:                return parser_clear(parser, raw);
+        case ACTION_CLEAR_INT:            return parser_clear_int(parser, raw);
+        case ACTION_CLEAR_INT_AND_PARAMS: return parser_clear_int_and_params(parser, raw);
+        case ACTION_CLEAR_PARAMS_ONLY:    return parser_clear_params(parser, raw);
+        case ACTION_IGNORE:               return parser_ignore(parser, raw);
+        case ACTION_PRINT:                return parser_print(parser, raw);
+        case ACTION_EXECUTE:              return parser_execute(parser, raw);
+        case ACTION_COLLECT_ESC:          return parser_collect_esc(parser, raw);
+        case ACTION_COLLECT_CSI:          return parser_collect_csi(parser, raw);
+        case ACTION_COLLECT_PARAMETER:    return parser_collect_parameter(parser, raw);
+        case ACTION_PARAM:                return parser_param(parser, raw);
+        case ACTION_FINISH_PARAM:         return parser_finish_param(parser, raw);
+        case ACTION_FINISH_SUBPARAM:      return parser_finish_subparam(parser, raw);
+        case ACTION_ESC_DISPATCH:         return parser_esc(parser, raw);
+        case ACTION_CSI_DISPATCH:         return parser_csi(parser, raw);
+        case ACTION_DCS_START:            return parser_dcs_start(parser, raw);
+        case ACTION_DCS_CONSUME:          return parser_dcs_consume(parser, raw);
+        case ACTION_DCS_COLLECT:          return parser_dcs_collect(parser, raw);
+        case ACTION_DCS_DISPATCH:         return parser_dcs(parser, raw);
+        case ACTION_OSC_START:            return parser_osc_start(parser, raw);
+        case ACTION_OSC_COLLECT:          return parser_osc_collect(parser, raw);
+        case ACTION_OSC_DISPATCH:         return parser_osc(parser, raw);
+        case ACTION_SCI_DISPATCH:         return parser_sci(parser, raw);
         }
 
         g_assert_not_reached();
         return VTE_SEQ_NONE;
 }
 
+static inline int
+parser_step(vte_parser_t* parser,
+            uint32_t raw)
+{
+        auto const entry = parser_table.entry(parser->state, raw);
+
+        /* Do the deferred clear from STATE_{DCS_PASS,OSC_STRING}_ESC */
+        if (G_UNLIKELY(entry & PARSER_ENTRY_ESC_CLEAR))
+                parser_clear_int(parser, 0x1b /* ESC */);
+
+        /* Perform the state transition, and dispatch related actions.
+         * Note that actions may themselves change the state.
+         */
+        parser->state = parser_entry_state(entry);
+        return parser_perform_action(parser, raw, parser_entry_action(entry));
+}
+
 int
 vte_parser_feed(vte_parser_t* parser,
                 uint32_t raw)
 {
-        /*
-         * Notes:
-         *  * DEC treats GR codes as GL. We don't do that as we require UTF-8
-         *    as charset and, thus, it doesn't make sense to treat GR special.
-         *  * During control sequences, unexpected C1 codes cancel the sequence
-         *    and immediately start a new one. C0 codes, however, may or may not
-         *    be ignored/executed depending on the sequence.
-         */
+        return parser_step(parser, raw);
+}
 
-        switch (raw) {
-        case 0x18:                /* CAN */
-                return parser_transition(parser, raw,
-                                         STATE_GROUND, ACTION_IGNORE);
-        case 0x1a:                /* SUB */
-                return parser_transition(parser, raw,
-                                         STATE_GROUND, ACTION_EXECUTE);
-        case 0x7f:                 /* DEL */
-                return parser_nop(parser, raw);
-        case 0x80 ... 0x8f:        /* C1 \ {DCS, SOS, SCI, CSI, ST, OSC, PM, APC} */
-        case 0x91 ... 0x97:
-        case 0x99:
-                return parser_transition(parser, raw,
-                                         STATE_GROUND, ACTION_EXECUTE);
-        case 0x98:                /* SOS */
-        case 0x9e:                /* PM */
-        case 0x9f:                /* APC */
-                return parser_transition_no_action(parser, raw, STATE_ST_IGNORE);
-                // FIXMEchpe shouldn't this use ACTION_CLEAR?
-        case 0x90:                /* DCS */
-                return parser_transition(parser, raw,
-                                         STATE_DCS_ENTRY, ACTION_DCS_START);
-        case 0x9a:                /* SCI */
-                return parser_transition(parser, raw,
-                                         STATE_SCI, ACTION_CLEAR);
-        case 0x9d:                /* OSC */
-                return parser_transition(parser, raw,
-                                         STATE_OSC_STRING, ACTION_OSC_START);
-        case 0x9b:                /* CSI */
-                return parser_transition(parser, raw,
-                                         STATE_CSI_ENTRY, ACTION_CLEAR_INT_AND_PARAMS);
-        default:
-                return parser_feed_to_state(parser, raw);
+/**
+ * vte_parser_feed_buffer() - Feed a buffer of codepoints to the parser
+ * @parser: the struct vte_parser
+ * @ptr: (inout): the current position in the buffer
+ * @end: the end of the buffer
+ *
+ * Feeds characters from *@ptr to the parser until a sequence is
+ * complete, or the buffer is exhausted. On return, *@ptr points after
+ * the last consumed character.
+ *
+ * Returns: the type of the completed sequence as vte_parser_feed()
+ *   would, or %VTE_SEQ_NONE if the buffer was exhausted
+ */
+int
+vte_parser_feed_buffer(vte_parser_t* parser,
+                       uint32_t const** ptr,
+                       uint32_t const* end)
+{
+        auto p = *ptr;
+        auto rv = int{VTE_SEQ_NONE};
+        while (p < end) {
+                rv = parser_step(parser, *p++);
+                if (rv != VTE_SEQ_NONE)
+                        break;
         }
+
+        *ptr = p;
+        return rv;
 }
 
 void
 vte_parser_reset(vte_parser_t* parser)
 {
-        parser_transition(parser, 0, STATE_GROUND, ACTION_IGNORE);
+        parser->state = STATE_GROUND;
+        parser_ignore(parser, 0);
 }
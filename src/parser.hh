@@ -38,6 +38,11 @@ struct vte_seq_t;
 
 #define VTE_PARSER_ARG_MAX (32)
 
+/* The parser's initial and ground state, in which graphic characters
+ * are dispatched directly.
+ */
+#define VTE_PARSER_STATE_GROUND (0u)
+
 enum {
         VTE_SEQ_NONE,        /* placeholder, no sequence parsed */
 
@@ -89,6 +94,18 @@ enum {
         VTE_SEQ_PARAMETER_CHAR_WHAT  = '?'  /* 03/15 */
 };
 
+/* Flags describing which part of a sequence's string argument the
+ * sequence carries. Strings that are not streamed are always dispatched
+ * complete; a streamed DCS is dispatched once for each segment of its
+ * string, see VTE_SEQ_STRING_SEGMENT_SIZE.
+ */
+enum {
+        VTE_SEQ_STRING_SEGMENT_FIRST    = 1u << 0, /* starts the string */
+        VTE_SEQ_STRING_SEGMENT_LAST     = 1u << 1, /* ends the string */
+
+        VTE_SEQ_STRING_SEGMENT_COMPLETE = VTE_SEQ_STRING_SEGMENT_FIRST | VTE_SEQ_STRING_SEGMENT_LAST,
+};
+
 #define VTE_SEQ_MAKE_INTERMEDIATE(c) ((c) - ' ' + 1)
 
 enum {
@@ -194,16 +211,28 @@ struct vte_seq_t {
         unsigned int n_final_args;
         vte_seq_arg_t args[VTE_PARSER_ARG_MAX];
         vte_seq_string_t arg_str;
+        unsigned int string_segment;
         uint32_t introducer;
 };
 
 struct vte_parser_t {
         vte_seq_t seq;
         unsigned int state;
+        bool string_streamed; /* the current DCS's string is passed on in segments */
+        bool string_flushed;  /* the current segment was dispatched */
 };
 
 void vte_parser_init(vte_parser_t* parser);
 void vte_parser_deinit(vte_parser_t* parser);
 int vte_parser_feed(vte_parser_t* parser,
                     uint32_t raw);
+int vte_parser_feed_buffer(vte_parser_t* parser,
+                           uint32_t const** ptr,
+                           uint32_t const* end);
 void vte_parser_reset(vte_parser_t* parser);
+
+static inline bool
+vte_parser_in_ground_state(vte_parser_t const* parser)
+{
+        return parser->state == VTE_PARSER_STATE_GROUND;
+}
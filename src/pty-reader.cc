@@ -0,0 +1,493 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "pty-reader.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <new>
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define VTE_HAVE_PTY_READER 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "cxx-utils.hh"
+#include "debug.h"
+#include "vtedefines.hh"
+
+namespace vte::base {
+
+void
+PtyReader::Stream::add_packet_flags(char pkt_header) noexcept
+{
+        auto flags = m_packet_flags.load(std::memory_order_relaxed);
+        auto new_flags = unsigned{};
+        do {
+                new_flags = flags;
+                if (pkt_header & TIOCPKT_IOCTL)
+                        new_flags |= eIOCTL;
+                /* Only the latest scroll lock state matters */
+                if (pkt_header & TIOCPKT_STOP)
+                        new_flags = (new_flags & ~eSTART) | eSTOP;
+                if (pkt_header & TIOCPKT_START)
+                        new_flags = (new_flags & ~eSTOP) | eSTART;
+        } while (!m_packet_flags.compare_exchange_weak(flags, new_flags));
+}
+
+Chunk::unique_type
+PtyReader::Stream::pop() noexcept
+{
+        auto chunk = m_queue.pop();
+        if (!chunk)
+                return chunk;
+
+        /* Pairs with the fence in PtyReader::read_stream(), so that either
+         * we see that the reader throttled the stream, or the reader sees
+         * the queue space we just freed.
+         */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_throttled.load(std::memory_order_relaxed) &&
+            m_queue.size() <= k_resume_depth &&
+            m_throttled.exchange(false))
+                PtyReader::get().resume(*this);
+
+        return chunk;
+}
+
+bool
+PtyReader::enabled() noexcept
+{
+#ifdef VTE_HAVE_PTY_READER
+        static bool const s_enabled = g_getenv("VTE_PTY_READER_THREAD") != nullptr;
+        return s_enabled;
+#else
+        return false;
+#endif
+}
+
+PtyReader&
+PtyReader::get() noexcept
+{
+        /* Never destroyed, since the thread may still be running at exit */
+        static PtyReader* s_reader = new PtyReader{};
+        return *s_reader;
+}
+
+#ifdef VTE_HAVE_PTY_READER
+
+bool
+PtyReader::start() noexcept
+{
+        if (m_thread.joinable())
+                return true;
+
+        auto epoll_fd = vte::libc::FD{epoll_create1(EPOLL_CLOEXEC)};
+        if (epoll_fd == -1) {
+                auto errsv = vte::libc::ErrnoSaver{};
+                _vte_debug_print(VTE_DEBUG_IO, "Failed to create epoll fd: %s\n",
+                                 g_strerror(errsv));
+                return false;
+        }
+
+        auto notify_fd = vte::libc::FD{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+        if (notify_fd == -1) {
+                auto errsv = vte::libc::ErrnoSaver{};
+                _vte_debug_print(VTE_DEBUG_IO, "Failed to create eventfd: %s\n",
+                                 g_strerror(errsv));
+                return false;
+        }
+
+        m_epoll_fd = std::move(epoll_fd);
+        m_notify_fd = std::move(notify_fd);
+
+        try {
+                m_thread = std::thread{&PtyReader::run, this};
+        } catch (...) {
+                _vte_debug_print(VTE_DEBUG_IO, "Failed to start PTY reader thread\n");
+                m_epoll_fd.reset();
+                m_notify_fd.reset();
+                return false;
+        }
+
+        m_notify_source = g_unix_fd_add_full(VTE_CHILD_INPUT_PRIORITY,
+                                             m_notify_fd.get(),
+                                             G_IO_IN,
+                                             (GUnixFDSourceFunc)notify_cb,
+                                             this,
+                                             nullptr);
+
+        return true;
+}
+
+PtyReader::stream_type
+PtyReader::add(int fd,
+               Stream::ready_func func,
+               void* data) noexcept
+{
+        if (!start())
+                return {};
+
+        auto stream = stream_type{};
+        try {
+                stream = std::make_shared<Stream>(fd, func, data);
+        } catch (...) {
+                return {};
+        }
+
+        auto lock = std::lock_guard<std::mutex>{m_mutex};
+
+        stream->m_id = ++m_next_id;
+        if (!set_polling(*stream, true))
+                return {};
+
+        try {
+                m_streams.push_back(stream);
+        } catch (...) {
+                set_polling(*stream, false);
+                return {};
+        }
+
+        stream->m_registered = true;
+
+        _vte_debug_print(VTE_DEBUG_IO, "PTY reader: added fd %d\n", fd);
+
+        return stream;
+}
+
+void
+PtyReader::remove(stream_type const& stream) noexcept
+{
+        stream->m_ready_func = nullptr;
+        stream->m_ready_data = nullptr;
+
+        {
+                auto lock = std::lock_guard<std::mutex>{m_mutex};
+
+                if (!stream->m_registered)
+                        return;
+
+                stream->m_registered = false;
+
+                auto it = std::find(m_streams.begin(), m_streams.end(), stream);
+                if (it != m_streams.end())
+                        m_streams.erase(it);
+        }
+
+        /* The reader thread can't find the stream anymore, but it may
+         * still be reading from it; see run().
+         */
+        {
+                auto lock = std::unique_lock<std::mutex>{m_reading_mutex};
+                m_reading_done.wait(lock, [&] { return !stream->m_reading.load(); });
+        }
+
+        set_polling(*stream, false);
+
+        _vte_debug_print(VTE_DEBUG_IO, "PTY reader: removed fd %d\n", stream->m_fd);
+}
+
+/* Called with the mutex held */
+PtyReader::stream_type
+PtyReader::lookup(uint64_t id) const noexcept
+{
+        for (auto const& stream : m_streams) {
+                if (stream->m_id == id)
+                        return stream;
+        }
+
+        return {};
+}
+
+/* Called on the main thread, or on the reader thread from read_stream() */
+bool
+PtyReader::set_polling(Stream& stream,
+                       bool polling) noexcept
+{
+        if (stream.m_polling == polling)
+                return true;
+
+        auto event = epoll_event{};
+        event.events = EPOLLIN | EPOLLPRI;
+        event.data.u64 = stream.m_id;
+        if (epoll_ctl(m_epoll_fd.get(),
+                      polling ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      stream.m_fd,
+                      &event) == -1) {
+                auto errsv = vte::libc::ErrnoSaver{};
+                _vte_debug_print(VTE_DEBUG_IO, "PTY reader: epoll_ctl failed: %s\n",
+                                 g_strerror(errsv));
+                return false;
+        }
+
+        stream.m_polling = polling;
+        return true;
+}
+
+void
+PtyReader::resume(Stream& stream) noexcept
+{
+        if (!stream.m_registered || stream.m_eos)
+                return;
+
+        _vte_debug_print(VTE_DEBUG_IO, "PTY reader: resuming fd %d\n", stream.m_fd);
+        set_polling(stream, true);
+}
+
+void
+PtyReader::notify(Stream& stream) noexcept
+{
+        if (stream.m_notify_pending.exchange(true))
+                return;
+
+        auto const one = uint64_t{1};
+        if (write(m_notify_fd.get(), &one, sizeof(one)) == -1 &&
+            errno != EAGAIN) {
+                auto errsv = vte::libc::ErrnoSaver{};
+                _vte_debug_print(VTE_DEBUG_IO, "PTY reader: failed to notify: %s\n",
+                                 g_strerror(errsv));
+        }
+}
+
+/* Called on the reader thread, without the mutex; see run(). */
+void
+PtyReader::read_stream(Stream& stream,
+                       uint32_t events) noexcept
+{
+        if (!stream.m_polling)
+                return;
+
+        /* See the comment in Terminal::pty_io_read() about HUP. */
+        auto eos = bool{(events & (EPOLLIN | EPOLLPRI)) == 0};
+        auto queued = bool{false};
+        auto const packet_flags = stream.m_packet_flags.load(std::memory_order_relaxed);
+
+        while (!stream.m_queue.full()) {
+                auto chunk = Chunk::get();
+                auto bp = chunk->data;
+                auto rem = int(chunk->capacity());
+                auto len = int{0};
+                auto err = int{0};
+
+                while (!eos && rem) {
+                        /* As in Terminal::pty_io_read(), read one extra byte before
+                         * the data for the TIOCPKT header.
+                         */
+                        auto const save = bp[-1];
+                        errno = 0;
+                        auto ret = read(stream.m_fd, bp - 1, rem + 1);
+                        auto const pkt_header = char(bp[-1]);
+                        bp[-1] = save;
+
+                        if (ret == -1) {
+                                err = errno;
+                                break;
+                        }
+                        if (ret == 0) {
+                                eos = true;
+                                break;
+                        }
+
+                        ret--;
+                        if (pkt_header == TIOCPKT_DATA) {
+                                bp += ret;
+                                rem -= ret;
+                                len += ret;
+                        } else {
+                                stream.add_packet_flags(pkt_header);
+                        }
+                }
+
+                switch (err) {
+                case 0:
+                case EAGAIN:
+                case EBUSY:
+                        break;
+                case EIO: /* EOS */
+                        eos = true;
+                        break;
+                default: {
+                        auto errsv = vte::libc::ErrnoSaver{};
+                        _vte_debug_print(VTE_DEBUG_IO, "Error reading from child: %s\n",
+                                         g_strerror(errsv));
+                        break;
+                }
+                }
+
+                chunk->len = len;
+                if (eos) {
+                        chunk->set_sealed();
+                        chunk->set_eos();
+                }
+
+                if (len > 0 || eos) {
+                        stream.m_queue.push(chunk);
+                        queued = true;
+                }
+
+                /* EOS or short read; wait for more data */
+                if (eos || rem)
+                        break;
+        }
+
+        if (eos && queued) {
+                _vte_debug_print(VTE_DEBUG_IO, "PTY reader: got EOF on fd %d\n", stream.m_fd);
+                stream.m_eos = true;
+                set_polling(stream, false);
+        } else if (stream.m_queue.full()) {
+                /* Stop polling the PTY until the main thread has drained
+                 * the queue; see Stream::pop().
+                 */
+                _vte_debug_print(VTE_DEBUG_IO, "PTY reader: throttling fd %d\n", stream.m_fd);
+                set_polling(stream, false);
+                stream.m_throttled.store(true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (stream.m_queue.size() <= k_resume_depth &&
+                    stream.m_throttled.exchange(false))
+                        set_polling(stream, true);
+        }
+
+        if (queued ||
+            stream.m_packet_flags.load(std::memory_order_relaxed) != packet_flags)
+                notify(stream);
+}
+
+void
+PtyReader::run() noexcept
+{
+        epoll_event events[16];
+        stream_type streams[G_N_ELEMENTS(events)];
+
+        for (;;) {
+                auto const n_events = epoll_wait(m_epoll_fd.get(),
+                                                 events, G_N_ELEMENTS(events),
+                                                 -1);
+                if (n_events == -1) {
+                        if (errno == EINTR)
+                                continue;
+
+                        auto errsv = vte::libc::ErrnoSaver{};
+                        g_warning("PTY reader: epoll_wait failed: %s", g_strerror(errsv));
+                        break;
+                }
+
+                /* The streams may have been removed since epoll_wait() returned.
+                 * Those still there are marked as being read while the mutex is
+                 * held, so that remove() waits for them.
+                 */
+                {
+                        auto lock = std::lock_guard<std::mutex>{m_mutex};
+                        for (auto i = 0; i < n_events; ++i) {
+                                streams[i] = lookup(events[i].data.u64);
+                                if (streams[i])
+                                        streams[i]->m_reading = true;
+                        }
+                }
+
+                for (auto i = 0; i < n_events; ++i) {
+                        if (!streams[i])
+                                continue;
+
+                        read_stream(*streams[i], events[i].events);
+                        streams[i]->m_reading = false;
+                        streams[i].reset();
+                }
+
+                {
+                        auto lock = std::lock_guard<std::mutex>{m_reading_mutex};
+                }
+                m_reading_done.notify_all();
+        }
+}
+
+void
+PtyReader::dispatch_notifications()
+{
+        auto ready = std::vector<stream_type>{};
+
+        {
+                auto lock = std::lock_guard<std::mutex>{m_mutex};
+                for (auto const& stream : m_streams) {
+                        if (stream->m_notify_pending.exchange(false))
+                                ready.push_back(stream);
+                }
+        }
+
+        /* The callbacks may remove streams, which resets their
+         * ready func, so check it for each stream just before calling.
+         */
+        for (auto const& stream : ready) {
+                if (stream->m_ready_func)
+                        stream->m_ready_func(stream->m_ready_data);
+        }
+}
+
+gboolean
+PtyReader::notify_cb(int fd,
+                     GIOCondition condition,
+                     PtyReader* that) noexcept
+try
+{
+        auto count = uint64_t{};
+        if (read(fd, &count, sizeof(count)) == -1 &&
+            errno != EAGAIN) {
+                auto errsv = vte::libc::ErrnoSaver{};
+                _vte_debug_print(VTE_DEBUG_IO, "PTY reader: failed to read eventfd: %s\n",
+                                 g_strerror(errsv));
+        }
+
+        that->dispatch_notifications();
+
+        return G_SOURCE_CONTINUE;
+}
+catch (...)
+{
+        vte::log_exception();
+        return G_SOURCE_CONTINUE;
+}
+
+#else /* !VTE_HAVE_PTY_READER */
+
+PtyReader::stream_type
+PtyReader::add(int fd,
+               Stream::ready_func func,
+               void* data) noexcept
+{
+        return {};
+}
+
+void
+PtyReader::remove(stream_type const& stream) noexcept
+{
+}
+
+void
+PtyReader::resume(Stream& stream) noexcept
+{
+}
+
+#endif /* VTE_HAVE_PTY_READER */
+
+} // namespace vte::base
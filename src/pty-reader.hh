@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glib.h>
+
+#include "chunk.hh"
+#include "libc-glue.hh"
+
+namespace vte::base {
+
+/*
+ * PtyReader:
+ *
+ * A single background thread that reads from the PTYs of all terminals
+ * that opted in, so that the kernel PTY buffers keep being drained while
+ * the main thread is busy parsing or painting.
+ *
+ * Each PTY is represented by a Stream, which holds a ChunkQueue that the
+ * reader thread fills and the terminal drains on the main thread. When the
+ * queue is full, the reader stops polling the PTY until the terminal has
+ * drained it to k_resume_depth, so the queue depth provides flow control.
+ *
+ * The thread is started when the first stream is added, and lives until
+ * the process exits.
+ */
+class PtyReader {
+public:
+        class Stream {
+                friend class PtyReader;
+
+        public:
+                using ready_func = void (*)(void* data);
+
+                enum Packet : unsigned {
+                        eIOCTL = 1u << 0, /* termios changed */
+                        eSTOP  = 1u << 1, /* output stopped (^S) */
+                        eSTART = 1u << 2, /* output started (^Q) */
+                };
+
+                Stream(int fd,
+                       ready_func func,
+                       void* data) noexcept
+                        : m_fd{fd},
+                          m_ready_func{func},
+                          m_ready_data{data}
+                {
+                }
+
+                Stream(Stream const&) = delete;
+                Stream(Stream&&) = delete;
+                Stream& operator=(Stream const&) = delete;
+                Stream& operator=(Stream&&) = delete;
+
+                /* Main thread only. Returns the next chunk read from the PTY,
+                 * or an empty pointer if there is none.
+                 */
+                Chunk::unique_type pop() noexcept;
+
+                /* Main thread only. Returns and clears the TIOCPKT flags
+                 * received since the last call, as a set of Packet flags.
+                 */
+                inline unsigned take_packet_flags() noexcept { return m_packet_flags.exchange(0); }
+
+                inline bool empty() const noexcept { return m_queue.empty(); }
+
+        private:
+                int const m_fd;
+                ChunkQueue m_queue{};
+
+                std::atomic<unsigned> m_packet_flags{0};
+                std::atomic<bool> m_notify_pending{false};
+                std::atomic<bool> m_throttled{false};
+
+                /* The polling state is changed by the reader thread on EOS
+                 * or when throttling, and by the main thread otherwise, but
+                 * never by both at once; see read_stream() and pop().
+                 */
+                std::atomic<bool> m_registered{false};
+                std::atomic<bool> m_polling{false};
+                std::atomic<bool> m_eos{false};
+
+                /* Set while the reader thread reads from the fd, see remove() */
+                std::atomic<bool> m_reading{false};
+
+                /* Protected by the reader's mutex */
+                uint64_t m_id{0};
+
+                /* Main thread only */
+                ready_func m_ready_func;
+                void* m_ready_data;
+
+                void add_packet_flags(char pkt_header) noexcept;
+        };
+
+        using stream_type = std::shared_ptr<Stream>;
+
+        static constexpr size_t const k_resume_depth = ChunkQueue::k_capacity / 2;
+
+        /* Whether terminals should read their PTY on the reader thread;
+         * this is opt-in via the VTE_PTY_READER_THREAD environment variable.
+         */
+        static bool enabled() noexcept;
+
+        static PtyReader& get() noexcept;
+
+        /* Main thread only. Starts reading from @fd on the reader thread;
+         * @func is called on the main thread when new data, a TIOCPKT
+         * notification or the EOS is available on the stream.
+         */
+        stream_type add(int fd,
+                        Stream::ready_func func,
+                        void* data) noexcept;
+
+        /* Main thread only. Stops reading from the stream's fd; when this
+         * returns, the reader thread will not access the fd anymore. Chunks
+         * already in the stream's queue may still be popped.
+         */
+        void remove(stream_type const& stream) noexcept;
+
+private:
+        PtyReader() noexcept = default;
+        ~PtyReader() = delete;
+
+        /* Only held to look up the streams, not while reading from them */
+        std::mutex m_mutex{};
+        std::vector<stream_type> m_streams{}; /* protected by m_mutex */
+        uint64_t m_next_id{0}; /* protected by m_mutex */
+
+        /* Signalled when the reader thread is done reading streams */
+        std::mutex m_reading_mutex{};
+        std::condition_variable m_reading_done{};
+
+        vte::libc::FD m_epoll_fd{};
+        vte::libc::FD m_notify_fd{};
+        guint m_notify_source{0};
+        std::thread m_thread{};
+
+        bool start() noexcept;
+        void run() noexcept;
+        stream_type lookup(uint64_t id) const noexcept;
+        void read_stream(Stream& stream,
+                         uint32_t events) noexcept;
+        bool set_polling(Stream& stream,
+                         bool polling) noexcept;
+        void notify(Stream& stream) noexcept;
+        void resume(Stream& stream) noexcept;
+        void dispatch_notifications();
+
+        static gboolean notify_cb(int fd,
+                                  GIOCondition condition,
+                                  PtyReader* that) noexcept;
+};
+
+} // namespace vte::base
@@ -0,0 +1,385 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glib.h>
+
+#include "ring.hh"
+
+using namespace vte::base;
+
+/* Enough history for rewrap_range() to split it in two segments */
+static Ring::row_t const k_history_rows = 2 * Ring::kParallelRewrapMinRows + 3000;
+static Ring::column_t const k_columns = 80;
+static int const k_n_images = 8;
+
+/* Appends paragraphs of pseudo-random lengths, wrapped at @columns,
+ * until @ring has @n_rows rows; the same ones each time.
+ */
+static void
+fill_ring(Ring& ring,
+          Ring::column_t columns,
+          Ring::row_t n_rows)
+{
+        guint32 seed = 42;
+        auto const next_random = [&seed](guint32 max) {
+                seed = seed * 1103515245u + 12345u;
+                return (seed >> 16) % max;
+        };
+
+        while (ring.length() < n_rows) {
+                auto const len = next_random(6) == 0 ? 0 : next_random(4 * columns);
+                auto row = ring.append(0);
+                auto cell = basic_cell;
+
+                for (guint32 i = 0; i < len; i++) {
+                        if (row->len == columns) {
+                                row->attr.soft_wrapped = 1;
+                                row = ring.append(0);
+                        }
+
+                        /* Some non-ASCII text and attribute changes, so that
+                         * text offsets and columns don't line up. */
+                        cell.c = next_random(50) == 0 ? 0xe9 : 'a' + i % 26;
+                        if (next_random(40) == 0)
+                                cell.attr.set_bold(!cell.attr.bold());
+                        _vte_row_data_append(row, &cell);
+                }
+        }
+}
+
+static void
+init_ring(Ring& ring)
+{
+        ring.set_visible_rows(24);
+        ring.set_columns(k_columns);
+        fill_ring(ring, k_columns, k_history_rows);
+
+#ifdef WITH_SIXEL
+        /* Images still being decoded, they only need a position */
+        for (int i = 0; i < k_n_images; i++)
+                ring.append_image(nullptr, 30, 40,
+                                  i, ring.delta() + (i + 1) * ring.length() / (k_n_images + 1),
+                                  10, 20);
+#endif
+}
+
+/* Rewraps @ring to @columns, with markers at the screen's last rows
+ * and, if @full, at the top so that the whole ring is rewrapped at once.
+ * Returns the markers' distances from the end of the ring.
+ */
+static std::vector<VteVisualPosition>
+rewrap_ring(Ring& ring,
+            Ring::column_t columns,
+            unsigned threads,
+            bool full)
+{
+        VteVisualPosition positions[3] = {
+                { long(ring.next()) - 10, 5 },
+                { long(ring.next()) - 1, 0 },
+                { long(ring.delta()), 3 },
+        };
+        VteVisualPosition* markers[4] = { &positions[0], &positions[1], nullptr, nullptr };
+        if (full)
+                markers[2] = &positions[2];
+
+        ring.set_rewrap_threads(threads);
+        ring.rewrap(columns, markers);
+
+        std::vector<VteVisualPosition> result;
+        for (int i = 0; markers[i] != nullptr; i++)
+                result.push_back({ long(ring.next()) - markers[i]->row, markers[i]->col });
+        return result;
+}
+
+static void
+assert_rows_equal(VteRowData const* a,
+                  VteRowData const* b)
+{
+        g_assert_cmpuint(a->len, ==, b->len);
+        g_assert_cmpuint(a->attr.soft_wrapped, ==, b->attr.soft_wrapped);
+        for (int col = 0; col < a->len; col++) {
+                g_assert_cmpuint(a->cells[col].c, ==, b->cells[col].c);
+                g_assert_true(memcmp(&a->cells[col].attr, &b->cells[col].attr,
+                                     sizeof(VteCellAttr)) == 0);
+        }
+}
+
+static void
+assert_rings_equal(Ring& a,
+                   Ring& b)
+{
+        g_assert_cmpuint(a.length(), ==, b.length());
+        g_assert_false(a.rewrap_pending());
+        g_assert_false(b.rewrap_pending());
+
+        for (Ring::row_t i = 1; i <= a.length(); i++)
+                assert_rows_equal(a.index(a.next() - i), b.index(b.next() - i));
+
+#ifdef WITH_SIXEL
+        for (int i = 0; i < k_n_images; i++) {
+                auto const image_a = a.image_by_priority(i);
+                auto const image_b = b.image_by_priority(i);
+
+                g_assert_nonnull(image_a);
+                g_assert_nonnull(image_b);
+                g_assert_cmpint(long(a.next()) - image_a->get_top(), ==, long(b.next()) - image_b->get_top());
+        }
+#endif
+}
+
+static void
+assert_markers_equal(std::vector<VteVisualPosition> const& a,
+                     std::vector<VteVisualPosition> const& b)
+{
+        auto const n = MIN(a.size(), b.size());
+
+        for (size_t i = 0; i < n; i++) {
+                g_assert_cmpint(a[i].row, ==, b[i].row);
+                g_assert_cmpint(a[i].col, ==, b[i].col);
+        }
+}
+
+/* Rewraps the same contents serially and all at once, on several threads,
+ * and lazily, finishing either step by step or all at once on several threads;
+ * these all have to agree.
+ */
+static void
+test_ring_rewrap_parallel_lazy(void)
+{
+        Ring serial{1 << 20, true}, parallel{1 << 20, true}, lazy{1 << 20, true}, lazy_parallel{1 << 20, true};
+
+        init_ring(serial);
+        init_ring(parallel);
+        init_ring(lazy);
+        init_ring(lazy_parallel);
+
+        for (Ring::column_t const columns : {57l, 13l, 131l, k_columns}) {
+                auto const serial_markers = rewrap_ring(serial, columns, 1, true);
+                g_assert_false(serial.rewrap_pending());
+
+                auto const parallel_markers = rewrap_ring(parallel, columns, 4, true);
+                g_assert_false(parallel.rewrap_pending());
+
+                auto const lazy_markers = rewrap_ring(lazy, columns, 1, false);
+                g_assert_true(lazy.rewrap_pending());
+                while (lazy.rewrap_pending())
+                        lazy.rewrap_step(1000);
+
+                auto const lazy_parallel_markers = rewrap_ring(lazy_parallel, columns, 4, false);
+                g_assert_true(lazy_parallel.rewrap_pending());
+                lazy_parallel.rewrap_finish();
+
+                assert_rings_equal(serial, parallel);
+                assert_rings_equal(serial, lazy);
+                assert_rings_equal(serial, lazy_parallel);
+
+                assert_markers_equal(serial_markers, parallel_markers);
+                assert_markers_equal(serial_markers, lazy_markers);
+                assert_markers_equal(serial_markers, lazy_parallel_markers);
+        }
+}
+
+/* Reading a row that is still waiting to be rewrapped right after a resize
+ * has to give it with the new wrapping, as if it had been rewrapped at once.
+ */
+static void
+test_ring_rewrap_lazy_read(void)
+{
+        Ring serial{1 << 20, true}, lazy{1 << 20, true};
+
+        init_ring(serial);
+        init_ring(lazy);
+
+        for (Ring::column_t const columns : {57l, 13l, 131l, k_columns}) {
+                rewrap_ring(serial, columns, 1, true);
+                rewrap_ring(lazy, columns, 1, false);
+                g_assert_true(lazy.rewrap_pending());
+
+                /* The rows from rewrap_pending_end() on keep their numbers */
+                auto const distance = lazy.next() - (lazy.rewrap_pending_end() - 1);
+                auto const row = lazy.index(lazy.next() - distance);
+                g_assert_false(lazy.rewrap_pending());
+                assert_rows_equal(row, serial.index(serial.next() - distance));
+
+                assert_rings_equal(serial, lazy);
+        }
+}
+
+/* Appends @n rows to @ring, each with its number in @tags as its only cell */
+static void
+append_tagged_rows(Ring& ring,
+                   std::vector<vteunistr>& tags,
+                   Ring::row_t n)
+{
+        auto cell = basic_cell;
+
+        for (Ring::row_t i = 0; i < n; i++) {
+                cell.c = 0x100 + tags.size();
+                _vte_row_data_append(ring.append(0), &cell);
+                tags.push_back(cell.c);
+        }
+}
+
+static void
+assert_ring_tags(Ring& ring,
+                 std::vector<vteunistr> const& tags)
+{
+        g_assert_cmpuint(ring.length(), ==, tags.size());
+
+        for (Ring::row_t i = 0; i < ring.length(); i++) {
+                auto const row = ring.index(ring.delta() + i);
+                auto const tag = row->len ? row->cells[0].c : 0;
+                g_assert_cmpuint(tag, ==, tags[i]);
+        }
+}
+
+/* Inserts and removes rows here and there on the screen, and some way
+ * into the scrollback, in bulk and one at a time, and scrolls regions
+ * of it; the rows in between have to stay in order.
+ */
+static void
+test_ring_insert_remove(void)
+{
+        Ring ring{1 << 20, true};
+        std::vector<vteunistr> tags;
+
+        ring.set_visible_rows(24);
+        ring.set_columns(k_columns);
+        append_tagged_rows(ring, tags, 200);
+
+        guint32 seed = 7;
+        auto const next_random = [&seed](guint32 max) {
+                seed = seed * 1103515245u + 12345u;
+                return (seed >> 16) % max;
+        };
+
+        for (int i = 0; i < 2000; i++) {
+                auto const offset = next_random(60);
+                auto const position = ring.next() - MIN(offset, ring.length());
+                auto const count = next_random(4) == 0 ? 1 : next_random(40);
+                auto const index = position - ring.delta();
+
+                switch (next_random(4)) {
+                case 0:
+                        if (count == 1)
+                                ring.insert(position, 0);
+                        else
+                                ring.insert_rows(position, count, 0);
+                        tags.insert(tags.begin() + index, count, 0);
+                        break;
+                case 1: {
+                        if (count == 1)
+                                ring.remove(position);
+                        else
+                                ring.remove_rows(position, count);
+                        auto const n = MIN(count, tags.size() - index);
+                        tags.erase(tags.begin() + index, tags.begin() + index + n);
+                        break;
+                }
+                case 2:
+                        append_tagged_rows(ring, tags, count);
+                        break;
+                case 3: {
+                        if (position == ring.next())
+                                break;
+
+                        auto const height = next_random(30);
+                        auto const end = MIN(position + height, ring.next() - 1);
+                        auto const amount = long(next_random(2 * count + 1)) - long(count);
+                        ring.scroll_region(position, end, amount, 0);
+
+                        auto const first = tags.begin() + index;
+                        auto const last = tags.begin() + (end - ring.delta()) + 1;
+                        auto const n = MIN(Ring::row_t(ABS(amount)), Ring::row_t(last - first));
+                        if (amount > 0) {
+                                std::move_backward(first, last - n, last);
+                                std::fill(first, first + n, 0);
+                        } else {
+                                std::move(first + n, last, first);
+                                std::fill(last - n, last, 0);
+                        }
+                        break;
+                }
+                }
+
+                assert_ring_tags(ring, tags);
+        }
+}
+
+/* The rows above the screen are kept compact until they're read again;
+ * they have to read back the same, also after enough distinct attributes
+ * that the table of them has to be rebuilt along the way.
+ */
+static void
+test_ring_compact(void)
+{
+        Ring ring{1 << 20, true};
+        std::vector<std::vector<VteCell>> rows;
+        guint32 n = 0;
+
+        ring.set_visible_rows(24);
+        ring.set_columns(k_columns);
+
+        while (n <= 2 * StyleTable::k_max_styles) {
+                auto row = ring.append(0);
+                std::vector<VteCell> cells;
+
+                for (Ring::column_t col = 0; col < k_columns; col++, n++) {
+                        auto cell = basic_cell;
+                        cell.c = 'a' + n % 26;
+                        cell.attr.set_fore(VTE_RGB_COLOR_MASK(8, 8, 8) | (n & 0xffffff));
+                        cell.attr.set_bold(n % 3 == 0);
+                        _vte_row_data_append(row, &cell);
+                        cells.push_back(cell);
+                }
+                rows.push_back(std::move(cells));
+        }
+
+        /* The writable rows, and some frozen ones */
+        for (Ring::row_t i = 1; i <= 100; i++) {
+                auto const row = ring.index(ring.next() - i);
+                auto const& cells = rows[rows.size() - i];
+
+                g_assert_cmpuint(row->len, ==, cells.size());
+                for (int col = 0; col < row->len; col++) {
+                        g_assert_cmpuint(row->cells[col].c, ==, cells[col].c);
+                        g_assert_true(memcmp(&row->cells[col].attr, &cells[col].attr,
+                                             sizeof(VteCellAttr)) == 0);
+                }
+        }
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+        g_test_init(&argc, &argv, nullptr);
+
+        g_test_add_func("/vte/ring/insert-remove", test_ring_insert_remove);
+        g_test_add_func("/vte/ring/compact", test_ring_compact);
+        g_test_add_func("/vte/ring/rewrap/parallel-lazy", test_ring_rewrap_parallel_lazy);
+        g_test_add_func("/vte/ring/rewrap/lazy-read", test_ring_rewrap_lazy_read);
+
+        return g_test_run();
+}
@@ -26,6 +26,12 @@
 
 #include <string.h>
 
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 #ifdef WITH_SIXEL
 
 #include <new>
@@ -78,20 +84,34 @@ Ring::validate() const
 #define validate(...) do { } while(0)
 #endif
 
+/* The scrollback is kept in temporary files, unless the
+ * VTE_SCROLLBACK_STORAGE environment variable is set to "memory".
+ */
+static bool
+streams_in_memory_default() noexcept
+{
+        static bool const s_in_memory = g_strcmp0(g_getenv("VTE_SCROLLBACK_STORAGE"), "memory") == 0;
+        return s_in_memory;
+}
+
 Ring::Ring(row_t max_rows,
            bool has_streams)
         : m_max{MAX(max_rows, 3)},
           m_has_streams{has_streams},
+          m_streams_in_memory{streams_in_memory_default()},
           m_last_attr{basic_cell.attr}
 {
 	_vte_debug_print(VTE_DEBUG_RING, "New ring %p.\n", this);
 
 	m_array = (VteRowData* ) g_malloc0 (sizeof (m_array[0]) * (m_mask + 1));
+        m_slots = g_new(uint32_t, m_mask + 1);
+        for (size_t i = 0; i <= m_mask; i++)
+                m_slots[i] = i;
 
 	if (has_streams) {
-		m_attr_stream = _vte_file_stream_new ();
-		m_text_stream = _vte_file_stream_new ();
-		m_row_stream = _vte_file_stream_new ();
+		m_attr_stream = new_stream();
+		m_text_stream = new_stream();
+		m_row_stream = new_stream();
 	} else {
 		m_attr_stream = m_text_stream = m_row_stream = nullptr;
 	}
@@ -103,6 +123,7 @@ Ring::Ring(row_t max_rows,
         m_hyperlinks = g_ptr_array_new();
         auto empty_str = g_string_new_len("", 0);
         g_ptr_array_add(m_hyperlinks, empty_str);
+        m_hyperlinks_size = sizeof(*empty_str) + empty_str->allocated_len;
 
 #ifdef WITH_SIXEL
         m_image_by_top_map = new (std::nothrow) std::map<int, Image *>();
@@ -120,6 +141,7 @@ Ring::~Ring()
 		_vte_row_data_fini (&m_array[i]);
 
 	g_free (m_array);
+        g_free (m_slots);
 
 #ifdef WITH_SIXEL
         /* Clear images */
@@ -133,6 +155,7 @@ Ring::~Ring()
 #endif /* WITH_SIXEL */
 
 	if (m_has_streams) {
+		drop_prefix();
 		g_object_unref (m_attr_stream);
 		g_object_unref (m_text_stream);
 		g_object_unref (m_row_stream);
@@ -140,18 +163,33 @@ Ring::~Ring()
 
 	g_string_free (m_utf8_buffer, TRUE);
 
+        for (auto& cached : m_cached_rows)
+                _vte_row_data_fini(&cached.row);
+
         for (size_t i = 0; i < m_hyperlinks->len; i++)
                 g_string_free (hyperlink_get(i), TRUE);
         g_ptr_array_free (m_hyperlinks, TRUE);
 
 	_vte_row_data_fini(&m_cached_row);
+
+#ifdef VTE_DEBUG
+        auto const& stats = m_cell_slab.stats();
+        _vte_debug_print(VTE_DEBUG_RING,
+                         "Cell arrays: %" G_GUINT64_FORMAT " allocated (%" G_GUINT64_FORMAT " reused), "
+                         "%" G_GUINT64_FORMAT " freed, in %" G_GUINT64_FORMAT " chunks (%" G_GUINT64_FORMAT " released).\n",
+                         stats.allocs, stats.reuses, stats.frees, stats.chunk_allocs, stats.chunk_frees);
+#endif
 }
 
 #define SET_BIT(buf, n) buf[(n) / 8] |= (1 << ((n) % 8))
 #define GET_BIT(buf, n) ((buf[(n) / 8] >> ((n) % 8)) & 1)
 
 /*
- * Do a round of garbage collection. Hyperlinks that no longer occur in the ring are wiped out.
+ * Do a round of garbage collection. Hyperlinks that no longer occur in the ring are wiped out,
+ * and their idxs become free.
+ *
+ * This walks the cells of all the writable rows, so it's only done once in a while:
+ * see hyperlink_maybe_gc() and get_hyperlink_idx_no_update_current().
  */
 void
 Ring::hyperlink_gc()
@@ -182,9 +220,9 @@ Ring::hyperlink_gc()
         SET_BIT(used, m_last_attr.hyperlink_idx);
 
         for (i = m_writable; i < m_end; i++) {
-                row = get_writable_index(i);
+                row = get_writable_row(i);
                 for (j = 0; j < row->len; j++) {
-                        idx = row->cells[j].attr.hyperlink_idx;
+                        idx = _vte_row_data_get_attr(row, j, m_styles)->hyperlink_idx;
                         SET_BIT(used, idx);
                 }
         }
@@ -194,12 +232,20 @@ Ring::hyperlink_gc()
                         _vte_debug_print (VTE_DEBUG_HYPERLINK,
                                           "hyperlink: GC purging link %d to id;uri=\"%s\"\n",
                                           idx, hyperlink_get(idx)->str);
+                        m_hyperlink_map.erase(std::string_view{hyperlink_get(idx)->str, hyperlink_get(idx)->len});
+                        m_hyperlink_free_idxs.push_back(idx);
                         /* Wipe out the ID and URI itself so it doesn't linger on in the memory for a long time */
                         memset(hyperlink_get(idx)->str, 0, hyperlink_get(idx)->len);
                         g_string_truncate (hyperlink_get(idx), 0);
                 }
         }
 
+        /* Next time an idx is allocated, GC only once the links in use have doubled,
+         * so that the walks above take amortized constant time per link. */
+        m_hyperlink_gc_threshold = CLAMP(2 * m_hyperlink_map.size(),
+                                         size_t(kHyperlinkGCMinCount),
+                                         size_t(VTE_HYPERLINK_COUNT_MAX));
+
         while (m_hyperlink_highest_used_idx >= 1 && hyperlink_get(m_hyperlink_highest_used_idx)->len == 0) {
                m_hyperlink_highest_used_idx--;
         }
@@ -280,6 +326,28 @@ Ring::image_gc()
         }
 }
 
+/*
+ * Remove the images that have scrolled out of the ring entirely.
+ */
+void
+Ring::image_gc_scrolled_out()
+{
+        auto it = m_image_by_top_map->begin();
+        while (it != m_image_by_top_map->end() && it->first < long(m_start)) {
+                Image *image = it->second;
+
+                if (image->get_bottom() >= long(m_start)) {
+                        it++;
+                        continue;
+                }
+
+                m_image_fast_memory_used -= image->resource_size();
+                m_image_priority_map->erase(image->get_priority());
+                it = m_image_by_top_map->erase(it);
+                delete image;
+        }
+}
+
 void
 Ring::unlink_image_from_top_map(Image *image)
 {
@@ -304,28 +372,6 @@ Ring::rebuild_image_top_map()
         }
 }
 
-bool
-Ring::rewrap_images_in_range(std::map<int,Image*>::iterator &it,
-                             size_t text_start_ofs, size_t text_end_ofs, row_t new_row_index)
-{
-        for ( ; it != m_image_by_top_map->end(); it++) {
-                Image *image = it->second;
-                CellTextOffset ofs;
-
-                if (!frozen_row_column_to_text_offset(image->get_top(), 0, &ofs))
-                        return false;
-
-                if (ofs.text_offset >= text_end_ofs)
-                        break;
-
-                if (ofs.text_offset >= text_start_ofs && ofs.text_offset < text_end_ofs) {
-                        image->set_top(new_row_index);
-                }
-        }
-
-        return true;
-}
-
 #endif /* WITH_SIXEL */
 
 /*
@@ -334,8 +380,6 @@ Ring::rewrap_images_in_range(std::map<int,Image*>::iterator &it,
  * Returns 0 if given no hyperlink or an empty one, or if the pool is full.
  * Returns the idx (either already existing or newly allocated) from 1 up to
  * VTE_HYPERLINK_COUNT_MAX inclusive otherwise.
- *
- * FIXME do something more effective than a linear search
  */
 Ring::hyperlink_idx_t
 Ring::get_hyperlink_idx_no_update_current(char const* hyperlink)
@@ -349,31 +393,32 @@ Ring::get_hyperlink_idx_no_update_current(char const* hyperlink)
 
         len = strlen(hyperlink);
 
-        /* Linear search for this particular URI */
-        auto const last_idx = m_hyperlink_highest_used_idx + 1;
-        for (idx = 1; idx < last_idx; ++idx) {
-                if (strcmp(hyperlink_get(idx)->str, hyperlink) == 0) {
-                        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                          "get_hyperlink_idx: already existing idx %d for id;uri=\"%s\"\n",
-                                          idx, hyperlink);
-                        return idx;
-                }
+        auto const it = m_hyperlink_map.find(std::string_view{hyperlink, len});
+        if (it != m_hyperlink_map.end()) {
+                _vte_debug_print (VTE_DEBUG_HYPERLINK,
+                                  "get_hyperlink_idx: already existing idx %d for id;uri=\"%s\"\n",
+                                  it->second, hyperlink);
+                return it->second;
         }
 
-        /* FIXME it's the second time we're GCing if coming from get_hyperlink_idx */
-        hyperlink_gc();
+        if (m_hyperlink_map.size() >= m_hyperlink_gc_threshold)
+                hyperlink_gc();
 
-        /* Another linear search for an empty slot where a GString is already allocated */
-        for (idx = 1; idx < m_hyperlinks->len; idx++) {
-                if (hyperlink_get(idx)->len == 0) {
-                        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                          "get_hyperlink_idx: reassigning old idx %d for id;uri=\"%s\"\n",
-                                          idx, hyperlink);
-                        /* Grow size if required, however, never shrink to avoid long-term memory fragmentation. */
-                        g_string_append_len (hyperlink_get(idx), hyperlink, len);
-                        m_hyperlink_highest_used_idx = MAX (m_hyperlink_highest_used_idx, idx);
-                        return idx;
-                }
+        if (!m_hyperlink_free_idxs.empty()) {
+                /* Reuse an empty slot where a GString is already allocated */
+                idx = m_hyperlink_free_idxs.back();
+                m_hyperlink_free_idxs.pop_back();
+                _vte_debug_print (VTE_DEBUG_HYPERLINK,
+                                  "get_hyperlink_idx: reassigning old idx %d for id;uri=\"%s\"\n",
+                                  idx, hyperlink);
+                /* Grow size if required, however, never shrink to avoid long-term memory fragmentation. */
+                str = hyperlink_get(idx);
+                m_hyperlinks_size -= str->allocated_len;
+                g_string_append_len (str, hyperlink, len);
+                m_hyperlinks_size += str->allocated_len;
+                m_hyperlink_highest_used_idx = MAX (m_hyperlink_highest_used_idx, idx);
+                m_hyperlink_map.emplace(std::string_view{str->str, str->len}, idx);
+                return idx;
         }
 
         /* All allocated slots are in use. Gotta allocate a new one */
@@ -394,6 +439,8 @@ Ring::get_hyperlink_idx_no_update_current(char const* hyperlink)
                           idx, hyperlink);
         str = g_string_new_len (hyperlink, len);
         g_ptr_array_add(m_hyperlinks, str);
+        m_hyperlinks_size += sizeof(*str) + str->allocated_len;
+        m_hyperlink_map.emplace(std::string_view{str->str, str->len}, idx);
 
         g_assert_cmpuint(m_hyperlink_highest_used_idx + 1, ==, m_hyperlinks->len);
 
@@ -412,10 +459,9 @@ Ring::get_hyperlink_idx_no_update_current(char const* hyperlink)
 Ring::hyperlink_idx_t
 Ring::get_hyperlink_idx(char const* hyperlink)
 {
-        /* Release current idx and do a round of GC to possibly purge its hyperlink,
-         * even if new hyperlink is nullptr or empty. */
+        /* Release current idx, so that the next GC can purge its hyperlink
+         * if it no longer occurs. */
         m_hyperlink_current_idx = 0;
-        hyperlink_gc();
 
         m_hyperlink_current_idx = get_hyperlink_idx_no_update_current(hyperlink);
         return m_hyperlink_current_idx;
@@ -425,7 +471,8 @@ void
 Ring::freeze_row(row_t position,
                  VteRowData const* row)
 {
-	VteCell *cell;
+	VteCell const* cell;
+	VteCell compact_cell;
 	GString *buffer = m_utf8_buffer;
         GString *hyperlink;
 	int i;
@@ -442,10 +489,18 @@ Ring::freeze_row(row_t position,
 	record.is_ascii = 1;
 
 	g_string_set_size (buffer, 0);
-	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
+	for (i = 0; i < row->len; i++) {
 		VteCellAttr attr;
 		int num_chars;
 
+		/* Compact rows get frozen without expanding them first */
+		if (G_UNLIKELY (row->attr.compact)) {
+			compact_cell.c = row->compact_cells[i].c;
+			compact_cell.attr = m_styles.get (row->compact_cells[i].style);
+			cell = &compact_cell;
+		} else
+			cell = &row->cells[i];
+
 		/* Attr storage:
 		 *
 		 * 1. We don't store attrs for fragments.  They can be
@@ -551,7 +606,7 @@ Ring::thaw_row(row_t position,
 
         g_assert(m_has_streams);
 
-	_vte_row_data_clear (row);
+	clear_row(row);
 
 	attr_change.text_end_offset = 0;
 
@@ -698,18 +753,36 @@ Ring::thaw_row(row_t position,
 				m_last_attr = basic_cell.attr;
 			}
 		}
-		_vte_stream_truncate (m_row_stream, position * sizeof (record));
+		truncate_row_records(position);
 		_vte_stream_truncate (m_attr_stream, attr_stream_truncate_at);
 		_vte_stream_truncate (m_text_stream, records[0].text_start_offset);
 	}
 }
 
+/* Drops the records of the frozen rows from @position on */
+void
+Ring::truncate_row_records(row_t position)
+{
+	if (G_LIKELY(position >= m_prefix_end)) {
+		_vte_stream_truncate(m_row_stream, position * sizeof (RowRecord));
+		return;
+	}
+
+	/* The rows from m_prefix_end on are all gone already */
+	_vte_stream_truncate(m_prefix_row_stream, (position - m_prefix_base) * sizeof (RowRecord));
+	_vte_stream_reset(m_row_stream, position * sizeof (RowRecord));
+	m_prefix_end = position;
+	if (m_prefix_end <= m_start)
+		drop_prefix();
+}
+
 void
 Ring::reset_streams(row_t position)
 {
 	_vte_debug_print (VTE_DEBUG_RING, "Reseting streams to %lu.\n", position);
 
 	if (m_has_streams) {
+		drop_prefix();
 		_vte_stream_reset(m_row_stream, position * sizeof(RowRecord));
                 _vte_stream_reset(m_text_stream, _vte_stream_head(m_text_stream));
                 _vte_stream_reset(m_attr_stream, _vte_stream_head(m_attr_stream));
@@ -719,6 +792,62 @@ Ring::reset_streams(row_t position)
 	m_last_attr = basic_cell.attr;
 }
 
+VteStream*
+Ring::new_stream() const
+{
+        return m_streams_in_memory ? _vte_memory_stream_new() : _vte_file_stream_new();
+}
+
+/* Returns a new stream of the current kind with the contents of @stream, and drops @stream */
+VteStream*
+Ring::migrate_stream(VteStream* stream) const
+{
+        auto const tail = _vte_stream_tail(stream);
+        auto const head = _vte_stream_head(stream);
+        auto migrated = new_stream();
+        char buf[4096];
+
+        _vte_stream_reset(migrated, tail);
+        for (auto offset = tail; offset < head; ) {
+                auto const len = MIN(sizeof(buf), head - offset);
+                /* Data that was lost already stays lost */
+                if (!_vte_stream_read(stream, offset, buf, len))
+                        memset(buf, 0, len);
+                _vte_stream_append(migrated, buf, len);
+                offset += len;
+        }
+
+        g_object_unref(stream);
+        return migrated;
+}
+
+/*
+ * Ring::set_streams_in_memory:
+ * @in_memory: whether to keep the frozen rows in memory
+ *
+ * Moves the streams, and so the scrollback, to memory or to temporary files.
+ */
+void
+Ring::set_streams_in_memory(bool in_memory)
+{
+        if (in_memory == m_streams_in_memory)
+                return;
+
+        _vte_debug_print(VTE_DEBUG_RING, "Moving the streams %s.\n", in_memory ? "to memory" : "to files");
+
+        m_streams_in_memory = in_memory;
+        if (!m_has_streams)
+                return;
+
+        m_attr_stream = migrate_stream(m_attr_stream);
+        m_text_stream = migrate_stream(m_text_stream);
+        m_row_stream = migrate_stream(m_row_stream);
+        if (m_prefix_row_stream != nullptr)
+                m_prefix_row_stream = migrate_stream(m_prefix_row_stream);
+        if (m_rewrap_row_stream != nullptr)
+                m_rewrap_row_stream = migrate_stream(m_rewrap_row_stream);
+}
+
 Ring::row_t
 Ring::reset()
 {
@@ -730,7 +859,16 @@ Ring::reset()
 
         reset_streams(m_end);
         m_start = m_writable = m_end;
-        m_cached_row_num = (row_t)-1;
+        invalidate_cached_rows();
+
+        /* None of the rows is in use anymore; give all their cell arrays back */
+        for (size_t i = 0; i <= m_mask; i++)
+                _vte_row_data_fini(&m_array[i]);
+        m_styles.clear();
+        for (auto& cached : m_cached_rows)
+                _vte_row_data_fini(&cached.row);
+        _vte_row_data_fini(&m_cached_row);
+        m_cell_slab.trim();
 
 #ifdef WITH_SIXEL
         /* Clear images */
@@ -738,7 +876,8 @@ Ring::reset()
                 delete it->second;
         image_map->clear();
         m_image_priority_map->clear();
-        m_next_image_priority = 0;
+        /* Don't reset m_next_image_priority, so that priorities of
+         * images still being decoded are never reused. */
         m_image_fast_memory_used = 0;
 #endif
 
@@ -751,13 +890,95 @@ Ring::index(row_t position)
 	if (G_LIKELY (position >= m_writable))
 		return get_writable_index(position);
 
-	if (m_cached_row_num != position) {
-		_vte_debug_print(VTE_DEBUG_RING, "Caching row %lu.\n", position);
-                thaw_row(position, &m_cached_row, false, -1, nullptr);
-		m_cached_row_num = position;
-	}
+	/* The rows above m_prefix_end still have their old wrapping, so rewrap
+	 * them all first. This renumbers them, see rewrap_step(). */
+	if (G_UNLIKELY(position < m_prefix_end))
+		rewrap_finish();
+
+        auto it = m_cached_rows_map.find(position);
+        if (it != m_cached_rows_map.end()) {
+                m_cached_rows_hits++;
+                m_cached_rows.splice(m_cached_rows.begin(), m_cached_rows, it->second);
+                return &it->second->row;
+        }
+
+        m_cached_rows_misses++;
+        _vte_debug_print(VTE_DEBUG_RING, "Caching row %lu.\n", position);
+
+        /* Reuse the least recently used entry if the cache is full */
+        if (m_cached_rows.size() < cached_rows_max()) {
+                m_cached_rows.push_front(CachedRow{(row_t)-1, {}});
+                _vte_row_data_init(&m_cached_rows.front().row);
+        } else {
+                auto const lru = std::prev(m_cached_rows.end());
+                if (lru->position != (row_t)-1)
+                        m_cached_rows_map.erase(lru->position);
+                m_cached_rows.splice(m_cached_rows.begin(), m_cached_rows, lru);
+        }
+
+        auto& cached = m_cached_rows.front();
+        _vte_row_data_alloc(&cached.row, m_cell_slab);
+        thaw_row(position, &cached.row, false, -1, nullptr);
+        cached.position = position;
+        m_cached_rows_map.emplace(position, m_cached_rows.begin());
+
+        return &cached.row;
+}
+
+/*
+ * Ring::invalidate_cached_row:
+ * @position: a row
+ *
+ * Drops the row at @position from the cache of thawed rows, if present.
+ */
+void
+Ring::invalidate_cached_row(row_t position)
+{
+        auto it = m_cached_rows_map.find(position);
+        if (it == m_cached_rows_map.end())
+                return;
+
+        auto const entry = it->second;
+        m_cached_rows_map.erase(it);
+        entry->position = (row_t)-1;
+        m_cached_rows.splice(m_cached_rows.end(), m_cached_rows, entry);
+}
 
-	return &m_cached_row;
+/*
+ * Ring::invalidate_cached_rows:
+ *
+ * Empties the cache of thawed rows, keeping the entries' memory for reuse.
+ */
+void
+Ring::invalidate_cached_rows()
+{
+        if (m_cached_rows_map.empty())
+                return;
+
+        _vte_debug_print(VTE_DEBUG_RING, "Invalidating cached rows (%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses so far).\n",
+                         m_cached_rows_hits, m_cached_rows_misses);
+
+        m_cached_rows_map.clear();
+        for (auto& cached : m_cached_rows)
+                cached.position = (row_t)-1;
+}
+
+/*
+ * Ring::trim_cached_rows:
+ *
+ * Frees the least recently used entries of the cache of thawed rows
+ * exceeding its maximum size.
+ */
+void
+Ring::trim_cached_rows()
+{
+        while (m_cached_rows.size() > cached_rows_max()) {
+                auto& lru = m_cached_rows.back();
+                if (lru.position != (row_t)-1)
+                        m_cached_rows_map.erase(lru.position);
+                _vte_row_data_fini(&lru.row);
+                m_cached_rows.pop_back();
+        }
 }
 
 bool
@@ -766,11 +987,13 @@ Ring::is_soft_wrapped(row_t position)
         const VteRowData *row;
         RowRecord record;
 
+        if (G_UNLIKELY (position < m_prefix_end))
+                rewrap_finish();
         if (G_UNLIKELY (position < m_start || position >= m_end))
                 return false;
 
         if (G_LIKELY (position >= m_writable)) {
-                row = get_writable_index(position);
+                row = get_writable_row(position);
                 return row->attr.soft_wrapped;
         }
 
@@ -807,14 +1030,22 @@ Ring::get_hyperlink_at_position(row_t position,
                 hyperlink = &hp;
         *hyperlink = nullptr;
 
-        if (update_hover_idx) {
-                /* Invalidate the cache because new hover idx might result in new idxs to report. */
-                m_cached_row_num = (row_t)-1;
-        }
+        /* Cached rows were thawed with the previous hover idx, and a new one
+         * might result in new idxs to report; so invalidate them when it changes.
+         */
+        auto set_hover_idx = [this](hyperlink_idx_t hover_idx) {
+                if (hover_idx != m_hyperlink_hover_idx)
+                        invalidate_cached_rows();
+                m_hyperlink_hover_idx = hover_idx;
+        };
+
+        /* See index() */
+        if (G_UNLIKELY (position < m_prefix_end))
+                rewrap_finish();
 
         if (G_UNLIKELY (!contains(position) || col < 0)) {
                 if (update_hover_idx)
-                        m_hyperlink_hover_idx = 0;
+                        set_hover_idx(0);
                 return 0;
         }
 
@@ -822,21 +1053,21 @@ Ring::get_hyperlink_at_position(row_t position,
                 VteRowData* row = get_writable_index(position);
                 if (col >= _vte_row_data_length(row)) {
                         if (update_hover_idx)
-                                m_hyperlink_hover_idx = 0;
+                                set_hover_idx(0);
                         return 0;
                 }
                 *hyperlink = hyperlink_get(row->cells[col].attr.hyperlink_idx)->str;
                 idx = row->cells[col].attr.hyperlink_idx;
         } else {
-                thaw_row(position, &m_cached_row, false, col, hyperlink);
-                /* Note: Intentionally don't set cached_row_num. We're about to update
+                /* Note: Intentionally don't cache this row. We're about to update
                  * m_hyperlink_hover_idx which makes some idxs no longer valid. */
+                thaw_row(position, &m_cached_row, false, col, hyperlink);
                 idx = get_hyperlink_idx_no_update_current(*hyperlink);
         }
         if (**hyperlink == '\0')
                 *hyperlink = nullptr;
         if (update_hover_idx)
-                m_hyperlink_hover_idx = idx;
+                set_hover_idx(idx);
         return idx;
 }
 
@@ -855,7 +1086,7 @@ Ring::freeze_one_row()
 	if (G_UNLIKELY (m_writable == m_start))
 		reset_streams(m_writable);
 
-	row = get_writable_index(m_writable);
+	row = get_writable_row(m_writable);
 	freeze_row(m_writable, row);
 
 	m_writable++;
@@ -868,26 +1099,36 @@ Ring::thaw_one_row()
 
 	g_assert_cmpuint(m_start, <, m_writable);
 
+	/* Rows that haven't been rewrapped yet would get frozen again as they are */
+	if (G_UNLIKELY(m_writable - 1 < m_prefix_end))
+		rewrap_finish();
+
 	ensure_writable_room();
 
 	m_writable--;
 
-	if (m_writable == m_cached_row_num)
-		m_cached_row_num = (row_t)-1; /* Invalidate cached row */
+        invalidate_cached_row(m_writable);
 
-	row = get_writable_index(m_writable);
+	row = get_writable_row(m_writable);
         thaw_row(m_writable, row, true, -1, nullptr);
 }
 
 void
 Ring::discard_one_row()
 {
+        invalidate_cached_row(m_start);
 	m_start++;
 	if (G_UNLIKELY(m_start == m_writable)) {
 		reset_streams(m_writable);
 	} else if (m_start < m_writable) {
 		RowRecord record;
-		_vte_stream_advance_tail(m_row_stream, m_start * sizeof (record));
+		if (G_UNLIKELY(m_start < m_prefix_end)) {
+			_vte_stream_advance_tail(m_prefix_row_stream, (m_start - m_prefix_base) * sizeof (record));
+		} else {
+			if (G_UNLIKELY(m_prefix_row_stream != nullptr))
+				drop_prefix();
+			_vte_stream_advance_tail(m_row_stream, m_start * sizeof (record));
+		}
 		if (G_LIKELY(read_row_record(&record, m_start))) {
 			_vte_stream_advance_tail(m_text_stream, record.text_start_offset);
 			_vte_stream_advance_tail(m_attr_stream, record.attr_start_offset);
@@ -895,6 +1136,12 @@ Ring::discard_one_row()
 	} else {
 		m_writable = m_start;
 	}
+
+#ifdef WITH_SIXEL
+        /* Images are otherwise only limited on their own, see image_gc() */
+        if (G_UNLIKELY(m_max_bytes != 0))
+                image_gc_scrolled_out();
+#endif
 }
 
 void
@@ -908,47 +1155,186 @@ Ring::maybe_freeze_one_row()
 		ensure_writable_room();
 }
 
+/*
+ * Ring::compact_row:
+ * @row: a writable row
+ *
+ * Switches @row to the compact layout, see StyleTable. If m_styles is
+ * full, it is rebuilt from the compact rows first; if it still is, @row
+ * stays as it is.
+ */
+void
+Ring::compact_row(VteRowData* row)
+{
+        if (G_UNLIKELY(!_vte_row_data_compact(row, m_styles, m_cell_slab))) {
+                style_gc();
+                _vte_row_data_compact(row, m_styles, m_cell_slab);
+        }
+}
+
+/*
+ * Ring::maybe_compact_rows:
+ * @count: the number of rows just added
+ *
+ * Compacts the rows that adding @count rows scrolled out of the screen,
+ * except for the one right above it, see ensure_writable_room(). Until
+ * they are frozen, they rarely get accessed again, and when they do,
+ * get_writable_index() expands them. The full cell arrays they give back
+ * are released once they add up to a chunk.
+ */
+void
+Ring::maybe_compact_rows(row_t count)
+{
+        if (G_UNLIKELY(m_end < m_visible_rows + 1))
+                return;
+
+        auto const end = m_end - m_visible_rows - 1;
+        for (auto i = MAX(end - MIN(count, end), m_writable); i < end; i++) {
+                auto const row = get_writable_row(i);
+                if (!row->attr.compact)
+                        compact_row(row);
+        }
+        m_cell_slab.maybe_trim();
+}
+
+/*
+ * Ring::style_gc:
+ *
+ * Rebuilds m_styles with only the styles the compact rows still use.
+ */
+void
+Ring::style_gc()
+{
+        StyleTable styles;
+
+        /* Rows in slots not in use keep their cells until reused, so go through all of them */
+        for (size_t i = 0; i <= m_mask; i++)
+                _vte_row_data_restyle(&m_array[i], m_styles, styles);
+
+        _vte_debug_print(VTE_DEBUG_RING, "Style GC: kept %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " styles.\n",
+                         styles.size(), m_styles.size());
+
+        m_styles = std::move(styles);
+}
+
 //FIXMEchpe maybe inline this one
 void
 Ring::maybe_discard_one_row()
 {
-	if (length() == m_max)
+	if (length() == m_max || G_UNLIKELY(over_max_bytes()))
+		discard_one_row();
+
+	if (G_UNLIKELY(m_streams_in_memory))
+		discard_lost_rows();
+}
+
+/*
+ * Ring::row_lost:
+ * @position: a frozen row
+ *
+ * Returns: whether the streams dropped some of @position's data to stay
+ *   within the memory budget, see _vte_file_stream_get_readable_tail()
+ */
+bool
+Ring::row_lost(row_t position)
+{
+	RowRecord record;
+
+	if (G_UNLIKELY(position < m_prefix_end)) {
+		if ((position - m_prefix_base) * sizeof(record) < _vte_file_stream_get_readable_tail(m_prefix_row_stream))
+			return true;
+	} else if (position * sizeof(record) < _vte_file_stream_get_readable_tail(m_row_stream)) {
+		return true;
+	}
+
+	if (!read_row_record(&record, position))
+		return true;
+
+	return record.text_start_offset < _vte_file_stream_get_readable_tail(m_text_stream) ||
+	       record.attr_start_offset < _vte_file_stream_get_readable_tail(m_attr_stream);
+}
+
+/*
+ * Ring::discard_lost_rows:
+ *
+ * In memory, the streams drop their oldest blocks when the budget is used up.
+ * Discards the rows that lost data that way, so that the history starts after
+ * them instead of having holes.
+ */
+void
+Ring::discard_lost_rows()
+{
+	while (m_start < m_writable && G_UNLIKELY(row_lost(m_start)))
 		discard_one_row();
 }
 
+/*
+ * Ring::over_max_bytes:
+ *
+ * Returns: whether the ring exceeds its byte limit, and has rows to discard
+ *   beyond the visible ones
+ *
+ * This gets checked for each row added; memory_usage() only adds up running
+ * totals, the streams' ones included, without waiting for their writer.
+ */
+bool
+Ring::over_max_bytes() const
+{
+        if (G_LIKELY(m_max_bytes == 0) || length() <= m_visible_rows)
+                return false;
+
+        MemoryUsage usage;
+        memory_usage(&usage);
+        return usage.cells + usage.streams + usage.hyperlinks + usage.images > m_max_bytes;
+}
+
+/*
+ * Ring::ensure_writable_room:
+ * @count: the number of rows about to be added
+ *
+ * Enlarges the writable array, if necessary, so that @count rows can be
+ * added at the end of the writable region.
+ */
 void
-Ring::ensure_writable_room()
+Ring::ensure_writable_room(row_t count)
 {
 	row_t new_mask, old_mask, i, end;
 	VteRowData* old_array, *new_array;;
+        uint32_t* old_slots;
 
         /* Keep at least m_visible_rows + 1 rows in the ring.
          * The BiDi spec requires that the just scrolled out row
          * is still alterable (can be switched to hard line ending).
          * It's nice anyway to make that hard wrapped upon a clear. */
         if (G_LIKELY(m_mask >= m_visible_rows + 1 &&
-                     m_writable + m_mask + 1 > m_end))
+                     m_writable + m_mask + 1 > m_end + count - 1))
 		return;
 
 	old_mask = m_mask;
 	old_array = m_array;
+        old_slots = m_slots;
 
 	do {
 		m_mask = (m_mask << 1) + 1;
-        } while (m_mask < m_visible_rows + 1 || m_writable + m_mask + 1 <= m_end);
+        } while (m_mask < m_visible_rows + 1 || m_writable + m_mask + 1 <= m_end + count - 1);
 
 	_vte_debug_print(VTE_DEBUG_RING, "Enlarging writable array from %lu to %lu\n", old_mask, m_mask);
 
 	m_array = (VteRowData* ) g_malloc0(sizeof (m_array[0]) * (m_mask + 1));
+        m_slots = g_new(uint32_t, m_mask + 1);
+        for (i = 0; i <= m_mask; i++)
+                m_slots[i] = i;
 
 	new_mask = m_mask;
 	new_array = m_array;
 
+        /* The rows go back in order, in the slots their positions map to */
 	end = m_writable + old_mask + 1;
 	for (i = m_writable; i < end; i++)
-		new_array[i & new_mask] = old_array[i & old_mask];
+		new_array[i & new_mask] = old_array[old_slots[i & old_mask]];
 
 	g_free (old_array);
+        g_free (old_slots);
 }
 
 void
@@ -964,6 +1350,66 @@ Ring::ensure_writable(row_t position)
 		thaw_one_row();
 }
 
+/*
+ * Ring::reverse_writable:
+ * @first: the first row
+ * @last: the row after the last row
+ *
+ * Reverses the order of the writable rows in [@first, @last), by their slots.
+ */
+void
+Ring::reverse_writable(row_t first,
+                       row_t last)
+{
+        while (first + 1 < last) {
+                std::swap(get_writable_slot(first), get_writable_slot(last - 1));
+                first++;
+                last--;
+        }
+}
+
+/*
+ * Ring::rotate_writable:
+ * @first: the first row
+ * @middle: the row to move to @first
+ * @last: the row after the last row
+ *
+ * Rotates the writable rows (or unused slots of the writable array) in
+ * [@first, @last) so that @middle becomes the first one, like std::rotate().
+ * Only the rows' slot numbers in m_slots move, each at most twice, regardless
+ * of how far they are rotated; the rows themselves stay where they are.
+ */
+void
+Ring::rotate_writable(row_t first,
+                      row_t middle,
+                      row_t last)
+{
+        if (first == middle || middle == last)
+                return;
+
+        /* Rotating by a single row is common, and can be done with
+         * moving each slot number only once.
+         */
+        if (last - middle == 1) {
+                auto const tmp = get_writable_slot(middle);
+                for (auto i = middle; i > first; i--)
+                        get_writable_slot(i) = get_writable_slot(i - 1);
+                get_writable_slot(first) = tmp;
+                return;
+        }
+        if (middle - first == 1) {
+                auto const tmp = get_writable_slot(first);
+                for (auto i = first; i < last - 1; i++)
+                        get_writable_slot(i) = get_writable_slot(i + 1);
+                get_writable_slot(last - 1) = tmp;
+                return;
+        }
+
+        reverse_writable(first, middle);
+        reverse_writable(middle, last);
+        reverse_writable(first, last);
+}
+
 /**
  * Ring::resize:
  * @max_rows: new maximum numbers of rows in the ring
@@ -983,6 +1429,8 @@ Ring::resize(row_t max_rows)
 		if (m_start >= m_writable) {
 			reset_streams(m_writable);
 			m_writable = m_start;
+		} else if (m_start >= m_prefix_end) {
+			drop_prefix();
 		}
 	}
 
@@ -1025,8 +1473,7 @@ Ring::shrink(row_t max_len)
 VteRowData*
 Ring::insert(row_t position, guint8 bidi_flags)
 {
-	row_t i;
-	VteRowData* row, tmp;
+	VteRowData* row;
 
 	_vte_debug_print(VTE_DEBUG_RING, "Inserting at position %lu.\n", position);
 	validate();
@@ -1038,18 +1485,16 @@ Ring::insert(row_t position, guint8 bidi_flags)
 	g_assert_cmpuint (position, >=, m_writable);
 	g_assert_cmpuint (position, <=, m_end);
 
-        //FIXMEchpe WTF use better data structures!
-	tmp = *get_writable_index(m_end);
-	for (i = m_end; i > position; i--)
-		*get_writable_index(i) = *get_writable_index(i - 1);
-	*get_writable_index(position) = tmp;
+        /* Move the unused slot at m_end to @position */
+        rotate_writable(position, m_end, m_end + 1);
 
-	row = get_writable_index(position);
-	_vte_row_data_clear (row);
+	row = get_writable_row(position);
+	clear_row(row);
         row->attr.bidi_flags = bidi_flags;
 	m_end++;
 
 	maybe_freeze_one_row();
+	maybe_compact_rows(1);
         validate();
 	return row;
 }
@@ -1063,9 +1508,6 @@ Ring::insert(row_t position, guint8 bidi_flags)
 void
 Ring::remove(row_t position)
 {
-	row_t i;
-	VteRowData tmp;
-
 	_vte_debug_print(VTE_DEBUG_RING, "Removing item at position %lu.\n", position);
         validate();
 
@@ -1074,11 +1516,8 @@ Ring::remove(row_t position)
 
 	ensure_writable(position);
 
-        //FIXMEchpe WTF as above
-	tmp = *get_writable_index(position);
-	for (i = position; i < m_end - 1; i++)
-		*get_writable_index(i) = *get_writable_index(i + 1);
-	*get_writable_index(m_end - 1) = tmp;
+        /* Move the removed row's slot past the end, for reuse */
+        rotate_writable(position, position + 1, m_end);
 
 	if (m_end > m_writable)
 		m_end--;
@@ -1086,37 +1525,191 @@ Ring::remove(row_t position)
         validate();
 }
 
-
 /**
- * Ring::append:
- * @data: the new item
+ * Ring::insert_rows:
+ * @position: an index
+ * @count: the number of rows to insert
+ * @bidi_flags: the BiDi flags for the new rows
  *
- * Appends a new item to the ring.
+ * Inserts @count new, empty, rows into @ring at the @position'th offset.
+ * The item at that position and any items after that are shifted down.
  *
- * Return: the newly added row.
+ * This is equivalent to calling insert() @count times, but rotates
+ * the slots of the rows after @position only once.
  */
-VteRowData*
-Ring::append(guint8 bidi_flags)
+void
+Ring::insert_rows(row_t position,
+                  row_t count,
+                  guint8 bidi_flags)
 {
-        return insert(next(), bidi_flags);
-}
+	_vte_debug_print(VTE_DEBUG_RING, "Inserting %lu rows at position %lu.\n", count, position);
+	validate();
+
+        if (count == 0)
+                return;
+
+        while (length() > 0 && length() + count > m_max)
+                discard_one_row();
+        while (over_max_bytes())
+                discard_one_row();
+	ensure_writable(position);
+
+	g_assert_cmpuint (position, >=, m_writable);
+	g_assert_cmpuint (position, <=, m_end);
 
+        /* Like insert(), keep the writable region from growing by freezing
+         * rows from its start, as far as they are before @position; only
+         * enlarge the array if that doesn't make enough room.
+         */
+        while (m_mask >= m_visible_rows + 1 &&
+               m_writable < position &&
+               m_end + count > m_writable + m_mask)
+                freeze_one_row();
+
+        /* As maybe_discard_one_row() does for each row insert() adds; the rows
+         * just frozen may have pushed the streams over the memory budget too */
+        if (G_UNLIKELY(m_streams_in_memory))
+                discard_lost_rows();
+
+        ensure_writable_room(count + 1);
+
+        /* Move the unused slots at m_end to @position */
+        rotate_writable(position, m_end, m_end + count);
+
+        for (auto i = position; i < position + count; i++) {
+                auto row = get_writable_row(i);
+                clear_row(row);
+                row->attr.bidi_flags = bidi_flags;
+        }
+        m_end += count;
+        maybe_compact_rows(count);
+
+        validate();
+}
 
 /**
- * Ring::drop_scrollback:
- * @position: drop contents up to this point, which must be in the writable region.
+ * Ring::remove_rows:
+ * @position: an index
+ * @count: the number of rows to remove
  *
- * Drop the scrollback (offscreen contents).
+ * Removes the items from the @position'th to before the (@position + @count)'th
+ * from @ring, or as many of them as it contains.
  *
- * TODOegmont: We wouldn't need the position argument after addressing 708213#c29.
+ * This is equivalent to calling remove() @count times, but rotates
+ * the slots of the rows after the removed ones only once.
  */
 void
-Ring::drop_scrollback(row_t position)
+Ring::remove_rows(row_t position,
+                  row_t count)
 {
-        ensure_writable(position);
+	_vte_debug_print(VTE_DEBUG_RING, "Removing %lu rows at position %lu.\n", count, position);
+        validate();
 
-        m_start = m_writable = position;
-        reset_streams(position);
+	if (G_UNLIKELY(!contains(position)))
+		return;
+
+        count = MIN(count, m_end - position);
+        if (count == 0)
+                return;
+
+	ensure_writable(position);
+
+        /* Move the removed rows' slots past the end, for reuse */
+        rotate_writable(position, position + count, m_end);
+        m_end -= count;
+
+        validate();
+}
+
+
+/**
+ * Ring::scroll_region:
+ * @start: the first row of the region
+ * @end: the last row of the region
+ * @amount: the number of rows to scroll by; positive scrolls down, negative up
+ * @bidi_flags: the BiDi flags for the new rows
+ *
+ * Scrolls the rows from @start to @end (inclusive) by @amount rows.
+ * The rows scrolled out of the region are discarded, and the rows newly
+ * scrolled in are cleared. The rows outside the region don't move.
+ *
+ * Unlike removing and inserting rows, this doesn't change the ring's
+ * length, so it neither discards nor freezes any row. The region must
+ * be contained in @ring.
+ */
+void
+Ring::scroll_region(row_t start,
+                    row_t end,
+                    long amount,
+                    guint8 bidi_flags)
+{
+	_vte_debug_print(VTE_DEBUG_RING, "Scrolling rows %lu to %lu by %ld.\n", start, end, amount);
+        validate();
+
+        g_assert_cmpuint(start, >=, m_start);
+        g_assert_cmpuint(start, <=, end);
+        g_assert_cmpuint(end, <, m_end);
+
+        auto const height = end - start + 1;
+        auto const count = MIN(row_t(ABS(amount)), height);
+        if (count == 0)
+                return;
+
+	ensure_writable(start);
+
+        /* Rotate the slots of the rows scrolled out of the region around
+         * to where the new rows appear, and clear just those rows. None
+         * of the rows in the region moves.
+         */
+        row_t first;
+        if (amount > 0) {
+                rotate_writable(start, end + 1 - count, end + 1);
+                first = start;
+        } else {
+                rotate_writable(start, start + count, end + 1);
+                first = end + 1 - count;
+        }
+
+        for (auto i = first; i < first + count; i++) {
+                auto row = get_writable_row(i);
+                clear_row(row);
+                row->attr.bidi_flags = bidi_flags;
+        }
+
+        validate();
+}
+
+/**
+ * Ring::append:
+ * @data: the new item
+ *
+ * Appends a new item to the ring.
+ *
+ * Return: the newly added row.
+ */
+VteRowData*
+Ring::append(guint8 bidi_flags)
+{
+        return insert(next(), bidi_flags);
+}
+
+
+/**
+ * Ring::drop_scrollback:
+ * @position: drop contents up to this point, which must be in the writable region.
+ *
+ * Drop the scrollback (offscreen contents).
+ *
+ * TODOegmont: We wouldn't need the position argument after addressing 708213#c29.
+ */
+void
+Ring::drop_scrollback(row_t position)
+{
+        ensure_writable(position);
+
+        m_start = m_writable = position;
+        reset_streams(position);
+        invalidate_cached_rows();
 }
 
 /**
@@ -1131,6 +1724,96 @@ void
 Ring::set_visible_rows(row_t rows)
 {
         m_visible_rows = rows;
+        trim_cached_rows();
+}
+
+/**
+ * Ring::set_columns:
+ * @columns: the number of columns
+ *
+ * Sizes the cell arrays of rows added from now on to fit @columns cells.
+ */
+void
+Ring::set_columns(column_t columns)
+{
+        m_cell_slab.set_columns(columns);
+}
+
+/**
+ * Ring::set_max_bytes:
+ * @max_bytes: the maximum number of bytes, or 0 for no limit
+ *
+ * Limits the memory and storage used by the ring, as reported by
+ * memory_usage(), in addition to the number of rows: while the limit is
+ * exceeded, the oldest rows are discarded, but never the visible ones.
+ * Rows are discarded right away if necessary, and then as new rows are
+ * added.
+ *
+ * This counts the cell arrays, the streams after compression, the hyperlinks
+ * and the images. Discarding rows doesn't free the cell arrays of the
+ * writable rows, nor the images on them; if these alone exceed the limit,
+ * all the rows beyond the visible ones are discarded.
+ */
+void
+Ring::set_max_bytes(size_t max_bytes)
+{
+        _vte_debug_print(VTE_DEBUG_RING, "Limiting to %" G_GSIZE_FORMAT " bytes.\n", max_bytes);
+
+        m_max_bytes = max_bytes;
+        while (over_max_bytes())
+                discard_one_row();
+}
+
+/**
+ * Ring::memory_usage:
+ * @usage: (out): the memory usage
+ *
+ * Reports the memory (and for streams in files, storage) used by the ring.
+ */
+void
+Ring::memory_usage(MemoryUsage* usage) const
+{
+        /* The cell arrays of all rows, writable and cached, compact or not, come from the slab */
+        usage->cells = (sizeof(m_array[0]) + sizeof(m_slots[0])) * (m_mask + 1);
+        usage->cells += m_cell_slab.memory_size();
+        usage->cells += m_cached_rows.size() * sizeof(CachedRow);
+        usage->cells += m_styles.memory_size();
+
+        usage->streams = 0;
+        if (m_has_streams) {
+                usage->streams += _vte_file_stream_get_storage_size(m_attr_stream);
+                usage->streams += _vte_file_stream_get_storage_size(m_text_stream);
+                usage->streams += _vte_file_stream_get_storage_size(m_row_stream);
+                if (m_prefix_row_stream != nullptr)
+                        usage->streams += _vte_file_stream_get_storage_size(m_prefix_row_stream);
+                if (m_rewrap_row_stream != nullptr)
+                        usage->streams += _vte_file_stream_get_storage_size(m_rewrap_row_stream);
+        }
+
+        usage->hyperlinks = m_hyperlinks_size +
+                m_hyperlink_map.size() * (sizeof(decltype(m_hyperlink_map)::value_type) + 2 * sizeof(void*)) +
+                m_hyperlink_free_idxs.capacity() * sizeof(hyperlink_idx_t);
+
+#ifdef WITH_SIXEL
+        usage->images = m_image_fast_memory_used;
+#else
+        usage->images = 0;
+#endif
+}
+
+/**
+ * Ring::set_cached_rows_max:
+ * @max_rows: the maximum number of thawed rows to cache, or 0
+ *
+ * Sets the size of the LRU cache of rows thawed from the streams by index().
+ * If @max_rows is 0, the cache holds twice the number of visible rows,
+ * so that redrawing a page of scrollback doesn't thaw its rows again.
+ */
+void
+Ring::set_cached_rows_max(row_t max_rows)
+{
+        m_cached_rows_max = max_rows;
+        trim_cached_rows();
 }
 
 
@@ -1298,6 +1981,501 @@ Ring::frozen_row_text_offset_to_column(row_t position,
 }
 
 
+/*
+ * Ring::rewrap_begin:
+ * @state: (out): the rewrapping state
+ * @columns: the new number of columns
+ * @position: the first row to rewrap, at the start of a paragraph
+ * @end: the row after the last one to rewrap, at the start of a paragraph, or m_end
+ *
+ * Prepares for rewrapping the frozen rows in [@position, @end) one paragraph
+ * at a time with rewrap_paragraph().
+ */
+bool
+Ring::rewrap_begin(RewrapState* state,
+                   column_t columns,
+                   row_t position,
+                   row_t end)
+{
+	state->readers = nullptr;
+	state->columns = columns;
+	state->end = end;
+	state->end_text_offset = row_text_offset(end);
+	state->new_row_index = 0;
+	state->records.clear();
+
+	if (!read_row_record(&state->old_record, position))
+		return false;
+	state->old_row_index = position + 1;
+	state->paragraph_start_text_offset = state->old_record.text_start_offset;
+
+	state->attr_offset = state->old_record.attr_start_offset;
+	rewrap_read_attr_change(state);
+
+	return true;
+}
+
+/* Like read_row_record(), through @state's readers if any */
+bool
+Ring::rewrap_read_row_record(RewrapState const* state,
+                             RowRecord* record,
+                             row_t position)
+{
+	if (state->readers == nullptr)
+		return read_row_record(record, position);
+	if (G_UNLIKELY(position < m_prefix_end))
+		return _vte_stream_reader_read(state->readers->prefix_row,
+					       (position - m_prefix_base) * sizeof(*record),
+					       (char*)record,
+					       sizeof(*record));
+	return _vte_stream_reader_read(state->readers->row,
+				       position * sizeof(*record),
+				       (char*)record,
+				       sizeof(*record));
+}
+
+/* Reads the attr change at @state's attr_offset, or the current attr beyond the last one */
+void
+Ring::rewrap_read_attr_change(RewrapState* state)
+{
+	auto const data = (char *) &state->attr_change;
+	auto const len = sizeof (state->attr_change);
+
+	if (state->readers == nullptr ? _vte_stream_read(m_attr_stream, state->attr_offset, data, len)
+				      : _vte_stream_reader_read(state->readers->attr, state->attr_offset, data, len))
+		return;
+
+	_attrcpy(&state->attr_change.attr, &m_last_attr);
+	state->attr_change.attr.hyperlink_length = hyperlink_get(m_last_attr.hyperlink_idx)->len;
+	state->attr_change.text_end_offset = _vte_stream_head(m_text_stream);
+}
+
+/* Like reading text_stream, through @state's readers if any */
+bool
+Ring::rewrap_read_text(RewrapState const* state,
+                       gsize offset,
+                       char* data,
+                       gsize len)
+{
+	if (state->readers == nullptr)
+		return _vte_stream_read(m_text_stream, offset, data, len);
+	return _vte_stream_reader_read(state->readers->text, offset, data, len);
+}
+
+/* Appends the records of @state's new rows to @stream */
+void
+Ring::rewrap_flush(RewrapState* state,
+                   VteStream* stream)
+{
+	if (state->records.empty())
+		return;
+	_vte_stream_append(stream,
+			   (char const*) state->records.data(),
+			   state->records.size() * sizeof (RowRecord));
+	state->records.clear();
+}
+
+/*
+ * Ring::rewrap_paragraph:
+ * @state: the rewrapping state
+ * @new_row_base: the number of the first new row
+ * @num_markers: the number of markers
+ * @marker_text_offsets: the markers' text offsets
+ * @new_markers: (inout): the markers' new positions, updated for those in the paragraph
+ *
+ * Rewraps the next paragraph, adding the new rows' records to @state.
+ * This may run on a worker thread if @state has readers; it then only
+ * reads the streams, through them.
+ */
+bool
+Ring::rewrap_paragraph(RewrapState* state,
+                       row_t new_row_base,
+                       int num_markers,
+                       CellTextOffset const* marker_text_offsets,
+                       VteVisualPosition* new_markers)
+{
+	/* Find the boundaries of the next paragraph */
+	gboolean prev_record_was_soft_wrapped = FALSE;
+	gboolean paragraph_is_ascii = TRUE;
+	guint8 paragraph_bidi_flags = state->old_record.bidi_flags;
+	gsize paragraph_start_text_offset = state->paragraph_start_text_offset;
+	gsize paragraph_end_text_offset = state->end_text_offset;
+	gsize paragraph_len;  /* excluding trailing '\n' */
+	gsize text_offset = paragraph_start_text_offset;
+	auto const columns = state->columns;
+	auto& attr_change = state->attr_change;
+	auto& attr_offset = state->attr_offset;
+	RowRecord new_record;
+	column_t col = 0;
+	int i;
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"  Old paragraph:  row %lu  (text_offset %" G_GSIZE_FORMAT ")  up to (exclusive)  ",  /* no '\n' */
+			state->old_row_index - 1,
+			paragraph_start_text_offset);
+	while (state->old_row_index <= state->end) {
+		prev_record_was_soft_wrapped = state->old_record.soft_wrapped;
+		paragraph_is_ascii = paragraph_is_ascii && state->old_record.is_ascii;
+		if (G_LIKELY (state->old_row_index < state->end)) {
+			if (!rewrap_read_row_record(state, &state->old_record, state->old_row_index))
+				return false;
+			paragraph_end_text_offset = state->old_record.text_start_offset;
+		} else {
+			paragraph_end_text_offset = state->end_text_offset;
+		}
+		state->old_row_index++;
+		if (!prev_record_was_soft_wrapped)
+			break;
+	}
+
+	paragraph_len = paragraph_end_text_offset - paragraph_start_text_offset;
+	if (!prev_record_was_soft_wrapped)  /* The last paragraph can be soft wrapped! */
+		paragraph_len--;  /* Strip trailing '\n' */
+	_vte_debug_print(VTE_DEBUG_RING,
+			"row %lu  (text_offset %" G_GSIZE_FORMAT ")%s  len %" G_GSIZE_FORMAT "  is_ascii %d\n",
+			state->old_row_index - 1,
+			paragraph_end_text_offset,
+			prev_record_was_soft_wrapped ? "  soft_wrapped" : "",
+			paragraph_len, paragraph_is_ascii);
+
+	/* Wrap the paragraph */
+	if (attr_change.text_end_offset <= text_offset) {
+		/* Attr change at paragraph boundary, advance to next attr. */
+                attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
+		rewrap_read_attr_change(state);
+	}
+	memset(&new_record, 0, sizeof (new_record));
+	new_record.text_start_offset = text_offset;
+	new_record.attr_start_offset = attr_offset;
+	new_record.is_ascii = paragraph_is_ascii;
+	new_record.bidi_flags = paragraph_bidi_flags;
+
+	while (paragraph_len > 0) {
+		/* Wrap one continuous run of identical attributes within the paragraph. */
+		gsize runlength;  /* number of bytes we process in one run: identical attributes, within paragraph */
+		if (attr_change.text_end_offset <= text_offset) {
+			/* Attr change at line boundary, advance to next attr. */
+                        attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
+			rewrap_read_attr_change(state);
+		}
+		runlength = MIN(paragraph_len, attr_change.text_end_offset - text_offset);
+
+		if (G_UNLIKELY (attr_change.attr.columns() == 0)) {
+			/* Combining characters all fit in the current row */
+			text_offset += runlength;
+			paragraph_len -= runlength;
+		} else {
+			while (runlength) {
+				if (col >= columns - attr_change.attr.columns() + 1) {
+					/* Wrap now, write the soft wrapped row's record */
+					new_record.soft_wrapped = 1;
+					state->records.push_back(new_record);
+					_vte_debug_print(VTE_DEBUG_RING,
+							"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "  soft_wrapped\n",
+							new_row_base + state->new_row_index,
+							new_record.text_start_offset, new_record.attr_start_offset);
+					for (i = 0; i < num_markers; i++) {
+						if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
+								marker_text_offsets[i].text_offset < text_offset)) {
+							new_markers[i].row = new_row_base + state->new_row_index;
+							_vte_debug_print(VTE_DEBUG_RING,
+									"      Marker #%d will be here in row %lu\n", i, new_row_base + state->new_row_index);
+						}
+					}
+
+					state->new_row_index++;
+					new_record.text_start_offset = text_offset;
+					new_record.attr_start_offset = attr_offset;
+					col = 0;
+
+				}
+				if (paragraph_is_ascii) {
+					/* Shortcut for quickly wrapping ASCII (excluding TAB) text.
+					   Don't read text_stream, and advance by a whole row of characters. */
+					int len = MIN(runlength, (gsize) (columns - col));
+					col += len;
+					text_offset += len;
+					paragraph_len -= len;
+					runlength -= len;
+				} else {
+					/* Process one character only. */
+					char textbuf[6];  /* fits at least one UTF-8 character */
+					int textbuf_len;
+					col += attr_change.attr.columns();
+					/* Find beginning of next UTF-8 character */
+					text_offset++; paragraph_len--; runlength--;
+					textbuf_len = MIN(runlength, sizeof (textbuf));
+					if (!rewrap_read_text(state, text_offset, textbuf, textbuf_len))
+						return false;
+					for (i = 0; i < textbuf_len && (textbuf[i] & 0xC0) == 0x80; i++) {
+						text_offset++; paragraph_len--; runlength--;
+					}
+				}
+			}
+		}
+	}
+
+	/* Write the record of the paragraph's last row. */
+	/* Hard wrapped, except maybe at the end of the very last paragraph */
+	new_record.soft_wrapped = prev_record_was_soft_wrapped;
+	state->records.push_back(new_record);
+	_vte_debug_print(VTE_DEBUG_RING,
+			"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "\n",
+			new_row_base + state->new_row_index,
+			new_record.text_start_offset, new_record.attr_start_offset);
+	for (i = 0; i < num_markers; i++) {
+		if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
+				marker_text_offsets[i].text_offset < paragraph_end_text_offset)) {
+			new_markers[i].row = new_row_base + state->new_row_index;
+			_vte_debug_print(VTE_DEBUG_RING,
+					"      Marker #%d will be here in row %lu\n", i, new_row_base + state->new_row_index);
+		}
+	}
+
+	state->new_row_index++;
+	state->paragraph_start_text_offset = paragraph_end_text_offset;
+	return true;
+}
+
+/* A segment queued on the rewrap pool by rewrap_range(), which waits for
+ * all of its jobs to be done */
+namespace {
+
+struct RewrapJobs {
+        std::mutex mutex{};
+        std::condition_variable done{};
+        size_t pending{0};
+};
+
+struct RewrapJob {
+        std::function<bool()> rewrap;
+        bool ok{false};
+        RewrapJobs* jobs{nullptr};
+};
+
+} // anon namespace
+
+static void
+rewrap_job_run(gpointer data,
+               gpointer user_data)
+{
+        auto const job = reinterpret_cast<RewrapJob*>(data);
+
+        job->ok = job->rewrap();
+
+        auto lock = std::lock_guard<std::mutex>{job->jobs->mutex};
+        if (--job->jobs->pending == 0)
+                job->jobs->done.notify_one();
+}
+
+/* The threads for rewrapping, shared by all rings. They're started along with
+ * the pool on the first parallel rewrap, and kept for the next ones. */
+static GThreadPool*
+rewrap_pool()
+{
+        static GThreadPool* pool = nullptr;
+
+        if (g_once_init_enter(&pool)) {
+                /* One processor is left for the calling thread */
+                auto const p = g_thread_pool_new(rewrap_job_run, nullptr,
+                                                 MAX(g_get_num_processors(), 2u) - 1,
+                                                 true, nullptr);
+                g_once_init_leave(&pool, p);
+        }
+        return pool;
+}
+
+/*
+ * Ring::rewrap_range:
+ * @columns: the new number of columns
+ * @position: the first row to rewrap, at the start of a paragraph
+ * @end: the row after the last one to rewrap, at the start of a paragraph, or m_end
+ * @stream: the stream to append the new row records to
+ * @new_row_base: the number of the first new row
+ * @num_markers: the number of markers
+ * @marker_text_offsets: the markers' text offsets
+ * @new_markers: (inout): the markers' new positions, updated for those in the range
+ * @new_rows: (out): the number of new rows
+ *
+ * Rewraps the frozen rows in [@position, @end). Paragraphs wrap independently
+ * of each other, so a large range is split into segments of whole paragraphs,
+ * up to one per processor unless limited with set_rewrap_threads(), and all
+ * but the first one are rewrapped on the threads of rewrap_pool(). The streams
+ * aren't modified until they're done.
+ */
+bool
+Ring::rewrap_range(column_t columns,
+                   row_t position,
+                   row_t end,
+                   VteStream* stream,
+                   row_t new_row_base,
+                   int num_markers,
+                   CellTextOffset const* marker_text_offsets,
+                   VteVisualPosition* new_markers,
+                   row_t* new_rows)
+{
+	RowRecord record;
+	auto const n_threads = m_rewrap_threads ? m_rewrap_threads : MAX(g_get_num_processors(), 1u);
+	auto const n_segments = CLAMP((end - position) / kParallelRewrapMinRows, row_t(1), row_t(n_threads));
+	std::vector<row_t> bounds{position};
+	bool ok = true;
+	int i;
+
+	/* Split at the paragraph starts after evenly spaced rows */
+	for (row_t k = 1; k < n_segments; k++) {
+		auto bound = position + (end - position) * k / n_segments;
+		while (bound < end && read_row_record(&record, bound - 1) && record.soft_wrapped)
+			bound++;
+		if (bound > bounds.back() && bound < end)
+			bounds.push_back(bound);
+	}
+	bounds.push_back(end);
+
+	auto const n = bounds.size() - 1;
+	std::vector<RewrapState> states(n);
+	for (size_t k = 0; k < n; k++) {
+		if (!rewrap_begin(&states[k], columns, bounds[k], bounds[k + 1]))
+			return false;
+	}
+
+	auto const rewrap_segment = [&](RewrapState* state, row_t base, VteVisualPosition* markers) {
+		while (state->paragraph_start_text_offset < state->end_text_offset) {
+			if (!rewrap_paragraph(state, base, num_markers, marker_text_offsets, markers))
+				return false;
+		}
+		return true;
+	};
+
+	if (n == 1) {
+		ok = rewrap_segment(&states[0], new_row_base, new_markers);
+		rewrap_flush(&states[0], stream);
+		*new_rows = states[0].new_row_index;
+		return ok;
+	}
+
+	_vte_debug_print(VTE_DEBUG_RING, "Rewrapping rows %lu to %lu in %lu segments.\n",
+			 position, end, (gulong) n);
+
+	/* The segments after the first one are rewrapped on the pool, each with
+	 * readers of its own, and with their markers' rows relative to them.
+	 * The first one is rewrapped right here, meanwhile. */
+	std::vector<RewrapReaders> readers(n);
+	std::vector<VteVisualPosition> segment_markers(n * num_markers);
+	std::vector<RewrapJob> segment_jobs(n);
+	RewrapJobs jobs;
+
+	for (auto& marker : segment_markers)
+		marker.row = marker.col = -1;
+	jobs.pending = n - 1;
+	for (size_t k = 1; k < n; k++) {
+		readers[k].prefix_row = m_prefix_row_stream ? _vte_stream_reader_new(m_prefix_row_stream) : nullptr;
+		readers[k].row = _vte_stream_reader_new(m_row_stream);
+		readers[k].attr = _vte_stream_reader_new(m_attr_stream);
+		readers[k].text = _vte_stream_reader_new(m_text_stream);
+		states[k].readers = &readers[k];
+		segment_jobs[k].rewrap = [&, k] {
+			return rewrap_segment(&states[k], 0, segment_markers.data() + k * num_markers);
+		};
+		segment_jobs[k].jobs = &jobs;
+		g_thread_pool_push(rewrap_pool(), &segment_jobs[k], nullptr);
+	}
+	segment_jobs[0].ok = rewrap_segment(&states[0], 0, segment_markers.data());
+	{
+		auto lock = std::unique_lock<std::mutex>{jobs.mutex};
+		jobs.done.wait(lock, [&] { return jobs.pending == 0; });
+	}
+
+	/* Concatenate the segments */
+	*new_rows = 0;
+	for (size_t k = 0; k < n; k++) {
+		ok = ok && segment_jobs[k].ok;
+		if (ok) {
+			rewrap_flush(&states[k], stream);
+			for (i = 0; i < num_markers; i++) {
+				if (segment_markers[k * num_markers + i].row != -1)
+					new_markers[i].row = new_row_base + *new_rows + segment_markers[k * num_markers + i].row;
+			}
+			*new_rows += states[k].new_row_index;
+		}
+		if (k > 0) {
+			if (readers[k].prefix_row != nullptr)
+				_vte_stream_reader_free(readers[k].prefix_row);
+			_vte_stream_reader_free(readers[k].row);
+			_vte_stream_reader_free(readers[k].attr);
+			_vte_stream_reader_free(readers[k].text);
+		}
+	}
+	return ok;
+}
+
+/* The offset in text_stream where the frozen row at @position begins,
+ * or where the next frozen row would begin */
+gsize
+Ring::row_text_offset(row_t position)
+{
+	RowRecord record;
+
+	if (position < m_writable && read_row_record(&record, position))
+		return record.text_start_offset;
+	return _vte_stream_head(m_text_stream);
+}
+
+/* Returns the last frozen row in [@lo, @hi) that begins at or before @text_offset, or @lo */
+Ring::row_t
+Ring::find_row_at_text_offset(gsize text_offset,
+                              row_t lo,
+                              row_t hi)
+{
+	RowRecord record;
+
+	while (lo + 1 < hi) {
+		auto const mid = lo + (hi - lo) / 2;
+		if (read_row_record(&record, mid) && record.text_start_offset <= text_offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Ring::rewrap_boundary:
+ * @columns: the new number of columns
+ * @position: the topmost row to rewrap
+ *
+ * Returns: the first row of a paragraph far enough above @position for
+ *   rewrapping from there on to fill the screen above @position, or m_start
+ *   if the rows above it are too few to bother rewrapping them later.
+ */
+Ring::row_t
+Ring::rewrap_boundary(column_t columns,
+                      row_t position)
+{
+	RowRecord record;
+	auto const target = 2 * MAX(m_visible_rows, kMinCachedRows);
+	row_t rows = 0;  /* estimated, from the paragraphs' lengths */
+
+	position = MIN(position, m_end);
+	while (position > m_start && position < m_end &&
+	       read_row_record(&record, position - 1) && record.soft_wrapped)
+		position--;
+
+	while (position > m_start && rows < target) {
+		auto const paragraph_end_text_offset = row_text_offset(position);
+
+		do
+			position--;
+		while (position > m_start &&
+		       read_row_record(&record, position - 1) && record.soft_wrapped);
+
+		rows += MAX((paragraph_end_text_offset - row_text_offset(position)) / columns, gsize(1));
+	}
+
+	if (position - m_start < kLazyRewrapMinRows)
+		return m_start;
+	return position;
+}
+
 /**
  * Ring::rewrap:
  * @columns: new number of columns
@@ -1306,34 +2484,31 @@ Ring::frozen_row_text_offset_to_column(row_t position,
  * Reflow the @ring to match the new number of @columns.
  * For all @markers, find the cell at that position and update them to
  * reflect the cell's new position.
+ *
+ * Only the paragraphs from the one of the topmost marker on, and enough
+ * above them to fill the screen, are rewrapped right away. The rows above
+ * keep their old wrapping until rewrap_step() has rewrapped them too; see
+ * rewrap_pending().
  */
 /* See ../doc/rewrap.txt for design and implementation details. */
 void
 Ring::rewrap(column_t columns,
              VteVisualPosition** markers)
 {
-	row_t old_row_index, new_row_index;
+	row_t boundary, new_row_base, new_rows, old_start, old_ring_end, min_marker_row;
 	int i;
 	int num_markers = 0;
 	CellTextOffset *marker_text_offsets;
 	VteVisualPosition *new_markers;
-	RowRecord old_record;
-	CellAttrChange attr_change;
-	VteStream *new_row_stream;
-	gsize paragraph_start_text_offset;
-	gsize paragraph_end_text_offset;
-	gsize paragraph_len;  /* excluding trailing '\n' */
-	gsize attr_offset;
-	gsize old_ring_end;
+	VteStream *new_row_stream = nullptr;
 #ifdef WITH_SIXEL
-	auto image_it = m_image_by_top_map->begin();
+	std::vector<std::pair<Image*, gsize>> images;
 #endif
 
 	if (G_UNLIKELY(length() == 0))
 		return;
 	_vte_debug_print(VTE_DEBUG_RING, "Ring before rewrapping:\n");
         validate();
-	new_row_stream = _vte_file_stream_new();
 
 	/* Freeze everything, because rewrapping is really complicated and we don't want to
 	   duplicate the code for frozen and thawed rows. */
@@ -1346,201 +2521,105 @@ Ring::rewrap(column_t columns,
 		num_markers++;
 	marker_text_offsets = (CellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
 	new_markers = (VteVisualPosition *) g_malloc(num_markers * sizeof (new_markers[0]));
+	min_marker_row = m_end;
 	for (i = 0; i < num_markers; i++) {
 		/* Convert visual column into byte offset */
 		if (!frozen_row_column_to_text_offset(markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
 			goto err;
 		new_markers[i].row = new_markers[i].col = -1;
+		/* Markers scrolled off at the top end up at the top anyway */
+		if (markers[i]->row >= long(m_start))
+			min_marker_row = MIN(min_marker_row, row_t(markers[i]->row));
 		_vte_debug_print(VTE_DEBUG_RING,
 				"Marker #%d old coords:  row %ld  col %ld  ->  text_offset %" G_GSIZE_FORMAT " fragment_cells %d  eol_cells %d\n",
 				i, markers[i]->row, markers[i]->col, marker_text_offsets[i].text_offset,
 				marker_text_offsets[i].fragment_cells, marker_text_offsets[i].eol_cells);
 	}
 
-	/* Prepare for rewrapping */
-	if (!read_row_record(&old_record, m_start))
-		goto err;
-	paragraph_start_text_offset = old_record.text_start_offset;
-	paragraph_end_text_offset = _vte_stream_head(m_text_stream);  /* initialized to silence gcc */
-	new_row_index = 0;
-
-	attr_offset = old_record.attr_start_offset;
-	if (!_vte_stream_read(m_attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                _attrcpy(&attr_change.attr, &m_last_attr);
-                attr_change.attr.hyperlink_length = hyperlink_get(m_last_attr.hyperlink_idx)->len;
-		attr_change.text_end_offset = _vte_stream_head(m_text_stream);
-	}
-
-	old_row_index = m_start + 1;
-	while (paragraph_start_text_offset < _vte_stream_head(m_text_stream)) {
-		/* Find the boundaries of the next paragraph */
-		gboolean prev_record_was_soft_wrapped = FALSE;
-		gboolean paragraph_is_ascii = TRUE;
-                guint8 paragraph_bidi_flags = old_record.bidi_flags;
-		gsize text_offset = paragraph_start_text_offset;
-		RowRecord new_record;
-		column_t col = 0;
+	boundary = rewrap_boundary(columns, min_marker_row);
 
-		_vte_debug_print(VTE_DEBUG_RING,
-				"  Old paragraph:  row %lu  (text_offset %" G_GSIZE_FORMAT ")  up to (exclusive)  ",  /* no '\n' */
-                                 old_row_index - 1,
-                                 paragraph_start_text_offset);
-		while (old_row_index <= m_end) {
-			prev_record_was_soft_wrapped = old_record.soft_wrapped;
-			paragraph_is_ascii = paragraph_is_ascii && old_record.is_ascii;
-			if (G_LIKELY (old_row_index < m_end)) {
-				if (!read_row_record(&old_record, old_row_index))
-					goto err;
-				paragraph_end_text_offset = old_record.text_start_offset;
-			} else {
-				paragraph_end_text_offset = _vte_stream_head (m_text_stream);
-			}
-			old_row_index++;
-			if (!prev_record_was_soft_wrapped)
-				break;
-		}
+	/* The rows above @boundary keep their records until rewrap_step() gets to
+	 * them. Number the rewrapped rows so that those can take any number of
+	 * rows then: each of them takes at least a byte of text, or is the first
+	 * one of its paragraph.
+	 */
+	old_start = m_start;
+	new_row_base = 0;
+	if (boundary > m_start)
+		new_row_base = MAX(boundary, row_text_offset(boundary) - row_text_offset(m_start) + (boundary - m_start));
 
-		paragraph_len = paragraph_end_text_offset - paragraph_start_text_offset;
-		if (!prev_record_was_soft_wrapped)  /* The last paragraph can be soft wrapped! */
-			paragraph_len--;  /* Strip trailing '\n' */
-		_vte_debug_print(VTE_DEBUG_RING,
-				"row %lu  (text_offset %" G_GSIZE_FORMAT ")%s  len %" G_GSIZE_FORMAT "  is_ascii %d\n",
-                                 old_row_index - 1,
-                                 paragraph_end_text_offset,
-				prev_record_was_soft_wrapped ? "  soft_wrapped" : "",
-				paragraph_len, paragraph_is_ascii);
+	_vte_debug_print(VTE_DEBUG_RING, "Rewrapping from row %lu on, to row %lu on.\n", boundary, new_row_base);
 
-		/* Wrap the paragraph */
-		if (attr_change.text_end_offset <= text_offset) {
-			/* Attr change at paragraph boundary, advance to next attr. */
-                        attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
-			if (!_vte_stream_read(m_attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                                _attrcpy(&attr_change.attr, &m_last_attr);
-                                attr_change.attr.hyperlink_length = hyperlink_get(m_last_attr.hyperlink_idx)->len;
-				attr_change.text_end_offset = _vte_stream_head(m_text_stream);
-			}
-		}
-		memset(&new_record, 0, sizeof (new_record));
-		new_record.text_start_offset = text_offset;
-		new_record.attr_start_offset = attr_offset;
-		new_record.is_ascii = paragraph_is_ascii;
-                new_record.bidi_flags = paragraph_bidi_flags;
-
-		while (paragraph_len > 0) {
-			/* Wrap one continuous run of identical attributes within the paragraph. */
-			gsize runlength;  /* number of bytes we process in one run: identical attributes, within paragraph */
-			if (attr_change.text_end_offset <= text_offset) {
-				/* Attr change at line boundary, advance to next attr. */
-                                attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
-				if (!_vte_stream_read(m_attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                                        _attrcpy(&attr_change.attr, &m_last_attr);
-                                        attr_change.attr.hyperlink_length = hyperlink_get(m_last_attr.hyperlink_idx)->len;
-					attr_change.text_end_offset = _vte_stream_head(m_text_stream);
-				}
-			}
-			runlength = MIN(paragraph_len, attr_change.text_end_offset - text_offset);
-
-			if (G_UNLIKELY (attr_change.attr.columns() == 0)) {
-				/* Combining characters all fit in the current row */
-				text_offset += runlength;
-				paragraph_len -= runlength;
-			} else {
-				while (runlength) {
-					if (col >= columns - attr_change.attr.columns() + 1) {
-						/* Wrap now, write the soft wrapped row's record */
-						new_record.soft_wrapped = 1;
-						_vte_stream_append(new_row_stream, (char const* ) &new_record, sizeof (new_record));
-						_vte_debug_print(VTE_DEBUG_RING,
-								"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "  soft_wrapped\n",
-								new_row_index,
-								new_record.text_start_offset, new_record.attr_start_offset);
-						for (i = 0; i < num_markers; i++) {
-							if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
-									marker_text_offsets[i].text_offset < text_offset)) {
-								new_markers[i].row = new_row_index;
-								_vte_debug_print(VTE_DEBUG_RING,
-										"      Marker #%d will be here in row %lu\n", i, new_row_index);
-							}
-						}
+	new_row_stream = new_stream();
+	_vte_stream_reset(new_row_stream, new_row_base * sizeof (RowRecord));
+	if (!rewrap_range(columns, boundary, m_end, new_row_stream, new_row_base,
+			  num_markers, marker_text_offsets, new_markers, &new_rows))
+		goto err;
 
 #ifdef WITH_SIXEL
-						if (!rewrap_images_in_range(image_it, new_record.text_start_offset, text_offset, new_row_index))
-							goto err;
+	/* Find the images' text offsets while the old rows are still around */
+	for (auto const& top_image : *m_image_by_top_map) {
+		auto const image = top_image.second;
+		CellTextOffset ofs;
+
+		if (top_image.first < long(boundary)) {
+			image->set_top(top_image.first + (new_row_base - boundary));
+			continue;
+		}
+		if (!frozen_row_column_to_text_offset(top_image.first, 0, &ofs))
+			goto err;
+		images.emplace_back(image, ofs.text_offset);
+	}
 #endif
 
-						new_row_index++;
-						new_record.text_start_offset = text_offset;
-						new_record.attr_start_offset = attr_offset;
-						col = 0;
-
-					}
-					if (paragraph_is_ascii) {
-						/* Shortcut for quickly wrapping ASCII (excluding TAB) text.
-						   Don't read text_stream, and advance by a whole row of characters. */
-						int len = MIN(runlength, (gsize) (columns - col));
-						col += len;
-						text_offset += len;
-						paragraph_len -= len;
-						runlength -= len;
-					} else {
-						/* Process one character only. */
-						char textbuf[6];  /* fits at least one UTF-8 character */
-						int textbuf_len;
-						col += attr_change.attr.columns();
-						/* Find beginning of next UTF-8 character */
-						text_offset++; paragraph_len--; runlength--;
-						textbuf_len = MIN(runlength, sizeof (textbuf));
-						if (!_vte_stream_read(m_text_stream, text_offset, textbuf, textbuf_len))
-							goto err;
-						for (i = 0; i < textbuf_len && (textbuf[i] & 0xC0) == 0x80; i++) {
-							text_offset++; paragraph_len--; runlength--;
-						}
-					}
-				}
-			}
-		}
+	/* Update the ring. */
+	old_ring_end = m_end;
+	if (boundary > m_start) {
+		/* Keep the records of the rows above @boundary in the prefix stream */
+		if (m_prefix_row_stream == nullptr) {
+			m_prefix_row_stream = m_row_stream;
+			m_prefix_base = 0;
+			m_prefix_end = m_end;
+		} else {
+			RowRecord record;
 
-		/* Write the record of the paragraph's last row. */
-		/* Hard wrapped, except maybe at the end of the very last paragraph */
-		new_record.soft_wrapped = prev_record_was_soft_wrapped;
-		_vte_stream_append(new_row_stream, (char const* ) &new_record, sizeof (new_record));
-		_vte_debug_print(VTE_DEBUG_RING,
-				"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "\n",
-				new_row_index,
-				new_record.text_start_offset, new_record.attr_start_offset);
-		for (i = 0; i < num_markers; i++) {
-			if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
-					marker_text_offsets[i].text_offset < paragraph_end_text_offset)) {
-				new_markers[i].row = new_row_index;
-				_vte_debug_print(VTE_DEBUG_RING,
-						"      Marker #%d will be here in row %lu\n", i, new_row_index);
+			for (auto row = m_prefix_end; row < boundary; row++) {
+				if (!read_row_record(&record, row))
+					goto err;
+				_vte_stream_append(m_prefix_row_stream, (char const*) &record, sizeof (record));
 			}
+			m_prefix_end = MAX(m_prefix_end, boundary);
+			g_object_unref(m_row_stream);
 		}
+		_vte_stream_truncate(m_prefix_row_stream, (boundary - m_prefix_base) * sizeof (RowRecord));
 
-#ifdef WITH_SIXEL
-		if (!rewrap_images_in_range(image_it, new_record.text_start_offset, paragraph_end_text_offset, new_row_index))
-			goto err;
-#endif
-
-		new_row_index++;
-		paragraph_start_text_offset = paragraph_end_text_offset;
+		m_prefix_base += new_row_base - boundary;
+		m_prefix_end = new_row_base;
+		m_start += new_row_base - boundary;
+	} else {
+		drop_prefix();
+		g_object_unref(m_row_stream);
+		m_start = 0;
 	}
-
-	/* Update the ring. */
-	old_ring_end = m_end;
-	g_object_unref(m_row_stream);
 	m_row_stream = new_row_stream;
-	m_writable = m_end = new_row_index;
-	m_start = 0;
-	if (m_end > m_max)
+	m_writable = m_end = new_row_base + new_rows;
+	if (m_end - m_start > m_max) {
 		m_start = m_end - m_max;
-	m_cached_row_num = (row_t) -1;
+		if (m_start >= m_prefix_end)
+			drop_prefix();
+	}
+	invalidate_cached_rows();
+
+	if (m_prefix_row_stream != nullptr) {
+		m_rewrap_columns = columns;
+		rewrap_restart();
+	}
 
 	/* Find the markers. This requires that the ring is already updated. */
 	for (i = 0; i < num_markers; i++) {
-		/* Compute the row for markers beyond the ring */
+		/* Compute the row for markers beyond the ring, or above the rows rewrapped right now */
 		if (new_markers[i].row == -1)
-			new_markers[i].row = markers[i]->row - old_ring_end + m_end;
+			new_markers[i].row = markers[i]->row < long(old_start) ? m_start : markers[i]->row - old_ring_end + m_end;
 		/* Convert byte offset into visual column */
 		if (!frozen_row_text_offset_to_column(new_markers[i].row, &marker_text_offsets[i], &new_markers[i].col))
 			goto err;
@@ -1555,6 +2634,8 @@ Ring::rewrap(column_t columns,
 	g_free(new_markers);
 
 #ifdef WITH_SIXEL
+	for (auto const& image_offset : images)
+		image_offset.first->set_top(find_row_at_text_offset(image_offset.second, new_row_base, m_end));
 	rebuild_image_top_map();
 #endif
 
@@ -1568,11 +2649,162 @@ err:
 			"Error while rewrapping\n");
 	g_assert_not_reached();
 #endif
-	g_object_unref(new_row_stream);
+	if (new_row_stream != nullptr && new_row_stream != m_row_stream)
+		g_object_unref(new_row_stream);
 	g_free(marker_text_offsets);
 	g_free(new_markers);
 }
 
+/* Starts rewrapping the rows above m_prefix_end over, from m_start on */
+void
+Ring::rewrap_restart()
+{
+	if (m_rewrap_row_stream == nullptr)
+		m_rewrap_row_stream = new_stream();
+	_vte_stream_reset(m_rewrap_row_stream, 0);
+
+	if (!rewrap_begin(&m_rewrap_state, m_rewrap_columns, m_start, m_prefix_end))
+		rewrap_abort();
+}
+
+/* Gives up rewrapping the rows above m_prefix_end; they keep their wrapping */
+void
+Ring::rewrap_abort()
+{
+	if (m_rewrap_row_stream != nullptr)
+		g_object_unref(m_rewrap_row_stream);
+	m_rewrap_row_stream = nullptr;
+	m_rewrap_columns = 0;
+}
+
+/* Drops the rows above m_prefix_end, after they have been discarded */
+void
+Ring::drop_prefix()
+{
+	rewrap_abort();
+	if (m_prefix_row_stream != nullptr)
+		g_object_unref(m_prefix_row_stream);
+	m_prefix_row_stream = nullptr;
+	m_prefix_base = m_prefix_end = 0;
+}
+
+/*
+ * Ring::rewrap_step:
+ * @max_rows: roughly the maximum number of rows to rewrap
+ *
+ * Continues rewrapping the rows left over by rewrap(), if any. Once all of
+ * them are rewrapped, they are renumbered, and so is m_start; rows from
+ * rewrap_pending_end() on keep their numbers.
+ *
+ * Returns: %true if the rewrapping just got completed
+ */
+bool
+Ring::rewrap_step(row_t max_rows)
+{
+	if (m_rewrap_columns == 0)
+		return false;
+
+	/* Start over if the rows being rewrapped got discarded meanwhile */
+	if (G_UNLIKELY(m_start >= m_rewrap_state.old_row_index)) {
+		rewrap_restart();
+		if (m_rewrap_columns == 0)
+			return false;
+	}
+
+	auto const stop = m_rewrap_state.old_row_index + max_rows;
+	while (m_rewrap_state.paragraph_start_text_offset < m_rewrap_state.end_text_offset) {
+		if (m_rewrap_state.old_row_index > stop)
+			return false;
+		if (!rewrap_paragraph(&m_rewrap_state, 0, 0, nullptr, nullptr)) {
+			_vte_debug_print(VTE_DEBUG_RING, "Error while rewrapping, giving up.\n");
+			rewrap_abort();
+			return false;
+		}
+		rewrap_flush(&m_rewrap_state, m_rewrap_row_stream);
+	}
+
+	rewrap_complete();
+	return true;
+}
+
+/* Rewraps the rows left over by rewrap() right away, see rewrap_range() */
+void
+Ring::rewrap_finish()
+{
+	row_t new_rows = 0;
+
+	if (m_rewrap_columns == 0)
+		return;
+	if (G_UNLIKELY(m_start >= m_rewrap_state.old_row_index)) {
+		rewrap_restart();
+		if (m_rewrap_columns == 0)
+			return;
+	}
+
+	/* The paragraph rewrap_step() would do next starts in the row of old_record */
+	if (m_rewrap_state.paragraph_start_text_offset < m_rewrap_state.end_text_offset &&
+	    !rewrap_range(m_rewrap_columns, m_rewrap_state.old_row_index - 1, m_rewrap_state.end,
+			  m_rewrap_row_stream, 0, 0, nullptr, nullptr, &new_rows)) {
+		_vte_debug_print(VTE_DEBUG_RING, "Error while rewrapping, giving up.\n");
+		rewrap_abort();
+		return;
+	}
+	m_rewrap_state.new_row_index += new_rows;
+
+	rewrap_complete();
+}
+
+/* Replaces the rows above m_prefix_end with the ones rewrap_step() made */
+void
+Ring::rewrap_complete()
+{
+	auto const new_rows = m_rewrap_state.new_row_index;
+	auto const start_text_offset = row_text_offset(m_start);
+#ifdef WITH_SIXEL
+	std::vector<std::pair<Image*, gsize>> images;
+
+	for (auto const& top_image : *m_image_by_top_map) {
+		CellTextOffset ofs;
+
+		if (top_image.first >= long(m_prefix_end))
+			break;
+		if (frozen_row_column_to_text_offset(top_image.first, 0, &ofs))
+			images.emplace_back(top_image.second, ofs.text_offset);
+	}
+#endif
+
+	_vte_debug_print(VTE_DEBUG_RING, "Rewrapped %lu rows above row %lu to %lu rows.\n",
+			 m_prefix_end - m_start, m_prefix_end, new_rows);
+
+	g_object_unref(m_prefix_row_stream);
+	m_prefix_row_stream = m_rewrap_row_stream;
+	m_rewrap_row_stream = nullptr;
+	m_rewrap_columns = 0;
+	m_prefix_base = m_prefix_end - new_rows;
+
+	/* Rows of text that got discarded while rewrapping still got rewrapped;
+	 * skip them, at the cost of the remainder of a partially discarded row. */
+	RowRecord record;
+	m_start = find_row_at_text_offset(start_text_offset, m_prefix_base, m_prefix_end);
+	if (read_row_record(&record, m_start) && record.text_start_offset < start_text_offset)
+		m_start++;
+	if (m_end - m_start > m_max)
+		m_start = m_end - m_max;
+	if (m_start >= m_prefix_end)
+		drop_prefix();
+	else
+		_vte_stream_advance_tail(m_prefix_row_stream, (m_start - m_prefix_base) * sizeof (RowRecord));
+	invalidate_cached_rows();
+
+#ifdef WITH_SIXEL
+	for (auto const& image_offset : images)
+		image_offset.first->set_top(find_row_at_text_offset(image_offset.second, m_start, MAX(m_prefix_end, m_start)));
+	rebuild_image_top_map();
+#endif
+
+        validate();
+}
+
 
 bool
 Ring::write_row(GOutputStream* stream,
@@ -1674,9 +2906,13 @@ Ring::write_contents(GOutputStream* stream,
  * @cell_width: Width of image in cell units
  * @cell_height: Height of image in cell units
  *
- * Append an image to the internal image list.
+ * Append an image to the internal image list. @surface may be %NULL for an
+ * image that is still being decoded; see Ring::set_image_surface().
+ *
+ * Returns: the image's priority, which identifies it for as long as it
+ *   exists, or -1 if the image could not be added
  */
-void
+int
 Ring::append_image (cairo_surface_t *surface, gint pixelwidth, gint pixelheight, glong left, glong top, glong cell_width, glong cell_height)
 {
         Image *image;
@@ -1687,7 +2923,9 @@ Ring::append_image (cairo_surface_t *surface, gint pixelwidth, gint pixelheight,
                                           left, top,
                                           cell_width, cell_height);
         if (!image)
-                return;
+                return -1;
+
+        auto const priority = image->get_priority();
 
         m_image_by_top_map->insert (std::make_pair (image->get_top (), image));
         m_image_priority_map->insert (std::make_pair (image->get_priority (), image));
@@ -1695,6 +2933,44 @@ Ring::append_image (cairo_surface_t *surface, gint pixelwidth, gint pixelheight,
 
         image_gc_region();
         image_gc();
+
+        return priority;
+}
+
+/**
+ * Ring::image_by_priority:
+ * @priority: the image's priority, as returned from Ring::append_image()
+ *
+ * Returns: the image, or %nullptr if it has been removed since
+ */
+Image*
+Ring::image_by_priority(int priority) const
+{
+        auto it = m_image_priority_map->find(priority);
+        if (it == m_image_priority_map->end())
+                return nullptr;
+
+        return it->second;
+}
+
+/**
+ * Ring::set_image_surface:
+ * @image: an image in the ring
+ * @surface: the image's decoded surface
+ *
+ * Attaches @surface to an image that was appended while still being decoded.
+ * This may push the image memory over budget, in which case older images are
+ * pruned, possibly including @image itself; don't use @image afterwards.
+ */
+void
+Ring::set_image_surface(Image* image,
+                        vte::cairo::Surface&& surface)
+{
+        m_image_fast_memory_used -= image->resource_size();
+        image->set_surface(std::move(surface));
+        m_image_fast_memory_used += image->resource_size();
+
+        image_gc();
 }
 
 #endif /* WITH_SIXEL */
@@ -33,7 +33,11 @@
 #include <map>
 #endif
 
+#include <list>
+#include <string_view>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 typedef struct _VteVisualPosition {
 	long row, col;
@@ -54,6 +58,17 @@ public:
         typedef glong column_t;
 
         static const row_t kDefaultMaxRows = VTE_SCROLLBACK_INIT;
+        static const row_t kMinCachedRows = 16;
+        static const row_t kLazyRewrapMinRows = 4096;
+        static const row_t kParallelRewrapMinRows = 16384;  /* per thread */
+        static const hyperlink_idx_t kHyperlinkGCMinCount = 256;
+
+        typedef struct _MemoryUsage {
+                size_t cells;       /* cell arrays of the rows in memory */
+                size_t streams;     /* frozen rows, compressed, in files or in memory; approximate */
+                size_t hyperlinks;  /* the hyperlink pool */
+                size_t images;      /* sixel images */
+        } MemoryUsage;
 
         Ring(row_t max_rows = kDefaultMaxRows,
              bool has_streams = false);
@@ -92,22 +107,50 @@ public:
         void resize(row_t max_rows = kDefaultMaxRows);
         void shrink(row_t max_len = kDefaultMaxRows);
         VteRowData* insert(row_t position, guint8 bidi_flags);
+        void insert_rows(row_t position,
+                         row_t count,
+                         guint8 bidi_flags);
         VteRowData* append(guint8 bidi_flags);
         void remove(row_t position);
+        void remove_rows(row_t position,
+                         row_t count);
+        void scroll_region(row_t start,
+                           row_t end,
+                           long amount,
+                           guint8 bidi_flags);
         void drop_scrollback(row_t position);
+        void set_streams_in_memory(bool in_memory);
+        inline bool streams_in_memory() const { return m_streams_in_memory; }
         void set_visible_rows(row_t rows);
+        void set_columns(column_t columns);
+        void set_cached_rows_max(row_t max_rows);
+        inline void set_rewrap_threads(unsigned threads) { m_rewrap_threads = threads; }
+        void set_max_bytes(size_t max_bytes);
+        inline size_t max_bytes() const { return m_max_bytes; }
+        void memory_usage(MemoryUsage* usage) const;
+        inline row_t cached_rows_max() const { return m_cached_rows_max ? m_cached_rows_max : MAX(2 * m_visible_rows, kMinCachedRows); }
+        inline guint64 cached_rows_hits() const { return m_cached_rows_hits; }
+        inline guint64 cached_rows_misses() const { return m_cached_rows_misses; }
+        inline CellSlab::Stats const& cell_slab_stats() const { return m_cell_slab.stats(); }
         void rewrap(column_t columns,
                     VteVisualPosition** markers);
+        inline bool rewrap_pending() const { return m_rewrap_columns != 0; }
+        inline row_t rewrap_pending_end() const { return m_prefix_end; }
+        bool rewrap_step(row_t max_rows);
+        void rewrap_finish();
         bool write_contents(GOutputStream* stream,
                             VteWriteFlags flags,
                             GCancellable* cancellable,
                             GError** error);
 
 #ifdef WITH_SIXEL
-        void append_image (cairo_surface_t *surface,
-                           gint pixelwidth, gint pixelheight,
-                           glong left, glong top,
-                           glong cell_width, glong cell_height);
+        int append_image (cairo_surface_t *surface,
+                          gint pixelwidth, gint pixelheight,
+                          glong left, glong top,
+                          glong cell_width, glong cell_height);
+        vte::image::Image* image_by_priority(int priority) const;
+        void set_image_surface(vte::image::Image* image,
+                               vte::cairo::Surface&& surface);
         std::map<gint, vte::image::Image *> *m_image_by_top_map;
         std::map<int, vte::image::Image *> *m_image_priority_map;
 #endif
@@ -120,7 +163,19 @@ private:
 
         inline GString* hyperlink_get(hyperlink_idx_t idx) const { return (GString*)g_ptr_array_index(m_hyperlinks, idx); }
 
-        inline VteRowData* get_writable_index(row_t position) const { return &m_array[position & m_mask]; }
+        inline uint32_t& get_writable_slot(row_t position) const { return m_slots[position & m_mask]; }
+        /* The writable row at @position, in either layout */
+        inline VteRowData* get_writable_row(row_t position) const { return &m_array[get_writable_slot(position)]; }
+        inline VteRowData* get_writable_index(row_t position) {
+                auto const row = get_writable_row(position);
+                if (G_UNLIKELY(row->attr.compact))
+                        _vte_row_data_expand(row, m_styles, m_cell_slab);
+                return row;
+        }
+        inline void clear_row(VteRowData* row) { _vte_row_data_clear(row); _vte_row_data_alloc(row, m_cell_slab); }
+        void compact_row(VteRowData* row);
+        void maybe_compact_rows(row_t count);
+        void style_gc();
 
         void hyperlink_gc();
         hyperlink_idx_t get_hyperlink_idx_no_update_current(char const* hyperlink);
@@ -152,6 +207,11 @@ private:
         inline bool read_row_record(RowRecord* record /* out */,
                                     row_t position)
         {
+                if (G_UNLIKELY(position < m_prefix_end))
+                        return _vte_stream_read(m_prefix_row_stream,
+                                                (position - m_prefix_base) * sizeof(*record),
+                                                (char*)record,
+                                                sizeof(*record));
                 return _vte_stream_read(m_row_stream,
                                         position * sizeof(*record),
                                         (char*)record,
@@ -166,6 +226,69 @@ private:
                                    sizeof(*record));
         }
 
+        /* Readers of the streams for rewrapping on a worker thread, see rewrap_range() */
+        typedef struct _RewrapReaders {
+                VteStreamReader* prefix_row;  /* nullptr if there's no prefix */
+                VteStreamReader* row;
+                VteStreamReader* attr;
+                VteStreamReader* text;
+        } RewrapReaders;
+
+        /* The progress of rewrapping a range of rows, see rewrap_paragraph() */
+        typedef struct _RewrapState {
+                RewrapReaders* readers;     /* nullptr on the main thread */
+                column_t columns;
+                row_t end;                  /* the row after the last one to rewrap */
+                gsize end_text_offset;      /* the text offset of that row */
+                row_t old_row_index;        /* the row after the one of old_record */
+                RowRecord old_record;
+                gsize paragraph_start_text_offset;
+                gsize attr_offset;
+                CellAttrChange attr_change;
+                row_t new_row_index;        /* the number of new rows so far */
+                std::vector<RowRecord> records;  /* new rows' records not yet appended to a stream */
+        } RewrapState;
+
+        bool rewrap_begin(RewrapState* state,
+                          column_t columns,
+                          row_t position,
+                          row_t end);
+        bool rewrap_paragraph(RewrapState* state,
+                              row_t new_row_base,
+                              int num_markers,
+                              CellTextOffset const* marker_text_offsets,
+                              VteVisualPosition* new_markers);
+        bool rewrap_range(column_t columns,
+                          row_t position,
+                          row_t end,
+                          VteStream* stream,
+                          row_t new_row_base,
+                          int num_markers,
+                          CellTextOffset const* marker_text_offsets,
+                          VteVisualPosition* new_markers,
+                          row_t* new_rows);
+        void rewrap_flush(RewrapState* state,
+                          VteStream* stream);
+        bool rewrap_read_row_record(RewrapState const* state,
+                                    RowRecord* record,
+                                    row_t position);
+        void rewrap_read_attr_change(RewrapState* state);
+        bool rewrap_read_text(RewrapState const* state,
+                              gsize offset,
+                              char* data,
+                              gsize len);
+        row_t rewrap_boundary(column_t columns,
+                              row_t position);
+        void rewrap_restart();
+        void rewrap_abort();
+        void rewrap_complete();
+        void drop_prefix();
+        gsize row_text_offset(row_t position);
+        row_t find_row_at_text_offset(gsize text_offset,
+                                      row_t lo,
+                                      row_t hi);
+        void truncate_row_records(row_t position);
+
         bool frozen_row_column_to_text_offset(row_t position,
                                               column_t column,
                                               CellTextOffset* offset);
@@ -180,13 +303,25 @@ private:
                        GError** error);
 
         void ensure_writable(row_t position);
-        void ensure_writable_room();
+        void ensure_writable_room(row_t count = 1);
+        void reverse_writable(row_t first,
+                              row_t last);
+        void rotate_writable(row_t first,
+                             row_t middle,
+                             row_t last);
 
         void freeze_one_row();
         void maybe_freeze_one_row();
         void thaw_one_row();
         void discard_one_row();
         void maybe_discard_one_row();
+        bool row_lost(row_t position);
+        void discard_lost_rows();
+        bool over_max_bytes() const;
+
+        void invalidate_cached_row(row_t position);
+        void invalidate_cached_rows();
+        void trim_cached_rows();
 
         void freeze_row(row_t position,
                         VteRowData const* row);
@@ -196,8 +331,11 @@ private:
                       int hyperlink_column,
                       char const** hyperlink);
         void reset_streams(row_t position);
+        VteStream* new_stream() const;
+        VteStream* migrate_stream(VteStream* stream) const;
 
 	row_t m_max;
+        size_t m_max_bytes{0};  /* 0 for no limit, see set_max_bytes() */
 	row_t m_start{0};
         row_t m_end{0};
 
@@ -205,6 +343,19 @@ private:
 	row_t m_writable{0};
         row_t m_mask{31};
 	VteRowData *m_array;
+        /* The slot of m_array holding each writable row, indexed like m_array
+         * was before; rows are inserted, removed and scrolled by moving these
+         * instead of the rows themselves. See rotate_writable().
+         */
+        uint32_t *m_slots;
+
+        /* The cell arrays of the writable and cached rows */
+        CellSlab m_cell_slab;
+
+        /* Writable rows above the screen are kept in the compact layout,
+         * with their attributes in m_styles, until they are accessed again.
+         */
+        StyleTable m_styles;
 
         /* Storage:
          *
@@ -221,18 +372,49 @@ private:
          *  - 2 bytes repeating attr.hyperlink_length so that we can walk backwards.
          */
 	bool m_has_streams;
+        bool m_streams_in_memory;  /* rather than in temporary files */
 	VteStream *m_attr_stream, *m_text_stream, *m_row_stream;
 	size_t m_last_attr_text_start_offset{0};
 	VteCellAttr m_last_attr;
 	GString *m_utf8_buffer;
 
+        /* Lazy rewrapping: rewrap() leaves the rows before m_prefix_end with
+         * their old wrapping, and their records in m_prefix_row_stream at
+         * (position - m_prefix_base). While m_rewrap_columns isn't 0,
+         * rewrap_step() rewraps them to m_rewrap_columns columns into
+         * m_rewrap_row_stream; reading any of them with index() first
+         * rewraps the rest of them with rewrap_finish(). m_prefix_end is 0
+         * if there's no such row.
+         */
+        VteStream* m_prefix_row_stream{nullptr};
+        row_t m_prefix_base{0};
+        row_t m_prefix_end{0};
+        column_t m_rewrap_columns{0};
+        unsigned m_rewrap_threads{0};  /* 0 for one per processor, see rewrap_range() */
+        RewrapState m_rewrap_state;
+        VteStream* m_rewrap_row_stream{nullptr};
+
+        /* Scratch row for looking up hyperlinks in the streams */
 	VteRowData m_cached_row;
-	row_t m_cached_row_num{(row_t)-1};
+
+        /* LRU cache of rows thawed by index(), most recently used first.
+         * Unused entries have position (row_t)-1 and are kept at the back.
+         */
+        typedef struct _CachedRow {
+                row_t position;
+                VteRowData row;
+        } CachedRow;
+        std::list<CachedRow> m_cached_rows;
+        std::unordered_map<row_t, std::list<CachedRow>::iterator> m_cached_rows_map;
+        row_t m_cached_rows_max{0};  /* 0 to size by the visible rows */
+        guint64 m_cached_rows_hits{0};
+        guint64 m_cached_rows_misses{0};
 
         row_t m_visible_rows{0};  /* to keep at least a screenful of lines in memory, bug 646098 comment 12 */
 
         GPtrArray *m_hyperlinks;  /* The hyperlink pool. Contains GString* items.
                                    [0] points to an empty GString, [1] to [VTE_HYPERLINK_COUNT_MAX] contain the id;uri pairs. */
+        size_t m_hyperlinks_size{0};  /* The memory allocated for the pool's GStrings */
         char m_hyperlink_buf[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];  /* One more hyperlink buffer to get the value if it's not placed in the pool. */
         hyperlink_idx_t m_hyperlink_highest_used_idx{0};  /* 0 if no hyperlinks at all in the pool. */
         hyperlink_idx_t m_hyperlink_current_idx{0};  /* The hyperlink idx used for newly created cells.
@@ -240,16 +422,18 @@ private:
         hyperlink_idx_t m_hyperlink_hover_idx{0};  /* The hyperlink idx of the hovered cell.
                                                  An idx is allocated on hover even if the cell is scrolled out to the streams. */
         row_t m_hyperlink_maybe_gc_counter{0};  /* Do a GC when it reaches 65536. */
+        std::unordered_map<std::string_view, hyperlink_idx_t> m_hyperlink_map;  /* id;uri of the nonempty GStrings of the pool -> idx */
+        std::vector<hyperlink_idx_t> m_hyperlink_free_idxs;  /* idxs of the empty GStrings of the pool, except [0] */
+        size_t m_hyperlink_gc_threshold{kHyperlinkGCMinCount};  /* Do a GC before allocating an idx when this many are in use. */
 
 #ifdef WITH_SIXEL
         /* Image bookkeeping */
 
         void image_gc();
         void image_gc_region();
+        void image_gc_scrolled_out();
         void unlink_image_from_top_map(vte::image::Image *image);
         void rebuild_image_top_map();
-        bool rewrap_images_in_range(std::map<int,vte::image::Image*>::iterator &it,
-                                    size_t text_start_ofs, size_t text_end_ofs, row_t new_row_index);
 
         int m_next_image_priority;
         unsigned int m_image_fast_memory_used;
@@ -283,7 +467,9 @@ static inline VteRowData *_vte_ring_append (VteRing *ring, guint8 bidi_flags) {
 static inline void _vte_ring_remove (VteRing *ring, gulong position) { ring->remove(position); }
 static inline void _vte_ring_drop_scrollback (VteRing *ring, gulong position) { ring->drop_scrollback(position); }
 static inline void _vte_ring_set_visible_rows (VteRing *ring, gulong rows) { ring->set_visible_rows(rows); }
+static inline void _vte_ring_set_columns (VteRing *ring, glong columns) { ring->set_columns(columns); }
 static inline void _vte_ring_rewrap (VteRing *ring, glong columns, VteVisualPosition **markers) { ring->rewrap(columns, markers); }
+static inline gboolean _vte_ring_rewrap_pending (VteRing *ring) { return ring->rewrap_pending(); }
 static inline gboolean _vte_ring_write_contents (VteRing *ring,
                                                  GOutputStream *stream,
                                                  VteWriteFlags flags,
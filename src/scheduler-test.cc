@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <vector>
+
+#include <glib.h>
+
+#include "scheduler.hh"
+
+using namespace vte::terminal;
+
+struct Item {
+        int id;
+        Scheduler<Item>::Entry entry{this};
+
+        explicit Item(int i) : id{i} { }
+};
+
+static std::vector<int>
+scheduler_ids(Scheduler<Item>& s)
+{
+        auto ids = std::vector<int>{};
+        s.for_each([&](Item* item) { ids.push_back(item->id); });
+        return ids;
+}
+
+static void
+test_scheduler_add_remove(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1}, c{2};
+
+        g_assert_true(s.empty());
+
+        s.add(a.entry, 1000);
+        s.add(b.entry, 1000);
+        s.add(b.entry, 1000); /* no-op */
+        s.add(c.entry, 1000);
+        g_assert_cmpuint(s.size(), ==, 3);
+        g_assert_cmpuint(s.total_weight(), ==, 3);
+        g_assert_true(b.entry.active());
+
+        s.remove(b.entry);
+        s.remove(b.entry); /* no-op */
+        g_assert_false(b.entry.active());
+        g_assert_cmpuint(s.size(), ==, 2);
+        g_assert_cmpuint(s.total_weight(), ==, 2);
+
+        s.remove(a.entry);
+        s.remove(c.entry);
+        g_assert_true(s.empty());
+        g_assert_cmpuint(s.total_weight(), ==, 0);
+}
+
+static void
+test_scheduler_rotate(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1}, c{2};
+
+        s.add(a.entry, 1000);
+        s.add(b.entry, 1000);
+        s.add(c.entry, 1000);
+
+        g_assert_true((scheduler_ids(s) == std::vector<int>{0, 1, 2}));
+        g_assert_true((scheduler_ids(s) == std::vector<int>{1, 2, 0}));
+        g_assert_true((scheduler_ids(s) == std::vector<int>{2, 0, 1}));
+}
+
+static void
+test_scheduler_remove_in_iteration(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1}, c{2}, d{3};
+
+        s.add(a.entry, 1000);
+        s.add(b.entry, 1000);
+        s.add(c.entry, 1000);
+        s.add(d.entry, 1000);
+
+        /* Remove the current and the next entry while iterating */
+        auto ids = std::vector<int>{};
+        s.for_each([&](Item* item) {
+                ids.push_back(item->id);
+                if (item->id == 1) {
+                        s.remove(b.entry);
+                        s.remove(c.entry);
+                }
+        });
+        g_assert_true((ids == std::vector<int>{0, 1, 3}));
+        g_assert_cmpuint(s.size(), ==, 2);
+
+        /* Remove everything */
+        s.for_each([&](Item* item) { s.remove(item->entry); });
+        g_assert_true(s.empty());
+        g_assert_true(scheduler_ids(s).empty());
+}
+
+/* An exception from the callback mustn't leave the scheduler stuck mid-iteration */
+static void
+test_scheduler_throw_in_iteration(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1};
+
+        s.add(a.entry, 1000);
+        s.add(b.entry, 1000);
+
+        try {
+                s.for_each([&](Item* item) { throw item->id; });
+                g_assert_not_reached();
+        } catch (int id) {
+                g_assert_cmpint(id, ==, 0);
+        }
+
+        g_assert_true((scheduler_ids(s) == std::vector<int>{0, 1}));
+}
+
+static void
+test_scheduler_weights(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1}, c{2};
+
+        s.set_weight(a.entry, 4);
+        s.add(a.entry, 60000);
+        g_assert_cmpuint(s.allowance(a.entry, 60000), ==, 60000);
+
+        /* Inactive entries are counted as if they were active */
+        s.set_weight(b.entry, 2);
+        g_assert_cmpuint(s.allowance(b.entry, 60000), ==, 20000);
+
+        s.add(b.entry, 60000);
+        s.add(c.entry, 60000);
+        g_assert_cmpuint(s.total_weight(), ==, 7);
+        g_assert_cmpuint(s.quantum(a.entry, 70000), ==, 40000);
+        g_assert_cmpuint(s.quantum(b.entry, 70000), ==, 20000);
+        g_assert_cmpuint(s.quantum(c.entry, 70000), ==, 10000);
+
+        /* Re-weighting an active entry updates the total */
+        s.set_weight(a.entry, 1);
+        g_assert_cmpuint(s.total_weight(), ==, 4);
+
+        /* The quantum has a lower bound */
+        g_assert_cmpuint(s.quantum(c.entry, 16), ==, s.k_min_quantum);
+}
+
+static void
+test_scheduler_deficit(void)
+{
+        Scheduler<Item> s;
+        Item a{0}, b{1};
+
+        s.add(a.entry, 20000);
+        s.add(b.entry, 20000);
+
+        /* @a was added alone and got the whole budget */
+        g_assert_cmpint(a.entry.stats().deficit, ==, 20000);
+        g_assert_cmpint(b.entry.stats().deficit, ==, 10000);
+
+        /* Overshooting the allowance is carried over as debt */
+        s.charge(a.entry, 20000, 22000, 10);
+        g_assert_cmpint(a.entry.stats().deficit, ==, 10000 - 2000);
+        g_assert_cmpuint(s.allowance(a.entry, 20000), ==, 8000);
+
+        /* An unused allowance is not carried over */
+        s.charge(b.entry, 20000, 10, 10);
+        g_assert_cmpint(b.entry.stats().deficit, ==, 10000);
+
+        /* Debt is capped at one quantum */
+        s.charge(a.entry, 20000, 40000, 10);
+        g_assert_cmpint(a.entry.stats().deficit, ==, 0);
+        g_assert_cmpuint(s.allowance(a.entry, 20000), ==, 0);
+
+        /* Replenishing gives a new quantum, but isn't a round */
+        s.replenish(a.entry, 20000);
+        g_assert_cmpint(a.entry.stats().deficit, ==, 10000);
+
+        g_assert_cmpuint(a.entry.stats().bytes_processed, ==, 62000);
+        g_assert_cmpint(a.entry.stats().time_spent, ==, 20);
+        g_assert_cmpuint(a.entry.stats().rounds, ==, 2);
+        g_assert_cmpuint(a.entry.stats().budget, ==, 10000);
+
+        /* Removing resets the deficit */
+        s.remove(a.entry);
+        g_assert_cmpint(a.entry.stats().deficit, ==, 0);
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+        g_test_init(&argc, &argv, nullptr);
+
+        g_test_add_func("/vte/scheduler/add-remove", test_scheduler_add_remove);
+        g_test_add_func("/vte/scheduler/rotate", test_scheduler_rotate);
+        g_test_add_func("/vte/scheduler/remove-in-iteration", test_scheduler_remove_in_iteration);
+        g_test_add_func("/vte/scheduler/throw-in-iteration", test_scheduler_throw_in_iteration);
+        g_test_add_func("/vte/scheduler/weights", test_scheduler_weights);
+        g_test_add_func("/vte/scheduler/deficit", test_scheduler_deficit);
+
+        return g_test_run();
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace vte::terminal {
+
+struct SchedulerStats {
+        uint64_t bytes_processed{0}; /* total bytes processed */
+        int64_t time_spent{0};       /* total time spent processing, in µs */
+        uint64_t rounds{0};          /* number of times processed */
+        size_t budget{0};            /* the latest per-round quantum */
+        long deficit{0};             /* bytes allowed until the next round */
+};
+
+/*
+ * Scheduler:
+ *
+ * Keeps the list of terminals that have input to process or updates to
+ * paint, and distributes the per-round input budget between them using
+ * deficit round robin.
+ *
+ * Each entry has a weight; in each round, an entry's quantum is its share
+ * (by weight) of the budget. An entry may read up to its deficit before it
+ * is processed next; reading more than that (since reads are done in whole
+ * chunks) is carried over as debt into the next round, up to one quantum,
+ * while an unused allowance is not, since it means the entry ran out of input.
+ *
+ * Adding, removing, re-weighting and counting entries are O(1).
+ */
+template<class T>
+class Scheduler {
+public:
+        static constexpr size_t const k_min_quantum = 256;
+
+        class Entry {
+                friend class Scheduler;
+
+        public:
+                explicit constexpr Entry(T* owner) noexcept
+                        : m_owner{owner}
+                {
+                }
+
+                Entry(Entry const&) = delete;
+                Entry(Entry&&) = delete;
+                Entry& operator=(Entry const&) = delete;
+                Entry& operator=(Entry&&) = delete;
+
+                inline constexpr bool active() const noexcept { return m_active; }
+                inline constexpr unsigned weight() const noexcept { return m_weight; }
+                inline constexpr auto const& stats() const noexcept { return m_stats; }
+
+        private:
+                T* m_owner;
+                Entry* m_prev{nullptr};
+                Entry* m_next{nullptr};
+                bool m_active{false};
+                unsigned m_weight{1};
+                SchedulerStats m_stats{};
+        };
+
+        constexpr Scheduler() noexcept = default;
+
+        Scheduler(Scheduler const&) = delete;
+        Scheduler(Scheduler&&) = delete;
+        Scheduler& operator=(Scheduler const&) = delete;
+        Scheduler& operator=(Scheduler&&) = delete;
+
+        inline constexpr size_t size() const noexcept { return m_size; }
+        inline constexpr bool empty() const noexcept { return m_size == 0; }
+        inline constexpr size_t total_weight() const noexcept { return m_total_weight; }
+
+        /*
+         * Scheduler::quantum:
+         * @entry: an #Entry
+         * @budget: the per-round budget, in bytes
+         *
+         * Returns: @entry's share of @budget, counting @entry as active
+         */
+        size_t quantum(Entry const& entry,
+                       size_t budget) const noexcept
+        {
+                auto total = m_total_weight;
+                if (!entry.m_active)
+                        total += entry.m_weight;
+
+                return std::max(size_t(uint64_t(budget) * entry.m_weight / total),
+                                k_min_quantum);
+        }
+
+        /*
+         * Scheduler::allowance:
+         * @entry: an #Entry
+         * @budget: the per-round budget, in bytes
+         *
+         * Returns: the number of bytes @entry may read before it is processed next
+         */
+        size_t allowance(Entry const& entry,
+                         size_t budget) const noexcept
+        {
+                if (!entry.m_active)
+                        return quantum(entry, budget);
+
+                return entry.m_stats.deficit > 0 ? size_t(entry.m_stats.deficit) : 0;
+        }
+
+        void add(Entry& entry,
+                 size_t budget) noexcept
+        {
+                if (entry.m_active)
+                        return;
+
+                entry.m_stats.budget = quantum(entry, budget);
+                entry.m_stats.deficit = long(entry.m_stats.budget);
+
+                entry.m_active = true;
+                entry.m_next = nullptr;
+                entry.m_prev = m_tail;
+                if (m_tail)
+                        m_tail->m_next = &entry;
+                else
+                        m_head = &entry;
+                m_tail = &entry;
+
+                ++m_size;
+                m_total_weight += entry.m_weight;
+        }
+
+        void remove(Entry& entry) noexcept
+        {
+                if (!entry.m_active)
+                        return;
+
+                /* Keep any iteration in for_each() valid */
+                if (m_iter_next == &entry)
+                        m_iter_next = entry.m_next;
+
+                unlink(entry);
+                entry.m_active = false;
+                entry.m_stats.deficit = 0;
+
+                --m_size;
+                m_total_weight -= entry.m_weight;
+        }
+
+        void set_weight(Entry& entry,
+                        unsigned weight) noexcept
+        {
+                assert(weight > 0);
+
+                if (entry.m_active)
+                        m_total_weight = m_total_weight - entry.m_weight + weight;
+                entry.m_weight = weight;
+        }
+
+        /*
+         * Scheduler::charge:
+         * @entry: an #Entry
+         * @budget: the per-round budget, in bytes
+         * @bytes: the number of bytes processed in this round
+         * @time: the time spent processing them, in µs
+         *
+         * Accounts for a round of processing, and gives @entry its next quantum.
+         */
+        void charge(Entry& entry,
+                    size_t budget,
+                    size_t bytes,
+                    int64_t time) noexcept
+        {
+                auto& stats = entry.m_stats;
+                stats.bytes_processed += bytes;
+                stats.time_spent += time;
+                ++stats.rounds;
+
+                if (!entry.m_active)
+                        return;
+
+                stats.deficit -= long(bytes);
+                replenish(entry, budget);
+        }
+
+        /*
+         * Scheduler::replenish:
+         * @entry: an #Entry
+         * @budget: the per-round budget, in bytes
+         *
+         * Gives @entry its next quantum without accounting for a round of
+         * processing, e.g. when it has input that it held back.
+         */
+        void replenish(Entry& entry,
+                       size_t budget) noexcept
+        {
+                if (!entry.m_active)
+                        return;
+
+                /* Carry over at most one quantum of debt, so that an entry
+                 * that overshot by a lot isn't starved for many rounds.
+                 */
+                auto& stats = entry.m_stats;
+                stats.budget = quantum(entry, budget);
+                auto const q = long(stats.budget);
+                stats.deficit = std::clamp(stats.deficit, -q, 0L) + q;
+        }
+
+        /*
+         * Scheduler::for_each:
+         * @func: a function taking a T*
+         *
+         * Calls @func for each active entry's owner. @func may remove any
+         * entry, including the one it is called for. Afterwards, the first
+         * entry is moved to the back, so the next round starts with another
+         * entry.
+         */
+        template<class F>
+        void for_each(F&& func)
+        {
+                assert(m_iter_next == nullptr);
+
+                /* The loop ends with m_iter_next reset, but so must an exception from @func */
+                struct IterGuard {
+                        Entry*& m_iter;
+                        ~IterGuard() { m_iter = nullptr; }
+                } guard{m_iter_next};
+
+                auto const first = m_head;
+                for (auto entry = m_head; entry != nullptr; entry = m_iter_next) {
+                        m_iter_next = entry->m_next;
+                        func(entry->m_owner);
+                }
+
+                if (first && first == m_head && m_head != m_tail) {
+                        unlink(*first);
+                        first->m_next = nullptr;
+                        first->m_prev = m_tail;
+                        m_tail->m_next = first;
+                        m_tail = first;
+                }
+        }
+
+private:
+        Entry* m_head{nullptr};
+        Entry* m_tail{nullptr};
+        Entry* m_iter_next{nullptr};
+        size_t m_size{0};
+        size_t m_total_weight{0};
+
+        void unlink(Entry& entry) noexcept
+        {
+                if (entry.m_prev)
+                        entry.m_prev->m_next = entry.m_next;
+                else
+                        m_head = entry.m_next;
+                if (entry.m_next)
+                        entry.m_next->m_prev = entry.m_prev;
+                else
+                        m_tail = entry.m_prev;
+                entry.m_prev = entry.m_next = nullptr;
+        }
+};
+
+} // namespace vte::terminal
@@ -29,6 +29,8 @@
 
 #include <glib.h>
 
+#include "sixelparser.hh"
+
 /* The image data is stored as a series of palette indexes, with 16 bits
  * per pixel and TRANSPARENT_SLOT indicating transparency. This allows for
  * palette sizes up to 65535 colors.
@@ -51,6 +53,10 @@
 #define TEST_IMAGE_SIZE_MIN 16
 #define TEST_IMAGE_SIZE_MAX 512
 
+#define BENCH_IMAGE_WIDTH_DEFAULT 1920
+#define BENCH_IMAGE_HEIGHT_DEFAULT 1080
+#define BENCH_N_FRAMES_DEFAULT 50
+
 /* Big palettes make our toy printer extremely slow; use with caution */
 #define TEST_PALETTE_SIZE_MIN 1
 #define TEST_PALETTE_SIZE_MAX 16
@@ -249,6 +255,22 @@ image_draw_shape (Image *image)
         }
 }
 
+/* Dense diagonal stripes, so that most sixels have several colors and
+ * runs of varying lengths. */
+static void
+image_draw_stripes (Image *image)
+{
+        int y, x;
+
+        for (y = 0; y < image->height; y++) {
+                for (x = 0; x < image->width; x++) {
+                        int pen = ((x + y) / 7) % image->n_colors;
+
+                        image_set_pixel (image, x, y, pen_to_slot (pen));
+                }
+        }
+}
+
 static void
 image_generate (Image *image, uint32_t first_color, uint32_t last_color)
 {
@@ -373,7 +395,8 @@ image_print_sixels (const Image *image, GString *gstr)
 typedef enum
 {
         TEST_MODE_UNSET,
-        TEST_MODE_FUZZ
+        TEST_MODE_FUZZ,
+        TEST_MODE_BENCH
 }
 TestMode;
 
@@ -387,6 +410,8 @@ typedef struct
         int seed;
         int n_scroll;
 
+        int bench_width, bench_height;
+
         int term_width_cells, term_height_cells;
         int term_width_pixels, term_height_pixels;
 
@@ -565,6 +590,71 @@ print_loop (const Options *options)
         }
 }
 
+/* --- Decoder benchmark --- */
+
+static void
+bench_loop (const Options *options)
+{
+        int n_frames = options->n_frames > 0 ? options->n_frames : BENCH_N_FRAMES_DEFAULT;
+        Image image;
+        GString *gstr;
+        const char *data;
+        uint32_t *u32;
+        unsigned char *pixels;
+        gsize n_chars;
+        gint64 start_time, elapsed;
+        double secs;
+        int i;
+
+        image_init (&image, options->bench_width, options->bench_height, TEST_PALETTE_SIZE_MAX);
+        image_generate_palette (&image, 0x00400000, 0x00a0ffff);
+        image_draw_stripes (&image);
+
+        gstr = g_string_new ("");
+        image_print_sixels (&image, gstr);
+
+        /* The decoder is fed the string after the DCS introducer and final,
+         * the same as the terminal does. */
+        data = strchr (gstr->str, 'q') + 1;
+        n_chars = gstr->str + gstr->len - data;
+        u32 = (uint32_t *) g_malloc (n_chars * sizeof (uint32_t));
+        for (gsize n = 0; n < n_chars; n++)
+                u32 [n] = (unsigned char) data [n];
+
+        pixels = (unsigned char *) g_malloc ((gsize) image.width * image.height * 4);
+
+        start_time = g_get_monotonic_time ();
+
+        for (i = 0; i < n_frames; i++) {
+                sixel_state_t state;
+
+                if (sixel_parser_init (&state, 0xffffff, 0x000000, 1) < 0
+                    || sixel_parser_feed (&state, u32, n_chars) < 0
+                    || sixel_parser_finalize (&state, pixels) < 0) {
+                        fprintf (stderr, "Failed to decode frame %d. Aborting.\n", i);
+                        sixel_parser_deinit (&state);
+                        break;
+                }
+
+                sixel_parser_deinit (&state);
+        }
+
+        elapsed = g_get_monotonic_time () - start_time;
+        secs = MAX (elapsed, 1) / 1000000.0;
+
+        printf ("Decoded %d frames of %dx%d pixels (%" G_GSIZE_FORMAT " bytes each) in %.3f s\n"
+                "%.1f frames/s, %.1f MiB/s, %.1f Mpixels/s\n",
+                i, image.width, image.height, n_chars, secs,
+                i / secs,
+                i * (double) n_chars / secs / (1024.0 * 1024.0),
+                i * (double) image.width * image.height / secs / 1000000.0);
+
+        g_free (pixels);
+        g_free (u32);
+        g_string_free (gstr, TRUE);
+        image_deinit (&image);
+}
+
 /* --- Argument parsing and init --- */
 
 static bool
@@ -636,14 +726,17 @@ parse_options (Options *options, int argc, char **argv)
         if (argc < 2) {
                 fprintf (stderr, "Usage: %s <mode> [options]\n\n"
                          "Modes:\n"
-                         "    fuzz        Perform fuzzing test.\n\n"
+                         "    fuzz        Perform fuzzing test.\n"
+                         "    bench       Measure decoder throughput; does not need a terminal.\n\n"
                          "Options:\n"
                          "    -d <float>  Delay between frames, in seconds (default: 0.0).\n"
                          "    -e <int>    Maximum number of random errors per frame (default: 0).\n"
                          "    -n <int>    Number of frames to output (default: infinite).\n"
                          "    -r <int>    Random seed to use (default: current time).\n"
-                         "    -s <int>    Number of lines to scroll for each frame (default: 0).\n\n",
-                         argv [0]);
+                         "    -s <int>    Number of lines to scroll for each frame (default: 0).\n"
+                         "    -x <int>    Benchmark image width, in pixels (default: %d).\n"
+                         "    -y <int>    Benchmark image height, in pixels (default: %d).\n\n",
+                         argv [0], BENCH_IMAGE_WIDTH_DEFAULT, BENCH_IMAGE_HEIGHT_DEFAULT);
                 goto out;
         }
 
@@ -657,6 +750,12 @@ parse_options (Options *options, int argc, char **argv)
                         continue;
                 }
 
+                if (!strcmp (arg, "bench")) {
+                        options->mode = TEST_MODE_BENCH;
+                        i++;
+                        continue;
+                }
+
                 if (i + 1 >= argc)
                         break;
 
@@ -682,6 +781,14 @@ parse_options (Options *options, int argc, char **argv)
                         if (!parse_int (arg, val, &options->n_scroll))
                                 goto out;
                         i += 2;
+                } else if (!strcmp (arg, "-x")) {
+                        if (!parse_int (arg, val, &options->bench_width))
+                                goto out;
+                        i += 2;
+                } else if (!strcmp (arg, "-y")) {
+                        if (!parse_int (arg, val, &options->bench_height))
+                                goto out;
+                        i += 2;
                 } else {
                         fprintf (stderr, "Unrecognized option '%s'. Aborting.\n", arg);
                         goto out;
@@ -698,6 +805,12 @@ parse_options (Options *options, int argc, char **argv)
                 goto out;
         }
 
+        if (options->bench_width < 1 || options->bench_width > WIDTH_MAX
+            || options->bench_height < 1 || options->bench_height > HEIGHT_MAX) {
+                fprintf (stderr, "Benchmark image size out of range. Aborting.\n");
+                goto out;
+        }
+
         result = TRUE;
 
 out:
@@ -751,10 +864,17 @@ main (int argc, char *argv [])
         static Options options = { };
 
         options.seed = (int) time (NULL);
+        options.bench_width = BENCH_IMAGE_WIDTH_DEFAULT;
+        options.bench_height = BENCH_IMAGE_HEIGHT_DEFAULT;
 
         if (!parse_options (&options, argc, argv))
                 return 1;
 
+        if (options.mode == TEST_MODE_BENCH) {
+                bench_loop (&options);
+                return 0;
+        }
+
         if (!query_terminal (&options))
                 return 2;
 
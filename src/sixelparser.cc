@@ -24,9 +24,17 @@
 #include <string.h>  /* memcpy */
 #include <glib.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "sixelparser.hh"
 
 #define PACK_RGB(r, g, b) ((r) + ((g) << 8) +  ((b) << 16))
+/* Swaps a packed RGB value's red and blue channels, giving Cairo's native-endian xRGB */
+#define PACK_BGR(c) ((((c) >> 16) & 0xff) | ((c) & 0xff00) | (((c) & 0xff) << 16))
 #define SCALE_VALUE(n,a,m) (((n) * (a) + ((m) / 2)) / (m))
 #define SCALE_AND_PACK_RGB(r,g,b) \
         PACK_RGB(SCALE_VALUE(r, 255, 100), SCALE_VALUE(g, 255, 100), SCALE_VALUE(b, 255, 100))
@@ -272,7 +280,7 @@ image_buffer_ensure_min_size(sixel_image_t *image, int req_width, int req_height
         return status;
 }
 
-static void
+void
 sixel_image_deinit(sixel_image_t *image)
 {
         g_free(image->data);
@@ -323,57 +331,60 @@ parser_collect_param_or_zero(sixel_state_t *st)
         return 0;
 }
 
+/* Fills @n pixels at @dst with @pen */
+static inline void
+fill_pen(sixel_color_no_t *dst, sixel_color_no_t pen, int n)
+{
+        int x = 0;
+
+#if defined(__AVX2__)
+        __m256i const v = _mm256_set1_epi16(pen);
+        for (; x + 16 <= n; x += 16)
+                _mm256_storeu_si256((__m256i *) (dst + x), v);
+#endif
+#if defined(__SSE2__)
+        __m128i const v8 = _mm_set1_epi16(pen);
+        for (; x + 8 <= n; x += 8)
+                _mm_storeu_si128((__m128i *) (dst + x), v8);
+#elif defined(__ARM_NEON)
+        uint16x8_t const v8 = vdupq_n_u16(pen);
+        for (; x + 8 <= n; x += 8)
+                vst1q_u16(dst + x, v8);
+#endif
+
+        for (; x < n; x++)
+                dst[x] = pen;
+}
+
 static void
 draw_sixels(sixel_state_t *st, uint32_t bits)
 {
         sixel_image_t *image = &st->image;
+        sixel_color_no_t *dst;
+        sixel_color_no_t pen;
+        int n;
 
         if (bits == 0)
                 return;
 
-        if (st->repeat_count <= 1) {
-                uint32_t sixel_vertical_mask = 0x01;
-
-                for (int i = 0; i < 6; i++) {
-                        if ((bits & sixel_vertical_mask) != 0) {
-                                int pos = image->width * (st->pos_y + i) + st->pos_x;
-                                image->data[pos] = st->color_index;
-                                if (st->max_x < st->pos_x)
-                                        st->max_x = st->pos_x;
-                                if (st->max_y < (st->pos_y + i))
-                                        st->max_y = st->pos_y + i;
-                        }
-                        sixel_vertical_mask <<= 1;
-                }
-        } else {
-                uint32_t sixel_vertical_mask = 0x01;
-
-                /* st->repeat_count > 1 */
-                for (int i = 0; i < 6; i++) {
-                        if ((bits & sixel_vertical_mask) != 0) {
-                                uint32_t c = sixel_vertical_mask << 1;
-                                int n;
-
-                                for (n = 1; (i + n) < 6; n++) {
-                                        if ((bits & c) == 0)
-                                                break;
-                                        c <<= 1;
-                                }
-                                for (int y = st->pos_y + i; y < st->pos_y + i + n; ++y) {
-                                        for (int x = st->pos_x; x < st->pos_x + st->repeat_count; ++x)
-                                                image->data[image->width * y + x] = st->color_index;
-                                }
-                                if (st->max_x < (st->pos_x + st->repeat_count - 1))
-                                        st->max_x = st->pos_x + st->repeat_count - 1;
-                                if (st->max_y < (st->pos_y + i + n - 1))
-                                        st->max_y = st->pos_y + i + n - 1;
-                                i += (n - 1);
-                                sixel_vertical_mask <<= (n - 1);
-                        }
+        /* The caller has clamped the repeat count to the image width */
+        n = st->repeat_count > 1 ? st->repeat_count : 1;
+        pen = st->color_index;
+        dst = image->data + image->width * st->pos_y + st->pos_x;
 
-                        sixel_vertical_mask <<= 1;
-                }
+        /* Visit only the set bits, lowest (topmost pixel) first */
+        if (n == 1) {
+                for (uint32_t b = bits; b != 0; b &= b - 1)
+                        dst[image->width * __builtin_ctz(b)] = pen;
+        } else {
+                for (uint32_t b = bits; b != 0; b &= b - 1)
+                        fill_pen(dst + image->width * __builtin_ctz(b), pen, n);
         }
+
+        if (st->max_x < st->pos_x + n - 1)
+                st->max_x = st->pos_x + n - 1;
+        if (st->max_y < st->pos_y + 31 - __builtin_clz(bits))
+                st->max_y = st->pos_y + 31 - __builtin_clz(bits);
 }
 
 static int
@@ -624,16 +635,12 @@ sixel_parser_deinit(sixel_state_t *st)
 }
 
 int
-sixel_parser_finalize(sixel_state_t *st, unsigned char *pixels)
+sixel_parser_finish(sixel_state_t *st)
 {
         int status = -1;
         int sx;
         int sy;
         sixel_image_t *image = &st->image;
-        int x, y;
-        sixel_color_no_t *src;
-        unsigned char *dst;
-        int color;
 
         if (++st->max_x < st->attributed_ph)
                 st->max_x = st->attributed_ph;
@@ -656,39 +663,95 @@ sixel_parser_finalize(sixel_state_t *st, unsigned char *pixels)
                         goto out;
         }
 
-        src = st->image.data;
-        dst = pixels;
-        for (y = 0; y < st->image.height; ++y) {
-                for (x = 0; x < st->image.width; ++x) {
-                        sixel_color_no_t pen = *src++;
-
-                        /* FIXME-hpj: We may want to make this branch-free, among other
-                         * performance improvements. */
-
-                        if (pen == 0) {
-                                /* Cairo wants premultiplied alpha: Transparent
-                                 * areas must be all zeroes. */
-
-                                *dst++ = 0;
-                                *dst++ = 0;
-                                *dst++ = 0;
-                                *dst++ = 0;
-                        } else {
-                                color = st->image.palette[pen];
-                                *dst++ = color >> 16 & 0xff;   /* b */
-                                *dst++ = color >> 8 & 0xff;    /* g */
-                                *dst++ = color >> 0 & 0xff;    /* r */
-                                *dst++ = 0xff;                 /* a */
-                        }
-                }
-        }
-
         status = 0;
 
 out:
         return status;
 }
 
+int
+sixel_image_to_argb32(const sixel_image_t *image, unsigned char *pixels)
+{
+        uint32_t argb[DECSIXEL_PALETTE_MAX];
+        const sixel_color_no_t *src;
+        uint32_t *dst;
+        int color;
+        int i, n;
+
+        if (!image->data)
+                return -1;
+
+        /* Resolve the palette to premultiplied ARGB32 once; pen 0 is
+         * transparent, and Cairo wants transparent areas all zeroes. */
+        argb[0] = 0;
+        for (color = 1; color < DECSIXEL_PALETTE_MAX; color++)
+                argb[color] = 0xff000000u | (uint32_t) PACK_BGR(image->palette[color]);
+
+        src = image->data;
+        dst = (uint32_t *) pixels;
+        n = image->width * image->height;
+        i = 0;
+
+#if defined(__AVX2__)
+        for (; i + 8 <= n; i += 8) {
+                __m256i const pens = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *) (src + i)));
+                _mm256_storeu_si256((__m256i *) (dst + i),
+                                    _mm256_i32gather_epi32((int const *) argb, pens, 4));
+        }
+#elif defined(__SSE2__)
+        /* There is no gather before AVX2, but sixel images are mostly runs
+         * of one pen; store those with a single lookup per 8 pixels. */
+        for (; i + 8 <= n; i += 8) {
+                __m128i const pens = _mm_loadu_si128((__m128i const *) (src + i));
+                __m128i const run = _mm_cmpeq_epi16(pens, _mm_set1_epi16(src[i]));
+                __m128i lo, hi;
+
+                if (_mm_movemask_epi8(run) == 0xffff) {
+                        lo = hi = _mm_set1_epi32(argb[src[i]]);
+                } else {
+                        lo = _mm_setr_epi32(argb[src[i]], argb[src[i + 1]],
+                                            argb[src[i + 2]], argb[src[i + 3]]);
+                        hi = _mm_setr_epi32(argb[src[i + 4]], argb[src[i + 5]],
+                                            argb[src[i + 6]], argb[src[i + 7]]);
+                }
+                _mm_storeu_si128((__m128i *) (dst + i), lo);
+                _mm_storeu_si128((__m128i *) (dst + i + 4), hi);
+        }
+#elif defined(__ARM_NEON)
+        /* Likewise: NEON has no gather, so only runs of one pen are vectorised */
+        for (; i + 8 <= n; i += 8) {
+                uint64x2_t const run = vreinterpretq_u64_u16(vceqq_u16(vld1q_u16(src + i),
+                                                                       vdupq_n_u16(src[i])));
+
+                if ((vgetq_lane_u64(run, 0) & vgetq_lane_u64(run, 1)) == ~UINT64_C(0)) {
+                        uint32x4_t const v = vdupq_n_u32(argb[src[i]]);
+                        vst1q_u32(dst + i, v);
+                        vst1q_u32(dst + i + 4, v);
+                } else {
+                        for (int j = i; j < i + 8; j++)
+                                dst[j] = argb[src[j]];
+                }
+        }
+#endif
+
+        for (; i < n; i++)
+                dst[i] = argb[src[i]];
+
+        return 0;
+}
+
+int
+sixel_parser_finalize(sixel_state_t *st, unsigned char *pixels)
+{
+        int status;
+
+        status = sixel_parser_finish(st);
+        if (status < 0)
+                return status;
+
+        return sixel_image_to_argb32(&st->image, pixels);
+}
+
 int
 sixel_parser_set_default_color(sixel_state_t *st)
 {
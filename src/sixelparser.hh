@@ -73,3 +73,11 @@ int sixel_parser_feed(sixel_state_t *st, const uint32_t *p, size_t len);
 int sixel_parser_set_default_color(sixel_state_t *st);
 int sixel_parser_finalize(sixel_state_t *st, unsigned char *pixels);
 void sixel_parser_deinit(sixel_state_t *st);
+
+/* sixel_parser_finalize() in two steps: sixel_parser_finish() settles the
+ * image size and palette, after which st->image may be moved elsewhere
+ * (e.g. to another thread) and converted with sixel_image_to_argb32(),
+ * which writes width * height native-endian premultiplied ARGB32 pixels. */
+int sixel_parser_finish(sixel_state_t *st);
+int sixel_image_to_argb32(const sixel_image_t *image, unsigned char *pixels);
+void sixel_image_deinit(sixel_image_t *image);
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the throughput of freezing (compressing, encrypting and
+ * writing) scrollback data to a file stream, and of reading it back,
+ * for each available block codec.
+ *
+ * Usage: stream-bench [--repeat=N] FILE…
+ * e.g. stream-bench perf/UTF-8-demo.txt perf/bidi-demo.txt
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib-object.h>
+#include <locale.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "vtestream.h"
+
+/* About the size of a row's worth of text, as the ring appends it */
+#define CHUNK_SIZE 128
+
+static void
+bench_codec(VteStreamCodec codec,
+            std::string const& corpus,
+            int repeat)
+{
+        auto stream = _vte_file_stream_new();
+        _vte_file_stream_set_codec(stream, codec);
+
+        auto const start_time = g_get_monotonic_time();
+        for (auto i = 0; i < repeat; i++) {
+                for (size_t offset = 0; offset < corpus.size(); offset += CHUNK_SIZE)
+                        _vte_stream_append(stream,
+                                           corpus.data() + offset,
+                                           MIN(size_t(CHUNK_SIZE), corpus.size() - offset));
+        }
+        _vte_file_stream_flush(stream);
+        auto const write_time = g_get_monotonic_time() - start_time;
+
+        auto const head = _vte_stream_head(stream);
+        char buf[CHUNK_SIZE];
+        auto const read_start_time = g_get_monotonic_time();
+        for (gsize offset = 0; offset + CHUNK_SIZE <= head; offset += CHUNK_SIZE) {
+                if (!_vte_stream_read(stream, offset, buf, CHUNK_SIZE)) {
+                        g_printerr("Failed to read back at offset %" G_GSIZE_FORMAT "\n", offset);
+                        break;
+                }
+        }
+        auto const read_time = g_get_monotonic_time() - read_start_time;
+
+        VteStreamWriteStats stats;
+        _vte_file_stream_get_write_stats(stream, &stats);
+        g_object_unref(stream);
+
+        auto const total = double(corpus.size()) * repeat;
+        g_print("%-6s %8.1f MB/s write %8.1f MB/s read %12" G_GUINT64_FORMAT " bytes stored (%5.1f%%) in %" G_GUINT64_FORMAT " blocks\n",
+                _vte_stream_codec_name(codec),
+                total / double(MAX(write_time, 1)),
+                total / double(MAX(read_time, 1)),
+                stats.stored_bytes,
+                100. * double(stats.stored_bytes) / total,
+                stats.blocks);
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+        setlocale(LC_ALL, "");
+
+        int repeat = 16;
+        GOptionEntry const entries[] = {
+                { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat,
+                  "Append the corpus this many times", "N" },
+                { nullptr }
+        };
+
+        GError* error = nullptr;
+        auto context = g_option_context_new("FILE… — scrollback stream benchmark");
+        g_option_context_add_main_entries(context, entries, nullptr);
+        auto const rv = g_option_context_parse(context, &argc, &argv, &error);
+        g_option_context_free(context);
+        if (!rv) {
+                g_printerr("Failed to parse arguments: %s\n", error->message);
+                g_error_free(error);
+                return EXIT_FAILURE;
+        }
+
+        if (argc < 2 || repeat < 1) {
+                g_printerr("Usage: %s [--repeat=N] FILE…\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        auto corpus = std::string{};
+        for (auto i = 1; i < argc; i++) {
+                char* contents;
+                gsize len;
+                if (!g_file_get_contents(argv[i], &contents, &len, &error)) {
+                        g_printerr("Failed to read \"%s\": %s\n", argv[i], error->message);
+                        g_error_free(error);
+                        return EXIT_FAILURE;
+                }
+                corpus.append(contents, len);
+                g_free(contents);
+        }
+
+        g_print("%" G_GSIZE_FORMAT " bytes × %d\n", corpus.size(), repeat);
+        for (auto i = 0; i <= VTE_STREAM_CODEC_LAST; i++) {
+                auto const codec = VteStreamCodec(i);
+                if (_vte_stream_codec_available(codec))
+                        bench_codec(codec, corpus, repeat);
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -19,8 +19,10 @@
 
 #include "utf8.hh"
 
+#include <algorithm>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include <glib.h>
 
@@ -85,6 +87,29 @@ decode(uint8_t const* in,
         }
 }
 
+static void
+decode_bulk(uint8_t const* in,
+            size_t len,
+            size_t split,
+            std::u32string& out)
+{
+        decoder.reset();
+
+        /* Decode in two parts to check that partial sequences
+         * are carried over correctly.
+         */
+        split = std::min(split, len);
+        auto buf = std::vector<uint32_t>(len + 1);
+        auto bptr = decoder.decode_bulk(in, in + split, buf.data());
+        bptr = decoder.decode_bulk(in + split, in + len, bptr);
+        g_assert_cmpuint(bptr - buf.data(), <=, len + 1);
+        out.append(reinterpret_cast<char32_t const*>(buf.data()), bptr - buf.data());
+
+        if (decoder.flush()) {
+                out.push_back(decoder.codepoint());
+        }
+}
+
 static void
 assert_u32streq(std::u32string const& str1,
                 std::u32string const& str2)
@@ -98,9 +123,16 @@ assert_decode(char const* in,
               ssize_t len,
               std::u32string const& expected)
 {
+        auto const inlen = len != -1 ? size_t(len) : strlen(in);
         std::u32string converted;
-        decode((uint8_t const*)in, len != -1 ? size_t(len) : strlen(in), converted);
+        decode((uint8_t const*)in, inlen, converted);
         assert_u32streq(converted, expected);
+
+        for (size_t split = 0; split <= inlen; ++split) {
+                std::u32string bulk_converted;
+                decode_bulk((uint8_t const*)in, inlen, split, bulk_converted);
+                assert_u32streq(bulk_converted, expected);
+        }
 }
 
 static void
@@ -296,6 +328,68 @@ test_utf8_decoder_replacement(void)
         assert_decode("a\xF4\x8F\xBF\xFFZ", -1, U"a\uFFFD\uFFFDZ"s);
 }
 
+static void
+test_utf8_decoder_bulk(void)
+{
+        /* Compare the bulk decoder against the bytewise one on random input
+         * biased towards valid and almost-valid multibyte sequences.
+         */
+        auto const rand = g_rand_new_with_seed(0x5eed);
+        uint8_t buf[512];
+        uint8_t const bytes[] = { 'a', 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf, 0xc0,
+                                  0xc1, 0xc2, 0xdf, 0xe0, 0xe1, 0xed, 0xef, 0xf0, 0xf4, 0xf5, 0xff };
+        for (auto i = 0; i < 4096; ++i) {
+                auto const len = size_t(g_rand_int_range(rand, 0, sizeof(buf)));
+                /* Every other buffer is mostly ASCII, to exercise the vectorised path */
+                auto const mostly_ascii = (i & 1) != 0;
+                for (size_t j = 0; j < len; ++j) {
+                        if (mostly_ascii && g_rand_int_range(rand, 0, 32) != 0)
+                                buf[j] = uint8_t(g_rand_int_range(rand, 0, 0x80));
+                        else if (g_rand_boolean(rand))
+                                buf[j] = bytes[g_rand_int_range(rand, 0, G_N_ELEMENTS(bytes))];
+                        else
+                                buf[j] = uint8_t(g_rand_int_range(rand, 0, 0x100));
+                }
+
+                std::u32string expected;
+                decode(buf, len, expected);
+
+                std::u32string converted;
+                decode_bulk(buf, len, size_t(g_rand_int_range(rand, 0, len + 1)), converted);
+                assert_u32streq(converted, expected);
+        }
+        g_rand_free(rand);
+}
+
+static void
+test_utf8_find_control(void)
+{
+        /* Exercise all alignments and lengths around the vector widths */
+        uint32_t buf[64];
+        for (size_t len = 0; len <= G_N_ELEMENTS(buf); ++len) {
+                for (size_t pos = 0; pos <= len; ++pos) {
+                        std::fill(buf, buf + len, uint32_t('a'));
+                        if (pos < len)
+                                buf[pos] = (pos & 1) ? 0x9b : 0x1b;
+
+                        for (size_t start = 0; start <= std::min(len, size_t(17)); ++start) {
+                                auto const expected = start <= pos ? buf + pos : buf + len;
+                                g_assert_true(find_control(buf + start, buf + len) == expected);
+                        }
+                }
+        }
+
+        /* Check the range boundaries */
+        for (uint32_t c : { 0x0u, 0x1fu, 0x20u, 0x7eu, 0x7fu, 0x80u, 0x9fu, 0xa0u, 0x120u, 0xfffdu, 0x10ffffu }) {
+                uint32_t line[20];
+                std::fill(line, line + G_N_ELEMENTS(line), uint32_t(0x4e00));
+                line[13] = c;
+                auto const is_control = c < 0x20 || (c >= 0x7f && c < 0xa0);
+                auto const expected = is_control ? line + 13 : line + G_N_ELEMENTS(line);
+                g_assert_true(find_control(line, line + G_N_ELEMENTS(line)) == expected);
+        }
+}
+
 int
 main(int argc,
      char* argv[])
@@ -304,6 +398,8 @@ main(int argc,
 
         g_test_add_func("/vte/utf8/decoder/decode", test_utf8_decoder_decode);
         g_test_add_func("/vte/utf8/decoder/replacement", test_utf8_decoder_replacement);
+        g_test_add_func("/vte/utf8/decoder/bulk", test_utf8_decoder_bulk);
+        g_test_add_func("/vte/utf8/find-control", test_utf8_find_control);
 
         return g_test_run();
 }
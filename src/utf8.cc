@@ -25,6 +25,12 @@
 
 #include "utf8.hh"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define RJ vte::base::UTF8Decoder::REJECT
 #define RW vte::base::UTF8Decoder::REJECT_REWIND
 
@@ -111,3 +117,199 @@ uint8_t const vte::base::UTF8Decoder::kTable[] = {
         RW, 36, RW, RW, RW, RW, RW, RW, RW, RW, RW, RW, // state 96
         RJ, RJ, RJ, RJ, RJ, RJ, RJ, RJ, RJ, RJ, RJ, RJ, // state 108 (reject-rewind)
 };
+
+#undef RJ
+#undef RW
+
+namespace vte::base {
+
+static inline constexpr bool
+is_continuation(uint8_t c) noexcept
+{
+        return (c & 0xc0u) == 0x80u;
+}
+
+uint32_t*
+UTF8Decoder::decode_bulk(uint8_t const* start,
+                         uint8_t const* end,
+                         uint32_t* out) noexcept
+{
+        auto ptr = start;
+
+        while (ptr < end) {
+                if (m_state == ACCEPT) {
+                        /* Widen runs of ASCII 16 bytes at a time */
+#if defined(__AVX2__) || defined(__SSE2__)
+                        auto const zero = _mm_setzero_si128();
+                        while (end - ptr >= 16) {
+                                auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ptr));
+                                if (auto const mask = _mm_movemask_epi8(v); mask != 0) {
+                                        for (auto n = __builtin_ctz(mask); n > 0; --n)
+                                                *out++ = *ptr++;
+                                        break;
+                                }
+
+                                auto const lo = _mm_unpacklo_epi8(v, zero);
+                                auto const hi = _mm_unpackhi_epi8(v, zero);
+                                auto const o = reinterpret_cast<__m128i*>(out);
+                                _mm_storeu_si128(o + 0, _mm_unpacklo_epi16(lo, zero));
+                                _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo, zero));
+                                _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi, zero));
+                                _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi, zero));
+                                ptr += 16;
+                                out += 16;
+                        }
+#elif defined(__ARM_NEON)
+                        while (end - ptr >= 16) {
+                                auto const v = vld1q_u8(ptr);
+#if defined(__aarch64__)
+                                if (vmaxvq_u8(v) >= 0x80)
+                                        break;
+#else
+                                auto const v64 = vreinterpretq_u64_u8(v);
+                                if (((vgetq_lane_u64(v64, 0) | vgetq_lane_u64(v64, 1)) & UINT64_C(0x8080808080808080)) != 0)
+                                        break;
+#endif
+                                auto const lo = vmovl_u8(vget_low_u8(v));
+                                auto const hi = vmovl_u8(vget_high_u8(v));
+                                vst1q_u32(out + 0, vmovl_u16(vget_low_u16(lo)));
+                                vst1q_u32(out + 4, vmovl_u16(vget_high_u16(lo)));
+                                vst1q_u32(out + 8, vmovl_u16(vget_low_u16(hi)));
+                                vst1q_u32(out + 12, vmovl_u16(vget_high_u16(hi)));
+                                ptr += 16;
+                                out += 16;
+                        }
+#endif
+                        if (ptr == end)
+                                break;
+
+                        /* Well-formed sequences can be decoded directly; anything
+                         * else, including sequences truncated by the end of the input,
+                         * goes through the DFA below so that errors are handled exactly
+                         * like the bytewise decoder does.
+                         */
+                        auto const c = ptr[0];
+                        auto const avail = end - ptr;
+                        if (c < 0x80u) {
+                                *out++ = c;
+                                ++ptr;
+                                continue;
+                        }
+                        if (c >= 0xc2u && c <= 0xdfu &&
+                            avail >= 2 &&
+                            is_continuation(ptr[1])) {
+                                *out++ = (uint32_t(c & 0x1fu) << 6) | (ptr[1] & 0x3fu);
+                                ptr += 2;
+                                continue;
+                        }
+                        if (c >= 0xe0u && c <= 0xefu &&
+                            avail >= 3 &&
+                            ptr[1] >= (c == 0xe0u ? 0xa0u : 0x80u) &&
+                            ptr[1] <= (c == 0xedu ? 0x9fu : 0xbfu) &&
+                            is_continuation(ptr[2])) {
+                                *out++ = (uint32_t(c & 0x0fu) << 12) |
+                                        (uint32_t(ptr[1] & 0x3fu) << 6) |
+                                        (ptr[2] & 0x3fu);
+                                ptr += 3;
+                                continue;
+                        }
+                        if (c >= 0xf0u && c <= 0xf4u &&
+                            avail >= 4 &&
+                            ptr[1] >= (c == 0xf0u ? 0x90u : 0x80u) &&
+                            ptr[1] <= (c == 0xf4u ? 0x8fu : 0xbfu) &&
+                            is_continuation(ptr[2]) &&
+                            is_continuation(ptr[3])) {
+                                *out++ = (uint32_t(c & 0x07u) << 18) |
+                                        (uint32_t(ptr[1] & 0x3fu) << 12) |
+                                        (uint32_t(ptr[2] & 0x3fu) << 6) |
+                                        (ptr[3] & 0x3fu);
+                                ptr += 4;
+                                continue;
+                        }
+                }
+
+                switch (decode(*ptr)) {
+                case REJECT_REWIND:
+                        /* Don't consume the byte; it will be read again in
+                         * the ACCEPT state, so this cannot loop.
+                         */
+                        reset();
+                        *out++ = m_codepoint;
+                        break;
+                case REJECT:
+                        reset();
+                        /* Insert the U+FFFD replacement character. */
+                        [[fallthrough]];
+                case ACCEPT:
+                        *out++ = m_codepoint;
+                        [[fallthrough]];
+                default:
+                        ++ptr;
+                        break;
+                }
+        }
+
+        return out;
+}
+
+uint32_t const*
+find_control(uint32_t const* start,
+             uint32_t const* end) noexcept
+{
+        auto ptr = start;
+
+        /* Codepoints are at most 0x10ffff, so signed comparisons are fine.
+         * A codepoint is a C0 or C1 control or DEL iff c < 0x20 || (c > 0x7e && c < 0xa0).
+         */
+#if defined(__AVX2__)
+        auto const c0 = _mm256_set1_epi32(0x20);
+        auto const del = _mm256_set1_epi32(0x7e);
+        auto const c1 = _mm256_set1_epi32(0xa0);
+        while (end - ptr >= 8) {
+                auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(ptr));
+                auto const ctrl = _mm256_or_si256(_mm256_cmpgt_epi32(c0, v),
+                                                  _mm256_and_si256(_mm256_cmpgt_epi32(v, del),
+                                                                   _mm256_cmpgt_epi32(c1, v)));
+                auto const mask = uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(ctrl)));
+                if (mask != 0)
+                        return ptr + __builtin_ctz(mask);
+                ptr += 8;
+        }
+#endif /* __AVX2__ */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+        auto const c0_4 = _mm_set1_epi32(0x20);
+        auto const del_4 = _mm_set1_epi32(0x7e);
+        auto const c1_4 = _mm_set1_epi32(0xa0);
+        while (end - ptr >= 4) {
+                auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ptr));
+                auto const ctrl = _mm_or_si128(_mm_cmpgt_epi32(c0_4, v),
+                                               _mm_and_si128(_mm_cmpgt_epi32(v, del_4),
+                                                             _mm_cmpgt_epi32(c1_4, v)));
+                auto const mask = uint32_t(_mm_movemask_ps(_mm_castsi128_ps(ctrl)));
+                if (mask != 0)
+                        return ptr + __builtin_ctz(mask);
+                ptr += 4;
+        }
+#elif defined(__ARM_NEON)
+        auto const c0 = vdupq_n_u32(0x20);
+        auto const del = vdupq_n_u32(0x7f);
+        auto const c1 = vdupq_n_u32(0xa0);
+        while (end - ptr >= 4) {
+                auto const v = vld1q_u32(ptr);
+                auto const ctrl = vorrq_u32(vcltq_u32(v, c0),
+                                            vandq_u32(vcgeq_u32(v, del), vcltq_u32(v, c1)));
+                auto const ctrl64 = vreinterpretq_u64_u32(ctrl);
+                if ((vgetq_lane_u64(ctrl64, 0) | vgetq_lane_u64(ctrl64, 1)) != 0)
+                        break; /* locate the exact codepoint below */
+                ptr += 4;
+        }
+#endif
+
+        while (ptr < end && !(*ptr < 0x20u || (*ptr >= 0x7fu && *ptr < 0xa0u)))
+                ++ptr;
+
+        return ptr;
+}
+
+} // namespace vte::base
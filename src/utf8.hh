@@ -52,6 +52,11 @@ public:
 
         inline constexpr uint32_t codepoint() const noexcept { return m_codepoint; }
 
+        /* Returns whether the decoder is between sequences, i.e. whether
+         * the next byte starts a new character.
+         */
+        inline constexpr bool accepting() const noexcept { return m_state == ACCEPT; }
+
         inline uint32_t decode(uint32_t byte) noexcept {
                 uint32_t type = kTable[byte];
                 m_codepoint = (m_state != ACCEPT) ?
@@ -67,6 +72,23 @@ public:
                 m_codepoint = 0xfffdU;
         }
 
+        /* decode_bulk:
+         * @start: start of the input
+         * @end: end of the input
+         * @out: the output buffer, which must have room for (@end - @start + 1)
+         *   codepoints
+         *
+         * Decodes [@start, @end) into UTF-32, producing the exact same output
+         * as calling decode() on each byte and handling REJECT, REJECT_REWIND
+         * by inserting U+FFFD. A partial sequence at the end of the input
+         * is carried over to the next call (or flush()).
+         *
+         * Returns: a pointer past the last codepoint written to @out
+         */
+        uint32_t* decode_bulk(uint8_t const* start,
+                              uint8_t const* end,
+                              uint32_t* out) noexcept;
+
         inline bool flush() noexcept {
                 auto state = m_state;
                 if (m_state != ACCEPT)
@@ -82,6 +104,20 @@ private:
 
 }; // class UTF8Decoder
 
+/* find_control:
+ * @start: start of the buffer
+ * @end: end of the buffer
+ *
+ * Scans the UTF-32 buffer [@start, @end) for the first C0 or C1
+ * control character or DEL.
+ * This uses SSE2, AVX2 or NEON when available.
+ *
+ * Returns: a pointer to the first control character, or @end if
+ *   there is none
+ */
+uint32_t const* find_control(uint32_t const* start,
+                             uint32_t const* end) noexcept;
+
 } // namespace base
 
 } // namespace vte
@@ -108,7 +108,7 @@ static guint process_timeout_tag = 0;
 static gboolean in_process_timeout;
 static guint update_timeout_tag = 0;
 static gboolean in_update_timeout;
-static GList *g_active_terminals;
+static vte::terminal::Scheduler<vte::terminal::Terminal> g_scheduler;
 
 static int
 _vte_unichar_width(gunichar c, int utf8_ambiguous_width)
@@ -180,6 +180,32 @@ Terminal::ring_remove(vte::grid::row_t position)
 	_vte_ring_remove(m_screen->row_data, position);
 }
 
+/* Scrolls the rows from @start to @end (inclusive) by @amount rows,
+ * down if positive or up if negative. The rows scrolled in, and those
+ * appended to extend the ring to @end, are filled with the background
+ * colour, like the ones inserted by ring_insert().
+ */
+void
+Terminal::ring_scroll_region(vte::grid::row_t start,
+                             vte::grid::row_t end,
+                             vte::grid::row_t amount)
+{
+	VteRing *ring = m_screen->row_data;
+        bool const not_default_bg = (m_color_defaults.attr.back() != VTE_DEFAULT_BG);
+
+        while (_vte_ring_next(ring) <= end)
+                ring_append(true);
+
+        ring->scroll_region(start, end, amount, get_bidi_flags());
+
+        if (not_default_bg) {
+                auto const count = std::min(std::abs(amount), end - start + 1);
+                auto const first = amount > 0 ? start : end + 1 - count;
+                for (auto i = first; i < first + count; i++)
+                        _vte_row_data_fill (_vte_ring_index_writable(ring, i), &m_color_defaults, m_column_count);
+        }
+}
+
 /* Reset defaults for character insertion. */
 void
 Terminal::reset_default_attributes(bool reset_hyperlink)
@@ -315,7 +341,7 @@ Terminal::invalidate_rows(vte::grid::row_t row_start,
 			"Invalidating pixels at (%d,%d)x(%d,%d).\n",
 			rect.x, rect.y, rect.width, rect.height);
 
-	if (m_active_terminals_link != nullptr) {
+	if (is_processing()) {
                 g_array_append_val(m_update_rects, rect);
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
@@ -459,7 +485,7 @@ Terminal::invalidate_all()
 	reset_update_rects();
 	m_invalidated_all = TRUE;
 
-        if (m_active_terminals_link != nullptr) {
+        if (is_processing()) {
                 auto allocation = get_allocated_rect();
                 cairo_rectangle_int_t rect;
                 rect.x = -m_padding.left;
@@ -2709,9 +2735,8 @@ Terminal::cursor_down(bool explicit_sequence)
                                  * we're about to tear apart the contents. */
                                 set_hard_wrapped(start - 1);
                                 set_hard_wrapped(end);
-                                /* Scroll by removing a line and inserting a new one. */
-				ring_remove(start);
-				ring_insert(end, true);
+                                /* Scroll the region up by one line. */
+                                ring_scroll_region(start, end, -1);
                                 /* Repaint the affected lines. No need to extend,
                                  * set_hard_wrapped() took care of invalidating
                                  * the context lines if necessary. */
@@ -2793,6 +2818,50 @@ Terminal::save_cursor(VteScreen *screen__)
         screen__->saved.character_replacement = m_character_replacement;
 }
 
+/* DEC Special Character and Line Drawing Set.  VT100 and higher (per XTerm docs). */
+static gunichar const line_drawing_map[32] = {
+        0x0020,  /* _ => blank (space) */
+        0x25c6,  /* ` => diamond */
+        0x2592,  /* a => checkerboard */
+        0x2409,  /* b => HT symbol */
+        0x240c,  /* c => FF symbol */
+        0x240d,  /* d => CR symbol */
+        0x240a,  /* e => LF symbol */
+        0x00b0,  /* f => degree */
+        0x00b1,  /* g => plus/minus */
+        0x2424,  /* h => NL symbol */
+        0x240b,  /* i => VT symbol */
+        0x2518,  /* j => downright corner */
+        0x2510,  /* k => upright corner */
+        0x250c,  /* l => upleft corner */
+        0x2514,  /* m => downleft corner */
+        0x253c,  /* n => cross */
+        0x23ba,  /* o => scan line 1/9 */
+        0x23bb,  /* p => scan line 3/9 */
+        0x2500,  /* q => horizontal line (also scan line 5/9) */
+        0x23bc,  /* r => scan line 7/9 */
+        0x23bd,  /* s => scan line 9/9 */
+        0x251c,  /* t => left t */
+        0x2524,  /* u => right t */
+        0x2534,  /* v => bottom t */
+        0x252c,  /* w => top t */
+        0x2502,  /* x => vertical line */
+        0x2264,  /* y => <= */
+        0x2265,  /* z => >= */
+        0x03c0,  /* { => pi */
+        0x2260,  /* | => not equal */
+        0x00a3,  /* } => pound currency sign */
+        0x00b7,  /* ~ => bullet */
+};
+
+static inline gunichar
+map_line_drawing(gunichar c)
+{
+        if (c >= 95 && c <= 126)
+                return line_drawing_map[c - 95];
+        return c;
+}
+
 /* Insert a single character into the stored data array. */
 void
 Terminal::insert_char(gunichar c,
@@ -2806,50 +2875,12 @@ Terminal::insert_char(gunichar c,
 	bool line_wrapped = false; /* cursor moved before char inserted */
         gunichar c_unmapped = c;
 
-        /* DEC Special Character and Line Drawing Set.  VT100 and higher (per XTerm docs). */
-        static const gunichar line_drawing_map[32] = {
-                0x0020,  /* _ => blank (space) */
-                0x25c6,  /* ` => diamond */
-                0x2592,  /* a => checkerboard */
-                0x2409,  /* b => HT symbol */
-                0x240c,  /* c => FF symbol */
-                0x240d,  /* d => CR symbol */
-                0x240a,  /* e => LF symbol */
-                0x00b0,  /* f => degree */
-                0x00b1,  /* g => plus/minus */
-                0x2424,  /* h => NL symbol */
-                0x240b,  /* i => VT symbol */
-                0x2518,  /* j => downright corner */
-                0x2510,  /* k => upright corner */
-                0x250c,  /* l => upleft corner */
-                0x2514,  /* m => downleft corner */
-                0x253c,  /* n => cross */
-                0x23ba,  /* o => scan line 1/9 */
-                0x23bb,  /* p => scan line 3/9 */
-                0x2500,  /* q => horizontal line (also scan line 5/9) */
-                0x23bc,  /* r => scan line 7/9 */
-                0x23bd,  /* s => scan line 9/9 */
-                0x251c,  /* t => left t */
-                0x2524,  /* u => right t */
-                0x2534,  /* v => bottom t */
-                0x252c,  /* w => top t */
-                0x2502,  /* x => vertical line */
-                0x2264,  /* y => <= */
-                0x2265,  /* z => >= */
-                0x03c0,  /* { => pi */
-                0x2260,  /* | => not equal */
-                0x00a3,  /* } => pound currency sign */
-                0x00b7,  /* ~ => bullet */
-        };
-
         insert |= m_modes_ecma.IRM();
 
 	/* If we've enabled the special drawing set, map the characters to
 	 * Unicode. */
-        if (G_UNLIKELY (*m_character_replacement == VTE_CHARACTER_REPLACEMENT_LINE_DRAWING)) {
-                if (c >= 95 && c <= 126)
-                        c = line_drawing_map[c - 95];
-        }
+        if (G_UNLIKELY (*m_character_replacement == VTE_CHARACTER_REPLACEMENT_LINE_DRAWING))
+                c = map_line_drawing(c);
 
 	/* Figure out how many columns this character should occupy. */
         columns = _vte_unichar_width(c, m_utf8_ambiguous_width);
@@ -3004,6 +3035,107 @@ not_inserted:
         m_line_wrapped = line_wrapped;
 }
 
+/* Insert a run of graphic characters sharing the current attributes into the
+ * stored data array. This inserts as many characters as fit into the current
+ * row in one go, up to 256, and stops at the next autowrap, so that each call
+ * touches at most two rows. Characters that need special handling (combining marks,
+ * autowrap, insert mode) are passed on to insert_char() one by one.
+ *
+ * Returns: the number of characters consumed from @chars
+ */
+size_t
+Terminal::insert_chars(gunichar const* chars,
+                       size_t len)
+{
+        g_assert(len > 0);
+
+        auto const line_drawing = *m_character_replacement == VTE_CHARACTER_REPLACEMENT_LINE_DRAWING;
+
+        auto const col = m_screen->cursor.col;
+
+        /* Resolve the widths, for use below, and find how much of the run fits into this row */
+        guint8 widths[256];
+        auto end_col = col;
+        auto n = size_t{0};
+        if (G_LIKELY(!m_modes_ecma.IRM())) {
+                for (len = std::min(len, G_N_ELEMENTS(widths)); n < len; ++n) {
+                        auto const c = G_UNLIKELY(line_drawing) ? map_line_drawing(chars[n]) : chars[n];
+                        auto const columns = _vte_unichar_width(c, m_utf8_ambiguous_width);
+                        if (columns == 0 || end_col + columns > m_column_count)
+                                break;
+                        widths[n] = columns;
+                        end_col += columns;
+                }
+        }
+
+        if (n == 0) {
+                insert_char(chars[0], false, false);
+                return 1;
+        }
+
+	/* Make sure we have enough rows to hold this data. */
+        auto row = ensure_cursor();
+        cleanup_fragments(col, end_col);
+        _vte_row_data_fill(row, &basic_cell, end_col);
+
+        auto cell = _vte_row_data_get_writable(row, col);
+        for (size_t i = 0; i < n; ++i) {
+                auto const c = G_UNLIKELY(line_drawing) ? map_line_drawing(chars[i]) : chars[i];
+                auto const columns = int{widths[i]};
+
+                auto attr = m_defaults.attr;
+                attr.set_columns(columns);
+                cell->c = c;
+                cell->attr = attr;
+                ++cell;
+
+                /* insert wide-char fragments */
+                attr.set_fragment(true);
+                for (auto j = 1; j < columns; ++j) {
+                        cell->c = c;
+                        cell->attr = attr;
+                        ++cell;
+                }
+        }
+
+	if (_vte_row_data_length (row) > m_column_count)
+		cleanup_fragments(m_column_count, _vte_row_data_length (row));
+	_vte_row_data_shrink (row, m_column_count);
+
+        m_screen->cursor.col = end_col;
+        m_last_graphic_character = chars[n - 1];
+
+	/* We added text, so make a note of it. */
+	m_text_inserted_flag = TRUE;
+        m_line_wrapped = false;
+
+        return n;
+}
+
+/* Insert @count copies of @c, invalidating the touched rows once. */
+void
+Terminal::insert_char_repeated(gunichar c,
+                               size_t count)
+{
+        if (count == 0)
+                return;
+
+        /* REP repeats at most the rest of the line, so this buffer is
+         * usually inserted just once; wider lines take a few passes.
+         */
+        gunichar chars[256];
+        auto const n_chars = std::min(count, G_N_ELEMENTS(chars));
+        std::fill_n(chars, n_chars, c);
+
+        auto const top = m_screen->cursor.row;
+
+        while (count > 0)
+                count -= insert_chars(chars, std::min(count, n_chars));
+
+        invalidate_rows_and_context(std::min(top, m_screen->cursor.row),
+                                    std::max(top, m_screen->cursor.row));
+}
+
 guint8
 Terminal::get_bidi_flags() const noexcept
 {
@@ -3162,12 +3294,28 @@ io_read_cb(int fd,
         return that->pty_io_read(fd, condition);
 }
 
+static void
+pty_reader_ready_cb(vte::terminal::Terminal* that)
+{
+        that->pty_reader_ready();
+}
+
 void
 Terminal::connect_pty_read()
 {
-	if (m_pty_input_source != 0 || !pty())
+	if (m_pty_input_source != 0 || m_pty_reader_stream || !pty())
 		return;
 
+        if (vte::base::PtyReader::enabled()) {
+                m_pty_reader_stream = vte::base::PtyReader::get().add(pty()->fd(),
+                                                                      (vte::base::PtyReader::Stream::ready_func)pty_reader_ready_cb,
+                                                                      this);
+                if (m_pty_reader_stream) {
+                        _vte_debug_print (VTE_DEBUG_IO, "Reading PTY on the reader thread\n");
+                        return;
+                }
+        }
+
         _vte_debug_print (VTE_DEBUG_IO, "Adding PTY input source\n");
 
         m_pty_input_source = g_unix_fd_add_full(VTE_CHILD_INPUT_PRIORITY,
@@ -3223,6 +3371,15 @@ Terminal::connect_pty_write()
 void
 Terminal::disconnect_pty_read()
 {
+        if (m_pty_reader_stream) {
+		_vte_debug_print (VTE_DEBUG_IO, "Removing PTY from the reader thread\n");
+                vte::base::PtyReader::get().remove(m_pty_reader_stream);
+
+                /* Keep what the reader thread has already read */
+                pty_reader_drain(true);
+                m_pty_reader_stream.reset();
+        }
+
 	if (m_pty_input_source != 0) {
 		_vte_debug_print (VTE_DEBUG_IO, "Removing PTY input source\n");
 		g_source_remove(m_pty_input_source);
@@ -3331,6 +3488,32 @@ Terminal::process_incoming()
 }
 
 
+namespace {
+
+/* Sets Terminal::m_decoding_chunk for as long as the decoded input is being
+ * processed, also if a sequence handler throws; see reset_decoder().
+ */
+class DecodingChunk {
+public:
+        explicit DecodingChunk(bool& decoding) noexcept
+                : m_decoding{decoding}
+        {
+                m_decoding = true;
+        }
+
+        ~DecodingChunk() noexcept { m_decoding = false; }
+
+        DecodingChunk(DecodingChunk const&) = delete;
+        DecodingChunk(DecodingChunk&&) = delete;
+        DecodingChunk& operator=(DecodingChunk const&) = delete;
+        DecodingChunk& operator=(DecodingChunk&&) = delete;
+
+private:
+        bool& m_decoding;
+};
+
+} // anon namespace
+
 /* Note that this code is mostly copied to process_incoming_pcterm() below; any non-charset-decoding
  * related changes made here need to be made there, too.
  * FIXMEchpe: refactor this to share more code with process_incoming_pcterm().
@@ -3387,40 +3570,80 @@ Terminal::process_incoming_utf8()
                 g_assert_nonnull(chunk.get());
 
                 _VTE_DEBUG_IF(VTE_DEBUG_IO) {
-                        _vte_debug_hexdump("Incoming buffer", chunk->data, chunk->len);
+                        _vte_debug_hexdump("Incoming buffer", chunk->begin(), chunk->len);
                 }
 
                 bytes_processed += chunk->len;
 
-                auto const* ip = chunk->data;
-                auto const* iend = chunk->data + chunk->len;
+                /* Decode the chunk in slices that fit m_utf32_buffer; the decoder
+                 * carries any partial sequence at the end of a slice over to the
+                 * next one, or to the next chunk.
+                 */
+                for (auto slice = chunk->begin(); slice < chunk->end(); ) {
+                        auto const slice_end = slice + std::min(size_t(chunk->end() - slice),
+                                                                m_utf32_buffer.size() - 1);
+                        auto const* ip = m_utf32_buffer.data();
+                        auto const* iend = m_utf8_decoder.decode_bulk(slice,
+                                                                      slice_end,
+                                                                      m_utf32_buffer.data());
+                        slice = slice_end;
+
+                        /* A RIS in the middle of the slice must not reset the decoder,
+                         * since it now holds the partial sequence at the slice's end.
+                         */
+                        auto const decoding = DecodingChunk{m_decoding_chunk};
 
-                for ( ; ip < iend; ++ip) {
+                        while (ip < iend) {
 
-                        switch (m_utf8_decoder.decode(*ip)) {
-                        case vte::base::UTF8Decoder::REJECT_REWIND:
-                                /* Rewind the stream.
-                                 * Note that this will never lead to a loop, since in the
-                                 * next round this byte *will* be consumed.
+                                /* Fast path: in ground state, a run of characters without
+                                 * any controls consists solely of GRAPHIC sequences, which
+                                 * we can insert directly without parsing each character.
                                  */
-                                --ip;
-                                [[fallthrough]];
-                        case vte::base::UTF8Decoder::REJECT:
-                                m_utf8_decoder.reset();
-                                /* Fall through to insert the U+FFFD replacement character. */
-                                [[fallthrough]];
-                        case vte::base::UTF8Decoder::ACCEPT: {
-                                auto rv = m_parser.feed(m_utf8_decoder.codepoint());
+                                if (((*ip >= 0x20 && *ip < 0x7f) || *ip >= 0xa0) &&
+                                    m_parser.in_ground_state() &&
+                                    !_vte_debug_on(VTE_DEBUG_PARSER)) {
+                                        auto const run_end = vte::base::find_control(ip, iend);
+
+                                        while (ip < run_end) {
+                                                bbox_top = std::min(bbox_top,
+                                                                    m_screen->cursor.row);
+
+                                                ip += insert_chars(ip, run_end - ip);
+
+                                                if (m_line_wrapped) {
+                                                        m_line_wrapped = false;
+                                                        /* line wrapped, correct bbox */
+                                                        if (invalidated_text &&
+                                                            (m_screen->cursor.row > bbox_bottom + VTE_CELL_BBOX_SLACK ||
+                                                             m_screen->cursor.row < bbox_top - VTE_CELL_BBOX_SLACK)) {
+                                                                invalidate_rows_and_context(bbox_top, bbox_bottom);
+                                                                bbox_bottom = -G_MAXINT;
+                                                                bbox_top = G_MAXINT;
+                                                        }
+                                                        bbox_top = std::min(bbox_top,
+                                                                            m_screen->cursor.row);
+                                                }
+                                                bbox_bottom = std::max(bbox_bottom,
+                                                                       m_screen->cursor.row);
+                                        }
+
+                                        invalidated_text = TRUE;
+                                        modified = TRUE;
+                                        continue;
+                                }
+
+                                /* Feed characters until a sequence is complete; this advances @ip */
+                                auto rv = m_parser.feed(&ip, iend);
                                 if (G_UNLIKELY(rv < 0)) {
 #ifdef DEBUG
-                                        uint32_t c = m_utf8_decoder.codepoint();
+                                        uint32_t c = ip[-1];
                                         char c_buf[7];
                                         g_snprintf(c_buf, sizeof(c_buf), "%lc", c);
                                         char const* wp_str = g_unichar_isprint(c) ? c_buf : _vte_debug_sequence_to_string(c_buf, -1);
                                         _vte_debug_print(VTE_DEBUG_PARSER, "Parser error on U+%04X [%s]!\n",
                                                          c, wp_str);
 #endif
-                                        break;
+                                        continue;
                                 }
 
 #ifdef VTE_DEBUG
@@ -3428,6 +3651,17 @@ Terminal::process_incoming_utf8()
                                         g_assert((bool)seq);
 #endif
 
+#ifdef WITH_SIXEL
+                                /* While a DECSIXEL string is in progress, the parser only
+                                 * returns its next segment; anything else means that CAN,
+                                 * SUB, ESC or a C1 control cancelled it before its ST.
+                                 */
+                                if (G_UNLIKELY(m_sixel_in_progress) &&
+                                    rv != VTE_SEQ_NONE &&
+                                    (rv != VTE_SEQ_DCS || seq.command() != VTE_CMD_DECSIXEL))
+                                        cancel_sixel();
+#endif
+
                                 _VTE_DEBUG_IF(VTE_DEBUG_PARSER) {
                                         if (rv != VTE_SEQ_NONE) {
                                                 seq.print();
@@ -3444,7 +3678,7 @@ Terminal::process_incoming_utf8()
                                         bbox_top = std::min(bbox_top,
                                                             m_screen->cursor.row);
 
-                                        // does insert_char(c, false, false)
+                                        // does insert_chars(&c, 1)
                                         GRAPHIC(seq);
                                         _vte_debug_print(VTE_DEBUG_PARSER,
                                                          "Last graphic is now U+%04X %lc\n",
@@ -3521,8 +3755,6 @@ Terminal::process_incoming_utf8()
                                         break;
                                 }
                                 }
-                                break;
-                        }
                         }
                 }
 
@@ -3669,13 +3901,13 @@ Terminal::process_incoming_pcterm()
                 g_assert_nonnull(chunk.get());
 
                 _VTE_DEBUG_IF(VTE_DEBUG_IO) {
-                        _vte_debug_hexdump("Incoming buffer", chunk->data, chunk->len);
+                        _vte_debug_hexdump("Incoming buffer", chunk->begin(), chunk->len);
                 }
 
                 bytes_processed += chunk->len;
 
-                auto const* ip = chunk->data;
-                auto const* iend = chunk->data + chunk->len;
+                auto const* ip = chunk->begin();
+                auto const* iend = chunk->end();
 
                 auto eos = bool{false};
                 auto flush = bool{false};
@@ -3702,6 +3934,17 @@ Terminal::process_incoming_pcterm()
                                         g_assert((bool)seq);
 #endif
 
+#ifdef WITH_SIXEL
+                                /* While a DECSIXEL string is in progress, the parser only
+                                 * returns its next segment; anything else means that CAN,
+                                 * SUB, ESC or a C1 control cancelled it before its ST.
+                                 */
+                                if (G_UNLIKELY(m_sixel_in_progress) &&
+                                    rv != VTE_SEQ_NONE &&
+                                    (rv != VTE_SEQ_DCS || seq.command() != VTE_CMD_DECSIXEL))
+                                        cancel_sixel();
+#endif
+
                                 _VTE_DEBUG_IF(VTE_DEBUG_PARSER) {
                                         if (rv != VTE_SEQ_NONE) {
                                                 seq.print();
@@ -3718,7 +3961,7 @@ Terminal::process_incoming_pcterm()
                                         bbox_top = std::min(bbox_top,
                                                             m_screen->cursor.row);
 
-                                        // does insert_char(c, false, false)
+                                        // does insert_chars(&c, 1)
                                         GRAPHIC(seq);
                                         _vte_debug_print(VTE_DEBUG_PARSER,
                                                          "Last graphic is now U+%04X %lc\n",
@@ -3932,13 +4175,7 @@ Terminal::pty_io_read(int const fd,
 		 *    maximum number of bytes we can read/process in between
 		 *    updates.
 		 */
-		max_bytes = m_active_terminals_link != nullptr ?
-		            g_list_length(g_active_terminals) - 1 : 0;
-		if (max_bytes) {
-			max_bytes = m_max_input_bytes / max_bytes;
-		} else {
-			max_bytes = m_max_input_bytes;
-		}
+		max_bytes = input_allowance();
 		bytes = m_input_bytes;
 
                 /* If possible, try adding more data to the chunk at the back of the queue */
@@ -4079,6 +4316,69 @@ out:
 	return again;
 }
 
+/*
+ * Terminal::pty_reader_ready:
+ *
+ * Called on the main thread when the PTY reader thread has read new data,
+ * TIOCPKT notifications or the EOS from the PTY.
+ */
+void
+Terminal::pty_reader_ready()
+{
+        auto const flags = m_pty_reader_stream->take_packet_flags();
+        if (flags & vte::base::PtyReader::Stream::eIOCTL)
+                pty_termios_changed();
+        if (flags & vte::base::PtyReader::Stream::eSTOP)
+                pty_scroll_lock_changed(true);
+        if (flags & vte::base::PtyReader::Stream::eSTART)
+                pty_scroll_lock_changed(false);
+
+        if (!m_pty_reader_stream->empty() && !is_processing())
+                add_process_timeout(this);
+}
+
+/*
+ * Terminal::pty_reader_drain:
+ * @all: whether to drain all chunks regardless of the input limit
+ *
+ * Moves the chunks read by the PTY reader thread to the incoming queue.
+ * Unless @all is true, this stops once the same per-update input limit as
+ * in pty_io_read() is reached; the remaining chunks stay in the stream's
+ * queue, which in turn throttles the reader thread.
+ */
+void
+Terminal::pty_reader_drain(bool all)
+{
+        auto const max_bytes = input_allowance();
+
+        auto bytes = m_input_bytes;
+        while (all || bytes < max_bytes) {
+                auto chunk = m_pty_reader_stream->pop();
+                if (!chunk)
+                        break;
+
+                bytes += chunk->len;
+                auto const eos = chunk->eos();
+                m_incoming_queue.push(std::move(chunk));
+
+                if (eos) {
+                        _vte_debug_print(VTE_DEBUG_IO, "got PTY EOF\n");
+
+                        /* Cancel wait timer */
+                        m_child_exited_eos_wait_timer.abort();
+                        break;
+                }
+        }
+
+        m_pty_input_active = bytes != m_input_bytes;
+
+        _vte_debug_print(VTE_DEBUG_IO, "drained %" G_GSIZE_FORMAT "/%" G_GSIZE_FORMAT " bytes from the PTY reader, active? %s\n",
+                         bytes, max_bytes,
+                         m_pty_input_active ? "yes" : "no");
+
+        m_input_bytes = bytes;
+}
+
 /*
  * Terminal::feed:
  * @data: data
@@ -4092,10 +4392,21 @@ Terminal::feed(std::string_view const& data,
         auto length = data.size();
         auto ptr = data.data();
 
+        /* Keep the data in order with buffers queued by feed_bytes() */
+        if (!m_feed_bytes_queue.empty()) {
+                if (length != 0)
+                        m_feed_bytes_queue.push({vte::glib::take_bytes(g_bytes_new(ptr, length)), 0});
+                if (start_processing_)
+                        start_processing();
+                return;
+        }
+
         vte::base::Chunk* chunk = nullptr;
         if (!m_incoming_queue.empty()) {
                 auto& achunk = m_incoming_queue.back();
-                if (length < achunk->remaining_capacity() && !achunk->sealed())
+                /* Borrowed chunks have no capacity of their own, see feed_bytes_drain() */
+                if (!achunk->sealed() && !achunk->borrowed() &&
+                    length < achunk->remaining_capacity())
                         chunk = achunk.get();
         }
         if (chunk == nullptr) {
@@ -4124,6 +4435,64 @@ Terminal::feed(std::string_view const& data,
                 start_processing();
 }
 
+/*
+ * Terminal::feed_bytes:
+ * @bytes: a #GBytes
+ *
+ * Interprets the data in @bytes as if it were data received from a child
+ * process, without copying it. The data is queued by reference, and moved
+ * to the incoming queue in slices by feed_bytes_drain().
+ */
+void
+Terminal::feed_bytes(GBytes* bytes)
+{
+        if (g_bytes_get_size(bytes) == 0)
+                return;
+
+        m_feed_bytes_queue.push({vte::glib::take_bytes(g_bytes_ref(bytes)), 0});
+        start_processing();
+}
+
+/*
+ * Terminal::feed_bytes_drain:
+ *
+ * Moves data from the buffers queued by feed_bytes() to the incoming queue
+ * as borrowed chunks, each holding a reference to its buffer, up to the
+ * per-update input limit; the rest is left for the next update.
+ */
+void
+Terminal::feed_bytes_drain()
+{
+        auto const max_bytes = input_allowance();
+
+        auto bytes = m_input_bytes;
+        while (bytes < max_bytes && !m_feed_bytes_queue.empty()) {
+                auto& item = m_feed_bytes_queue.front();
+
+                auto size = gsize{0};
+                auto const data = reinterpret_cast<uint8_t const*>(g_bytes_get_data(item.bytes.get(), &size));
+                auto const len = std::min({size - item.offset,
+                                           max_bytes - bytes,
+                                           size_t{G_MAXUINT}});
+
+                auto release = [](void* ptr) noexcept -> void
+                {
+                        g_bytes_unref(reinterpret_cast<GBytes*>(ptr));
+                };
+                m_incoming_queue.push(vte::base::Chunk::get_borrowed(data + item.offset,
+                                                                     len,
+                                                                     release,
+                                                                     g_bytes_ref(item.bytes.get())));
+
+                bytes += len;
+                item.offset += len;
+                if (item.offset == size)
+                        m_feed_bytes_queue.pop();
+        }
+
+        m_input_bytes = bytes;
+}
+
 bool
 Terminal::pty_io_write(int const fd,
                        GIOCondition const condition)
@@ -7059,6 +7428,7 @@ Terminal::widget_focus_in()
 
         m_has_focus = true;
         widget()->grab_focus();
+        update_scheduler_weight(gtk_widget_get_mapped(m_widget));
 
 	/* We only have an IM context when we're realized, and there's not much
 	 * point to painting the cursor if we don't have a window. */
@@ -7109,6 +7479,7 @@ Terminal::widget_focus_out()
 	}
 
 	m_has_focus = false;
+        update_scheduler_weight(gtk_widget_get_mapped(m_widget));
 	check_cursor_blink();
 }
 
@@ -7412,6 +7783,48 @@ Terminal::refresh_size()
         m_tabstops.resize(columns);
 }
 
+/*
+ * Terminal::rewrap_timer_callback:
+ *
+ * Continues rewrapping the scrollback of the normal screen, which
+ * screen_set_size() rewraps only down from above the screen, for
+ * at most VTE_REWRAP_SLICE_TIME ms at a time. Repeated resizes start
+ * it over, so only the final size gets applied to all of it.
+ * Reading any of the rows left over, e.g. to draw them, rewraps all of
+ * them right away, see Ring::index(); this then only catches up with that.
+ */
+bool
+Terminal::rewrap_timer_callback()
+{
+        auto ring = m_normal_screen.row_data;
+        auto const deadline = g_get_monotonic_time() + VTE_REWRAP_SLICE_TIME * 1000;
+
+        while (ring->rewrap_pending()) {
+                if (ring->rewrap_step(VTE_REWRAP_SLICE_ROWS))
+                        break;
+                if (ring->rewrap_pending() && g_get_monotonic_time() >= deadline)
+                        return true; /* run again */
+        }
+
+        /* The rows above m_rewrap_pending_end got renumbered, and the first row too */
+        if (!m_selection_resolved.empty() &&
+            m_screen == &m_normal_screen &&
+            m_selection_resolved.start_row() < m_rewrap_pending_end)
+                deselect_all();
+
+        auto const delta = _vte_ring_delta(ring);
+        m_normal_screen.insert_delta = MAX(m_normal_screen.insert_delta, delta);
+        if (m_screen == &m_normal_screen) {
+                adjust_adjustments_full();
+                queue_adjustment_value_changed_clamped(m_screen->scroll_delta);
+        } else {
+                m_normal_screen.scroll_delta = MAX(m_normal_screen.scroll_delta, double(delta));
+        }
+        invalidate_all();
+
+        return false; /* don't run again */
+}
+
 /* Resize the given screen (normal or alternate) of the terminal. */
 void
 Terminal::screen_set_size(VteScreen *screen_,
@@ -7469,8 +7882,14 @@ Terminal::screen_set_size(VteScreen *screen_,
 
 	old_top_lines = below_current_paragraph.row - screen_->insert_delta;
 
-	if (do_rewrap && old_columns != m_column_count)
+	if (do_rewrap && old_columns != m_column_count) {
 		_vte_ring_rewrap(ring, m_column_count, markers);
+                /* The rows above the screen are rewrapped later, see rewrap_timer_callback() */
+                if (_vte_ring_rewrap_pending(ring)) {
+                        m_rewrap_pending_end = long(ring->rewrap_pending_end());
+                        m_rewrap_timer.schedule_idle(vte::glib::Timer::Priority::eLOW);
+                }
+        }
 
 	if (_vte_ring_length(ring) > m_row_count) {
 		/* The content won't fit without scrollbars. Before figuring out the position, we might need to
@@ -7586,6 +8005,8 @@ Terminal::set_size(long columns,
 
                 _vte_ring_set_visible_rows(m_normal_screen.row_data, m_row_count);
                 _vte_ring_set_visible_rows(m_alternate_screen.row_data, m_row_count);
+                _vte_ring_set_columns(m_normal_screen.row_data, m_column_count);
+                _vte_ring_set_columns(m_alternate_screen.row_data, m_column_count);
 
 		/* Resize the normal screen and (if rewrapping is enabled) rewrap it even if the alternate screen is visible: bug 415277 */
 		screen_set_size(&m_normal_screen, old_columns, old_rows, m_rewrap_on_resize);
@@ -7883,10 +8304,18 @@ Terminal::widget_size_allocate(GtkAllocation *allocation)
 	}
 }
 
+void
+Terminal::widget_map()
+{
+        update_scheduler_weight(true);
+}
+
+/* Called before the widget is actually unmapped */
 void
 Terminal::widget_unmap()
 {
         m_ringview.pause();
+        update_scheduler_weight(false);
 }
 
 void
@@ -7967,6 +8396,15 @@ Terminal::~Terminal()
 	if (m_search_attrs)
 		g_array_free (m_search_attrs, TRUE);
 
+#ifdef WITH_SIXEL
+        /* Discard an image whose DCS never finished */
+        cancel_sixel();
+
+        /* Drop images still being decoded */
+        if (m_image_decode_cancellable)
+                g_cancellable_cancel(m_image_decode_cancellable.get());
+#endif
+
 	/* Disconnect from autoscroll requests. */
 	stop_autoscroll();
 
@@ -9751,6 +10189,56 @@ Terminal::decscusr_cursor_shape() const noexcept
         }
 }
 
+bool
+Terminal::set_scrollback_in_memory(bool in_memory)
+{
+        if (in_memory == m_normal_screen.row_data->streams_in_memory())
+                return false;
+
+        /* Only the normal screen has streams, but keep the two consistent */
+        m_normal_screen.row_data->set_streams_in_memory(in_memory);
+        m_alternate_screen.row_data->set_streams_in_memory(in_memory);
+
+        return true;
+}
+
+bool
+Terminal::set_scrollback_bytes(size_t bytes)
+{
+        if (bytes == m_normal_screen.row_data->max_bytes())
+                return false;
+
+        _vte_debug_print(VTE_DEBUG_MISC,
+                         "Setting scrollback bytes to %" G_GSIZE_FORMAT "\n", bytes);
+
+        /* Only the normal screen has scrollback */
+        m_normal_screen.row_data->set_max_bytes(bytes);
+
+        /* Rows may have been discarded; fix up the screens and the scrollbar */
+        set_scrollback_lines(m_scrollback_lines);
+
+        return true;
+}
+
+/*
+ * Terminal::memory_usage:
+ * @usage: (out): the memory usage
+ *
+ * Sums up the memory used by the rows of both screens.
+ */
+void
+Terminal::memory_usage(vte::base::Ring::MemoryUsage* usage) const
+{
+        vte::base::Ring::MemoryUsage alternate;
+
+        m_normal_screen.row_data->memory_usage(usage);
+        m_alternate_screen.row_data->memory_usage(&alternate);
+        usage->cells += alternate.cells;
+        usage->streams += alternate.streams;
+        usage->hyperlinks += alternate.hyperlinks;
+        usage->images += alternate.images;
+}
+
 bool
 Terminal::set_scrollback_lines(long lines)
 {
@@ -9848,7 +10336,12 @@ Terminal::reset_decoder()
 {
         switch (data_syntax()) {
         case DataSyntax::eECMA48_UTF8:
-                m_utf8_decoder.reset();
+                /* The decoder's state belongs to the bytes after the ones
+                 * being processed; these always end in a complete character
+                 * when a sequence handler runs, so there's nothing to reset.
+                 */
+                if (!m_decoding_chunk)
+                        m_utf8_decoder.reset();
                 break;
 
 #ifdef WITH_ICU
@@ -9896,6 +10389,10 @@ Terminal::reset(bool clear_tabstops,
         /* Reset parser */
         m_parser.reset();
         m_last_graphic_character = 0;
+#ifdef WITH_SIXEL
+        /* This cancels any DECSIXEL string in progress, too */
+        cancel_sixel();
+#endif
 
         /* Reset modes */
         m_modes_ecma.reset();
@@ -9997,6 +10494,7 @@ Terminal::unset_pty(bool notify_widget)
         /* Clear incoming and outgoing queues */
         m_input_bytes = 0;
         m_incoming_queue = {};
+        m_feed_bytes_queue = {};
         _vte_byte_array_clear(m_outgoing);
 
         stop_processing(this); // FIXMEchpe only if m_incoming_queue.empty() !!!
@@ -10113,11 +10611,10 @@ add_update_timeout(vte::terminal::Terminal* that)
 	if (!in_process_timeout) {
                 remove_process_timeout_source();
         }
-	if (that->m_active_terminals_link == nullptr) {
+	if (!that->is_processing()) {
 		_vte_debug_print (VTE_DEBUG_TIMEOUT,
 				"Adding terminal to active list\n");
-		that->m_active_terminals_link = g_active_terminals =
-			g_list_prepend(g_active_terminals, that);
+                g_scheduler.add(that->m_scheduler_entry, that->m_max_input_bytes);
 	}
 }
 
@@ -10131,13 +10628,12 @@ Terminal::reset_update_rects()
 static bool
 remove_from_active_list(vte::terminal::Terminal* that)
 {
-	if (that->m_active_terminals_link == nullptr ||
+	if (!that->is_processing() ||
             that->m_update_rects->len != 0)
                 return false;
 
         _vte_debug_print(VTE_DEBUG_TIMEOUT, "Removing terminal from active list\n");
-        g_active_terminals = g_list_delete_link(g_active_terminals, that->m_active_terminals_link);
-        that->m_active_terminals_link = nullptr;
+        g_scheduler.remove(that->m_scheduler_entry);
         return true;
 }
 
@@ -10147,7 +10643,7 @@ stop_processing(vte::terminal::Terminal* that)
         if (!remove_from_active_list(that))
                 return;
 
-        if (g_active_terminals != nullptr)
+        if (!g_scheduler.empty())
                 return;
 
         if (!in_process_timeout) {
@@ -10173,8 +10669,7 @@ add_process_timeout(vte::terminal::Terminal* that)
 {
 	_vte_debug_print(VTE_DEBUG_TIMEOUT,
 			"Adding terminal to active list\n");
-	that->m_active_terminals_link = g_active_terminals =
-		g_list_prepend(g_active_terminals, that);
+        g_scheduler.add(that->m_scheduler_entry, that->m_max_input_bytes);
 	if (update_timeout_tag == 0 &&
 			process_timeout_tag == 0) {
 		_vte_debug_print(VTE_DEBUG_TIMEOUT,
@@ -10185,6 +10680,37 @@ add_process_timeout(vte::terminal::Terminal* that)
 	}
 }
 
+/*
+ * Terminal::input_allowance:
+ *
+ * Returns: the number of bytes to read from the PTY before the next
+ *   processing round, as allotted by the scheduler
+ */
+size_t
+Terminal::input_allowance() const noexcept
+{
+        return g_scheduler.allowance(m_scheduler_entry, m_max_input_bytes);
+}
+
+/*
+ * Terminal::update_scheduler_weight:
+ * @mapped: whether the widget is, or is about to be, mapped
+ *
+ * Gives the focused terminal the largest share of the input budget, and
+ * visible terminals a larger share than unmapped ones.
+ */
+void
+Terminal::update_scheduler_weight(bool mapped)
+{
+        auto weight = 1u;
+        if (m_has_focus)
+                weight = 4;
+        else if (mapped)
+                weight = 2;
+
+        g_scheduler.set_weight(m_scheduler_entry, weight);
+}
+
 void
 Terminal::start_processing()
 {
@@ -10320,9 +10846,14 @@ Terminal::time_process_incoming()
 bool
 Terminal::process(bool emit_adj_changed)
 {
+        if (!m_feed_bytes_queue.empty())
+                feed_bytes_drain();
+
         if (pty()) {
-                if (m_pty_input_active ||
-                    m_pty_input_source == 0) {
+                if (m_pty_reader_stream) {
+                        pty_reader_drain();
+                } else if (m_pty_input_active ||
+                           m_pty_input_source == 0) {
                         m_pty_input_active = false;
                         /* Do one read directly. FIXMEchpe: Why? */
                         pty_io_read(pty()->fd(), G_IO_IN);
@@ -10334,15 +10865,43 @@ Terminal::process(bool emit_adj_changed)
 
         bool is_active = !m_incoming_queue.empty();
         if (is_active) {
+                auto const start_time = g_get_monotonic_time();
                 if (VTE_MAX_PROCESS_TIME) {
                         time_process_incoming();
                 } else {
                         process_incoming();
                 }
+
+                g_scheduler.charge(m_scheduler_entry,
+                                   m_max_input_bytes,
+                                   m_input_bytes,
+                                   g_get_monotonic_time() - start_time);
+
+                _VTE_DEBUG_IF(VTE_DEBUG_TIMEOUT) {
+                        auto const& stats = m_scheduler_entry.stats();
+                        g_printerr("Processed %" G_GSIZE_FORMAT " bytes; "
+                                   "total %" G_GUINT64_FORMAT " bytes in %" G_GINT64_FORMAT "us "
+                                   "over %" G_GUINT64_FORMAT " rounds; "
+                                   "weight %u budget %" G_GSIZE_FORMAT " deficit %ld\n",
+                                   m_input_bytes,
+                                   stats.bytes_processed, stats.time_spent, stats.rounds,
+                                   m_scheduler_entry.weight(), stats.budget, stats.deficit);
+                }
+
                 m_input_bytes = 0;
         } else
                 emit_pending_signals();
 
+        /* Input that was held back because this terminal's allowance was
+         * used up keeps it active; give it a new quantum for the next round.
+         */
+        if (!is_active &&
+            (!m_feed_bytes_queue.empty() ||
+             (m_pty_reader_stream && !m_pty_reader_stream->empty()))) {
+                g_scheduler.replenish(m_scheduler_entry, m_max_input_bytes);
+                is_active = true;
+        }
+
         return is_active;
 }
 
@@ -10353,37 +10912,32 @@ static gboolean
 process_timeout (gpointer data) noexcept
 try
 {
-	GList *l, *next;
 	gboolean again;
 
 	in_process_timeout = TRUE;
 
 	_vte_debug_print (VTE_DEBUG_WORK, "<");
 	_vte_debug_print (VTE_DEBUG_TIMEOUT,
-                          "Process timeout:  %d active\n",
-                          g_list_length(g_active_terminals));
-
-	for (l = g_active_terminals; l != NULL; l = next) {
-		auto that = reinterpret_cast<vte::terminal::Terminal*>(l->data);
-		bool active;
-
-		next = l->next;
+                          "Process timeout:  %" G_GSIZE_FORMAT " active\n",
+                          g_scheduler.size());
 
-		if (l != g_active_terminals) {
+        auto n = 0u;
+        g_scheduler.for_each([&n](vte::terminal::Terminal* that) {
+		if (n++ > 0) {
 			_vte_debug_print (VTE_DEBUG_WORK, "T");
 		}
 
                 // FIXMEchpe find out why we don't emit_adjustment_changed() here!!
-                active = that->process(false);
+                auto const active = that->process(false);
 
 		if (!active) {
                         remove_from_active_list(that);
 		}
-	}
+        });
 
 	_vte_debug_print (VTE_DEBUG_WORK, ">");
 
-	if (g_active_terminals != nullptr && update_timeout_tag == 0) {
+	if (!g_scheduler.empty() && update_timeout_tag == 0) {
 		again = TRUE;
 	} else {
 		_vte_debug_print(VTE_DEBUG_TIMEOUT,
@@ -10445,32 +10999,27 @@ Terminal::invalidate_dirty_rects_and_process_updates()
 static gboolean
 update_repeat_timeout (gpointer data)
 {
-	GList *l, *next;
 	bool again;
 
 	in_update_timeout = TRUE;
 
 	_vte_debug_print (VTE_DEBUG_WORK, "[");
 	_vte_debug_print (VTE_DEBUG_TIMEOUT,
-                          "Repeat timeout:  %d active\n",
-                          g_list_length(g_active_terminals));
-
-	for (l = g_active_terminals; l != NULL; l = next) {
-		auto that = reinterpret_cast<vte::terminal::Terminal*>(l->data);
+                          "Repeat timeout:  %" G_GSIZE_FORMAT " active\n",
+                          g_scheduler.size());
 
-                next = l->next;
-
-		if (l != g_active_terminals) {
+        auto n = 0u;
+        g_scheduler.for_each([&n](vte::terminal::Terminal* that) {
+		if (n++ > 0) {
 			_vte_debug_print (VTE_DEBUG_WORK, "T");
 		}
 
                 that->process(true);
 
-		again = that->invalidate_dirty_rects_and_process_updates();
-		if (!again) {
+		if (!that->invalidate_dirty_rects_and_process_updates()) {
                         remove_from_active_list(that);
 		}
-	}
+        });
 
 	_vte_debug_print (VTE_DEBUG_WORK, "]");
 
@@ -10479,7 +11028,7 @@ update_repeat_timeout (gpointer data)
          * reinstall a new one because we need to delay by the amount of time
          * it took to repaint the screen: bug 730732.
 	 */
-	if (g_active_terminals == nullptr) {
+	if (g_scheduler.empty()) {
 		_vte_debug_print(VTE_DEBUG_TIMEOUT,
 				"Stopping update timeout\n");
 		update_timeout_tag = 0;
@@ -10512,30 +11061,25 @@ static gboolean
 update_timeout (gpointer data) noexcept
 try
 {
-	GList *l, *next;
-
 	in_update_timeout = TRUE;
 
 	_vte_debug_print (VTE_DEBUG_WORK, "{");
 	_vte_debug_print (VTE_DEBUG_TIMEOUT,
-                          "Update timeout:  %d active\n",
-                          g_list_length(g_active_terminals));
+                          "Update timeout:  %" G_GSIZE_FORMAT " active\n",
+                          g_scheduler.size());
 
         remove_process_timeout_source();
 
-	for (l = g_active_terminals; l != NULL; l = next) {
-		auto that = reinterpret_cast<vte::terminal::Terminal*>(l->data);
-
-                next = l->next;
-
-		if (l != g_active_terminals) {
+        auto n = 0u;
+        g_scheduler.for_each([&n](vte::terminal::Terminal* that) {
+		if (n++ > 0) {
 			_vte_debug_print (VTE_DEBUG_WORK, "T");
 		}
 
                 that->process(true);
 
                 that->invalidate_dirty_rects_and_process_updates();
-	}
+        });
 
 	_vte_debug_print (VTE_DEBUG_WORK, "}");
 
@@ -10567,6 +11111,182 @@ Terminal::write_contents_sync (GOutputStream *stream,
 					 cancellable, error);
 }
 
+#ifdef WITH_SIXEL
+
+/*
+ * Image decoding
+ *
+ * Converting a decoded sixel image to pixels and a Cairo surface happens on
+ * a worker thread. The image's place in the ring is reserved beforehand, so
+ * the job only carries the ring and the image's priority, and the result is
+ * dropped if the image has been removed in the meantime.
+ */
+
+namespace {
+
+class ImageDecodeJob {
+public:
+        ImageDecodeJob(vte::base::Ring* ring,
+                       int priority,
+                       sixel_image_t const& image) noexcept
+                : m_ring{ring},
+                  m_priority{priority},
+                  m_image(image)
+        {
+        }
+
+        ~ImageDecodeJob() noexcept { sixel_image_deinit(&m_image); }
+
+        ImageDecodeJob(ImageDecodeJob const&) = delete;
+        ImageDecodeJob(ImageDecodeJob&&) = delete;
+        ImageDecodeJob& operator=(ImageDecodeJob const&) = delete;
+        ImageDecodeJob& operator=(ImageDecodeJob&&) = delete;
+
+        vte::base::Ring* m_ring;
+        int m_priority;
+        sixel_image_t m_image;
+}; // class ImageDecodeJob
+
+} // anon namespace
+
+static void
+image_decode_thread_cb(GTask* task,
+                       void* source_object,
+                       void* task_data,
+                       GCancellable* cancellable) noexcept
+{
+        auto job = reinterpret_cast<ImageDecodeJob*>(task_data);
+        auto const& image = job->m_image;
+
+        auto surface = vte::cairo::Surface(cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                                      image.width,
+                                                                      image.height));
+        if (cairo_surface_status(surface.get()) != CAIRO_STATUS_SUCCESS ||
+            cairo_image_surface_get_stride(surface.get()) != image.width * 4) {
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        "Failed to create image surface");
+                return;
+        }
+
+        cairo_surface_flush(surface.get());
+        if (sixel_image_to_argb32(&image, cairo_image_surface_get_data(surface.get())) < 0) {
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        "Failed to convert image");
+                return;
+        }
+        cairo_surface_mark_dirty(surface.get());
+
+        g_task_return_pointer(task, surface.release(), (GDestroyNotify)cairo_surface_destroy);
+}
+
+static void
+image_decode_ready_cb(GObject* source_object,
+                      GAsyncResult* result,
+                      void* user_data) noexcept
+try
+{
+        auto task = G_TASK(result);
+
+        /* This fails when the terminal was destroyed (and thus the task
+         * cancelled), in which case @user_data is dangling.
+         */
+        auto error = vte::glib::Error{};
+        auto surface = vte::cairo::Surface(reinterpret_cast<cairo_surface_t*>(g_task_propagate_pointer(task, error)));
+        if (!surface) {
+                _vte_debug_print(VTE_DEBUG_IMAGE, "Image decoding failed: %s\n", error.message());
+                return;
+        }
+
+        auto that = reinterpret_cast<vte::terminal::Terminal*>(user_data);
+        auto job = reinterpret_cast<ImageDecodeJob*>(g_task_get_task_data(task));
+        that->image_decoded(job->m_ring, job->m_priority, std::move(surface));
+}
+catch (...)
+{
+        vte::log_exception();
+}
+
+/*
+ * Terminal::queue_image_decode:
+ * @ring: the ring the image was appended to
+ * @priority: the image's priority in @ring
+ * @image: the finished sixel image
+ *
+ * Converts @image on a worker thread, and attaches the result to the image
+ * with @priority in @ring when done. This takes over @image's data.
+ */
+void
+Terminal::queue_image_decode(vte::base::Ring* ring,
+                             int priority,
+                             sixel_image_t* image)
+{
+        auto job = new ImageDecodeJob{ring, priority, *image};
+        image->data = nullptr;
+
+        if (!m_image_decode_cancellable)
+                m_image_decode_cancellable = vte::glib::take_ref(g_cancellable_new());
+
+        auto task = vte::glib::take_ref(g_task_new(nullptr,
+                                                   m_image_decode_cancellable.get(),
+                                                   image_decode_ready_cb,
+                                                   this));
+        g_task_set_source_tag(task.get(), (void*)image_decode_ready_cb);
+        g_task_set_task_data(task.get(), job, [](void* data) { delete reinterpret_cast<ImageDecodeJob*>(data); });
+        g_task_run_in_thread(task.get(), image_decode_thread_cb);
+}
+
+/*
+ * Terminal::image_decoded:
+ * @ring: the ring the image was appended to
+ * @priority: the image's priority in @ring
+ * @image_surface: the decoded image
+ *
+ * Attaches the decoded pixels to the image, unless it has been removed (e.g.
+ * overdrawn, scrolled out, or the ring was reset) in the meantime.
+ */
+void
+Terminal::image_decoded(vte::base::Ring* ring,
+                        int priority,
+                        vte::cairo::Surface&& image_surface)
+{
+        auto image = ring->image_by_priority(priority);
+        if (!image)
+                return;
+
+        auto const width = cairo_image_surface_get_width(image_surface.get());
+        auto const height = cairo_image_surface_get_height(image_surface.get());
+
+	/* Convert to device-compatible surface for m_widget, if possible */
+
+        auto surface = vte::cairo::Surface{};
+        if (auto window = gtk_widget_get_window(m_widget)) {
+                surface = vte::cairo::Surface(gdk_window_create_similar_surface(window,
+                                                                                CAIRO_CONTENT_COLOR_ALPHA,
+                                                                                width, height));
+                if (!surface)
+                        return;
+
+                auto cr = cairo_create(surface.get());
+                cairo_set_source_surface(cr, image_surface.get(), 0, 0);
+                cairo_paint(cr);
+                cairo_destroy(cr);
+        } else {
+                surface = std::move(image_surface);
+        }
+
+        auto const top = image->get_top();
+        auto const bottom = image->get_bottom();
+        ring->set_image_surface(image, std::move(surface));
+
+        /* Later output may have been drawn over the image's area meanwhile,
+         * but text is always painted over images, so just redraw it.
+         */
+        if (ring == m_screen->row_data)
+                invalidate_rows(top, bottom);
+}
+
+#endif /* WITH_SIXEL */
+
 /*
  * Buffer search
  */
@@ -186,6 +186,9 @@ void vte_terminal_feed(VteTerminal *terminal,
                        const char *data,
                        gssize length) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
 _VTE_PUBLIC
+void vte_terminal_feed_bytes(VteTerminal *terminal,
+                             GBytes *bytes) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+_VTE_PUBLIC
 void vte_terminal_feed_child(VteTerminal *terminal,
                              const char *text,
                              gssize length) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
@@ -311,6 +314,34 @@ void vte_terminal_set_scrollback_lines(VteTerminal *terminal,
 _VTE_PUBLIC
 glong vte_terminal_get_scrollback_lines(VteTerminal *terminal) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
 
+/* Keep the scrollback in memory rather than in temporary files. */
+_VTE_PUBLIC
+void vte_terminal_set_scrollback_in_memory(VteTerminal *terminal,
+                                           gboolean in_memory) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+gboolean vte_terminal_get_scrollback_in_memory(VteTerminal *terminal) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+
+/* Limit the scrollback by the memory it takes. */
+_VTE_PUBLIC
+void vte_terminal_set_scrollback_bytes(VteTerminal *terminal,
+                                       gsize bytes) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+gsize vte_terminal_get_scrollback_bytes(VteTerminal *terminal) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+
+_VTE_PUBLIC
+gsize vte_terminal_get_memory_usage(VteTerminal *terminal,
+                                    gsize *cells,
+                                    gsize *scrollback,
+                                    gsize *hyperlinks,
+                                    gsize *images) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+
+_VTE_PUBLIC
+void vte_terminal_get_processing_stats(VteTerminal *terminal,
+                                       guint64 *bytes_processed,
+                                       gint64 *time_spent,
+                                       guint64 *rounds,
+                                       gsize *budget) _VTE_CXX_NOEXCEPT _VTE_GNUC_NONNULL(1);
+
 /* Set or retrieve the current font. */
 _VTE_PUBLIC
 void vte_terminal_set_font(VteTerminal *terminal,
@@ -86,6 +86,8 @@
 #define VTE_UPDATE_TIMEOUT		15
 #define VTE_UPDATE_REPEAT_TIMEOUT	30
 #define VTE_MAX_PROCESS_TIME		100
+#define VTE_REWRAP_SLICE_TIME		5    /* ms of rewrapping the scrollback per idle slice */
+#define VTE_REWRAP_SLICE_ROWS		4096 /* rows rewrapped between checking the time */
 #define VTE_CELL_BBOX_SLACK		1
 #define VTE_DEFAULT_UTF8_AMBIGUOUS_WIDTH 1
 
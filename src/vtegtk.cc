@@ -706,6 +706,12 @@ try
                 case PROP_REWRAP_ON_RESIZE:
                         g_value_set_boolean (value, vte_terminal_get_rewrap_on_resize (terminal));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        g_value_set_uint64 (value, vte_terminal_get_scrollback_bytes(terminal));
+                        break;
+                case PROP_SCROLLBACK_IN_MEMORY:
+                        g_value_set_boolean (value, vte_terminal_get_scrollback_in_memory(terminal));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         g_value_set_uint (value, vte_terminal_get_scrollback_lines(terminal));
                         break;
@@ -821,6 +827,12 @@ try
                 case PROP_REWRAP_ON_RESIZE:
                         vte_terminal_set_rewrap_on_resize (terminal, g_value_get_boolean (value));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        vte_terminal_set_scrollback_bytes (terminal, g_value_get_uint64 (value));
+                        break;
+                case PROP_SCROLLBACK_IN_MEMORY:
+                        vte_terminal_set_scrollback_in_memory (terminal, g_value_get_boolean (value));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         vte_terminal_set_scrollback_lines (terminal, g_value_get_uint (value));
                         break;
@@ -1894,6 +1906,34 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                       TRUE,
                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
 
+        /**
+         * VteTerminal:scrollback-bytes:
+         *
+         * The maximum number of bytes used by the lines of the normal screen,
+         * or 0 for no limit. See vte_terminal_set_scrollback_bytes().
+         *
+         * Since: 0.62
+         */
+        pspecs[PROP_SCROLLBACK_BYTES] =
+                g_param_spec_uint64 ("scrollback-bytes", NULL, NULL,
+                                     0, G_MAXSIZE,
+                                     0,
+                                     (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
+        /**
+         * VteTerminal:scrollback-in-memory:
+         *
+         * Whether the scrollback is kept in memory rather than in temporary
+         * files. It is compressed, and encrypted if VTE was built with
+         * encryption, either way.
+         *
+         * Since: 0.62
+         */
+        pspecs[PROP_SCROLLBACK_IN_MEMORY] =
+                g_param_spec_boolean ("scrollback-in-memory", NULL, NULL,
+                                      FALSE,
+                                      (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
         /**
          * VteTerminal:scrollback-lines:
          *
@@ -3531,6 +3571,37 @@ catch (...)
         vte::log_exception();
 }
 
+/**
+ * vte_terminal_feed_bytes:
+ * @terminal: a #VteTerminal
+ * @bytes: a #GBytes in the terminal's current encoding
+ *
+ * Interprets the data in @bytes as if it were data received from a child
+ * process, like vte_terminal_feed().
+ *
+ * Unlike vte_terminal_feed(), the data is not copied; instead @terminal
+ * keeps a reference to @bytes until all of its data has been processed.
+ * This makes it suitable for feeding large buffers; the data is still
+ * processed in the same time-sliced manner as data received from the
+ * child process.
+ *
+ * Since: 0.62
+ */
+void
+vte_terminal_feed_bytes(VteTerminal *terminal,
+                        GBytes *bytes) noexcept
+try
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+        g_return_if_fail(bytes != NULL);
+
+        WIDGET(terminal)->feed_bytes(bytes);
+}
+catch (...)
+{
+        vte::log_exception();
+}
+
 /**
  * vte_terminal_feed_child:
  * @terminal: a #VteTerminal
@@ -5344,6 +5415,208 @@ catch (...)
         return 0;
 }
 
+/**
+ * vte_terminal_set_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ * @bytes: the maximum number of bytes, or 0 for no limit
+ *
+ * Limits the scrollback by the memory and storage it takes, in addition to
+ * the number of lines set with vte_terminal_set_scrollback_lines(). Once the
+ * lines of the normal screen take more than @bytes, as reported by
+ * vte_terminal_get_memory_usage(), the oldest ones are discarded, but never
+ * the lines on the screen.
+ *
+ * This counts the lines in memory, the compressed scrollback, the hyperlinks
+ * and the images. The lines on the screen, and the images on them, take
+ * memory regardless; if they alone exceed @bytes, no scrollback is kept.
+ * The alternate screen, which has no scrollback, isn't limited.
+ *
+ * Since: 0.62
+ */
+void
+vte_terminal_set_scrollback_bytes(VteTerminal *terminal,
+                                  gsize bytes) noexcept
+try
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        if (IMPL(terminal)->set_scrollback_bytes(bytes))
+                g_object_notify_by_pspec(G_OBJECT(terminal), pspecs[PROP_SCROLLBACK_BYTES]);
+}
+catch (...)
+{
+        vte::log_exception();
+}
+
+/**
+ * vte_terminal_get_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: the maximum number of bytes used by the scrollback, or 0 for no limit
+ *
+ * Since: 0.62
+ */
+gsize
+vte_terminal_get_scrollback_bytes(VteTerminal *terminal) noexcept
+try
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+        return IMPL(terminal)->m_normal_screen.row_data->max_bytes();
+}
+catch (...)
+{
+        vte::log_exception();
+        return 0;
+}
+
+/**
+ * vte_terminal_get_memory_usage:
+ * @terminal: a #VteTerminal
+ * @cells: (out) (optional): a location to store the size of the rows in memory, or %NULL
+ * @scrollback: (out) (optional): a location to store the size of the compressed
+ *   scrollback, or %NULL
+ * @hyperlinks: (out) (optional): a location to store the size of the hyperlinks, or %NULL
+ * @images: (out) (optional): a location to store the size of the images, or %NULL
+ *
+ * Reports the number of bytes used by the terminal's rows, on both screens.
+ * Unless the scrollback is kept in memory (see
+ * vte_terminal_set_scrollback_in_memory()), its size is what it takes in
+ * temporary files; it is estimated either way.
+ *
+ * Returns: the sum of the above
+ *
+ * Since: 0.62
+ */
+gsize
+vte_terminal_get_memory_usage(VteTerminal *terminal,
+                              gsize *cells,
+                              gsize *scrollback,
+                              gsize *hyperlinks,
+                              gsize *images) noexcept
+try
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+
+        vte::base::Ring::MemoryUsage usage;
+        IMPL(terminal)->memory_usage(&usage);
+
+        if (cells)
+                *cells = usage.cells;
+        if (scrollback)
+                *scrollback = usage.streams;
+        if (hyperlinks)
+                *hyperlinks = usage.hyperlinks;
+        if (images)
+                *images = usage.images;
+
+        return usage.cells + usage.streams + usage.hyperlinks + usage.images;
+}
+catch (...)
+{
+        vte::log_exception();
+        return 0;
+}
+
+/**
+ * vte_terminal_get_processing_stats:
+ * @terminal: a #VteTerminal
+ * @bytes_processed: (out) (optional): a location to store the number of bytes
+ *   of input processed so far, or %NULL
+ * @time_spent: (out) (optional): a location to store the time spent processing
+ *   them, in microseconds, or %NULL
+ * @rounds: (out) (optional): a location to store the number of times the
+ *   terminal's input was processed, or %NULL
+ * @budget: (out) (optional): a location to store the number of bytes the
+ *   terminal may currently process per round, or %NULL
+ *
+ * Reports how much input @terminal has processed. The input of all the
+ * terminals in the process is read in rounds, sharing a budget per round;
+ * the focused terminal gets the largest share, and mapped terminals a larger
+ * one than unmapped ones.
+ *
+ * Since: 0.62
+ */
+void
+vte_terminal_get_processing_stats(VteTerminal *terminal,
+                                  guint64 *bytes_processed,
+                                  gint64 *time_spent,
+                                  guint64 *rounds,
+                                  gsize *budget) noexcept
+try
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        auto const& stats = IMPL(terminal)->scheduler_stats();
+
+        if (bytes_processed)
+                *bytes_processed = stats.bytes_processed;
+        if (time_spent)
+                *time_spent = stats.time_spent;
+        if (rounds)
+                *rounds = stats.rounds;
+        if (budget)
+                *budget = stats.budget;
+}
+catch (...)
+{
+        vte::log_exception();
+}
+
+/**
+ * vte_terminal_set_scrollback_in_memory:
+ * @terminal: a #VteTerminal
+ * @in_memory: whether to keep the scrollback in memory
+ *
+ * Controls whether the scrollback is kept in memory rather than in temporary
+ * files, e.g. where disk space for temporary files is scarce. Changing this
+ * moves the existing scrollback.
+ *
+ * The scrollback of all terminals in memory together is limited to a budget,
+ * 256 MiB by default, which can be changed with the
+ * VTE_SCROLLBACK_MEMORY_BUDGET environment variable. Beyond that, the oldest
+ * blocks of scrollback are dropped, cutting the history short from the top.
+ *
+ * The default is %FALSE, unless the VTE_SCROLLBACK_STORAGE environment
+ * variable is set to "memory".
+ *
+ * Since: 0.62
+ */
+void
+vte_terminal_set_scrollback_in_memory(VteTerminal *terminal,
+                                      gboolean in_memory) noexcept
+try
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        if (IMPL(terminal)->set_scrollback_in_memory(in_memory != FALSE))
+                g_object_notify_by_pspec(G_OBJECT(terminal), pspecs[PROP_SCROLLBACK_IN_MEMORY]);
+}
+catch (...)
+{
+        vte::log_exception();
+}
+
+/**
+ * vte_terminal_get_scrollback_in_memory:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: whether the scrollback is kept in memory rather than in temporary files
+ *
+ * Since: 0.62
+ */
+gboolean
+vte_terminal_get_scrollback_in_memory(VteTerminal *terminal) noexcept
+try
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), false);
+        return IMPL(terminal)->m_normal_screen.row_data->streams_in_memory();
+}
+catch (...)
+{
+        vte::log_exception();
+        return false;
+}
+
 /**
  * vte_terminal_set_scroll_on_keystroke:
  * @terminal: a #VteTerminal
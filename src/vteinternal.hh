@@ -39,6 +39,7 @@
 #include "reaper.hh"
 #include "ring.hh"
 #include "ringview.hh"
+#include "scheduler.hh"
 #include "buffer.h"
 #include "parser.hh"
 #include "parser-glue.hh"
@@ -52,8 +53,10 @@
 
 #include "chunk.hh"
 #include "pty.hh"
+#include "pty-reader.hh"
 #include "utf8.hh"
 
+#include <array>
 #include <list>
 #include <queue>
 #include <optional>
@@ -579,6 +582,8 @@ public:
 
         guint m_pty_input_source{0};
         guint m_pty_output_source{0};
+        /* Set when reading the PTY on the PtyReader thread instead of m_pty_input_source */
+        vte::base::PtyReader::stream_type m_pty_reader_stream{};
         bool m_pty_input_active{false};
         pid_t m_pty_pid{-1};           /* pid of child process */
         int m_child_exit_status{-1};   /* pid's exit status, or -1 */
@@ -595,7 +600,19 @@ public:
          */
         std::queue<vte::base::Chunk::unique_type, std::list<vte::base::Chunk::unique_type>> m_incoming_queue;
 
+        /* Queue of buffers from feed_bytes() not yet moved to the incoming
+         * queue, and the offset of the first unqueued byte in each.
+         */
+        struct FeedBytes {
+                vte::glib::BytesPtr bytes;
+                size_t offset;
+        };
+        std::queue<FeedBytes, std::list<FeedBytes>> m_feed_bytes_queue;
+
         vte::base::UTF8Decoder m_utf8_decoder;
+        /* Scratch buffer for decoded input, taken one chunk's worth of bytes at a time */
+        std::array<uint32_t, vte::base::Chunk::k_chunk_size + 1> m_utf32_buffer;
+        bool m_decoding_chunk{false}; /* m_utf8_decoder already holds the state at the slice's end */
 
         enum class DataSyntax {
                 eECMA48_UTF8,
@@ -616,10 +633,8 @@ public:
          */
         GArray *m_update_rects;
         bool m_invalidated_all{false};       /* pending refresh of entire terminal */
-        /* If non-nullptr, contains the GList element for @this in g_active_terminals
-         * and means that this terminal is processing data.
-         */
-        GList *m_active_terminals_link;
+        /* Active while this terminal is processing data or has pending updates */
+        vte::terminal::Scheduler<Terminal>::Entry m_scheduler_entry{this};
         // FIXMEchpe should these two be g[s]size ?
         size_t m_input_bytes;
         long m_max_input_bytes{VTE_MAX_INPUT_READ};
@@ -690,6 +705,11 @@ public:
         bool m_allow_bold{true};
         bool m_bold_is_bright{false};
         bool m_rewrap_on_resize{true};
+        long m_rewrap_pending_end{0};
+        bool rewrap_timer_callback();
+        vte::glib::Timer m_rewrap_timer{std::bind(&Terminal::rewrap_timer_callback,
+                                                  this),
+                                        "rewrap-timer"};
         gboolean m_text_modified_flag;
         gboolean m_text_inserted_flag;
         gboolean m_text_deleted_flag;
@@ -757,6 +777,20 @@ public:
         bool m_sixel_enabled{VTE_SIXEL_ENABLED_DEFAULT};
         bool m_images_enabled{VTE_SIXEL_ENABLED_DEFAULT};
         sixel_state_t m_sixel_state;
+        bool m_sixel_in_progress{false}; /* a DECSIXEL string is being decoded into m_sixel_state */
+
+#ifdef WITH_SIXEL
+        /* Cancelled on destruction, so that images decoded afterwards are dropped */
+        vte::glib::RefPtr<GCancellable> m_image_decode_cancellable{};
+
+        void queue_image_decode(vte::base::Ring* ring,
+                                int priority,
+                                sixel_image_t* image);
+        void image_decoded(vte::base::Ring* ring,
+                           int priority,
+                           vte::cairo::Surface&& image_surface);
+        void cancel_sixel() noexcept;
+#endif
 
         bool set_sixel_enabled(bool enabled) noexcept
         {
@@ -1000,6 +1034,9 @@ public:
                                        bool fill);
         /* inline */ VteRowData* ring_append(bool fill);
         /* inline */ void ring_remove(vte::grid::row_t position);
+        void ring_scroll_region(vte::grid::row_t start,
+                                vte::grid::row_t end,
+                                vte::grid::row_t amount);
         inline VteRowData const* find_row_data(vte::grid::row_t row) const;
         inline VteRowData* find_row_data_writable(vte::grid::row_t row) const;
         inline VteCell const* find_charcell(vte::grid::column_t col,
@@ -1036,6 +1073,10 @@ public:
         void insert_char(gunichar c,
                          bool insert,
                          bool invalidate_now);
+        size_t insert_chars(gunichar const* chars,
+                            size_t len);
+        void insert_char_repeated(gunichar c,
+                                  size_t count);
 
         void invalidate_row(vte::grid::row_t row);
         void invalidate_rows(vte::grid::row_t row_start,
@@ -1061,8 +1102,11 @@ public:
         void process_incoming_pcterm();
         #endif
         bool process(bool emit_adj_changed);
-        inline bool is_processing() const { return m_active_terminals_link != nullptr; }
+        inline bool is_processing() const { return m_scheduler_entry.active(); }
         void start_processing();
+        size_t input_allowance() const noexcept;
+        void update_scheduler_weight(bool mapped);
+        inline auto const& scheduler_stats() const noexcept { return m_scheduler_entry.stats(); }
 
         gssize get_preedit_width(bool left_only);
         gssize get_preedit_length(bool left_only);
@@ -1130,6 +1174,7 @@ public:
 
         void widget_realize();
         void widget_unrealize();
+        void widget_map();
         void widget_unmap();
         void widget_style_updated();
         void widget_focus_in();
@@ -1205,6 +1250,8 @@ public:
         void pty_channel_eof();
         bool pty_io_read(int const fd,
                          GIOCondition const condition);
+        void pty_reader_ready();
+        void pty_reader_drain(bool all = false);
         bool pty_io_write(int const fd,
                           GIOCondition const condition);
 
@@ -1235,6 +1282,8 @@ public:
 
         void feed(std::string_view const& data,
                   bool start_processsing_ = true);
+        void feed_bytes(GBytes* bytes);
+        void feed_bytes_drain();
         void feed_child(char const* data,
                         size_t length) { assert(data); feed_child({data, length}); }
         void feed_child(std::string_view const& str);
@@ -1524,6 +1573,9 @@ public:
         bool set_mouse_autohide(bool autohide);
         bool set_rewrap_on_resize(bool rewrap);
         bool set_scrollback_lines(long lines);
+        bool set_scrollback_in_memory(bool in_memory);
+        bool set_scrollback_bytes(size_t bytes);
+        void memory_usage(vte::base::Ring::MemoryUsage* usage) const;
         bool set_scroll_on_keystroke(bool scroll);
         bool set_scroll_on_output(bool scroll);
         bool set_images_enabled(bool enabled);
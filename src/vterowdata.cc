@@ -25,6 +25,7 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <type_traits>
 
 /* This will be true now that VteCell is POD, but make sure it'll be true
@@ -40,8 +41,8 @@ static_assert(std::is_trivially_move_assignable<VteCell>::value, "VteCell is not
  * VteCells: A row's cell array
  */
 
-typedef struct _VteCells VteCells;
 struct _VteCells {
+	vte::base::CellSlab::Chunk *chunk; /* NULL if not from a slab */
 	guint32 alloc_len;
 	VteCell cells[1];
 };
@@ -55,13 +56,20 @@ _vte_cells_for_cell_array (VteCell *cells)
 	return (VteCells *) (((guchar *) cells) - G_STRUCT_OFFSET (VteCells, cells));
 }
 
+static inline gsize
+_vte_cells_size (guint32 alloc_len)
+{
+	return G_STRUCT_OFFSET (VteCells, cells) + alloc_len * sizeof (VteCell);
+}
+
 static VteCells *
 _vte_cells_realloc (VteCells *cells, guint32 len)
 {
 	guint32 alloc_len = (1 << g_bit_storage (MAX (len, 80))) - 1;
 
 	_vte_debug_print(VTE_DEBUG_RING, "Enlarging cell array of %d cells to %d cells\n", cells ? cells->alloc_len : 0, alloc_len);
-	cells = (VteCells *)g_realloc (cells, G_STRUCT_OFFSET (VteCells, cells) + alloc_len * sizeof (cells->cells[0]));
+	cells = (VteCells *)g_realloc (cells, _vte_cells_size (alloc_len));
+	cells->chunk = NULL;
 	cells->alloc_len = alloc_len;
 
 	return cells;
@@ -75,6 +83,272 @@ _vte_cells_free (VteCells *cells)
 }
 
 
+/*
+ * CellSlab: The cell arrays of a ring's rows
+ */
+
+namespace vte::base {
+
+struct CellSlab::Chunk {
+        CellSlab* slab;
+        guint32 cls;
+        guint32 live;    /* cell arrays in use */
+        guint32 n_blocks;
+        guint32 padding;
+        /* followed by n_blocks cell arrays of block_size(cls) bytes */
+};
+
+static_assert(sizeof(CellSlab::Chunk) % alignof(VteCells) == 0, "CellSlab::Chunk has wrong size");
+
+/* Free cell arrays are linked through their first cells */
+static inline VteCells*
+free_list_next(VteCells* cells)
+{
+        VteCells* next;
+        memcpy(&next, cells->cells, sizeof(next));
+        return next;
+}
+
+static inline void
+free_list_set_next(VteCells* cells,
+                   VteCells* next)
+{
+        memcpy(cells->cells, &next, sizeof(next));
+}
+
+CellSlab::~CellSlab()
+{
+        for (auto chunk : m_chunks)
+                g_free(chunk);
+}
+
+size_t
+CellSlab::block_size(unsigned cls)
+{
+        auto const size = _vte_cells_size((1u << cls) - 1);
+        return (size + alignof(VteCells) - 1) & ~(alignof(VteCells) - 1);
+}
+
+/*
+ * CellSlab::set_columns:
+ * @columns: the number of columns
+ *
+ * Makes the cell arrays handed out from now on fit @columns cells, and
+ * releases the chunks left unused.
+ */
+void
+CellSlab::set_columns(glong columns)
+{
+        auto const cls = CLAMP(unsigned(g_bit_storage(MAX(columns, 0))), k_min_class, k_max_class);
+        if (cls == m_min_class)
+                return;
+
+        m_min_class = cls;
+        trim();
+}
+
+/*
+ * CellSlab::alloc:
+ * @len: the number of cells, less than 0xFFFF
+ *
+ * Returns: a cell array with room for at least @len cells, and for the
+ *   number of columns last set with set_columns()
+ */
+VteCells*
+CellSlab::alloc(gulong len)
+{
+        return alloc_class(MAX(m_min_class, unsigned(g_bit_storage(MAX(len, 80)))));
+}
+
+/*
+ * CellSlab::alloc_compact:
+ * @len: the number of compact cells, less than 0xFFFF
+ *
+ * Returns: a cell array with room for at least @len VteCompactCells
+ */
+VteCells*
+CellSlab::alloc_compact(gulong len)
+{
+        auto const n_cells = (len * sizeof(VteCompactCell) + sizeof(VteCell) - 1) / sizeof(VteCell);
+        return alloc_class(MAX(k_min_class, unsigned(g_bit_storage(n_cells))));
+}
+
+VteCells*
+CellSlab::alloc_class(unsigned cls)
+{
+        auto& free_list = m_free[cls - k_min_class];
+
+        m_stats.allocs++;
+
+        auto cells = free_list;
+        if (G_LIKELY(cells != nullptr)) {
+                free_list = free_list_next(cells);
+                cells->chunk->live++;
+                m_free_size -= block_size(cls);
+                m_stats.reuses++;
+                return cells;
+        }
+
+        auto const size = block_size(cls);
+        auto const n_blocks = MAX(k_chunk_size / size, size_t(1));
+
+        _vte_debug_print(VTE_DEBUG_RING, "Allocating a chunk of %" G_GSIZE_FORMAT " cell arrays of %u cells\n",
+                         n_blocks, (1u << cls) - 1);
+
+        auto const chunk = (Chunk*)g_malloc(sizeof(Chunk) + n_blocks * size);
+        chunk->slab = this;
+        chunk->cls = cls;
+        chunk->live = 1;
+        chunk->n_blocks = n_blocks;
+        m_chunks.push_back(chunk);
+        m_memory_size += sizeof(Chunk) + n_blocks * size;
+        m_free_size += (n_blocks - 1) * size;
+        m_stats.chunk_allocs++;
+
+        auto const blocks = (guchar*)(chunk + 1);
+        for (auto i = n_blocks; i-- > 0; ) {
+                cells = (VteCells*)(blocks + i * size);
+                cells->chunk = chunk;
+                cells->alloc_len = (1u << cls) - 1;
+                if (i > 0) {
+                        free_list_set_next(cells, free_list);
+                        free_list = cells;
+                }
+        }
+
+        return cells;
+}
+
+/*
+ * CellSlab::free:
+ * @cells: a cell array from alloc()
+ *
+ * Puts @cells back on its free list.
+ */
+void
+CellSlab::free(VteCells* cells)
+{
+        auto const chunk = cells->chunk;
+        auto& free_list = m_free[chunk->cls - k_min_class];
+
+        chunk->live--;
+        free_list_set_next(cells, free_list);
+        free_list = cells;
+        m_free_size += block_size(chunk->cls);
+        m_stats.frees++;
+}
+
+/*
+ * CellSlab::trim:
+ *
+ * Releases the chunks none of whose cell arrays are in use.
+ */
+void
+CellSlab::trim()
+{
+        for (auto& free_list : m_free) {
+                VteCells* kept = nullptr;
+                for (auto cells = free_list; cells != nullptr; ) {
+                        auto const next = free_list_next(cells);
+                        if (cells->chunk->live != 0) {
+                                free_list_set_next(cells, kept);
+                                kept = cells;
+                        } else {
+                                m_free_size -= block_size(cells->chunk->cls);
+                        }
+                        cells = next;
+                }
+                free_list = kept;
+        }
+
+        auto const it = std::remove_if(m_chunks.begin(), m_chunks.end(),
+                                       [this](Chunk* chunk) {
+                                               if (chunk->live != 0)
+                                                       return false;
+
+                                               m_memory_size -= sizeof(Chunk) + chunk->n_blocks * block_size(chunk->cls);
+                                               m_stats.chunk_frees++;
+                                               g_free(chunk);
+                                               return true;
+                                       });
+        m_chunks.erase(it, m_chunks.end());
+        m_trimmed_free_size = m_free_size;
+}
+
+/*
+ * CellSlab::maybe_trim:
+ *
+ * Calls trim() once a chunk's worth of cell arrays more than after the
+ * last one has been given back.
+ */
+void
+CellSlab::maybe_trim()
+{
+        m_trimmed_free_size = MIN(m_trimmed_free_size, m_free_size);
+        if (m_free_size - m_trimmed_free_size < k_chunk_size)
+                return;
+
+        trim();
+}
+
+/*
+ * StyleTable: The attributes of a ring's compact rows
+ */
+
+size_t
+StyleTable::Hash::operator()(VteCellAttr const& attr) const noexcept
+{
+        auto const h = std::hash<uint64_t>{}(attr.m_colors);
+        return h ^ (size_t(attr.attr) * 0x9e3779b1u) ^ (size_t(attr.hyperlink_idx) << 16);
+}
+
+/* Returns in @style the index of @attr, adding it if needed, unless the table is full */
+bool
+StyleTable::intern(VteCellAttr const& attr,
+                   guint16* style)
+{
+        auto it = m_index.find(attr);
+        if (G_LIKELY(it != m_index.end())) {
+                *style = it->second;
+                return true;
+        }
+
+        if (G_UNLIKELY(m_styles.size() == k_max_styles))
+                return false;
+
+        *style = guint16(m_styles.size());
+        m_styles.push_back(attr);
+        m_index.emplace(attr, *style);
+        return true;
+}
+
+void
+StyleTable::clear()
+{
+        m_styles.clear();
+        m_index.clear();
+}
+
+size_t
+StyleTable::memory_size() const noexcept
+{
+        return m_styles.capacity() * sizeof(VteCellAttr) +
+                m_index.size() * (sizeof(decltype(m_index)::value_type) + 2 * sizeof(void*)) +
+                m_index.bucket_count() * sizeof(void*);
+}
+
+} // namespace vte::base
+
+static inline void
+_vte_cells_release (VteCells *cells)
+{
+	if (cells->chunk)
+		cells->chunk->slab->free (cells);
+	else
+		_vte_cells_free (cells);
+}
+
+
 /*
  * VteRowData: A row's data
  */
@@ -89,6 +363,11 @@ void
 _vte_row_data_clear (VteRowData *row)
 {
 	VteCell *cells = row->cells;
+	if (G_UNLIKELY (row->attr.compact)) {
+		if (cells)
+			_vte_cells_release (_vte_cells_for_cell_array (cells));
+		cells = NULL;
+	}
 	_vte_row_data_init (row);
 	row->cells = cells;
 }
@@ -97,8 +376,85 @@ void
 _vte_row_data_fini (VteRowData *row)
 {
 	if (row->cells)
-		_vte_cells_free (_vte_cells_for_cell_array (row->cells));
+		_vte_cells_release (_vte_cells_for_cell_array (row->cells));
 	row->cells = NULL;
+	row->attr.compact = 0;
+}
+
+/* Gives a row without cell array one from @slab */
+void
+_vte_row_data_alloc (VteRowData *row, vte::base::CellSlab& slab)
+{
+	if (G_LIKELY (row->cells))
+		return;
+
+	row->cells = slab.alloc (0)->cells;
+}
+
+/*
+ * Switches @row to the compact layout, interning its attributes in @styles,
+ * with a smaller cell array from @slab.
+ * Its full cell array goes back to where it came from.
+ *
+ * Returns: %FALSE, leaving @row as it is, if @styles is full
+ */
+gboolean
+_vte_row_data_compact (VteRowData *row, vte::base::StyleTable& styles, vte::base::CellSlab& slab)
+{
+	VteCompactCell *compact_cells = NULL;
+
+	if (row->attr.compact)
+		return TRUE;
+
+	if (row->len) {
+		VteCells *compact = slab.alloc_compact (row->len);
+		compact_cells = (VteCompactCell *) compact->cells;
+		for (gulong i = 0; i < row->len; i++) {
+			compact_cells[i].c = row->cells[i].c;
+			if (G_UNLIKELY (!styles.intern (row->cells[i].attr, &compact_cells[i].style))) {
+				slab.free (compact);
+				return FALSE;
+			}
+		}
+	}
+
+	if (row->cells)
+		_vte_cells_release (_vte_cells_for_cell_array (row->cells));
+	row->compact_cells = compact_cells;
+	row->attr.compact = 1;
+	return TRUE;
+}
+
+/* Switches @row back to the full layout, with a cell array from @slab */
+void
+_vte_row_data_expand (VteRowData *row, vte::base::StyleTable const& styles, vte::base::CellSlab& slab)
+{
+	if (!row->attr.compact)
+		return;
+
+	VteCompactCell *compact_cells = row->compact_cells;
+	VteCells *cells = slab.alloc (row->len);
+	for (gulong i = 0; i < row->len; i++) {
+		cells->cells[i].c = compact_cells[i].c;
+		cells->cells[i].attr = styles.get (compact_cells[i].style);
+	}
+	if (compact_cells)
+		_vte_cells_release (_vte_cells_for_cell_array ((VteCell *) compact_cells));
+
+	row->cells = cells->cells;
+	row->attr.compact = 0;
+}
+
+/* Moves the attributes of a compact @row from @old_styles over to @styles */
+void
+_vte_row_data_restyle (VteRowData *row, vte::base::StyleTable const& old_styles, vte::base::StyleTable& styles)
+{
+	if (!row->attr.compact)
+		return;
+
+	/* @styles can't fill up, it only gets a subset of @old_styles */
+	for (gulong i = 0; i < row->len; i++)
+		styles.intern (old_styles.get (row->compact_cells[i].style), &row->compact_cells[i].style);
 }
 
 static inline gboolean
@@ -111,6 +467,15 @@ _vte_row_data_ensure (VteRowData *row, gulong len)
 	if (G_UNLIKELY (len >= 0xFFFF))
 		return FALSE;
 
+	if (cells && cells->chunk) {
+		auto slab = cells->chunk->slab;
+		auto new_cells = slab->alloc (len);
+		memcpy (new_cells->cells, cells->cells, row->len * sizeof (cells->cells[0]));
+		slab->free (cells);
+		row->cells = new_cells->cells;
+		return TRUE;
+	}
+
 	row->cells = _vte_cells_realloc (cells, len)->cells;
 
 	return TRUE;
@@ -193,3 +558,12 @@ guint16 _vte_row_data_nonempty_length (const VteRowData *row)
         return len;
 }
 
+
+/* The number of bytes allocated for the row's cells */
+gsize _vte_row_data_memory_size (const VteRowData *row)
+{
+        VteCells *cells = _vte_cells_for_cell_array (row->cells);
+        if (!cells)
+                return 0;
+        return _vte_cells_size (cells->alloc_len);
+}
@@ -29,6 +29,9 @@
 #include "attr.hh"
 #include "cell.hh"
 
+#include <unordered_map>
+#include <vector>
+
 G_BEGIN_DECLS
 
 /*
@@ -38,15 +41,30 @@ G_BEGIN_DECLS
 typedef struct _VteRowAttr {
         guint8 soft_wrapped  : 1;
         guint8 bidi_flags    : 4;
+        guint8 compact       : 1;  /* cells in compact_cells, see Ring::compact_row() */
 } VteRowAttr;
 static_assert(sizeof (VteRowAttr) == 1, "VteRowAttr has wrong size");
 
+/*
+ * VteCompactCell: A cell as its character and the index of its attributes
+ * in a vte::base::StyleTable
+ */
+
+typedef struct _VTE_GNUC_PACKED _VteCompactCell {
+	vteunistr c;
+	guint16 style;
+} VteCompactCell;
+static_assert(sizeof (VteCompactCell) == 6, "VteCompactCell has wrong size");
+
 /*
  * VteRowData: A single row's data
  */
 
 typedef struct _VteRowData {
-	VteCell *cells;
+	union {
+		VteCell *cells;
+		VteCompactCell *compact_cells;  /* if attr.compact */
+	};
 	guint16 len;
 	VteRowAttr attr;
 } VteRowData;
@@ -72,6 +90,8 @@ _vte_row_data_get_writable (VteRowData *row, gulong col)
 	return &row->cells[col];
 }
 
+typedef struct _VteCells VteCells;
+
 void _vte_row_data_init (VteRowData *row);
 void _vte_row_data_clear (VteRowData *row);
 void _vte_row_data_fini (VteRowData *row);
@@ -82,5 +102,132 @@ void _vte_row_data_fill (VteRowData *row, const VteCell *cell, gulong len);
 void _vte_row_data_shrink (VteRowData *row, gulong max_len);
 void _vte_row_data_copy (const VteRowData *src, VteRowData *dst);
 guint16 _vte_row_data_nonempty_length (const VteRowData *row);
+gsize _vte_row_data_memory_size (const VteRowData *row);
 
 G_END_DECLS
+
+namespace vte::base {
+
+/*
+ * CellSlab: Hands out the cell arrays of a ring's rows.
+ *
+ * Cell arrays are carved out of large chunks, in a few fixed capacities,
+ * the smallest one fitting the current number of columns, and are kept on
+ * free lists for reuse when their rows are cleared or grow. Chunks are only
+ * given back to the system by trim(), once none of their arrays is in use.
+ *
+ * Rows remember the slab of their cell array, so the _vte_row_data_*
+ * functions don't need to know about it, except to give a row its first
+ * cell array with _vte_row_data_alloc().
+ *
+ * Compact rows get their VteCompactCells from the slab too, in the smaller
+ * capacities; since compacting gives full arrays back in bulk, the ring
+ * calls maybe_trim() afterwards so that their chunks don't stay around.
+ */
+class CellSlab {
+public:
+        struct Chunk;
+
+        typedef struct _Stats {
+                guint64 allocs;       /* cell arrays handed out */
+                guint64 reuses;       /* ... of which from the free lists */
+                guint64 frees;        /* cell arrays given back */
+                guint64 chunk_allocs; /* chunks allocated */
+                guint64 chunk_frees;  /* chunks released by trim() */
+        } Stats;
+
+        CellSlab() = default;
+        ~CellSlab();
+
+        CellSlab(CellSlab const&) = delete;
+        CellSlab(CellSlab&&) = delete;
+        CellSlab& operator=(CellSlab const&) = delete;
+        CellSlab& operator=(CellSlab&&) = delete;
+
+        void set_columns(glong columns);
+        VteCells* alloc(gulong len);
+        VteCells* alloc_compact(gulong len);
+        void free(VteCells* cells);
+        void trim();
+        void maybe_trim();
+
+        inline size_t memory_size() const noexcept { return m_memory_size; }
+        inline Stats const& stats() const noexcept { return m_stats; }
+
+private:
+        /* Capacities are (1 << class) - 1 cells, as for the arrays not from a slab;
+         * the classes below 7 only hold compact cells */
+        static constexpr unsigned const k_min_class = 5;
+        static constexpr unsigned const k_max_class = 16;
+        static constexpr size_t const k_chunk_size = 256 * 1024;
+
+        static size_t block_size(unsigned cls);
+        VteCells* alloc_class(unsigned cls);
+
+        unsigned m_min_class{k_min_class};
+        VteCells* m_free[k_max_class - k_min_class + 1]{};
+        std::vector<Chunk*> m_chunks;
+        size_t m_memory_size{0};
+        size_t m_free_size{0};         /* bytes on the free lists */
+        size_t m_trimmed_free_size{0}; /* ... after the last trim, or less since */
+        Stats m_stats{};
+};
+
+/*
+ * StyleTable: Interns the cell attributes of a ring's compact rows.
+ *
+ * A row usually has only a few distinct attributes, so compact rows store
+ * a 16-bit index into this table for each cell instead of the attributes.
+ * Styles are never removed one by one; the ring rebuilds the table from
+ * the rows still using it once it is full.
+ */
+class StyleTable {
+public:
+        static constexpr size_t const k_max_styles = 1 << 16;
+
+        StyleTable() = default;
+
+        StyleTable(StyleTable const&) = delete;
+        StyleTable(StyleTable&&) = default;
+        StyleTable& operator=(StyleTable const&) = delete;
+        StyleTable& operator=(StyleTable&&) = default;
+
+        bool intern(VteCellAttr const& attr,
+                    guint16* style);
+        inline VteCellAttr const& get(guint16 style) const noexcept { return m_styles[style]; }
+        void clear();
+
+        inline size_t size() const noexcept { return m_styles.size(); }
+        size_t memory_size() const noexcept;
+
+private:
+        struct Hash {
+                size_t operator()(VteCellAttr const& attr) const noexcept;
+        };
+        struct Equal {
+                inline bool operator()(VteCellAttr const& a,
+                                       VteCellAttr const& b) const noexcept { return memcmp(&a, &b, sizeof(a)) == 0; }
+        };
+
+        std::vector<VteCellAttr> m_styles;
+        std::unordered_map<VteCellAttr, guint16, Hash, Equal> m_index;
+};
+
+} // namespace vte::base
+
+void _vte_row_data_alloc (VteRowData *row, vte::base::CellSlab& slab);
+gboolean _vte_row_data_compact (VteRowData *row, vte::base::StyleTable& styles, vte::base::CellSlab& slab);
+void _vte_row_data_expand (VteRowData *row, vte::base::StyleTable const& styles, vte::base::CellSlab& slab);
+void _vte_row_data_restyle (VteRowData *row, vte::base::StyleTable const& old_styles, vte::base::StyleTable& styles);
+
+/* The attributes of a cell of @row, compact or not */
+static inline VteCellAttr const*
+_vte_row_data_get_attr (const VteRowData *row, gulong col, vte::base::StyleTable const& styles)
+{
+	if (G_UNLIKELY (row->len <= col))
+		return NULL;
+
+	if (row->attr.compact)
+		return &styles.get (row->compact_cells[col].style);
+	return &row->cells[col].attr;
+}
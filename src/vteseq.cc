@@ -337,10 +337,7 @@ Terminal::scroll_text(vte::grid::row_t scroll_amount)
 
 	if (scroll_amount > 0) {
                 /* Scroll down. */
-		for (auto i = 0; i < scroll_amount; i++) {
-                        ring_remove(end);
-                        ring_insert(start, true);
-		}
+                ring_scroll_region(start, end, scroll_amount);
                 /* Set the boundaries to hard wrapped where we tore apart the contents.
                  * Need to do it after scrolling down, for the end row to be the desired one. */
                 set_hard_wrapped(start - 1);
@@ -351,10 +348,7 @@ Terminal::scroll_text(vte::grid::row_t scroll_amount)
                 set_hard_wrapped(start - 1);
                 set_hard_wrapped(end);
                 /* Scroll up. */
-		for (auto i = 0; i < -scroll_amount; i++) {
-                        ring_remove(start);
-                        ring_insert(end, true);
-		}
+                ring_scroll_region(start, end, scroll_amount);
 	}
 
         /* Repaint the affected lines. No need to extend, set_hard_wrapped() took care of
@@ -1285,7 +1279,7 @@ Terminal::erase_in_line(vte::parser::Sequence const& seq)
 void
 Terminal::insert_lines(vte::grid::row_t param)
 {
-        vte::grid::row_t start, end, i;
+        vte::grid::row_t start, end;
 
 	/* Find the region we're messing with. */
         auto row = m_screen->cursor.row;
@@ -1307,12 +1301,9 @@ Terminal::insert_lines(vte::grid::row_t param)
         auto limit = end - row + 1;
         param = MIN (param, limit);
 
-	for (i = 0; i < param; i++) {
-		/* Clear a line off the end of the region and add one to the
-		 * top of the region. */
-                ring_remove(end);
-                ring_insert(row, true);
-	}
+        /* Clear lines off the end of the region and add them to the
+         * top of the region. */
+        ring_scroll_region(row, end, param);
 
         /* Set the boundaries to hard wrapped where we tore apart the contents.
          * Need to do it after scrolling down, for the end row to be the desired one. */
@@ -1333,7 +1324,7 @@ Terminal::insert_lines(vte::grid::row_t param)
 void
 Terminal::delete_lines(vte::grid::row_t param)
 {
-        vte::grid::row_t start, end, i;
+        vte::grid::row_t start, end;
 
 	/* Find the region we're messing with. */
         auto row = m_screen->cursor.row;
@@ -1360,13 +1351,9 @@ Terminal::delete_lines(vte::grid::row_t param)
         auto limit = end - row + 1;
         param = MIN (param, limit);
 
-	/* Clear them from below the current cursor. */
-	for (i = 0; i < param; i++) {
-		/* Insert a line at the end of the region and remove one from
-		 * the top of the region. */
-                ring_remove(row);
-                ring_insert(end, true);
-	}
+	/* Clear them from below the current cursor: remove lines from
+         * the top of the region and insert them at the end of the region. */
+        ring_scroll_region(row, end, -param);
         m_screen->cursor.col = 0;
 
         /* Repaint the affected lines. No need to extend, set_hard_wrapped() took care of
@@ -1689,7 +1676,8 @@ Terminal::GRAPHIC(vte::parser::Sequence const& seq)
         return 0;
 #endif
 
-        insert_char(seq.terminator(), false, false);
+        auto const c = gunichar{seq.terminator()};
+        insert_chars(&c, 1);
 }
 
 void
@@ -4330,6 +4318,24 @@ Terminal::DECSGR(vte::parser::Sequence const& seq)
         /* TODO: consider implementing sub/superscript? */
 }
 
+#ifdef WITH_SIXEL
+
+/* Frees the sixel parser's buffers, if a DECSIXEL string is being decoded.
+ * Called when the string is cancelled before its ST, see process_incoming_utf8(),
+ * and on reset.
+ */
+void
+Terminal::cancel_sixel() noexcept
+{
+        if (!m_sixel_in_progress)
+                return;
+
+        sixel_parser_deinit(&m_sixel_state);
+        m_sixel_in_progress = false;
+}
+
+#endif /* WITH_SIXEL */
+
 void
 Terminal::DECSIXEL(vte::parser::Sequence const& seq)
 {
@@ -4343,43 +4349,54 @@ Terminal::DECSIXEL(vte::parser::Sequence const& seq)
         if (!m_sixel_enabled)
                 return;
 
-	unsigned char *pixels = NULL;
-	auto fg = get_color(VTE_DEFAULT_FG);
-	auto bg = get_color(VTE_DEFAULT_BG);
-	int nfg = (fg->red >> 8) | ((fg->green >> 8) << 8) | ((fg->blue >> 8) << 16);
-	int nbg = (bg->red >> 8) | ((bg->green >> 8) << 8) | ((bg->blue >> 8) << 16);
 	glong left, top, width, height;
 	glong pixelwidth, pixelheight;
 	glong i;
-	cairo_surface_t *image_surface, *surface;
-	cairo_t *cr;
 
-        /* This is unfortunate, but it avoids copying or measuring potentially
-         * megabytes of data */
+        /* The string arrives in segments, which are decoded as they come in.
+         * An image whose DCS was cancelled before the ST has already been
+         * discarded by cancel_sixel(); a new one starting is a cancel too.
+         */
+        auto const segment = seq.string_segment();
+        if (segment & VTE_SEQ_STRING_SEGMENT_FIRST) {
+                cancel_sixel();
+
+                auto fg = get_color(VTE_DEFAULT_FG);
+                auto bg = get_color(VTE_DEFAULT_BG);
+                int nfg = (fg->red >> 8) | ((fg->green >> 8) << 8) | ((fg->blue >> 8) << 16);
+                int nbg = (bg->red >> 8) | ((bg->green >> 8) << 8) | ((bg->blue >> 8) << 16);
+
+                if (sixel_parser_init(&m_sixel_state, nfg, nbg,
+                                      m_modes_private.XTERM_SIXEL_PRIVATE_COLOR_REGISTERS()) < 0) {
+                        sixel_parser_deinit(&m_sixel_state);
+                        return;
+                }
+
+                m_sixel_in_progress = true;
+        }
+
+        if (!m_sixel_in_progress)
+                return;
+
+        /* This is unfortunate, but it avoids copying the data */
         const vte_seq_string_t *arg_str = &((*((vte::parser::Sequence &) seq).seq_ptr())->arg_str);
 
 	/* Parse image */
 
-	if (sixel_parser_init(&m_sixel_state, nfg, nbg,
-                              m_modes_private.XTERM_SIXEL_PRIVATE_COLOR_REGISTERS()) < 0) {
-		sixel_parser_deinit(&m_sixel_state);
-		return;
-	}
 	if (sixel_parser_feed(&m_sixel_state, arg_str->buf, arg_str->len) < 0) {
-		sixel_parser_deinit(&m_sixel_state);
+                cancel_sixel();
 		return;
 	}
-	pixels = (unsigned char *)g_try_malloc(m_sixel_state.image.width * m_sixel_state.image.height * 4);
-	if (!pixels) {
-		sixel_parser_deinit(&m_sixel_state);
-		return;
-	}
-	if (sixel_parser_finalize(&m_sixel_state, pixels) < 0) {
-                g_free(pixels);
+
+        if (!(segment & VTE_SEQ_STRING_SEGMENT_LAST))
+                return;
+
+        m_sixel_in_progress = false;
+
+	if (sixel_parser_finish(&m_sixel_state) < 0) {
 		sixel_parser_deinit(&m_sixel_state);
 		return;
 	}
-	sixel_parser_deinit(&m_sixel_state);
 
 	/* Calculate geometry */
 
@@ -4390,31 +4407,14 @@ Terminal::DECSIXEL(vte::parser::Sequence const& seq)
 	pixelwidth = m_sixel_state.image.width;
 	pixelheight = m_sixel_state.image.height;
 
-	/* Convert to device-compatible surface for m_widget */
-
-	image_surface = cairo_image_surface_create_for_data(pixels, CAIRO_FORMAT_ARGB32, pixelwidth, pixelheight, pixelwidth * 4);
-        if (!image_surface) {
-                g_free(pixels);
-                return;
-        }
-
-	surface = gdk_window_create_similar_surface(gtk_widget_get_window (m_widget), CAIRO_CONTENT_COLOR_ALPHA, pixelwidth, pixelheight);
-        if (!surface) {
-                cairo_surface_destroy(image_surface);
-                g_free(pixels);
-                return;
-        }
-
-	cr = cairo_create(surface);
-	cairo_set_source_surface(cr, image_surface, 0, 0);
-	cairo_paint(cr);
-	cairo_destroy(cr);
-	cairo_surface_destroy(image_surface);
-	g_free(pixels);
+	/* Append image to Ring. Its footprint is reserved right away, so that
+	 * emulation doesn't depend on decoding; the pixels are converted off the
+	 * main thread, and attached when ready. */
 
-	/* Append image to Ring */
-
-	m_screen->row_data->append_image(surface, pixelwidth, pixelheight, left, top, m_cell_width, m_cell_height);
+	auto const priority = m_screen->row_data->append_image(nullptr, pixelwidth, pixelheight, left, top, m_cell_width, m_cell_height);
+        if (priority >= 0)
+                queue_image_decode(m_screen->row_data, priority, &m_sixel_state.image);
+	sixel_parser_deinit(&m_sixel_state);
 
 	/* Erase characters under the image */
 
@@ -6842,9 +6842,7 @@ Terminal::REP(vte::parser::Sequence const& seq)
 
         auto const count = seq.collect1(0, 1, 1, int(m_column_count - m_screen->cursor.col));
 
-        // FIXMEchpe insert in one run so we only clean up fragments once
-        for (auto i = 0; i < count; i++)
-                insert_char(m_last_graphic_character, false, true);
+        insert_char_repeated(m_last_graphic_character, count);
 }
 
 void
@@ -6875,8 +6873,7 @@ Terminal::RI(vte::parser::Sequence const& seq)
         if (m_screen->cursor.row == start) {
 		/* If we're at the top of the scrolling region, add a
 		 * line at the top to scroll the bottom off. */
-		ring_remove(end);
-		ring_insert(start, true);
+                ring_scroll_region(start, end, 1);
 
                 /* Set the boundaries to hard wrapped where we tore apart the contents.
                  * Need to do it after scrolling down, for the end row to be the desired one. */
@@ -67,10 +67,16 @@
  *   to the previous layers, this one provides methods on arbitrary amount of
  *   data. It doesn't offer random-access-writes, instead, it offers appending
  *   data, and truncating the head (undoing the latest appends). Write
- *   requests are batched up until there's a complete block to be compressed,
- *   encrypted and written to disk. Read requests are answered by reading,
+ *   requests are batched up until there's a complete block, which is then
+ *   handed to a worker thread to be compressed, encrypted and written to
+ *   disk, so that this doesn't stall the main thread. Read requests are answered by reading,
  *   decrypting and uncompressing possibly more underlying blocks, and sped up
- *   by caching the result.
+ *   by caching the result in a small LRU of blocks. When consecutive reads
+ *   walk across block boundaries in one direction, the next block in that
+ *   direction is read ahead into the cache.
+ *
+ * Instead of a file, the snake can keep the blocks in memory (see
+ * VteBlockStore), for systems where temporary files are unwanted.
  *
  * Design discussions: https://bugzilla.gnome.org/show_bug.cgi?id=738601
  */
@@ -84,6 +90,17 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+#ifdef WITH_LZ4
+# include <lz4.h>
+#endif
+#ifdef WITH_ZSTD
+# include <zstd.h>
+#endif
+
 #ifdef WITH_GNUTLS
 # include <gnutls/gnutls.h>
 # include <gnutls/crypto.h>
@@ -118,8 +135,12 @@ typedef guint8 _vte_overwrite_counter_t;
 #endif
 
 #define VTE_BLOCK_DATALENGTH_SIZE  sizeof(_vte_block_datalength_t)
+/* The top 4 bits of the data length store the codec; zlib is 0, as in blocks from before codecs were added */
+#define VTE_BLOCK_CODEC_SHIFT      (8 * VTE_BLOCK_DATALENGTH_SIZE - 4)
+#define VTE_BLOCK_DATALENGTH_MASK  ((_vte_block_datalength_t) ((1u << VTE_BLOCK_CODEC_SHIFT) - 1))
 #define VTE_OVERWRITE_COUNTER_SIZE sizeof(_vte_overwrite_counter_t)
 #define VTE_BOA_BLOCKSIZE (VTE_SNAKE_BLOCKSIZE - VTE_BLOCK_DATALENGTH_SIZE - VTE_OVERWRITE_COUNTER_SIZE - VTE_CIPHER_TAG_SIZE)
+G_STATIC_ASSERT (VTE_BOA_BLOCKSIZE <= VTE_BLOCK_DATALENGTH_MASK);
 
 #define OFFSET_BOA_TO_SNAKE(x) ((x) / VTE_BOA_BLOCKSIZE * VTE_SNAKE_BLOCKSIZE)
 #define ALIGN_BOA(x) ((x) / VTE_BOA_BLOCKSIZE * VTE_BOA_BLOCKSIZE)
@@ -273,6 +294,229 @@ _file_write (int fd, const char *data, gsize len, gsize offset)
 
 /******************************************************************************************/
 
+/*
+ * VteBlockStore: Keep the snake's blocks in memory rather than in a file.
+ *
+ * Each block is stored with its written length only, allocated from slabs
+ * of VTE_ARENA_SLAB_SIZE bytes. Blocks are mostly appended at the head and
+ * dropped at the tail, so a bump allocator suffices: a slab is freed when the
+ * last block allocated from it is dropped. The slabs of all the stores are
+ * accounted against an overall budget; when it's exhausted, a store drops its
+ * own oldest blocks to make room, so the history is cut short at the tail
+ * instead of getting holes. Only if there are none left, writes fail the same
+ * way as on a full disk.
+ */
+
+#ifndef VTESTREAM_MAIN
+# define VTE_ARENA_SLAB_SIZE (16 * VTE_SNAKE_BLOCKSIZE)
+# define VTE_BLOCK_STORE_DEFAULT_BUDGET (256 * 1024 * 1024)
+#else
+# define VTE_ARENA_SLAB_SIZE (3 * VTE_SNAKE_BLOCKSIZE)
+# define VTE_BLOCK_STORE_DEFAULT_BUDGET (8 * VTE_ARENA_SLAB_SIZE)
+#endif
+
+typedef struct _VteArenaSlab {
+        gsize used;   /* bytes handed out */
+        int live;     /* number of blocks handed out and not yet released */
+        char *data;   /* VTE_ARENA_SLAB_SIZE bytes, following the header */
+} VteArenaSlab;
+
+typedef struct _VteMemoryBlock {
+        VteArenaSlab *slab;  /* NULL if nothing is stored, e.g. after a failed write */
+        char *data;
+        gsize len;
+} VteMemoryBlock;
+
+typedef struct _VteBlockStore {
+        VteMemoryBlock *blocks;  /* circular, indexed by block number */
+        gsize capacity;          /* a power of two */
+        gsize first, count;      /* number of the first block, and the number of blocks */
+        VteArenaSlab *current;   /* the slab being filled */
+} VteBlockStore;
+
+/* Both are accessed atomically, since blocks are written on the worker thread */
+static gsize _vte_block_store_budget = 0;  /* 0 means not initialized yet */
+static gsize _vte_block_store_usage = 0;
+
+static gsize
+_vte_block_store_get_budget (void)
+{
+        gsize budget = (gsize) g_atomic_pointer_get (&_vte_block_store_budget);
+        const char *str;
+
+        if (G_LIKELY (budget != 0))
+                return budget;
+
+        budget = VTE_BLOCK_STORE_DEFAULT_BUDGET;
+        str = g_getenv ("VTE_SCROLLBACK_MEMORY_BUDGET");
+        if (str != NULL) {
+                guint64 value;
+                if (g_ascii_string_to_unsigned (str, 10, 1, G_MAXSIZE, &value, NULL))
+                        budget = value;
+                else
+                        g_warning ("Invalid VTE_SCROLLBACK_MEMORY_BUDGET \"%s\"", str);
+        }
+
+        /* Unless _vte_memory_stream_set_budget() was called meanwhile */
+        if (!g_atomic_pointer_compare_and_exchange (&_vte_block_store_budget, (gsize) 0, budget))
+                budget = (gsize) g_atomic_pointer_get (&_vte_block_store_budget);
+        return budget;
+}
+
+static VteArenaSlab *
+_vte_arena_slab_new (void)
+{
+        VteArenaSlab *slab;
+        gsize usage = g_atomic_pointer_add (&_vte_block_store_usage, VTE_ARENA_SLAB_SIZE);
+
+        if (G_UNLIKELY (usage + VTE_ARENA_SLAB_SIZE > _vte_block_store_get_budget ())) {
+                g_atomic_pointer_add (&_vte_block_store_usage, -(gssize) VTE_ARENA_SLAB_SIZE);
+                return NULL;
+        }
+
+        slab = (VteArenaSlab *) g_malloc (sizeof (VteArenaSlab) + VTE_ARENA_SLAB_SIZE);
+        slab->used = 0;
+        slab->live = 0;
+        slab->data = (char *) (slab + 1);
+        return slab;
+}
+
+static void
+_vte_arena_slab_free (VteArenaSlab *slab)
+{
+        g_free (slab);
+        g_atomic_pointer_add (&_vte_block_store_usage, -(gssize) VTE_ARENA_SLAB_SIZE);
+}
+
+static VteBlockStore *
+_vte_block_store_new (void)
+{
+        VteBlockStore *store = g_new0 (VteBlockStore, 1);
+        store->capacity = 16;
+        store->blocks = g_new0 (VteMemoryBlock, store->capacity);
+        return store;
+}
+
+static inline VteMemoryBlock *
+_vte_block_store_get (VteBlockStore *store, gsize n)
+{
+        return &store->blocks[n & (store->capacity - 1)];
+}
+
+static void
+_vte_block_store_release (VteBlockStore *store, VteMemoryBlock *block)
+{
+        VteArenaSlab *slab = block->slab;
+
+        if (slab != NULL && --slab->live == 0) {
+                if (slab == store->current)
+                        slab->used = 0;  /* Start over */
+                else
+                        _vte_arena_slab_free (slab);
+        }
+        block->slab = NULL;
+        block->data = NULL;
+        block->len = 0;
+}
+
+/* Drop the first block, to make room for others */
+static void
+_vte_block_store_drop_first (VteBlockStore *store)
+{
+        _vte_block_store_release (store, _vte_block_store_get (store, store->first));
+        store->first++;
+        store->count--;
+}
+
+/* Store @len bytes of @data in @block, which needs to be released */
+static void
+_vte_block_store_fill (VteBlockStore *store, VteMemoryBlock *block, const char *data, gsize len)
+{
+        VteArenaSlab *slab;
+
+        g_assert_cmpuint (len, <=, VTE_SNAKE_BLOCKSIZE);
+
+        while ((slab = store->current) == NULL || VTE_ARENA_SLAB_SIZE - slab->used < len) {
+                VteArenaSlab *new_slab = _vte_arena_slab_new ();
+
+                if (G_LIKELY (new_slab != NULL)) {
+                        if (slab != NULL && slab->live == 0)
+                                _vte_arena_slab_free (slab);
+                        store->current = new_slab;
+                        continue;
+                }
+
+                /* Over budget: drop the oldest blocks until their slab is freed, or the
+                 * current one emptied. Blocks from @block on are kept, if it comes to
+                 * that the block will read back as invalid. */
+                if (G_UNLIKELY (store->count == 0 || _vte_block_store_get (store, store->first) == block))
+                        return;
+                _vte_block_store_drop_first (store);
+        }
+
+        block->slab = slab;
+        block->data = slab->data + slab->used;
+        block->len = len;
+        memcpy (block->data, data, len);
+        slab->used += len;
+        slab->live++;
+}
+
+/* Drop the blocks before block number @n, or all of them if @n is past the last one */
+static void
+_vte_block_store_advance_tail (VteBlockStore *store, gsize n)
+{
+        while (store->count > 0 && store->first < n)
+                _vte_block_store_drop_first (store);
+        /* Blocks before the first one may have been dropped already, see _vte_block_store_fill() */
+        if (store->count == 0 && store->first < n)
+                store->first = n;
+}
+
+/* Append block number first+count */
+static void
+_vte_block_store_append (VteBlockStore *store, const char *data, gsize len)
+{
+        if (G_UNLIKELY (store->count == store->capacity)) {
+                VteMemoryBlock *blocks = g_new0 (VteMemoryBlock, 2 * store->capacity);
+                for (gsize i = 0; i < store->count; i++)
+                        blocks[(store->first + i) & (2 * store->capacity - 1)] = *_vte_block_store_get (store, store->first + i);
+                g_free (store->blocks);
+                store->blocks = blocks;
+                store->capacity *= 2;
+        }
+
+        _vte_block_store_fill (store, _vte_block_store_get (store, store->first + store->count), data, len);
+        store->count++;
+}
+
+static void
+_vte_block_store_free (VteBlockStore *store)
+{
+        /* This keeps the current slab, and frees all the others */
+        _vte_block_store_advance_tail (store, G_MAXSIZE);
+        if (store->current != NULL)
+                _vte_arena_slab_free (store->current);
+        g_free (store->blocks);
+        g_free (store);
+}
+
+gsize
+_vte_memory_stream_get_usage (void)
+{
+        return (gsize) g_atomic_pointer_get (&_vte_block_store_usage);
+}
+
+void
+_vte_memory_stream_set_budget (gsize bytes)
+{
+        g_return_if_fail (bytes > 0);
+
+        g_atomic_pointer_set (&_vte_block_store_budget, bytes);
+}
+
+/******************************************************************************************/
+
 /*
  * VteSnake:
  *
@@ -336,9 +580,23 @@ _file_write (int fd, const char *data, gsize len, gsize offset)
  * and so on...
  */
 
+#ifndef VTESTREAM_MAIN
+# define VTE_SNAKE_MAP_EXTENT (256 * VTE_SNAKE_BLOCKSIZE)
+#else
+# define VTE_SNAKE_MAP_EXTENT (4 * VTE_SNAKE_BLOCKSIZE)
+#endif
+
 typedef struct _VteSnake {
         GObject parent;
+        /* In memory, the blocks are kept in the store, and the state and the segments are unused */
+        VteBlockStore *store;
         int fd;
+        /* The file is mapped read-only in extents of VTE_SNAKE_MAP_EXTENT bytes, see _vte_snake_peek().
+         * The mapping may reach beyond the end of the file, only the first file_size bytes may be accessed. */
+        char *map;
+        gsize map_size;
+        gsize file_size;
+        gboolean map_failed;    /* Use pread() only */
         int state;
         struct {
                 gsize st_tail;  /* Stream's logical tail offset. */
@@ -374,12 +632,26 @@ _vte_snake_init (VteSnake *snake)
         snake->state = 1;
 }
 
+static void
+_vte_snake_unmap (VteSnake *snake)
+{
+#ifdef HAVE_MMAP
+        if (snake->map != NULL)
+                munmap (snake->map, snake->map_size);
+#endif
+        snake->map = NULL;
+        snake->map_size = 0;
+}
+
 static void
 _vte_snake_finalize (GObject *object)
 {
         VteSnake *snake = (VteSnake *) object;
 
+        _vte_snake_unmap (snake);
         _file_close (snake->fd);
+        if (snake->store != NULL)
+                _vte_block_store_free (snake->store);
 
         G_OBJECT_CLASS (_vte_snake_parent_class)->finalize(object);
 }
@@ -393,6 +665,15 @@ _vte_snake_ensure_file (VteSnake *snake)
         snake->fd = _vte_mkstemp ();
 }
 
+/* Resize the file, keeping track of its size to know how much of the mapping is safe to access */
+static void
+_vte_snake_truncate (VteSnake *snake, gsize size)
+{
+        /* On failure the size remains unchanged */
+        if (_file_try_truncate (snake->fd, size))
+                snake->file_size = size;
+}
+
 static void _vte_snake_advance_tail (VteSnake *snake, gsize offset);
 static void
 _vte_snake_reset (VteSnake *snake, gsize offset)
@@ -402,8 +683,17 @@ _vte_snake_reset (VteSnake *snake, gsize offset)
         /* See the comments in _vte_boa_reset(). */
         g_assert_cmpuint (offset, >=, snake->tail);
 
+        if (snake->store != NULL) {
+                _vte_block_store_advance_tail (snake->store, offset / VTE_SNAKE_BLOCKSIZE);
+                snake->tail = offset;
+                /* Never retreat the head: bug 748484. */
+                snake->head = MAX(snake->head, offset);
+                return;
+        }
+
         if (G_LIKELY (offset >= snake->head)) {
                 _file_reset (snake->fd);
+                snake->file_size = 0;
                 snake->segment[0].st_tail = snake->segment[0].st_head = snake->tail = snake->head = offset;
                 snake->segment[0].fd_tail = snake->segment[0].fd_head = 0;
                 snake->state = 1;
@@ -432,17 +722,101 @@ _vte_snake_offset_map (VteSnake *snake, gsize offset)
         g_assert_not_reached();
 }
 
+/*
+ * Return the block at offset without copying it: from the mapped file, or from the store.
+ * *len is set to the number of bytes that may be accessed, which in memory is only the
+ * length of the stored data. The pointer is valid until the next operation on the snake.
+ * Returns NULL if the block cannot be accessed this way, e.g. if mmap() failed;
+ * the caller then needs to fall back to _vte_snake_read().
+ */
+static const char *
+_vte_snake_peek (VteSnake *snake, gsize offset, gsize *len)
+{
+        g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
+
+        if (G_UNLIKELY (offset < snake->tail || offset >= snake->head))
+                return NULL;
+
+        if (snake->store != NULL) {
+                VteMemoryBlock *block;
+
+                if (G_UNLIKELY (offset / VTE_SNAKE_BLOCKSIZE < snake->store->first))
+                        return NULL;  /* Dropped to make room */
+                block = _vte_block_store_get (snake->store, offset / VTE_SNAKE_BLOCKSIZE);
+                *len = block->len;
+                return block->len > 0 ? block->data : NULL;
+        }
+
+#ifdef HAVE_MMAP
+        gsize fd_offset;
+
+        if (G_UNLIKELY (snake->map_failed || snake->fd == -1))
+                return NULL;
+
+        fd_offset = _vte_snake_offset_map(snake, offset);
+
+        /* Accessing the mapping beyond the end of the file would raise SIGBUS */
+        if (G_UNLIKELY (fd_offset + VTE_SNAKE_BLOCKSIZE > snake->file_size))
+                return NULL;
+
+        if (G_UNLIKELY (fd_offset + VTE_SNAKE_BLOCKSIZE > snake->map_size)) {
+                /* Remap in large extents so that a growing file is rarely remapped. The mapping is never shrunk. */
+                gsize map_size = (fd_offset + VTE_SNAKE_BLOCKSIZE + VTE_SNAKE_MAP_EXTENT - 1) / VTE_SNAKE_MAP_EXTENT * VTE_SNAKE_MAP_EXTENT;
+                void *map;
+
+                _vte_snake_unmap (snake);
+                map = mmap (NULL, map_size, PROT_READ, MAP_SHARED, snake->fd, 0);
+                if (G_UNLIKELY (map == MAP_FAILED)) {
+                        snake->map_failed = TRUE;
+                        return NULL;
+                }
+                snake->map = (char *) map;
+                snake->map_size = map_size;
+        }
+
+        *len = VTE_SNAKE_BLOCKSIZE;
+        return snake->map + fd_offset;
+#else
+        return NULL;
+#endif
+}
+
 /* Place VTE_SNAKE_BLOCKSIZE bytes at data */
 static gboolean
 _vte_snake_read (VteSnake *snake, gsize offset, char *data)
 {
-        gsize fd_offset;
+        gsize fd_offset, len;
+        const char *block;
 
         g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
 
         if (G_UNLIKELY (offset < snake->tail || offset >= snake->head))
                 return FALSE;
 
+        if (snake->store != NULL) {
+                VteMemoryBlock *block;
+
+                if (G_UNLIKELY (offset / VTE_SNAKE_BLOCKSIZE < snake->store->first))
+                        return FALSE;  /* Dropped to make room */
+                block = _vte_block_store_get (snake->store, offset / VTE_SNAKE_BLOCKSIZE);
+                if (block->len > 0)
+                        memcpy (data, block->data, block->len);
+#ifndef VTESTREAM_MAIN
+                memset (data + block->len, 0, VTE_SNAKE_BLOCKSIZE - block->len);
+#else
+                /* For convenient unit testing only: fill with dots, as in the file. */
+                memset (data + block->len, '.', VTE_SNAKE_BLOCKSIZE - block->len);
+#endif
+                return TRUE;
+        }
+
+        /* Copy from the mapped file if possible, saving a syscall */
+        block = _vte_snake_peek (snake, offset, &len);
+        if (G_LIKELY (block != NULL)) {
+                memcpy (data, block, VTE_SNAKE_BLOCKSIZE);
+                return TRUE;
+        }
+
         fd_offset = _vte_snake_offset_map(snake, offset);
 
         return (_file_read (snake->fd, data, VTE_SNAKE_BLOCKSIZE, fd_offset) == VTE_SNAKE_BLOCKSIZE);
@@ -466,6 +840,18 @@ _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
         g_assert_cmpuint (offset, <=, snake->head);
         g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
 
+        if (snake->store != NULL) {
+                if (G_LIKELY (offset == snake->head)) {
+                        _vte_block_store_append (snake->store, data, len);
+                        snake->head = offset + VTE_SNAKE_BLOCKSIZE;
+                } else {
+                        VteMemoryBlock *block = _vte_block_store_get (snake->store, offset / VTE_SNAKE_BLOCKSIZE);
+                        _vte_block_store_release (snake->store, block);
+                        _vte_block_store_fill (snake->store, block, data, len);
+                }
+                return;
+        }
+
         if (G_LIKELY (offset == snake->head)) {
                 /* Appending a new block to the head. */
                 _vte_snake_ensure_file (snake);
@@ -492,9 +878,9 @@ _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
                         snake->segment[last_segment].fd_head += VTE_SNAKE_BLOCKSIZE;
                 }
                 if (snake->state != 2) {
-                        /* Grow the file with sparse blocks to make sure that later pread() can
+                        /* Grow the file with sparse blocks to make sure that later pread() or the mapping can
                          * read back a whole block, even if we are about to write a shorter one. */
-                        _file_try_truncate (snake->fd, fd_offset + VTE_SNAKE_BLOCKSIZE);
+                        _vte_snake_truncate (snake, fd_offset + VTE_SNAKE_BLOCKSIZE);
 #ifdef VTESTREAM_MAIN
                         /* For convenient unit testing only: fill with dots. */
                         _file_try_punch_hole (snake->fd, fd_offset, VTE_SNAKE_BLOCKSIZE);
@@ -522,7 +908,7 @@ _vte_snake_advance_tail (VteSnake *snake, gsize offset)
         g_assert_cmpuint (offset, <=, snake->head);
         g_assert_cmpuint (offset % VTE_SNAKE_BLOCKSIZE, ==, 0);
 
-        if (G_UNLIKELY (offset == snake->head)) {
+        if (G_UNLIKELY (offset == snake->head || snake->store != NULL)) {
                 _vte_snake_reset (snake, offset);
 		return;
         }
@@ -542,7 +928,7 @@ _vte_snake_advance_tail (VteSnake *snake, gsize offset)
                                 break;
                         case 2:
                                 snake->segment[0] = snake->segment[1];
-                                _file_try_truncate (snake->fd, snake->segment[0].fd_head);
+                                _vte_snake_truncate (snake, snake->segment[0].fd_head);
                                 snake->state = 1;
                                 break;
                         case 3:
@@ -595,6 +981,187 @@ _vte_snake_class_init (VteSnakeClass *klass)
 
 /******************************************************************************************/
 
+/*
+ * Block codecs.
+ *
+ * zlib is always available; LZ4 and zstd are optional at build time. The codec
+ * a block was compressed with is recorded in its header, so a stream can switch
+ * codecs at any time and blocks written earlier remain readable.
+ *
+ * These are the real implementations, also built for unit testing (where the
+ * boa uses fake compression instead) so that test_codecs() can exercise them.
+ */
+
+/* Lazily created per-boa state for the codecs that benefit from reusing it */
+typedef struct _VteCodecContext {
+#ifdef WITH_ZSTD
+        ZSTD_CCtx *zstd_cctx;
+        ZSTD_DCtx *zstd_dctx;
+#endif
+} VteCodecContext;
+
+static void
+_vte_codec_context_clear (VteCodecContext *context)
+{
+#ifdef WITH_ZSTD
+        ZSTD_freeCCtx (context->zstd_cctx);
+        ZSTD_freeDCtx (context->zstd_dctx);
+        context->zstd_cctx = NULL;
+        context->zstd_dctx = NULL;
+#endif
+}
+
+gboolean
+_vte_stream_codec_available (VteStreamCodec codec)
+{
+        switch (codec) {
+        case VTE_STREAM_CODEC_ZLIB:
+                return TRUE;
+#ifdef WITH_LZ4
+        case VTE_STREAM_CODEC_LZ4:
+                return TRUE;
+#endif
+#ifdef WITH_ZSTD
+        case VTE_STREAM_CODEC_ZSTD:
+                return TRUE;
+#endif
+        default:
+                return FALSE;
+        }
+}
+
+const char *
+_vte_stream_codec_name (VteStreamCodec codec)
+{
+        switch (codec) {
+        case VTE_STREAM_CODEC_ZLIB: return "zlib";
+        case VTE_STREAM_CODEC_LZ4:  return "lz4";
+        case VTE_STREAM_CODEC_ZSTD: return "zstd";
+        default:                    return "unknown";
+        }
+}
+
+/* The codec for new streams: the one named by the VTE_SCROLLBACK_CODEC
+ * environment variable if it's available, otherwise the build time default. */
+VteStreamCodec
+_vte_stream_codec_default (void)
+{
+        static gsize initialized = 0;
+        static VteStreamCodec codec = VTE_DEFAULT_SCROLLBACK_CODEC;
+
+        if (g_once_init_enter (&initialized)) {
+                const char *name = g_getenv ("VTE_SCROLLBACK_CODEC");
+                if (name != NULL) {
+                        int i;
+                        for (i = 0; i <= VTE_STREAM_CODEC_LAST; i++) {
+                                if (g_ascii_strcasecmp (name, _vte_stream_codec_name ((VteStreamCodec) i)) == 0)
+                                        break;
+                        }
+                        if (i <= VTE_STREAM_CODEC_LAST && _vte_stream_codec_available ((VteStreamCodec) i))
+                                codec = (VteStreamCodec) i;
+                        else
+                                g_warning ("Scrollback codec \"%s\" is not available, using %s",
+                                           name, _vte_stream_codec_name (codec));
+                }
+                g_once_init_leave (&initialized, 1);
+        }
+
+        return codec;
+}
+
+static unsigned int
+_vte_codec_compress_bound (VteStreamCodec codec, unsigned int len)
+{
+        switch (codec) {
+        case VTE_STREAM_CODEC_ZLIB:
+                return compressBound (len);
+#ifdef WITH_LZ4
+        case VTE_STREAM_CODEC_LZ4:
+                return LZ4_compressBound (len);
+#endif
+#ifdef WITH_ZSTD
+        case VTE_STREAM_CODEC_ZSTD:
+                return ZSTD_compressBound (len);
+#endif
+        default:
+                g_assert_not_reached ();
+        }
+}
+
+/* Compress; returns the compressed size which might be bigger than the original.
+ * dstlen must be at least _vte_codec_compress_bound(srclen). */
+static unsigned int
+_vte_codec_compress (VteStreamCodec codec, VteCodecContext *context,
+                     char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        switch (codec) {
+        case VTE_STREAM_CODEC_ZLIB: {
+                uLongf dstlen_ulongf = dstlen;
+                unsigned int z_ret;
+
+                z_ret = compress2 ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen, 1);
+                g_assert_cmpuint (z_ret, ==, Z_OK);
+                return dstlen_ulongf;
+        }
+#ifdef WITH_LZ4
+        case VTE_STREAM_CODEC_LZ4: {
+                int ret = LZ4_compress_default (src, dst, srclen, dstlen);
+                g_assert_cmpint (ret, >, 0);
+                return ret;
+        }
+#endif
+#ifdef WITH_ZSTD
+        case VTE_STREAM_CODEC_ZSTD: {
+                size_t ret;
+
+                if (context->zstd_cctx == NULL)
+                        context->zstd_cctx = ZSTD_createCCtx ();
+                ret = ZSTD_compressCCtx (context->zstd_cctx, dst, dstlen, src, srclen, 1);
+                g_assert_false (ZSTD_isError (ret));
+                return ret;
+        }
+#endif
+        default:
+                g_assert_not_reached ();
+        }
+}
+
+/* Uncompress; returns the uncompressed size, or 0 on error. */
+static unsigned int
+_vte_codec_uncompress (VteStreamCodec codec, VteCodecContext *context,
+                       char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+{
+        switch (codec) {
+        case VTE_STREAM_CODEC_ZLIB: {
+                uLongf dstlen_ulongf = dstlen;
+
+                if (G_UNLIKELY (uncompress ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen) != Z_OK))
+                        return 0;
+                return dstlen_ulongf;
+        }
+#ifdef WITH_LZ4
+        case VTE_STREAM_CODEC_LZ4: {
+                int ret = LZ4_decompress_safe (src, dst, srclen, dstlen);
+                return ret > 0 ? ret : 0;
+        }
+#endif
+#ifdef WITH_ZSTD
+        case VTE_STREAM_CODEC_ZSTD: {
+                size_t ret;
+
+                if (context->zstd_dctx == NULL)
+                        context->zstd_dctx = ZSTD_createDCtx ();
+                ret = ZSTD_decompressDCtx (context->zstd_dctx, dst, dstlen, src, srclen);
+                return ZSTD_isError (ret) ? 0 : ret;
+        }
+#endif
+        default:
+                return 0;
+        }
+}
+
+/******************************************************************************************/
+
 /*
  * VteBoa: Compress and encrypt an elephant to make it look like a hat.
  *
@@ -622,7 +1189,8 @@ _vte_snake_class_init (VteSnakeClass *klass)
  *                       boa block 65512(7)
  *
  * Structure of the block that we give to the snake:
- * - 0..4 (0..1): The length of the compressed and encrypted Data, that is D-8 (D-2) [VTE_BLOCK_DATALENGTH_SIZE bytes]
+ * - 0..4 (0..1): The length of the compressed and encrypted Data, that is D-8 (D-2), in the low 28 (4) bits,
+ *                and the codec it was compressed with in the top 4 bits [VTE_BLOCK_DATALENGTH_SIZE bytes]
  * - 4..8 (1..2): Overwrite counter [VTE_OVERWRITE_COUNTER_SIZE bytes]
  * - 8..D (2..D): The compressed and encrypted Data [<= VTE_BOA_BLOCKSIZE bytes]
  * - D..T: Encryption verification Tag [VTE_CIPHER_TAG_SIZE bytes]
@@ -651,6 +1219,10 @@ typedef struct _VteBoa {
         VteIv iv;
 #endif
         int compressBound;
+
+        VteStreamCodec codec;  /* for writing new blocks */
+        VteCodecContext codec_context;
+        VteStreamWriteStats write_stats;
 } VteBoa;
 
 typedef struct _VteBoaClass {
@@ -701,11 +1273,14 @@ _vte_boa_encrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
 #endif
 }
 
-/* Decrypt: data is len bytes of data + VTE_CIPHER_TAG_SIZE more bytes of tag. Returns FALSE on tag mismatch. */
-static gboolean
-_vte_boa_decrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *data, unsigned int len)
+/* Decrypt: src is len bytes of data + VTE_CIPHER_TAG_SIZE more bytes of tag, which may be read-only.
+ * The len bytes of plaintext are placed at dst, which may be the same as src.
+ * Returns the plaintext (src itself if there's no encryption), or NULL on tag mismatch. */
+static const char *
+_vte_boa_decrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, const char *src, char *dst, unsigned int len)
 {
         unsigned char tag[VTE_CIPHER_TAG_SIZE];
+        const char *plaintext = src;
         unsigned int i, j;
         guint8 faulty = 0;
 
@@ -714,49 +1289,54 @@ _vte_boa_decrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
         boa->iv.offset = offset;
         boa->iv.overwrite_counter = overwrite_counter;
         gnutls_cipher_set_iv (boa->cipher_hd, &boa->iv, VTE_CIPHER_IV_SIZE);
-        gnutls_cipher_decrypt (boa->cipher_hd, data, len);
+        if (src == dst)
+                gnutls_cipher_decrypt (boa->cipher_hd, dst, len);
+        else
+                gnutls_cipher_decrypt2 (boa->cipher_hd, src, len, dst, len);
         gnutls_cipher_tag (boa->cipher_hd, tag, VTE_CIPHER_TAG_SIZE);
+        plaintext = dst;
 # endif
 #else
         /* Fake decryption for unit testing; see above. */
         for (i = 0; i < len; i++) {
-                unsigned char c = data[i];
+                unsigned char c = src[i];
                 if (c >= 0x40) c ^= 0x20;
-                data[i] = c;
+                dst[i] = c;
         }
         *tag = (((offset / VTE_BOA_BLOCKSIZE) & 037) << 3) | (overwrite_counter & 007);
+        plaintext = dst;
 #endif
 
         /* Constant time tag verification: 738601#c66 */
         for (i = 0, j = len; i < VTE_CIPHER_TAG_SIZE; i++, j++) {
-                faulty |= tag[i] ^ data[j];
+                faulty |= tag[i] ^ src[j];
         }
-        return !faulty;
+        return faulty ? NULL : plaintext;
 }
 
 static int
 _vte_boa_compressBound (unsigned int len)
 {
 #ifndef VTESTREAM_MAIN
-        return compressBound(len);
+        unsigned int bound = 0;
+        for (int codec = 0; codec <= VTE_STREAM_CODEC_LAST; codec++) {
+                if (_vte_stream_codec_available ((VteStreamCodec) codec))
+                        bound = MAX(bound, _vte_codec_compress_bound ((VteStreamCodec) codec, len));
+        }
+        return bound;
 #else
         return 2 * len;
 #endif
 }
 
-/* Compress; returns the compressed size which might be bigger than the original. */
+/* Compress with the boa's current codec; returns the compressed size which might be bigger than the original. */
 static unsigned int
-_vte_boa_compress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+_vte_boa_compress (VteBoa *boa, char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
 {
 #ifndef VTESTREAM_MAIN
-        uLongf dstlen_ulongf = dstlen;
-        unsigned int z_ret;
-
-        z_ret = compress2 ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen, 1);
-        g_assert_cmpuint (z_ret, ==, Z_OK);
-        return dstlen_ulongf;
+        return _vte_codec_compress (boa->codec, &boa->codec_context, dst, dstlen, src, srclen);
 #else
-        /* Fake compression for unit testing:
+        /* Fake compression for unit testing, the same for all codecs:
          * Each char gets prefixed by a repetition count. This prefix is omitted if it would be the
          * same as the previous.
          * E.g. abcdef <-> 1abcdef
@@ -782,17 +1362,13 @@ _vte_boa_compress (char *dst, unsigned int dstlen, const char *src, unsigned int
 #endif
 }
 
-/* Uncompress; returns the uncompressed size. */
+/* Uncompress data that was compressed with @codec; returns the uncompressed size.
+ * The codec @context is the caller's, so that threads can uncompress in parallel. */
 static unsigned int
-_vte_boa_uncompress (char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
+_vte_boa_uncompress (VteCodecContext *context, VteStreamCodec codec, char *dst, unsigned int dstlen, const char *src, unsigned int srclen)
 {
 #ifndef VTESTREAM_MAIN
-        uLongf dstlen_ulongf = dstlen;
-        unsigned int z_ret;
-
-        z_ret = uncompress ((Bytef *) dst, &dstlen_ulongf, (const Bytef *) src, srclen);
-        g_assert_cmpuint (z_ret, ==, Z_OK);
-        return dstlen_ulongf;
+        return _vte_codec_uncompress (codec, context, dst, dstlen, src, srclen);
 #else
         /* Fake decompression for unit testing; see above. */
         unsigned int len = 0, repeat = 0;
@@ -841,6 +1417,11 @@ _vte_boa_init (VteBoa *boa)
 #endif
 
         boa->compressBound = _vte_boa_compressBound(VTE_BOA_BLOCKSIZE);
+#ifndef VTESTREAM_MAIN
+        boa->codec = _vte_stream_codec_default ();
+#else
+        boa->codec = VTE_STREAM_CODEC_ZLIB;
+#endif
 }
 
 static void
@@ -855,6 +1436,8 @@ _vte_boa_finalize (GObject *object)
         gnutls_global_deinit ();
 #endif
 
+        _vte_codec_context_clear (&((VteBoa *) object)->codec_context);
+
         G_OBJECT_CLASS (_vte_boa_parent_class)->finalize(object);
 }
 
@@ -879,41 +1462,87 @@ _vte_boa_reset (VteBoa *boa, gsize offset)
         boa->head = MAX(boa->head, offset);
 }
 
-/* Place VTE_BOA_BLOCKSIZE bytes at data.
- * data can be NULL if we're only interested in integrity verification and the overwrite_counter. */
-static gboolean
-_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter)
+/* Verify and decrypt the block at offset. buf is VTE_SNAKE_BLOCKSIZE bytes large.
+ * Returns the compressed plaintext, of *compressed_len bytes, in buf or where the
+ * block is if there's no encryption; or NULL if the block is not valid. */
+static const char *
+_vte_boa_read_compressed (VteBoa *boa, gsize offset, char *buf, VteStreamCodec *codec,
+                          unsigned int *compressed_len, _vte_overwrite_counter_t *overwrite_counter)
 {
-        _vte_block_datalength_t compressed_len;
-        char *buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
+        _vte_block_datalength_t datalength;
+        const char *block, *plaintext;
+        gsize available;
 
         g_assert_cmpuint (offset % VTE_BOA_BLOCKSIZE, ==, 0);
 
-        /* Read */
-        if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
-                return FALSE;
+        /* Access the block where it is (mapped file or memory) rather than copying it, if possible */
+        block = _vte_snake_peek (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), &available);
+        if (block == NULL) {
+                if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
+                        return NULL;
+                block = buf;
+                available = VTE_SNAKE_BLOCKSIZE;
+        }
 
-        compressed_len = *((_vte_block_datalength_t *) buf);
-        *overwrite_counter = *((_vte_overwrite_counter_t *) (buf + VTE_BLOCK_DATALENGTH_SIZE));
+        /* Blocks in memory aren't necessarily aligned */
+        if (G_UNLIKELY (available < VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE))
+                return NULL;
+        memcpy (&datalength, block, VTE_BLOCK_DATALENGTH_SIZE);
+        *codec = (VteStreamCodec) (datalength >> VTE_BLOCK_CODEC_SHIFT);
+        *compressed_len = datalength & VTE_BLOCK_DATALENGTH_MASK;
+        memcpy (overwrite_counter, block + VTE_BLOCK_DATALENGTH_SIZE, VTE_OVERWRITE_COUNTER_SIZE);
 
         /* We could have read an empty block due to a previous disk full. Treat that as an error too. Perform other sanity checks. */
-        if (G_UNLIKELY (compressed_len <= 0 || compressed_len > VTE_BOA_BLOCKSIZE || *overwrite_counter <= 0))
-                return FALSE;
+        if (G_UNLIKELY (*compressed_len <= 0 || *compressed_len > VTE_BOA_BLOCKSIZE || *overwrite_counter <= 0 ||
+                        VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE + *compressed_len + VTE_CIPHER_TAG_SIZE > available))
+                return NULL;
 
-        /* Decrypt, bail out on tag mismatch */
-        if (G_UNLIKELY (!_vte_boa_decrypt (boa, offset, *overwrite_counter, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len)))
-                return FALSE;
+        /* Refuse blocks of a codec that we don't know or that wasn't built in */
+#ifndef VTESTREAM_MAIN
+        if (G_UNLIKELY (!_vte_stream_codec_available (*codec)))
+                return NULL;
+#else
+        if (G_UNLIKELY (*codec > VTE_STREAM_CODEC_LAST))
+                return NULL;
+#endif
 
-        /* Uncompress, or copy if wasn't compressable */
-        if (G_LIKELY (data != NULL)) {
-                if (G_UNLIKELY (compressed_len >= VTE_BOA_BLOCKSIZE)) {
-                        memcpy (data, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, VTE_BOA_BLOCKSIZE);
-                } else {
-                        unsigned int uncompressed_len;
-                        uncompressed_len = _vte_boa_uncompress(data, VTE_BOA_BLOCKSIZE, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len);
-                        g_assert_cmpuint (uncompressed_len, ==, VTE_BOA_BLOCKSIZE);
-                }
+        /* Decrypt into the buffer, bail out on tag mismatch. Without encryption, this leaves the block where it is. */
+        plaintext = _vte_boa_decrypt (boa, offset, *overwrite_counter,
+                                      block + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE,
+                                      buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE,
+                                      *compressed_len);
+        return plaintext;
+}
+
+/* Uncompress the plaintext of a block into VTE_BOA_BLOCKSIZE bytes at data, or copy it if it wasn't compressable */
+static void
+_vte_boa_uncompress_block (VteCodecContext *context, VteStreamCodec codec, const char *plaintext, unsigned int compressed_len, char *data)
+{
+        if (G_UNLIKELY (compressed_len >= VTE_BOA_BLOCKSIZE)) {
+                memcpy (data, plaintext, VTE_BOA_BLOCKSIZE);
+        } else {
+                unsigned int uncompressed_len;
+                uncompressed_len = _vte_boa_uncompress(context, codec, data, VTE_BOA_BLOCKSIZE, plaintext, compressed_len);
+                g_assert_cmpuint (uncompressed_len, ==, VTE_BOA_BLOCKSIZE);
         }
+}
+
+/* Place VTE_BOA_BLOCKSIZE bytes at data.
+ * data can be NULL if we're only interested in integrity verification and the overwrite_counter. */
+static gboolean
+_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter)
+{
+        VteStreamCodec codec;
+        unsigned int compressed_len;
+        const char *plaintext;
+        char *buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
+
+        plaintext = _vte_boa_read_compressed (boa, offset, buf, &codec, &compressed_len, overwrite_counter);
+        if (G_UNLIKELY (plaintext == NULL))
+                return FALSE;
+
+        if (G_LIKELY (data != NULL))
+                _vte_boa_uncompress_block (&boa->codec_context, codec, plaintext, compressed_len, data);
         return TRUE;
 }
 
@@ -965,16 +1594,18 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
         }
 
         _vte_block_datalength_t compressed_len;
+        VteStreamCodec codec = boa->codec;
 
-        /* Compress, or copy if uncompressable */
-        compressed_len = _vte_boa_compress (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, boa->compressBound,
+        /* Compress, or copy if uncompressable. Uncompressed blocks are marked as zlib, as they always were. */
+        compressed_len = _vte_boa_compress (boa, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, boa->compressBound,
                                             data, VTE_BOA_BLOCKSIZE);
         if (G_UNLIKELY (compressed_len >= VTE_BOA_BLOCKSIZE)) {
                 memcpy (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, data, VTE_BOA_BLOCKSIZE);
                 compressed_len = VTE_BOA_BLOCKSIZE;
+                codec = VTE_STREAM_CODEC_ZLIB;
         }
 
-        *((_vte_block_datalength_t *) buf) = (_vte_block_datalength_t) compressed_len;
+        *((_vte_block_datalength_t *) buf) = (_vte_block_datalength_t) (compressed_len | (codec << VTE_BLOCK_CODEC_SHIFT));
         *((_vte_overwrite_counter_t *) (buf + VTE_BLOCK_DATALENGTH_SIZE)) = (_vte_overwrite_counter_t) overwrite_counter;
 
         /* Encrypt */
@@ -983,6 +1614,9 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
         /* Write */
         _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf, VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE + compressed_len + VTE_CIPHER_TAG_SIZE);
 
+        boa->write_stats.blocks++;
+        boa->write_stats.stored_bytes += VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE + compressed_len + VTE_CIPHER_TAG_SIZE;
+
         if (G_LIKELY (offset == boa->head)) {
                 boa->head += VTE_BOA_BLOCKSIZE;
         }
@@ -1033,16 +1667,62 @@ _vte_boa_class_init (VteBoaClass *klass)
  * VteFileStream: Implement buffering/caching on top of VteBoa.
  */
 
+/* Number of decompressed blocks cached per stream */
+#ifndef VTESTREAM_MAIN
+# define VTE_FILE_STREAM_CACHE_BLOCKS 4
+#else
+# define VTE_FILE_STREAM_CACHE_BLOCKS 3
+#endif
+
+typedef struct _VteFileStreamCacheEntry {
+        char *buf;  /* allocated on first use */
+        /* Offset of the cached block, always a multiple of block size.
+         * Use a value of 1 (or anything that's not a multiple of block size)
+         * to denote if no block is cached. */
+        gsize offset;
+        guint64 last_use;
+        gboolean prefetched;  /* read ahead, and not yet used */
+} VteFileStreamCacheEntry;
+
+/* Number of complete blocks that may be waiting to be written by the worker thread */
+#define VTE_FILE_STREAM_PENDING_BLOCKS 2
+
+typedef struct _VteFileStreamPendingBlock {
+        char *buf;
+        gsize offset;
+} VteFileStreamPendingBlock;
+
 typedef struct _VteFileStream {
         GObject parent;
 
+        /* When async, only the worker thread writes to the boa, and
+         * every access to it is protected by boa_lock. */
         VteBoa *boa;
-
-        char *rbuf;
-        /* Offset of the cached record, always a multiple of block size.
-         * Use a value of 1 (or anything that's not a multiple of block size)
-         * to denote if no record is cached. */
-        gsize rbuf_offset;
+        GMutex boa_lock;
+        gboolean async;
+
+        /* Estimate of the bytes stored by the boa, and the offset of the first
+         * block its store still has, accessed atomically; updated with each
+         * change to the boa, so that reading them doesn't take boa_lock.
+         * See _vte_file_stream_get_storage_size() and _get_readable_tail(). */
+        gsize stored_size;
+        gsize store_first_offset;
+
+        /* Blocks queued for the worker, oldest first. The first one stays
+         * in the queue while being written, so that it can still be read.
+         * Protected by queue_lock; queue_cond is signalled when one is done. */
+        VteFileStreamPendingBlock pending[VTE_FILE_STREAM_PENDING_BLOCKS];
+        int pending_first, pending_count;
+        gboolean worker_scheduled;
+        GMutex queue_lock;
+        GCond queue_cond;
+
+        VteFileStreamCacheEntry cache[VTE_FILE_STREAM_CACHE_BLOCKS];
+        guint64 cache_clock;
+        VteCodecContext codec_context;  /* for uncompressing into the cache, see _vte_file_stream_read_frozen() */
+        /* Offset of the block last read from, to detect the direction for readahead */
+        gsize last_read_offset;
+        VteStreamCacheStats stats;
 
         char *wbuf;
         gsize wbuf_len;
@@ -1063,14 +1743,36 @@ _vte_file_stream_new (void)
 	return (VteStream *) g_object_new (VTE_TYPE_FILE_STREAM, NULL);
 }
 
-static void
-_vte_file_stream_init (VteFileStream *stream)
+/* The same as a file stream, including the compression and the encryption,
+ * but the snake keeps the blocks in memory */
+VteStream *
+_vte_memory_stream_new (void)
 {
-        stream->boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
+        VteFileStream *stream = (VteFileStream *) g_object_new (VTE_TYPE_FILE_STREAM, NULL);
+        VteSnake *snake = &stream->boa->parent;
 
-        stream->rbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
-        stream->wbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
-        stream->rbuf_offset = 1;  /* Invalidate */
+        snake->store = _vte_block_store_new ();
+        return (VteStream *) stream;
+}
+
+static void
+_vte_file_stream_init (VteFileStream *stream)
+{
+        stream->boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
+        g_mutex_init (&stream->boa_lock);
+        g_mutex_init (&stream->queue_lock);
+        g_cond_init (&stream->queue_cond);
+#ifndef VTESTREAM_MAIN
+        stream->async = TRUE;
+#else
+        /* Most unit tests check the file right after appending */
+        stream->async = FALSE;
+#endif
+
+        stream->wbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+        for (int i = 0; i < VTE_FILE_STREAM_CACHE_BLOCKS; i++)
+                stream->cache[i].offset = 1;  /* Invalidate */
+        stream->last_read_offset = 1;
 }
 
 static void
@@ -1078,13 +1780,270 @@ _vte_file_stream_finalize (GObject *object)
 {
         VteFileStream *stream = (VteFileStream *) object;
 
-        g_free(stream->rbuf);
+        /* The worker holds a reference while it has work, so nothing is pending here */
+        g_assert_cmpint (stream->pending_count, ==, 0);
+
+        for (int i = 0; i < VTE_FILE_STREAM_CACHE_BLOCKS; i++)
+                g_free(stream->cache[i].buf);
+        for (int i = 0; i < VTE_FILE_STREAM_PENDING_BLOCKS; i++)
+                g_free(stream->pending[i].buf);
         g_free(stream->wbuf);
+        _vte_codec_context_clear (&stream->codec_context);
         g_object_unref (stream->boa);
+        g_mutex_clear (&stream->boa_lock);
+        g_mutex_clear (&stream->queue_lock);
+        g_cond_clear (&stream->queue_cond);
 
         G_OBJECT_CLASS (_vte_file_stream_parent_class)->finalize(object);
 }
 
+/* Update stored_size and store_first_offset after changing the boa, with boa_lock held if async */
+static void
+_vte_file_stream_boa_changed (VteFileStream *stream)
+{
+        VteBoa *boa = stream->boa;
+        VteBlockStore *store = boa->parent.store;
+        guint64 stored = boa->head - boa->tail;
+
+        /* The size of each block isn't kept, estimate it from the compression ratio so far */
+        if (boa->write_stats.blocks > 0)
+                stored = stored * boa->write_stats.stored_bytes / (boa->write_stats.blocks * VTE_BOA_BLOCKSIZE);
+        g_atomic_pointer_set (&stream->stored_size, (gsize) stored);
+
+        if (store != NULL)
+                g_atomic_pointer_set (&stream->store_first_offset, store->first * VTE_BOA_BLOCKSIZE);
+}
+
+/* Runs on the worker thread: write out the stream's queued blocks in order */
+static void
+_vte_file_stream_worker (gpointer data, gpointer user_data)
+{
+        VteFileStream *stream = (VteFileStream *) data;
+
+        g_mutex_lock (&stream->queue_lock);
+        while (stream->pending_count > 0) {
+                VteFileStreamPendingBlock *block = &stream->pending[stream->pending_first];
+                g_mutex_unlock (&stream->queue_lock);
+
+                /* The main thread doesn't modify the first block while it's queued */
+                g_mutex_lock (&stream->boa_lock);
+                _vte_boa_write (stream->boa, block->offset, block->buf);
+                _vte_file_stream_boa_changed (stream);
+                g_mutex_unlock (&stream->boa_lock);
+
+                g_mutex_lock (&stream->queue_lock);
+                stream->pending_first = (stream->pending_first + 1) % VTE_FILE_STREAM_PENDING_BLOCKS;
+                stream->pending_count--;
+                g_cond_broadcast (&stream->queue_cond);
+        }
+        stream->worker_scheduled = FALSE;
+        g_mutex_unlock (&stream->queue_lock);
+
+        g_object_unref (stream);
+}
+
+static GThreadPool *
+_vte_file_stream_get_worker_pool (void)
+{
+        static GThreadPool *pool = NULL;
+
+        if (g_once_init_enter (&pool)) {
+                /* A single thread, so that each stream's blocks are written in order */
+                GThreadPool *p = g_thread_pool_new (_vte_file_stream_worker, NULL, 1, FALSE, NULL);
+                g_once_init_leave (&pool, p);
+        }
+        return pool;
+}
+
+/* Write the full write buffer as the block at @offset_aligned, in the background if async.
+ * The write buffer is swapped for a free one. If the queue is full, wait for the worker. */
+static void
+_vte_file_stream_write_block (VteFileStream *stream, gsize offset_aligned)
+{
+        VteFileStreamPendingBlock *block;
+        char *buf;
+
+        if (!stream->async) {
+                _vte_boa_write (stream->boa, offset_aligned, stream->wbuf);
+                _vte_file_stream_boa_changed (stream);
+                return;
+        }
+
+        g_mutex_lock (&stream->queue_lock);
+        while (stream->pending_count == VTE_FILE_STREAM_PENDING_BLOCKS)
+                g_cond_wait (&stream->queue_cond, &stream->queue_lock);
+
+        block = &stream->pending[(stream->pending_first + stream->pending_count) % VTE_FILE_STREAM_PENDING_BLOCKS];
+        buf = block->buf;
+        block->buf = stream->wbuf;
+        block->offset = offset_aligned;
+        stream->pending_count++;
+
+        if (!stream->worker_scheduled) {
+                stream->worker_scheduled = TRUE;
+                g_thread_pool_push (_vte_file_stream_get_worker_pool (), g_object_ref (stream), NULL);
+        }
+        g_mutex_unlock (&stream->queue_lock);
+
+        stream->wbuf = buf != NULL ? buf : (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+}
+
+/* Wait until the blocks queued at offsets before @offset_aligned are written out */
+static void
+_vte_file_stream_wait_pending (VteFileStream *stream, gsize offset_aligned)
+{
+        g_mutex_lock (&stream->queue_lock);
+        for (;;) {
+                gboolean found = FALSE;
+                for (int i = 0; i < stream->pending_count && !found; i++)
+                        found = stream->pending[(stream->pending_first + i) % VTE_FILE_STREAM_PENDING_BLOCKS].offset < offset_aligned;
+                if (!found)
+                        break;
+                g_cond_wait (&stream->queue_cond, &stream->queue_lock);
+        }
+        g_mutex_unlock (&stream->queue_lock);
+}
+
+/* Read the block at @offset_aligned: its latest version if it's still queued, from the boa otherwise.
+ * Only reading and decrypting the block is serialized by boa_lock. It's uncompressed, the bulk of
+ * the work, with the codec @context of the caller, so that readers on other threads don't wait. */
+static gboolean
+_vte_file_stream_read_frozen (VteFileStream *stream, gsize offset_aligned, char *data, VteCodecContext *context)
+{
+        VteStreamCodec codec;
+        unsigned int compressed_len;
+        _vte_overwrite_counter_t overwrite_counter;
+        const char *plaintext;
+        char *buf;
+        gboolean ret = FALSE;
+
+        g_mutex_lock (&stream->queue_lock);
+        for (int i = stream->pending_count - 1; i >= 0; i--) {
+                VteFileStreamPendingBlock *block = &stream->pending[(stream->pending_first + i) % VTE_FILE_STREAM_PENDING_BLOCKS];
+                if (block->offset == offset_aligned) {
+                        memcpy(data, block->buf, VTE_BOA_BLOCKSIZE);
+                        ret = TRUE;
+                        break;
+                }
+        }
+        g_mutex_unlock (&stream->queue_lock);
+        if (ret)
+                return TRUE;
+
+        /* Not queued (anymore), so it's been written. Without encryption the plaintext is
+         * where the block is, which the worker might modify once the lock is released. */
+        buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
+        g_mutex_lock (&stream->boa_lock);
+        plaintext = _vte_boa_read_compressed (stream->boa, offset_aligned, buf, &codec, &compressed_len, &overwrite_counter);
+        if (plaintext != NULL && plaintext != buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE) {
+                memcpy (buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, plaintext, compressed_len);
+                plaintext = buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE;
+        }
+        g_mutex_unlock (&stream->boa_lock);
+        if (G_UNLIKELY (plaintext == NULL))
+                return FALSE;
+
+        _vte_boa_uncompress_block (context, codec, plaintext, compressed_len, data);
+        return TRUE;
+}
+
+/* Invalidate the cached blocks at offsets in [@start, @end) */
+static void
+_vte_file_stream_cache_invalidate (VteFileStream *stream, gsize start, gsize end)
+{
+        for (int i = 0; i < VTE_FILE_STREAM_CACHE_BLOCKS; i++) {
+                VteFileStreamCacheEntry *entry = &stream->cache[i];
+                if (entry->offset != 1 && entry->offset >= start && entry->offset < end) {
+                        entry->offset = 1;  /* Invalidate */
+                        entry->prefetched = FALSE;
+                }
+        }
+        if (stream->last_read_offset >= start && stream->last_read_offset < end)
+                stream->last_read_offset = 1;
+}
+
+static VteFileStreamCacheEntry *
+_vte_file_stream_cache_find (VteFileStream *stream, gsize offset_aligned)
+{
+        for (int i = 0; i < VTE_FILE_STREAM_CACHE_BLOCKS; i++) {
+                if (stream->cache[i].offset == offset_aligned)
+                        return &stream->cache[i];
+        }
+        return NULL;
+}
+
+/* Read the block at @offset_aligned into the least recently used cache entry */
+static VteFileStreamCacheEntry *
+_vte_file_stream_cache_fill (VteFileStream *stream, gsize offset_aligned)
+{
+        VteFileStreamCacheEntry *entry = &stream->cache[0];
+        for (int i = 1; i < VTE_FILE_STREAM_CACHE_BLOCKS && entry->offset != 1; i++) {
+                if (stream->cache[i].offset == 1 || stream->cache[i].last_use < entry->last_use)
+                        entry = &stream->cache[i];
+        }
+
+        if (entry->buf == NULL)
+                entry->buf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+
+        entry->prefetched = FALSE;
+        if (G_UNLIKELY (!_vte_file_stream_read_frozen (stream, offset_aligned, entry->buf, &stream->codec_context))) {
+                entry->offset = 1;  /* Invalidate */
+                return NULL;
+        }
+        entry->offset = offset_aligned;
+        entry->last_use = ++stream->cache_clock;
+        return entry;
+}
+
+/* Return the decompressed block at @offset_aligned, from the cache if possible.
+ * When this continues a walk across blocks in one direction, also read ahead
+ * the next block in that direction. */
+static const char *
+_vte_file_stream_read_block (VteFileStream *stream, gsize offset_aligned)
+{
+        VteFileStreamCacheEntry *entry = _vte_file_stream_cache_find (stream, offset_aligned);
+        if (entry != NULL) {
+                stream->stats.hits++;
+                if (entry->prefetched) {
+                        stream->stats.readahead_hits++;
+                        entry->prefetched = FALSE;
+                }
+                entry->last_use = ++stream->cache_clock;
+        } else {
+                stream->stats.misses++;
+                entry = _vte_file_stream_cache_fill (stream, offset_aligned);
+                if (G_UNLIKELY (entry == NULL))
+                        return NULL;
+        }
+
+        if (offset_aligned != stream->last_read_offset) {
+                gsize next = 1;
+                if (offset_aligned + VTE_BOA_BLOCKSIZE == stream->last_read_offset) {
+                        /* Walking backward, e.g. scrolling back or searching up */
+                        if (offset_aligned >= ALIGN_BOA(stream->tail) + VTE_BOA_BLOCKSIZE)
+                                next = offset_aligned - VTE_BOA_BLOCKSIZE;
+                } else if (stream->last_read_offset + VTE_BOA_BLOCKSIZE == offset_aligned) {
+                        /* Walking forward; only blocks already written out */
+                        if (offset_aligned + VTE_BOA_BLOCKSIZE < ALIGN_BOA(stream->head))
+                                next = offset_aligned + VTE_BOA_BLOCKSIZE;
+                }
+                stream->last_read_offset = offset_aligned;
+
+                if (next != 1 && _vte_file_stream_cache_find (stream, next) == NULL) {
+                        VteFileStreamCacheEntry *ahead = _vte_file_stream_cache_fill (stream, next);
+                        if (ahead != NULL) {
+                                stream->stats.readaheads++;
+                                ahead->prefetched = TRUE;
+                                /* Don't let the block read ahead evict the one just read */
+                                ahead->last_use = entry->last_use;
+                                entry->last_use = ++stream->cache_clock;
+                        }
+                }
+        }
+
+        return entry->buf;
+}
+
 static void
 _vte_file_stream_reset (VteStream *astream, gsize offset)
 {
@@ -1095,7 +2054,11 @@ _vte_file_stream_reset (VteStream *astream, gsize offset)
          * to catch if this expectation is broken within a block. */
         g_assert_cmpuint (offset, >=, stream->head);
 
+        _vte_file_stream_wait_pending (stream, G_MAXSIZE);
+        g_mutex_lock (&stream->boa_lock);
         _vte_boa_reset (stream->boa, offset_aligned);
+        _vte_file_stream_boa_changed (stream);
+        g_mutex_unlock (&stream->boa_lock);
         stream->tail = stream->head = offset;
 
         /* When resetting at a non-aligned offset, initial bytes of the write buffer
@@ -1109,7 +2072,7 @@ _vte_file_stream_reset (VteStream *astream, gsize offset)
 #endif
 
         stream->wbuf_len = MOD_BOA(offset);
-        stream->rbuf_offset = 1;  /* Invalidate */
+        _vte_file_stream_cache_invalidate (stream, 0, G_MAXSIZE);
 }
 
 static gboolean
@@ -1134,13 +2097,10 @@ _vte_file_stream_read (VteStream *astream, gsize offset, char *data, gsize len)
 
         while (len && offset < ALIGN_BOA(stream->head)) {
                 gsize l = MIN(VTE_BOA_BLOCKSIZE - MOD_BOA(offset), len);
-                gsize offset_aligned = ALIGN_BOA(offset);
-                if (offset_aligned != stream->rbuf_offset) {
-                        if (G_UNLIKELY (!_vte_boa_read (stream->boa, offset_aligned, stream->rbuf)))
-                                return FALSE;
-                        stream->rbuf_offset = offset_aligned;
-                }
-                memcpy(data, stream->rbuf + MOD_BOA(offset), l);
+                const char *rbuf = _vte_file_stream_read_block (stream, ALIGN_BOA(offset));
+                if (G_UNLIKELY (rbuf == NULL))
+                        return FALSE;
+                memcpy(data, rbuf + MOD_BOA(offset), l);
                 offset += l; data += l; len -= l;
         }
         if (len) {
@@ -1160,7 +2120,7 @@ _vte_file_stream_append (VteStream *astream, const char *data, gsize len)
                 memcpy(stream->wbuf + stream->wbuf_len, data, l);
                 stream->wbuf_len += l; data += l; len -= l;
                 if (stream->wbuf_len == VTE_BOA_BLOCKSIZE) {
-                        _vte_boa_write (stream->boa, ALIGN_BOA(stream->head), stream->wbuf);
+                        _vte_file_stream_write_block (stream, ALIGN_BOA(stream->head));
                         stream->wbuf_len = 0;
                 }
                 stream->head += l;
@@ -1183,14 +2143,12 @@ _vte_file_stream_truncate (VteStream *astream, gsize offset)
                  * intact, that is, read back the new partial last block to
                  * the write cache. */
                 gsize offset_aligned = ALIGN_BOA(offset);
-                if (G_UNLIKELY (!_vte_boa_read (stream->boa, offset_aligned, stream->wbuf))) {
+                if (G_UNLIKELY (!_vte_file_stream_read_frozen (stream, offset_aligned, stream->wbuf, &stream->codec_context))) {
                         /* what now? */
                         memset(stream->wbuf, 0, VTE_BOA_BLOCKSIZE);
                 }
 
-                if (stream->rbuf_offset >= offset_aligned) {
-                        stream->rbuf_offset = 1;  /* Invalidate */
-                }
+                _vte_file_stream_cache_invalidate (stream, offset_aligned, G_MAXSIZE);
         }
         stream->wbuf_len = MOD_BOA(offset);
 	stream->head = offset;
@@ -1204,8 +2162,16 @@ _vte_file_stream_advance_tail (VteStream *astream, gsize offset)
         g_assert_cmpuint (offset, >=, stream->tail);
         g_assert_cmpuint (offset, <=, stream->head);
 
-        if (ALIGN_BOA(offset) > ALIGN_BOA(stream->tail))
+        if (ALIGN_BOA(offset) > ALIGN_BOA(stream->tail)) {
+                /* The dropped blocks have to be written out first. Normally they
+                 * are, unless the scrollback is tiny. */
+                _vte_file_stream_wait_pending (stream, ALIGN_BOA(offset));
+                g_mutex_lock (&stream->boa_lock);
                 _vte_boa_advance_tail (stream->boa, ALIGN_BOA(offset));
+                _vte_file_stream_boa_changed (stream);
+                g_mutex_unlock (&stream->boa_lock);
+                _vte_file_stream_cache_invalidate (stream, 0, ALIGN_BOA(offset));
+        }
 
         stream->tail = offset;
 }
@@ -1226,6 +2192,147 @@ _vte_file_stream_head (VteStream *astream)
 	return stream->head;
 }
 
+void
+_vte_file_stream_get_cache_stats (VteStream *astream, VteStreamCacheStats *stats)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+        *stats = stream->stats;
+}
+
+/* Blocks already written keep their codec; this only affects the ones written from now on. */
+void
+_vte_file_stream_set_codec (VteStream *astream, VteStreamCodec codec)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+#ifndef VTESTREAM_MAIN
+        g_return_if_fail (_vte_stream_codec_available (codec));
+#else
+        g_return_if_fail (codec <= VTE_STREAM_CODEC_LAST);
+#endif
+
+        g_mutex_lock (&stream->boa_lock);
+        stream->boa->codec = codec;
+        g_mutex_unlock (&stream->boa_lock);
+}
+
+void
+_vte_file_stream_get_write_stats (VteStream *astream, VteStreamWriteStats *stats)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+        g_mutex_lock (&stream->boa_lock);
+        *stats = stream->boa->write_stats;
+        g_mutex_unlock (&stream->boa_lock);
+}
+
+/* Approximate number of bytes taken by the stream: its blocks in the file or in memory, and its buffers.
+ * This is checked for every row the ring adds, so it takes no locks. */
+gsize
+_vte_file_stream_get_storage_size (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+        gsize size = VTE_BOA_BLOCKSIZE;  /* wbuf */
+
+        size += (gsize) g_atomic_pointer_get (&stream->stored_size);
+
+        /* Only this thread swaps the buffers in and out of the queue */
+        for (int i = 0; i < VTE_FILE_STREAM_PENDING_BLOCKS; i++) {
+                if (stream->pending[i].buf != NULL)
+                        size += VTE_BOA_BLOCKSIZE;
+        }
+
+        for (int i = 0; i < VTE_FILE_STREAM_CACHE_BLOCKS; i++) {
+                if (stream->cache[i].buf != NULL)
+                        size += VTE_BOA_BLOCKSIZE;
+        }
+
+        return size;
+}
+
+/* The offset from which on the stream can be read: its tail, unless blocks after that
+ * were dropped from memory to stay within the budget, see _vte_block_store_fill().
+ * The ring checks this for every row it adds, so it takes no locks. */
+gsize
+_vte_file_stream_get_readable_tail (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+        return MAX (stream->tail, (gsize) g_atomic_pointer_get (&stream->store_first_offset));
+}
+
+/* Wait until all complete blocks are written out */
+void
+_vte_file_stream_flush (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+        _vte_file_stream_wait_pending (stream, G_MAXSIZE);
+}
+
+/* A reader of its own for another thread: a block cached separately from the stream's cache */
+struct _VteStreamReader {
+        VteFileStream *stream;
+        gsize offset;  /* of the cached block, 1 if none */
+        char *buf;
+        VteCodecContext codec_context;
+};
+
+VteStreamReader *
+_vte_stream_reader_new (VteStream *astream)
+{
+        VteStreamReader *reader = g_new0 (VteStreamReader, 1);
+
+        reader->stream = (VteFileStream *) g_object_ref (astream);
+        reader->offset = 1;
+        reader->buf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+        return reader;
+}
+
+/* Like _vte_stream_read(), but may be called from any thread while the owner
+ * of the stream doesn't modify it. Blocks are uncompressed in parallel, see
+ * _vte_file_stream_read_frozen(). */
+gboolean
+_vte_stream_reader_read (VteStreamReader *reader, gsize offset, char *data, gsize len)
+{
+        VteFileStream *stream = reader->stream;
+
+        /* See _vte_file_stream_read() */
+        if (G_UNLIKELY (offset < stream->tail || offset + len > stream->head || offset + len < offset)) {
+                if (G_LIKELY (offset + len <= stream->tail || offset >= stream->head))
+                        return FALSE;
+                g_assert_not_reached();
+        }
+
+        while (len && offset < ALIGN_BOA(stream->head)) {
+                gsize l = MIN(VTE_BOA_BLOCKSIZE - MOD_BOA(offset), len);
+                if (ALIGN_BOA(offset) != reader->offset) {
+                        if (G_UNLIKELY (!_vte_file_stream_read_frozen (stream, ALIGN_BOA(offset), reader->buf, &reader->codec_context))) {
+                                reader->offset = 1;  /* Invalidate */
+                                return FALSE;
+                        }
+                        reader->offset = ALIGN_BOA(offset);
+                }
+                memcpy(data, reader->buf + MOD_BOA(offset), l);
+                offset += l; data += l; len -= l;
+        }
+        if (len) {
+                g_assert_cmpuint (MOD_BOA(offset) + len, <=, stream->wbuf_len);
+                memcpy(data, stream->wbuf + MOD_BOA(offset), len);
+        }
+        return TRUE;
+}
+
+void
+_vte_stream_reader_free (VteStreamReader *reader)
+{
+        g_object_unref (reader->stream);
+        _vte_codec_context_clear (&reader->codec_context);
+        g_free (reader->buf);
+        g_free (reader);
+}
+
 static void
 _vte_file_stream_class_init (VteFileStreamClass *klass)
 {
@@ -1314,7 +2421,10 @@ test_fakes (void)
         g_assert(strncmp (buf, "ABCDxyz1234!!!\056", 15) == 0);
 
         /* Decrypt */
-        g_assert_true(_vte_boa_decrypt (boa, 35, 6, buf, 14));
+        g_assert_true(_vte_boa_decrypt (boa, 35, 6, buf, buf2, 14) == buf2);
+        g_assert(strncmp (buf2, "abcdXYZ1234!!!", 14) == 0);
+        g_assert(strncmp (buf, "ABCDxyz1234!!!\056", 15) == 0);
+        g_assert_true(_vte_boa_decrypt (boa, 35, 6, buf, buf, 14) == buf);
         g_assert(strncmp (buf, "abcdXYZ1234!!!", 14) == 0);
 
         /* Encrypt again */
@@ -1323,42 +2433,42 @@ test_fakes (void)
 
         /* Decrypting with corrupted tag should fail */
         buf[14]++;
-        g_assert_false(_vte_boa_decrypt (boa, 35, 6, buf, 14));
+        g_assert_null(_vte_boa_decrypt (boa, 35, 6, buf, buf, 14));
 
         /* Compress, but becomes bigger */
         strcpy(buf, "abcdef");
-        g_assert_cmpuint(_vte_boa_compress (buf2, 100, buf, 6), ==, 7);
+        g_assert_cmpuint(_vte_boa_compress (boa, buf2, 100, buf, 6), ==, 7);
         g_assert(strncmp (buf2, "1abcdef", 7) == 0);
 
         /* Uncompress */
         strcpy(buf, "1abcdef");
-        g_assert_cmpuint(_vte_boa_uncompress (buf2, 100, buf, 7), ==, 6);
+        g_assert_cmpuint(_vte_boa_uncompress (&boa->codec_context, VTE_STREAM_CODEC_ZLIB, buf2, 100, buf, 7), ==, 6);
         g_assert(strncmp (buf2, "abcdef", 6) == 0);
 
         /* Compress, becomes smaller */
         strcpy(buf, "www");
-        g_assert_cmpuint(_vte_boa_compress (buf2, 100, buf, 3), ==, 2);
+        g_assert_cmpuint(_vte_boa_compress (boa, buf2, 100, buf, 3), ==, 2);
         g_assert(strncmp (buf2, "3w", 2) == 0);
 
         /* Uncompress */
         strcpy(buf, "3w");
-        g_assert_cmpuint(_vte_boa_uncompress (buf2, 100, buf, 2), ==, 3);
+        g_assert_cmpuint(_vte_boa_uncompress (&boa->codec_context, VTE_STREAM_CODEC_ZLIB, buf2, 100, buf, 2), ==, 3);
         g_assert(strncmp (buf2, "www", 3) == 0);
 
         /* Compress, remains the same size */
         strcpy(buf, "zebraaa");
-        g_assert_cmpuint(_vte_boa_compress (buf2, 100, buf, 7), ==, 7);
+        g_assert_cmpuint(_vte_boa_compress (boa, buf2, 100, buf, 7), ==, 7);
         g_assert(strncmp (buf2, "1zebr3a", 7) == 0);
 
         /* Uncompress */
         strcpy(buf, "1zebr3a");
-        g_assert_cmpuint(_vte_boa_uncompress (buf2, 100, buf, 7), ==, 7);
+        g_assert_cmpuint(_vte_boa_uncompress (&boa->codec_context, VTE_STREAM_CODEC_ZLIB, buf2, 100, buf, 7), ==, 7);
         g_assert(strncmp (buf2, "zebraaa", 7) == 0);
 
         /* Trying to uncompress the original does *not* give back the same contents.
          * This will be important below. */
         strcpy(buf, "zebraaa");
-        g_assert_cmpuint(_vte_boa_uncompress (buf2, 100, buf, 7), ==, 0);
+        g_assert_cmpuint(_vte_boa_uncompress (&boa->codec_context, VTE_STREAM_CODEC_ZLIB, buf2, 100, buf, 7), ==, 0);
 
         g_object_unref (boa);
 }
@@ -1594,12 +2704,12 @@ test_stream (void)
 
         /* Test that the read cache is invalidated on truncate */
         _vte_stream_read (astream, 12, buf, 2);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 7);
+        g_assert (_vte_file_stream_cache_find (stream, 7) != NULL);
         _vte_stream_truncate (astream, 13);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 1);
+        g_assert (_vte_file_stream_cache_find (stream, 7) == NULL);
         stream_append (astream, "z" "cat");
         _vte_stream_read (astream, 12, buf, 2);
-        g_assert_cmpuint (stream->rbuf_offset, ==, 7);
+        g_assert (_vte_file_stream_cache_find (stream, 7) != NULL);
         buf[2] = '\0';
         g_assert_cmpstr (buf, ==, "ez");
         assert_file (snake->fd, "\007\001AXOLOTL\001" "\006\0031B5E1Z\013.");
@@ -1758,6 +2868,391 @@ test_stream (void)
         g_object_unref (astream);
 }
 
+/* The codec is stored in the top 4 bits of the length byte; the fake compression is the same for all of them */
+static void
+test_boa_codecs (void)
+{
+        char buf[VTE_BOA_BLOCKSIZE];
+
+        VteBoa *boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
+        VteSnake *snake = (VteSnake *) &boa->parent;
+
+        boa->codec = VTE_STREAM_CODEC_LZ4;
+        _vte_boa_write (boa, 0, "bbbbbbb");
+        boa->codec = VTE_STREAM_CODEC_ZSTD;
+        _vte_boa_write (boa, 7, "axolotl");
+        _vte_boa_write (boa, 14, "beeeeee");
+        /* Uncompressable blocks are always marked as zlib */
+        assert_file (snake->fd, "\022\0017B\001....." "\007\001AXOLOTL\011" "\044\0011B6E\021...");
+
+        /* Blocks written with another codec remain readable */
+        boa->codec = VTE_STREAM_CODEC_ZLIB;
+        assert_boa (boa, 0, 21, "bbbbbbb" "axolotl" "beeeeee");
+
+        /* Overwriting switches the block to the current codec */
+        _vte_boa_write (boa, 0, "bbbbbbb");
+        assert_file (snake->fd, "\002\0027B\002....." "\007\001AXOLOTL\011" "\044\0011B6E\021...");
+        assert_boa (boa, 0, 21, "bbbbbbb" "axolotl" "beeeeee");
+
+        /* Unknown codec */
+        _vte_snake_write (snake, 0, "\142\0027B\002", 5);
+        g_assert_false (_vte_boa_read (boa, 0, buf));
+
+        g_object_unref (boa);
+}
+
+/* Round trip the real codecs that were built in */
+static void
+test_codecs (void)
+{
+        VteCodecContext context = {};
+        unsigned int len = 65536, bound, compressed_len;
+        char *src = (char *) g_malloc (len);
+        char *dst = (char *) g_malloc (len);
+        char *compressed;
+
+        for (unsigned int i = 0; i < len; i++)
+                src[i] = "The quick brown fox jumps over the lazy dog.\n"[i % 45] + (i / 4096) % 3;
+
+        for (int i = 0; i <= VTE_STREAM_CODEC_LAST; i++) {
+                VteStreamCodec codec = (VteStreamCodec) i;
+                if (!_vte_stream_codec_available (codec))
+                        continue;
+
+                bound = _vte_codec_compress_bound (codec, len);
+                g_assert_cmpuint (bound, >=, len);
+                compressed = (char *) g_malloc (bound);
+
+                compressed_len = _vte_codec_compress (codec, &context, compressed, bound, src, len);
+                g_assert_cmpuint (compressed_len, <, len / 4);
+                memset (dst, 0, len);
+                g_assert_cmpuint (_vte_codec_uncompress (codec, &context, dst, len, compressed, compressed_len), ==, len);
+                g_assert (memcmp (src, dst, len) == 0);
+
+                /* Not fitting in the output buffer is an error, not an overflow */
+                g_assert_cmpuint (_vte_codec_uncompress (codec, &context, dst, len / 2, compressed, compressed_len), ==, 0);
+
+                g_free (compressed);
+        }
+
+        g_assert_true (_vte_stream_codec_available (VTE_STREAM_CODEC_ZLIB));
+        g_assert_false (_vte_stream_codec_available ((VteStreamCodec) (VTE_STREAM_CODEC_LAST + 1)));
+
+        _vte_codec_context_clear (&context);
+        g_free (src);
+        g_free (dst);
+}
+
+/* Blocks are written on the worker thread, while reads, truncates and tail
+ * advances keep seeing a consistent stream */
+static void
+test_stream_async (void)
+{
+        char buf[8];
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+        VteBoa *boa = stream->boa;
+        stream->async = TRUE;
+
+        stream_append (astream, "aaaaaaa" "bbbbbbb" "ccccccc" "ddddddd" "eeeeeee" "fffffff" "g");
+        assert_stream (astream, 0, 43, "aaaaaaa" "bbbbbbb" "ccccccc" "ddddddd" "eeeeeee" "fffffff" "g");
+
+        /* Truncating back into a block that may still be queued */
+        _vte_stream_truncate (astream, 38);
+        stream_append (astream, "xxx" "hhhhhhh" "iiii");
+        assert_stream (astream, 0, 52, "aaaaaaa" "bbbbbbb" "ccccccc" "ddddddd" "eeeeeee" "fffxxxh" "hhhhhhi" "iii");
+
+        /* Dropping blocks that may still be queued */
+        _vte_stream_advance_tail (astream, 45);
+        assert_stream (astream, 45, 52, "hhhiiii");
+        g_assert (_vte_stream_read (astream, 46, buf, 3));
+        g_assert (memcmp(buf, "hhi", 3) == 0);
+
+        _vte_file_stream_flush (astream);
+        g_assert_cmpint (stream->pending_count, ==, 0);
+        assert_boa (boa, 42, 49, "hhhhhhi");
+        assert_stream (astream, 45, 52, "hhhiiii");
+
+        /* Resetting waits for the queue */
+        stream_append (astream, "jjjjjjj" "kkkkkkk");
+        _vte_stream_reset (astream, 70);
+        assert_stream (astream, 70, 70, "");
+        stream_append (astream, "lllllll");
+        _vte_file_stream_flush (astream);
+        assert_stream (astream, 70, 77, "lllllll");
+
+        g_object_unref (astream);
+}
+
+/* The snake keeping its blocks in memory, allocated from 30-byte slabs */
+static void
+test_snake_memory (void)
+{
+        gsize usage = _vte_memory_stream_get_usage ();
+        VteSnake *snake = (VteSnake *)g_object_new (VTE_TYPE_SNAKE, NULL);
+        snake->store = _vte_block_store_new ();
+
+        snake_write (snake, 0, "Armadillo");
+        snake_write (snake, 10, "Bobcat");
+        assert_snake (snake, 1, 0, 20, "Armadillo.Bobcat....");
+        g_assert_cmpint (snake->fd, ==, -1);
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage + VTE_ARENA_SLAB_SIZE);
+
+        /* Overwriting */
+        snake_write (snake, 10, "Chinchilla");
+        assert_snake (snake, 1, 0, 20, "Armadillo.Chinchilla");
+
+        /* Doesn't fit in the first slab anymore */
+        snake_write (snake, 20, "Duck");
+        snake_write (snake, 30, "Elephant");
+        assert_snake (snake, 1, 0, 40, "Armadillo.ChinchillaDuck......Elephant..");
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage + 2 * VTE_ARENA_SLAB_SIZE);
+
+        /* Dropping all the blocks of the first slab frees it */
+        _vte_snake_advance_tail (snake, 30);
+        assert_snake (snake, 1, 30, 40, "Elephant..");
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage + VTE_ARENA_SLAB_SIZE);
+
+        /* The current slab is reused */
+        _vte_snake_reset (snake, 250);
+        assert_snake (snake, 1, 250, 250, "");
+        snake_write (snake, 250, "Zebra");
+        assert_snake (snake, 1, 250, 260, "Zebra.....");
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage + VTE_ARENA_SLAB_SIZE);
+
+        g_object_unref (snake);
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage);
+}
+
+/* Test reading the file via the mapping, remapping as the file grows, and the fallback to pread() */
+static void
+test_snake_map (void)
+{
+        VteSnake *snake = (VteSnake *)g_object_new (VTE_TYPE_SNAKE, NULL);
+        VteBoa *boa;
+        const char *block;
+        gsize len;
+
+        snake_write (snake, 0, "Armadillo");
+        snake_write (snake, 10, "Bobcat");
+        block = _vte_snake_peek (snake, 10, &len);
+#ifdef HAVE_MMAP
+        g_assert_nonnull (block);
+        g_assert_cmpuint (len, ==, VTE_SNAKE_BLOCKSIZE);
+        g_assert (memcmp (block, "Bobcat....", VTE_SNAKE_BLOCKSIZE) == 0);
+        g_assert_cmpuint (snake->map_size, ==, VTE_SNAKE_MAP_EXTENT);
+
+        /* Writes are seen through the mapping */
+        snake_write (snake, 10, "Chinchilla");
+        block = _vte_snake_peek (snake, 10, &len);
+        g_assert (memcmp (block, "Chinchilla", VTE_SNAKE_BLOCKSIZE) == 0);
+
+        /* Growing beyond the first extent remaps */
+        snake_write (snake, 20, "Duck");
+        snake_write (snake, 30, "Elephant");
+        snake_write (snake, 40, "Ferret");
+        block = _vte_snake_peek (snake, 40, &len);
+        g_assert (memcmp (block, "Ferret....", VTE_SNAKE_BLOCKSIZE) == 0);
+        g_assert_cmpuint (snake->map_size, ==, 2 * VTE_SNAKE_MAP_EXTENT);
+        assert_snake (snake, 1, 0, 50, "Armadillo.ChinchillaDuck......Elephant..Ferret....");
+
+        /* Nothing beyond the head */
+        g_assert_null (_vte_snake_peek (snake, 50, &len));
+
+        /* Shrinking the file keeps the mapping, but doesn't let the dropped part be accessed */
+        _vte_snake_reset (snake, 50);
+        g_assert_cmpuint (snake->file_size, ==, 0);
+        snake_write (snake, 50, "Gazelle");
+        assert_file (snake->fd, "Gazelle...");
+        assert_snake (snake, 1, 50, 60, "Gazelle...");
+        g_assert_cmpuint (snake->map_size, ==, 2 * VTE_SNAKE_MAP_EXTENT);
+
+        /* Fall back to pread() */
+        _vte_snake_unmap (snake);
+        snake->map_failed = TRUE;
+        g_assert_null (_vte_snake_peek (snake, 50, &len));
+        assert_snake (snake, 1, 50, 60, "Gazelle...");
+#else
+        g_assert_null (block);
+#endif
+
+        g_object_unref (snake);
+
+        /* The boa reads the same blocks straight from the mapping as via pread() */
+        boa = (VteBoa *)g_object_new (VTE_TYPE_BOA, NULL);
+        _vte_boa_write (boa, 0, "axolotl");
+        _vte_boa_write (boa, 7, "beeeeee");
+        assert_boa (boa, 0, 14, "axolotl" "beeeeee");
+#ifdef HAVE_MMAP
+        g_assert_nonnull (boa->parent.map);
+#endif
+        _vte_snake_unmap (&boa->parent);
+        boa->parent.map_failed = TRUE;
+        assert_boa (boa, 0, 14, "axolotl" "beeeeee");
+        g_object_unref (boa);
+}
+
+/* The stream on top of the memory store, with the budget running out */
+static void
+test_stream_memory (void)
+{
+        char buf[8];
+        gsize usage = _vte_memory_stream_get_usage ();
+
+        VteStream *astream = _vte_memory_stream_new();
+        _vte_memory_stream_set_budget (usage + VTE_ARENA_SLAB_SIZE);
+
+        /* 10 + 7 + 10 bytes in the snake, in one slab */
+        stream_append (astream, "axolotl" "beeeeee" "cheetah");
+        assert_stream (astream, 0, 21, "axolotl" "beeeeee" "cheetah");
+
+        /* Another slab would be needed: the oldest blocks are dropped instead */
+        stream_append (astream, "deeeeer" "e");
+        g_assert_cmpuint (_vte_file_stream_get_readable_tail (astream), ==, 21);
+        g_assert (_vte_stream_read (astream, 21, buf, 8));
+        g_assert (memcmp (buf, "deeeeer" "e", 8) == 0);
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage + VTE_ARENA_SLAB_SIZE);
+
+        /* Once the tail catches up, the stream is whole again */
+        _vte_stream_advance_tail (astream, 21);
+        assert_stream (astream, 21, 29, "deeeeer" "e");
+        g_assert_cmpuint (_vte_file_stream_get_readable_tail (astream), ==, 21);
+
+        /* Dropping the data makes room again */
+        _vte_stream_advance_tail (astream, 28);
+        stream_append (astream, "ffffff");
+        assert_stream (astream, 28, 35, "effffff");
+
+        _vte_memory_stream_set_budget (VTE_BLOCK_STORE_DEFAULT_BUDGET);
+        g_object_unref (astream);
+        g_assert_cmpuint (_vte_memory_stream_get_usage (), ==, usage);
+}
+
+static void
+test_stream_cache (void)
+{
+        VteStreamCacheStats stats;
+        char buf[8];
+
+        VteStream *astream = _vte_file_stream_new();
+
+        /* Six complete blocks, and one byte in the write buffer */
+        stream_append (astream, "aaaaaaa" "bbbbbbb" "ccccccc" "ddddddd" "eeeeeee" "fffffff" "g");
+
+        /* Reading the same block again hits the cache */
+        g_assert (_vte_stream_read (astream, 36, buf, 2));
+        g_assert (_vte_stream_read (astream, 35, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'f');
+        _vte_file_stream_get_cache_stats (astream, &stats);
+        g_assert_cmpuint (stats.misses, ==, 1);
+        g_assert_cmpuint (stats.hits, ==, 1);
+        g_assert_cmpuint (stats.readaheads, ==, 0);
+
+        /* Walking backward reads the previous blocks ahead */
+        g_assert (_vte_stream_read (astream, 28, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'e');
+        g_assert (_vte_stream_read (astream, 21, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'd');
+        g_assert (_vte_stream_read (astream, 14, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'c');
+        g_assert (_vte_stream_read (astream, 7, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'b');
+        g_assert (_vte_stream_read (astream, 0, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'a');
+        _vte_file_stream_get_cache_stats (astream, &stats);
+        g_assert_cmpuint (stats.misses, ==, 2);
+        g_assert_cmpuint (stats.hits, ==, 5);
+        g_assert_cmpuint (stats.readaheads, ==, 4);
+        g_assert_cmpuint (stats.readahead_hits, ==, 4);
+
+        /* Reads across block boundaries */
+        g_assert (_vte_stream_read (astream, 5, buf, 4));
+        g_assert (memcmp(buf, "aabb", 4) == 0);
+        g_assert (_vte_stream_read (astream, 40, buf, 3));
+        g_assert (memcmp(buf, "ffg", 3) == 0);
+
+        /* Advancing the tail drops the blocks before it */
+        _vte_stream_advance_tail (astream, 15);
+        g_assert (_vte_file_stream_cache_find ((VteFileStream *) astream, 0) == NULL);
+        g_assert (_vte_file_stream_cache_find ((VteFileStream *) astream, 7) == NULL);
+
+        g_object_unref (astream);
+}
+
+/* Readers on other threads see the same data, without touching the stream's cache */
+static gpointer
+reader_thread (gpointer data)
+{
+        VteStreamReader *reader = (VteStreamReader *) data;
+        char buf[8];
+
+        for (int i = 0; i < 100; i++) {
+                g_assert (_vte_stream_reader_read (reader, 40, buf, 3));
+                g_assert (memcmp(buf, "ffg", 3) == 0);
+                g_assert (_vte_stream_reader_read (reader, 5, buf, 4));
+                g_assert (memcmp(buf, "aabb", 4) == 0);
+        }
+        return NULL;
+}
+
+static void
+test_stream_reader (void)
+{
+        VteStreamCacheStats stats;
+        VteStreamReader *readers[4];
+        GThread *threads[4];
+        char buf[8];
+
+        VteStream *astream = _vte_file_stream_new();
+        VteFileStream *stream = (VteFileStream *) astream;
+        stream->async = TRUE;
+
+        stream_append (astream, "aaaaaaa" "bbbbbbb" "ccccccc" "ddddddd" "eeeeeee" "fffffff" "g");
+
+        for (int i = 0; i < 4; i++) {
+                readers[i] = _vte_stream_reader_new (astream);
+                threads[i] = g_thread_new ("reader", reader_thread, readers[i]);
+        }
+        for (int i = 0; i < 4; i++) {
+                g_thread_join (threads[i]);
+                _vte_stream_reader_free (readers[i]);
+        }
+
+        _vte_file_stream_get_cache_stats (astream, &stats);
+        g_assert_cmpuint (stats.hits + stats.misses, ==, 0);
+
+        /* Out of bounds */
+        readers[0] = _vte_stream_reader_new (astream);
+        g_assert (!_vte_stream_reader_read (readers[0], 43, buf, 1));
+        _vte_stream_advance_tail (astream, 14);
+        g_assert (!_vte_stream_reader_read (readers[0], 0, buf, 7));
+        g_assert (_vte_stream_reader_read (readers[0], 14, buf, 1));
+        g_assert_cmpint (buf[0], ==, 'c');
+        _vte_stream_reader_free (readers[0]);
+
+        g_object_unref (astream);
+}
+
+static void
+test_stream_storage_size (void)
+{
+        VteStream *astream = _vte_file_stream_new();
+
+        /* Only the write buffer */
+        g_assert_cmpuint (_vte_file_stream_get_storage_size (astream), ==, VTE_BOA_BLOCKSIZE);
+
+        /* Two blocks stored in 10 and 7 bytes, see test_boa() */
+        stream_append (astream, "axolotl" "beeeeee" "c");
+        g_assert_cmpuint (_vte_file_stream_get_storage_size (astream), ==, VTE_BOA_BLOCKSIZE + 17);
+
+        /* Dropping a block drops its estimated share */
+        _vte_stream_advance_tail (astream, 7);
+        g_assert_cmpuint (_vte_file_stream_get_storage_size (astream), ==, VTE_BOA_BLOCKSIZE + 8);
+
+        g_object_unref (astream);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -1765,7 +3260,16 @@ main (int argc, char **argv)
 
         test_snake();
         test_boa();
+        test_boa_codecs();
         test_stream();
+        test_stream_cache();
+        test_stream_reader();
+        test_stream_storage_size();
+        test_stream_async();
+        test_snake_memory();
+        test_snake_map();
+        test_stream_memory();
+        test_codecs();
 
         printf("vtestream-file tests passed :)\n");
         return 0;
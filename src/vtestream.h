@@ -41,6 +41,79 @@ gsize _vte_stream_head (VteStream *stream);
 VteStream *
 _vte_file_stream_new (void);
 
+/* Keeps the compressed and encrypted blocks in memory instead of a file.
+ * All of these streams share one budget, see VTE_SCROLLBACK_MEMORY_BUDGET;
+ * when it's used up, a stream drops its oldest blocks to make room, see
+ * _vte_file_stream_get_readable_tail(). */
+VteStream *
+_vte_memory_stream_new (void);
+
+gsize
+_vte_memory_stream_get_usage (void);
+
+void
+_vte_memory_stream_set_budget (gsize bytes);
+
+/* Block compression codecs. The values are stored in the file, don't change them. */
+typedef enum {
+        VTE_STREAM_CODEC_ZLIB = 0,
+        VTE_STREAM_CODEC_LZ4  = 1,
+        VTE_STREAM_CODEC_ZSTD = 2,
+} VteStreamCodec;
+
+#define VTE_STREAM_CODEC_LAST VTE_STREAM_CODEC_ZSTD
+
+gboolean
+_vte_stream_codec_available (VteStreamCodec codec);
+
+const char *
+_vte_stream_codec_name (VteStreamCodec codec);
+
+VteStreamCodec
+_vte_stream_codec_default (void);
+
+void
+_vte_file_stream_set_codec (VteStream *stream, VteStreamCodec codec);
+
+typedef struct _VteStreamWriteStats {
+        guint64 blocks;        /* blocks written */
+        guint64 stored_bytes;  /* compressed size of the blocks written */
+} VteStreamWriteStats;
+
+void
+_vte_file_stream_get_write_stats (VteStream *stream, VteStreamWriteStats *stats);
+
+void
+_vte_file_stream_flush (VteStream *stream);
+
+gsize
+_vte_file_stream_get_storage_size (VteStream *stream);
+
+gsize
+_vte_file_stream_get_readable_tail (VteStream *stream);
+
+typedef struct _VteStreamCacheStats {
+        guint64 hits;            /* reads of blocks found in the cache */
+        guint64 misses;          /* reads of blocks not found in the cache */
+        guint64 readaheads;      /* blocks read ahead into the cache */
+        guint64 readahead_hits;  /* reads of blocks that had been read ahead */
+} VteStreamCacheStats;
+
+void
+_vte_file_stream_get_cache_stats (VteStream *stream, VteStreamCacheStats *stats);
+
+/* For reading a stream from worker threads, while it isn't modified */
+typedef struct _VteStreamReader VteStreamReader;
+
+VteStreamReader *
+_vte_stream_reader_new (VteStream *stream);
+
+gboolean
+_vte_stream_reader_read (VteStreamReader *reader, gsize offset, char *data, gsize len);
+
+void
+_vte_stream_reader_free (VteStreamReader *reader);
+
 G_END_DECLS
 
 #endif
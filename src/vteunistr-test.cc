@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2020 The VTE authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "vteunistr.h"
+
+#include <thread>
+#include <vector>
+
+#include <glib.h>
+
+static void
+assert_unistr(vteunistr s,
+              char const* expected)
+{
+        auto gs = g_string_new(nullptr);
+        _vte_unistr_append_to_string(s, gs);
+        g_assert_cmpstr(gs->str, ==, expected);
+        g_assert_cmpint(_vte_unistr_strlen(s), ==, g_utf8_strlen(expected, -1));
+        g_assert_cmpuint(_vte_unistr_get_base(s), ==, g_utf8_get_char(expected));
+        g_string_free(gs, true);
+}
+
+static void
+test_unistr_append(void)
+{
+        /* A single character is itself */
+        g_assert_cmpuint(_vte_unistr_strlen('a'), ==, 1);
+        assert_unistr('a', "a");
+
+        /* Base and a common mark, inlined */
+        auto const e_acute = _vte_unistr_append_unichar('e', 0x0301);
+        g_assert_cmpuint(e_acute, >, 0x10FFFF);
+        g_assert_cmpuint(_vte_unistr_append_unichar('e', 0x0301), ==, e_acute);
+        assert_unistr(e_acute, "e\xcc\x81");
+
+        /* Emoji with a skin tone modifier */
+        auto const thumbs_up = _vte_unistr_append_unichar(0x1F44D, 0x1F3FD);
+        assert_unistr(thumbs_up, "\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd");
+
+        /* Longer sequences, and ones with other characters, are registered */
+        auto const e_acute_circumflex = _vte_unistr_append_unichar(e_acute, 0x0302);
+        g_assert_cmpuint(_vte_unistr_append_unichar(e_acute, 0x0302), ==, e_acute_circumflex);
+        assert_unistr(e_acute_circumflex, "e\xcc\x81\xcc\x82");
+
+        auto const xy = _vte_unistr_append_unichar('x', 'y');
+        g_assert_cmpuint(_vte_unistr_append_unichar('x', 'y'), ==, xy);
+        assert_unistr(xy, "xy");
+
+        /* Appending a whole string is appending its characters */
+        g_assert_cmpuint(_vte_unistr_append_unistr('x', e_acute_circumflex), ==,
+                         _vte_unistr_append_unichar(_vte_unistr_append_unichar(_vte_unistr_append_unichar('x', 'e'), 0x0301), 0x0302));
+
+        /* Sequences don't grow beyond 11 characters */
+        vteunistr s = 'a';
+        for (auto i = 0; i < 20; i++)
+                s = _vte_unistr_append_unichar(s, 0x0301);
+        g_assert_cmpint(_vte_unistr_strlen(s), ==, 11);
+}
+
+static void
+test_unistr_replace_base(void)
+{
+        auto const s = _vte_unistr_append_unichar(_vte_unistr_append_unichar('e', 0x0301), 0x0302);
+        g_assert_cmpuint(_vte_unistr_replace_base(s, 'e'), ==, s);
+        g_assert_cmpuint(_vte_unistr_replace_base(s, 'a'), ==,
+                         _vte_unistr_append_unichar(_vte_unistr_append_unichar('a', 0x0301), 0x0302));
+
+        auto a = g_array_new(false, false, sizeof(gunichar));
+        _vte_unistr_append_to_gunichars(s, a);
+        g_assert_cmpuint(a->len, ==, 3);
+        g_assert_cmpuint(g_array_index(a, gunichar, 0), ==, 'e');
+        g_assert_cmpuint(g_array_index(a, gunichar, 1), ==, 0x0301);
+        g_assert_cmpuint(g_array_index(a, gunichar, 2), ==, 0x0302);
+        g_array_free(a, true);
+}
+
+/* Threads registering the same sequences get the same values */
+static void
+test_unistr_threads(void)
+{
+        auto const n_threads = 8;
+        auto const n = 4096;
+        std::vector<vteunistr> values(n_threads * n);
+        std::vector<std::thread> threads;
+
+        for (auto t = 0; t < n_threads; t++)
+                threads.emplace_back([&values, t] {
+                        for (auto i = 0; i < n; i++)
+                                values[t * n + i] = _vte_unistr_append_unichar(0x4E00 + i, 0x3001);
+                });
+        for (auto& thread : threads)
+                thread.join();
+
+        for (auto i = 0; i < n; i++) {
+                g_assert_cmpuint(_vte_unistr_get_base(values[i]), ==, 0x4E00 + i);
+                g_assert_cmpint(_vte_unistr_strlen(values[i]), ==, 2);
+                for (auto t = 1; t < n_threads; t++)
+                        g_assert_cmpuint(values[t * n + i], ==, values[i]);
+        }
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+        g_test_init(&argc, &argv, nullptr);
+
+        g_test_add_func("/vte/unistr/append", test_unistr_append);
+        g_test_add_func("/vte/unistr/replace-base", test_unistr_replace_base);
+        g_test_add_func("/vte/unistr/threads", test_unistr_threads);
+
+        return g_test_run();
+}
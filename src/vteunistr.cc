@@ -25,6 +25,7 @@
 
 #include <string.h>
 
+#include <atomic>
 
 /* Overview:
  *
@@ -36,186 +37,388 @@
  * This number is "our own private internal non-unicode code for this
  * sequence of characters".
  *
- * The rest of the problem would be how to efficiently implement this
- * registry.  It does *NOT* really have to be efficient at all, as it will
- * only be accessed in case of combining marks.  And the strings are pretty
- * short (two or three characters).  But our implementation is quite efficient
- * anyway.
+ * The most common strings, a base character below 0x80000 followed by one of
+ * the combining characters in unistr_marks, aren't registered at all: they're
+ * encoded in the value itself, from %VTE_UNISTR_INLINE_START on, as the base
+ * and the mark's index in that table.  This covers accented letters, most
+ * Indic syllables' vowel signs, variation selectors and emoji skin tones.
  *
  * The access pattern of using vteunistr's is that we have a vteunistr in a
  * terminal cell, a new gunichar comes in and we decide to combine with it,
  * and we combine them and get a new vteunistr.  So, that is exactly how we
- * encode vteunistr's: all we need to know about a vteunistr to be able to
+ * encode the others: all we need to know about a vteunistr to be able to
  * reconstruct its string is the vteunistr and the gunichar that joined to
- * form it.  That's what VteUnistrDecomp is.  That is the decomposition.
+ * form it.  That's what VteUnistrDecomp is.  That is the decomposition.  It
+ * also caches the string's first character and length, so that those don't
+ * need walking the prefixes.
  *
- * We start giving new vteunistr's unique numbers starting at
- * %VTE_UNISTR_START+1 and going up.  We keep the decompositions in a GArray,
- * called unistr_decomp.  The first entry of the array is unused (that's why
- * we start from %VTE_UNISTR_START plus one).  The decomposition table provides
- * enough information to efficiently answer questions like "what's the first
- * gunichar in this vteunistr?", "what's the sequence of gunichar's in this
- * vteunistr?", and "how many gunichar's are there in this vteunistr?".
+ * We give them unique numbers starting at %VTE_UNISTR_START+1 and going up.
+ * The decompositions are kept in chunks of %VTE_UNISTR_CHUNK_SIZE, which
+ * never move once allocated.
  *
- * We still do not have any efficient way to construct new vteunistr's though.
- * Given a vteunistr and a gunichar, we have to walk over the entire
- * decomposition table to see if we have already registered (encoded) this
- * combination.  To make that operation fast, we use a reverse map, that is,
- * a GHashTable named unistr_comp.  The hash table maps a decomposition to its
- * encoded vteunistr value.  The value obviously fits in a pointer and does
- * not need memory allocation.  We also want to avoid allocating memory for
- * the key of the hash table entries, as we already have those decompositions
- * in the memory in the unistr_decomp array.  We cannot use direct pointers
- * though as when growing, the GArray may resize and move to a new memory
- * buffer, rendering all our pointers invalid.  For this reason, we keep the
- * index into the array as our hash table key.  When we want to perform a
- * lookup in the hash table, we insert the decomposition that we are searching
- * for as item zero in the unistr_decomp table, then lookup for an equal entry
- * of it in the hash table.  Finally, if the hash lookup fails, we add the new
- * decomposition to the lookup array and the hash table, and return the newly
- * encoded vteunistr value.
+ * To find whether a combination is already registered, unistr_comp maps a
+ * decomposition's prefix and suffix, packed in a 64-bit key stored inline in
+ * its slot, to the vteunistr, with open addressing and linear probing.  It's
+ * at most half full; when it would be more, it's replaced by one twice as
+ * large.
+ *
+ * Registering is serialized by unistr_lock.  Everything else is lock-free:
+ * a decomposition and its slot are filled in before being published with
+ * release stores, and readers use acquire loads.  Replaced tables are kept
+ * around, since another thread may still be probing them; that's at most as
+ * much memory as the current one.  So any thread may build, look up and
+ * decompose vteunistr's.
  */
 
+#define VTE_UNISTR_INLINE_START 0x40000000
+#define VTE_UNISTR_INLINE_BASE_BITS 19
 #define VTE_UNISTR_START 0x80000000
 
-static vteunistr unistr_next = VTE_UNISTR_START + 1;
+/* Sanity limits to avoid OOM */
+#define VTE_UNISTR_COUNT_MAX 100000
+#define VTE_UNISTR_STRLEN_MAX 11
+
+#define VTE_UNISTR_CHUNK_SIZE 1024
+#define VTE_UNISTR_CHUNKS_MAX (VTE_UNISTR_COUNT_MAX / VTE_UNISTR_CHUNK_SIZE + 1)
 
 struct VteUnistrDecomp {
 	vteunistr prefix;
 	gunichar  suffix;
+	gunichar  base;
+	guint32   len;
 };
 
-GArray     *unistr_decomp;
-GHashTable *unistr_comp;
+struct VteUnistrSlot {
+	std::atomic<guint64> key;  /* 0 if empty */
+	std::atomic<vteunistr> value;
+};
+
+struct VteUnistrTable {
+	guint32 mask;
+	guint32 count;
+	struct VteUnistrTable *replaced;  /* kept, see above */
+	struct VteUnistrSlot slots[1];
+};
+
+/* The combining characters inlined in a vteunistr, as ranges in order */
+static constexpr struct {
+	gunichar first, last;
+} unistr_marks[] = {
+	{ 0x0300, 0x036F },  /* Combining Diacritical Marks */
+	{ 0x0483, 0x0489 },  /* Cyrillic */
+	{ 0x0591, 0x05C7 },  /* Hebrew */
+	{ 0x0610, 0x061A },  /* Arabic */
+	{ 0x064B, 0x065F },
+	{ 0x0670, 0x0670 },
+	{ 0x0900, 0x0DFF },  /* Devanagari to Sinhala */
+	{ 0x0E31, 0x0E4E },  /* Thai */
+	{ 0x1AB0, 0x1AFF },  /* Combining Diacritical Marks Extended */
+	{ 0x1DC0, 0x1DFF },  /* Combining Diacritical Marks Supplement */
+	{ 0x200C, 0x200D },  /* ZWNJ, ZWJ */
+	{ 0x20D0, 0x20FF },  /* Combining Diacritical Marks for Symbols */
+	{ 0x3099, 0x309A },  /* Kana voiced sound marks */
+	{ 0xFE00, 0xFE0F },  /* Variation Selectors */
+	{ 0xFE20, 0xFE2F },  /* Combining Half Marks */
+	{ 0x1F3FB, 0x1F3FF },  /* Emoji modifiers */
+	{ 0xE0100, 0xE01EF },  /* Variation Selectors Supplement */
+};
+
+static constexpr guint32
+unistr_marks_count ()
+{
+	guint32 count = 0;
+
+	for (auto const& range : unistr_marks)
+		count += range.last - range.first + 1;
+	return count;
+}
+
+/* Every base with every mark has to stay below the registered values */
+static_assert (VTE_UNISTR_INLINE_START + (guint64 (unistr_marks_count ()) << VTE_UNISTR_INLINE_BASE_BITS) <= VTE_UNISTR_START,
+	       "too many inline marks");
+
+static GMutex unistr_lock;
+static std::atomic<vteunistr> unistr_next{VTE_UNISTR_START + 1};
+static std::atomic<struct VteUnistrDecomp *> unistr_decomp[VTE_UNISTR_CHUNKS_MAX];
+static std::atomic<struct VteUnistrTable *> unistr_comp;
+
+/* Returns the index of @c in unistr_marks, or -1 */
+static int
+unistr_mark_index (gunichar c)
+{
+	int index = 0;
+
+	for (auto const& range : unistr_marks) {
+		if (c < range.first)
+			return -1;
+		if (c <= range.last)
+			return index + int(c - range.first);
+		index += int(range.last - range.first + 1);
+	}
+	return -1;
+}
+
+static gunichar
+unistr_mark (int index)
+{
+	for (auto const& range : unistr_marks) {
+		if (index <= int(range.last - range.first))
+			return range.first + index;
+		index -= int(range.last - range.first + 1);
+	}
+	g_assert_not_reached ();
+	return 0;
+}
+
+static inline gboolean
+unistr_is_inline (vteunistr s)
+{
+	return s >= VTE_UNISTR_INLINE_START && s < VTE_UNISTR_START;
+}
+
+static inline gunichar
+unistr_inline_base (vteunistr s)
+{
+	return (s - VTE_UNISTR_INLINE_START) & ((1u << VTE_UNISTR_INLINE_BASE_BITS) - 1);
+}
+
+static inline gunichar
+unistr_inline_mark (vteunistr s)
+{
+	return unistr_mark ((s - VTE_UNISTR_INLINE_START) >> VTE_UNISTR_INLINE_BASE_BITS);
+}
+
+static inline struct VteUnistrDecomp const *
+unistr_get_decomp (vteunistr s)
+{
+	guint32 i = s - VTE_UNISTR_START;
+	return &unistr_decomp[i / VTE_UNISTR_CHUNK_SIZE].load (std::memory_order_acquire)[i % VTE_UNISTR_CHUNK_SIZE];
+}
+
+/* Whether @s is a vteunistr that exists already */
+static inline gboolean
+unistr_is_valid (vteunistr s)
+{
+	return s < VTE_UNISTR_START || s < unistr_next.load (std::memory_order_acquire);
+}
+
+static inline guint64
+unistr_comp_key (vteunistr prefix, gunichar suffix)
+{
+	/* suffix is below 0x110000, so this bit tells an occupied slot */
+	return (guint64 (prefix) << 32) | suffix | (1u << 31);
+}
+
+static inline guint32
+unistr_comp_hash (guint64 key)
+{
+	return guint32 ((key * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32);
+}
+
+/* Returns the vteunistr registered for @key in @table, or 0 */
+static vteunistr
+unistr_comp_lookup (struct VteUnistrTable const *table, guint64 key)
+{
+	if (G_UNLIKELY (table == nullptr))
+		return 0;
 
-#define DECOMP_FROM_INDEX(i)	g_array_index (unistr_decomp, struct VteUnistrDecomp, (i))
-#define DECOMP_FROM_UNISTR(s)	DECOMP_FROM_INDEX ((s) - VTE_UNISTR_START)
+	for (guint32 i = unistr_comp_hash (key);; i++) {
+		auto const& slot = table->slots[i & table->mask];
+		auto const slot_key = slot.key.load (std::memory_order_acquire);
+		if (slot_key == key)
+			return slot.value.load (std::memory_order_relaxed);
+		if (slot_key == 0)
+			return 0;
+	}
+}
 
-static guint
-unistr_comp_hash (gconstpointer key)
+/* With unistr_lock held */
+static void
+unistr_comp_insert (struct VteUnistrTable *table, guint64 key, vteunistr value)
 {
-	struct VteUnistrDecomp *decomp;
-	decomp = &DECOMP_FROM_INDEX (GPOINTER_TO_UINT (key));
-	return decomp->prefix ^ decomp->suffix;
+	for (guint32 i = unistr_comp_hash (key);; i++) {
+		auto& slot = table->slots[i & table->mask];
+		if (slot.key.load (std::memory_order_relaxed) == 0) {
+			slot.value.store (value, std::memory_order_relaxed);
+			slot.key.store (key, std::memory_order_release);
+			table->count++;
+			return;
+		}
+	}
 }
 
-static gboolean
-unistr_comp_equal (gconstpointer a, gconstpointer b)
+/* With unistr_lock held. Returns a table with room for one more entry. */
+static struct VteUnistrTable *
+unistr_comp_reserve (void)
 {
-	return 0 == memcmp (&DECOMP_FROM_INDEX (GPOINTER_TO_UINT (a)),
-			    &DECOMP_FROM_INDEX (GPOINTER_TO_UINT (b)),
-			    sizeof (struct VteUnistrDecomp));
+	auto table = unistr_comp.load (std::memory_order_relaxed);
+	if (G_LIKELY (table != nullptr && 2 * (table->count + 1) <= table->mask + 1))
+		return table;
+
+	guint32 size = table != nullptr ? 2 * (table->mask + 1) : 256;
+	auto new_table = (struct VteUnistrTable *) g_malloc0 (sizeof (struct VteUnistrTable) +
+							       (size - 1) * sizeof (struct VteUnistrSlot));
+	new_table->mask = size - 1;
+	new_table->replaced = table;
+	if (table != nullptr) {
+		for (guint32 i = 0; i <= table->mask; i++) {
+			auto const key = table->slots[i].key.load (std::memory_order_relaxed);
+			if (key != 0)
+				unistr_comp_insert (new_table, key, table->slots[i].value.load (std::memory_order_relaxed));
+		}
+	}
+	unistr_comp.store (new_table, std::memory_order_release);
+	return new_table;
 }
 
 vteunistr
 _vte_unistr_append_unichar (vteunistr s, gunichar c)
 {
-	struct VteUnistrDecomp decomp;
-	vteunistr ret = 0;
+	vteunistr ret;
 
-	decomp.prefix = s;
-	decomp.suffix = c;
-
-	if (G_UNLIKELY (!unistr_decomp)) {
-		unistr_decomp = g_array_new (FALSE, TRUE, sizeof (struct VteUnistrDecomp));
-		g_array_set_size (unistr_decomp, 1);
-		unistr_comp = g_hash_table_new (unistr_comp_hash, unistr_comp_equal);
-	} else {
-		DECOMP_FROM_INDEX (0) = decomp;
-		ret = GPOINTER_TO_UINT (g_hash_table_lookup (unistr_comp, GUINT_TO_POINTER (0)));
+	if (G_LIKELY (s < VTE_UNISTR_INLINE_START)) {
+		int mark = unistr_mark_index (c);
+		if (G_LIKELY (mark >= 0 && s < (1u << VTE_UNISTR_INLINE_BASE_BITS)))
+			return VTE_UNISTR_INLINE_START + (vteunistr (mark) << VTE_UNISTR_INLINE_BASE_BITS) + s;
 	}
 
-	if (G_UNLIKELY (!ret)) {
-		/* sanity check to avoid OOM */
-		if (G_UNLIKELY (_vte_unistr_strlen (s) > 10 || unistr_next - VTE_UNISTR_START > 100000))
+	auto const key = unistr_comp_key (s, c);
+	ret = unistr_comp_lookup (unistr_comp.load (std::memory_order_acquire), key);
+	if (G_LIKELY (ret != 0))
+		return ret;
+
+	if (G_UNLIKELY (_vte_unistr_strlen (s) >= VTE_UNISTR_STRLEN_MAX))
+		return s;
+
+	g_mutex_lock (&unistr_lock);
+
+	/* Another thread may have registered it meanwhile */
+	auto table = unistr_comp.load (std::memory_order_relaxed);
+	ret = unistr_comp_lookup (table, key);
+	if (ret == 0) {
+		ret = unistr_next.load (std::memory_order_relaxed);
+		guint32 i = ret - VTE_UNISTR_START;
+		if (G_UNLIKELY (i > VTE_UNISTR_COUNT_MAX)) {
+			g_mutex_unlock (&unistr_lock);
 			return s;
+		}
 
-		ret = unistr_next++;
-		g_array_append_val (unistr_decomp, decomp);
-		g_hash_table_insert (unistr_comp,
-				     GUINT_TO_POINTER (ret - VTE_UNISTR_START),
-				     GUINT_TO_POINTER (ret));
+		auto chunk = unistr_decomp[i / VTE_UNISTR_CHUNK_SIZE].load (std::memory_order_relaxed);
+		if (chunk == nullptr) {
+			chunk = g_new0 (struct VteUnistrDecomp, VTE_UNISTR_CHUNK_SIZE);
+			unistr_decomp[i / VTE_UNISTR_CHUNK_SIZE].store (chunk, std::memory_order_release);
+		}
+		auto& decomp = chunk[i % VTE_UNISTR_CHUNK_SIZE];
+		decomp.prefix = s;
+		decomp.suffix = c;
+		decomp.base = _vte_unistr_get_base (s);
+		decomp.len = _vte_unistr_strlen (s) + 1;
+
+		unistr_next.store (ret + 1, std::memory_order_release);
+		unistr_comp_insert (unistr_comp_reserve (), key, ret);
 	}
 
+	g_mutex_unlock (&unistr_lock);
 	return ret;
 }
 
+/* Stores the characters of @s in @chars, returns their number */
+static int
+unistr_decompose (vteunistr s, gunichar chars[VTE_UNISTR_STRLEN_MAX])
+{
+	int len = _vte_unistr_strlen (s);
+
+	for (int i = len - 1; i > 0; i--) {
+		if (unistr_is_inline (s)) {
+			chars[i] = unistr_inline_mark (s);
+			s = unistr_inline_base (s);
+		} else {
+			auto const decomp = unistr_get_decomp (s);
+			chars[i] = decomp->suffix;
+			s = decomp->prefix;
+		}
+	}
+	chars[0] = s;
+	return len;
+}
+
 vteunistr
 _vte_unistr_append_unistr (vteunistr s, vteunistr t)
 {
-        g_return_val_if_fail (s < unistr_next, s);
-        g_return_val_if_fail (t < unistr_next, s);
-        if (G_UNLIKELY (t >= VTE_UNISTR_START)) {
-                s = _vte_unistr_append_unistr (s, DECOMP_FROM_UNISTR (t).prefix);
-                return _vte_unistr_append_unichar (s, DECOMP_FROM_UNISTR (t).suffix);
-        } else {
-                return _vte_unistr_append_unichar (s, t);
-        }
+	gunichar chars[VTE_UNISTR_STRLEN_MAX];
+
+        g_return_val_if_fail (unistr_is_valid (s), s);
+        g_return_val_if_fail (unistr_is_valid (t), s);
+
+        int len = unistr_decompose (t, chars);
+        for (int i = 0; i < len; i++)
+                s = _vte_unistr_append_unichar (s, chars[i]);
+        return s;
 }
 
 gunichar
 _vte_unistr_get_base (vteunistr s)
 {
-	g_return_val_if_fail (s < unistr_next, s);
-	while (G_UNLIKELY (s >= VTE_UNISTR_START))
-		s = DECOMP_FROM_UNISTR (s).prefix;
-	return (gunichar) s;
+	g_return_val_if_fail (unistr_is_valid (s), s);
+	if (G_LIKELY (s < VTE_UNISTR_INLINE_START))
+		return (gunichar) s;
+	if (unistr_is_inline (s))
+		return unistr_inline_base (s);
+	return unistr_get_decomp (s)->base;
 }
 
 void
 _vte_unistr_append_to_gunichars (vteunistr s, GArray *a)
 {
-        if (G_UNLIKELY (s >= VTE_UNISTR_START)) {
-                struct VteUnistrDecomp *decomp;
-                decomp = &DECOMP_FROM_UNISTR (s);
-                _vte_unistr_append_to_gunichars (decomp->prefix, a);
-                s = decomp->suffix;
-        }
-        gunichar val = (gunichar) s;
-        g_array_append_val (a, val);
+	gunichar chars[VTE_UNISTR_STRLEN_MAX];
+
+	g_return_if_fail (unistr_is_valid (s));
+
+	int len = unistr_decompose (s, chars);
+	g_array_append_vals (a, chars, len);
 }
 
 vteunistr
 _vte_unistr_replace_base (vteunistr s, gunichar c)
 {
-        g_return_val_if_fail (s < unistr_next, s);
+	gunichar chars[VTE_UNISTR_STRLEN_MAX];
+
+        g_return_val_if_fail (unistr_is_valid (s), s);
 
         if (G_LIKELY (_vte_unistr_get_base(s) == c))
                 return s;
 
-        GArray *a = g_array_new (FALSE, FALSE, sizeof (gunichar));
-        _vte_unistr_append_to_gunichars (s, a);
-        g_assert_cmpint(a->len, >=, 1);
+        int len = unistr_decompose (s, chars);
 
         s = c;
-        for (glong i = 1; i < a->len; i++)
-                s = _vte_unistr_append_unichar (s, g_array_index (a, gunichar, i));
-
-        g_array_free (a, TRUE);
+        for (int i = 1; i < len; i++)
+                s = _vte_unistr_append_unichar (s, chars[i]);
         return s;
 }
 
 void
 _vte_unistr_append_to_string (vteunistr s, GString *gs)
 {
-	g_return_if_fail (s < unistr_next);
-	if (G_UNLIKELY (s >= VTE_UNISTR_START)) {
-		struct VteUnistrDecomp *decomp;
-		decomp = &DECOMP_FROM_UNISTR (s);
-		_vte_unistr_append_to_string (decomp->prefix, gs);
-		s = decomp->suffix;
+	gunichar chars[VTE_UNISTR_STRLEN_MAX];
+
+	g_return_if_fail (unistr_is_valid (s));
+	if (G_LIKELY (s < VTE_UNISTR_INLINE_START)) {
+		g_string_append_unichar (gs, (gunichar) s);
+		return;
 	}
-	g_string_append_unichar (gs, (gunichar) s);
+
+	int len = unistr_decompose (s, chars);
+	for (int i = 0; i < len; i++)
+		g_string_append_unichar (gs, chars[i]);
 }
 
 int
 _vte_unistr_strlen (vteunistr s)
 {
-	int len = 1;
-	g_return_val_if_fail (s < unistr_next, len);
-	while (G_UNLIKELY (s >= VTE_UNISTR_START)) {
-		s = DECOMP_FROM_UNISTR (s).prefix;
-		len++;
-	}
-	return len;
+	g_return_val_if_fail (unistr_is_valid (s), 1);
+	if (G_LIKELY (s < VTE_UNISTR_INLINE_START))
+		return 1;
+	if (unistr_is_inline (s))
+		return 2;
+	return unistr_get_decomp (s)->len;
 }
@@ -40,7 +40,8 @@ G_BEGIN_DECLS
  * characters) where the code was designed to only allow one character.
  *
  * Strings are internalized efficiently and never freed.  No memory
- * management of vteunistr values is needed.
+ * management of vteunistr values is needed.  The functions below may
+ * be called from any thread.
  **/
 typedef guint32 vteunistr;
 
@@ -411,6 +411,8 @@ Widget::mouse_event_from_gdk(GdkEvent* event) const
 void
 Widget::map() noexcept
 {
+        m_terminal->widget_map();
+
         if (m_event_window)
                 gdk_window_show_unraised(m_event_window);
 }